@@ -0,0 +1,1253 @@
+/* bench.c
+   Headless load generator and latency benchmark for server.c
+   It opens many simulated campus/department sessions over loopback,
+   authenticates them with the framed protocol, drives a configurable
+   mix of traffic and reports throughput and end-to-end latency:
+   - unicast:   message to an exact Campus,Dept that is connected
+   - fallback:  message to a department nobody uses, so the server
+                falls back to any session of that campus
+   - list:      LIST_REQUEST, latency is request -> LIST reply
+   - heartbeat: UDP Campus|Dept heartbeat (counted, no reply)
+   - broadcast: admin broadcast typed into the server's stdin, latency
+                is measured at every session that receives it (needs -S)
+   - offline:   message to a campus nobody is connected as; with -L on the
+                server it is stored, latency is send -> "stored" notice
+                (durable). The last campus is kept offline for this op.
+   - churn:     a short-lived session logs in and says BYE a little later; with -Y the
+                latency is AUTH sent -> its join seen in a presence delta,
+                measured at every subscribed session
+   Every message carries its send time, so latency is measured where it
+   is received. The last line of output is a single RESULT line of
+   key=value pairs that can be saved as a baseline and compared.
+
+   Pipelining (-b N): each sending session issues N operations back to back
+   and writes them with one send(), instead of one send() per message. With
+   -S the benchmark also reports the server's read/write syscalls per
+   operation (from /proc/<pid>/io), so write coalescing (-W on the server)
+   and pipelining can be compared at small payload sizes.
+
+   Connect storm (-c N): instead of the mix, N clients connect, send AUTH,
+   wait for AUTH_OK and hang up (RST, so no TIME_WAIT) in a loop; reports
+   logins/s and connect -> AUTH_OK latency. -i K also holds K connections
+   open that never send credentials, to show they do not slow logins down
+   and that the server's handshake deadline (-A) closes them.
+
+   Idle hold (-I N): N sessions log in and then sit idle for the run time;
+   with -S the server's resident memory before and after gives its memory
+   per idle session. Loopback connections are spread over IDLE_SOURCES
+   source addresses so that 100k of them do not run out of local ports
+   (both ends need an open file limit above N).
+
+   File transfer (-X MB): alongside the mix, the first session sends the
+   second an attachment of this size (needs -T on the server). Reports the
+   transfer's MB/s, the server's CPU per MB and the latency of messages
+   delivered to the receiving session while its file streams in, so
+   sendfile and copy relaying (-Z on the server) can be compared.
+
+   Presence subscriptions (-Y): every session subscribes to presence after
+   logging in and follows the snapshot and deltas. Reports the presence bytes
+   each session received per second next to what LIST polling costs, so
+   -m churn=5,list=20 and -Y -m churn=5 can be compared.
+
+   Build: gcc -O2 -Wall -pthread -o bench bench.c
+   Example: ./bench -S "./server -n 5000" -n 2000 -d 10 -r 20000
+            ./bench -S "./server -n 5000 -A 2" -c 2000 -i 500 -d 5
+            ./bench -S "./server -W 200" -n 200 -s 32 -b 16 -r 0 -m unicast=100
+            ./bench -S "./server -n 100000 -H 600" -I 100000 -d 5
+            ./bench -S "./server -T /tmp/spool" -n 10 -r 500 -X 500 -d 10
+            ./bench -S "./server -n 5000" -n 2000 -r 500 -Y -m churn=100
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "protocol.h"
+
+#define MAX_NAME 40
+#define MAX_EVENTS 256
+#define MAX_PENDING_LIST 8
+#define MAX_PENDING_STORE 64
+#define MAX_CONNECTING 4
+#define IDLE_CONNECTING 64     /* idle hold: logins in flight */
+#define IDLE_SOURCES 64        /* idle hold: loopback source addresses 127.0.0.1.. */
+#define READ_BUDGET 262144     /* bytes read from one session before the others get a turn */
+#define CHURN_MAX 1024         /* churn op: short-lived sessions in flight */
+#define CHURN_HOLD_MS 300      /* how long one stays; a shorter visit than a server tick is never reported */
+#define CHURN_TAG (1ull << 63) /* epoll tag of a churn connection, the slot in the low bits */
+
+/* Same credentials the server ships with */
+struct Cred { const char *campus; const char *password; };
+struct Cred creds[] = {
+    {"Lahore","NU-LHR-123"},
+    {"Karachi","NU-KHI-123"},
+    {"Peshawar","NU-PSH-123"},
+    {"CFD","NU-CFD-123"},
+    {"Multan","NU-MTN-123"}
+};
+int numCreds = 5;
+
+enum { OP_UNICAST = 0, OP_FALLBACK, OP_LIST, OP_HEARTBEAT, OP_BROADCAST, OP_OFFLINE, OP_CHURN, NUM_OPS };
+const char *opNames[NUM_OPS] = { "unicast", "fallback", "list", "heartbeat", "broadcast", "offline", "churn" };
+int liveCampuses = 5;   /* sessions use creds[0..liveCampuses), the rest stay offline */
+
+/* One simulated department */
+struct SimSession {
+    int fd;
+    int udpFd;
+    int campus;                 /* index into creds */
+    char dept[MAX_NAME];
+    int authed;
+    char *inBuf;                /* grows to fit the largest frame seen */
+    size_t inLen, inCap;
+    char *outBuf;               /* bytes the socket did not take yet */
+    size_t outLen, outCap;
+    int unflushed;              /* frames queued by the current pipelined burst */
+    int readPending;            /* stopped reading at READ_BUDGET with data left */
+    uint64_t listSent[MAX_PENDING_LIST];  /* send times of outstanding LIST_REQUESTs */
+    int listHead, listCount;
+    uint64_t storeSent[MAX_PENDING_STORE];  /* send times of offline messages not yet acknowledged */
+    int storeHead, storeCount;
+    uint64_t presenceVersion;   /* -Y: version of the last snapshot or delta */
+    int presenceSynced;
+};
+
+/* Latency samples for one operation type, in nanoseconds */
+struct Samples {
+    uint64_t *v;
+    size_t n, cap;
+};
+
+/* Settings */
+const char *serverIp = "127.0.0.1";
+int tcpPort = 5000;
+int udpPort = 6000;
+int numSessions = 100;
+double duration = 5.0;
+double rate = 1000.0;          /* operations per second, 0 = as fast as possible */
+int payloadSize = 64;
+int weights[NUM_OPS] = { 70, 10, 5, 10, 5 };
+const char *spawnCmd = NULL;
+int pipeline = 1;              /* -b: operations each session issues per send() */
+int stormClients = 0;          /* -c: connect storm instead of the operation mix */
+int idleClients = 0;           /* -i: connections that never authenticate, during a storm */
+int idleHold = 0;              /* -I: authenticated sessions held idle, to measure server memory */
+uint64_t fileSize = 0;         /* -X: bytes sims[0] sends sims[1] as an attachment during the mix */
+int presenceSub = 0;           /* -Y: sessions subscribe to presence */
+
+struct SimSession *sims;
+int epfd;
+FILE *serverStdin = NULL;
+pid_t serverPid = -1;
+struct sockaddr_in udpServerAddr;
+
+int authedCount = 0;
+unsigned long opsIssued[NUM_OPS];
+unsigned long opsCompleted[NUM_OPS];
+unsigned long notices = 0;
+unsigned long bytesReceived = 0;
+unsigned long sendCalls = 0;
+int readPendingCount = 0;
+struct Samples samples[NUM_OPS];
+
+/* The -X attachment: sims[0] uploads it, sims[1] receives it */
+char fileId[24];
+uint64_t fileSent = 0;         /* bytes sims[0] has queued */
+uint64_t fileHeld = 0;         /* bytes the server holds, from its last FILE_ACK */
+uint64_t fileGot = 0;          /* bytes sims[1] has received */
+uint64_t fileConfirmed = 0;    /* bytes sims[1] has confirmed with FILE_RECEIVED */
+uint64_t fileStart = 0, fileUploaded = 0, fileDone = 0;
+struct Samples fileRecvSamples;   /* latency of messages to sims[1] while its file is in flight */
+
+/* Churn op: sessions that log in as "J<send time>" and leave again at once */
+struct ChurnConn {
+    int fd;                    /* -1 if the slot is free */
+    char in[512];
+    size_t len;
+    uint64_t leaveAt;          /* when to say BYE, 0 until AUTH_OK */
+};
+struct ChurnConn churn[CHURN_MAX];
+int churnCount = 0;
+unsigned long churnFailed = 0;
+
+/* Presence traffic, for -Y against LIST polling */
+unsigned long long presenceBytes = 0;   /* SNAP and DELTA frames received by all sessions */
+unsigned long long listBytes = 0;       /* LIST frames received by all sessions */
+unsigned long presenceGaps = 0;         /* deltas that did not follow on, so the session subscribed again */
+
+uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void addSample(struct Samples *s, uint64_t v) {
+    if(s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        uint64_t *nv = realloc(s->v, cap * sizeof(*nv));
+        if(!nv) return;
+        s->v = nv;
+        s->cap = cap;
+    }
+    s->v[s->n++] = v;
+}
+
+int cmpU64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Percentile of sorted samples, in microseconds */
+double percentileUs(struct Samples *s, double p) {
+    if(s->n == 0) return 0;
+    size_t i = (size_t)(p * (s->n - 1) + 0.5);
+    return s->v[i] / 1000.0;
+}
+
+int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Queue bytes for a session and write what the socket takes */
+void simFlush(struct SimSession *s) {
+    while(s->outLen > 0) {
+        ssize_t n = send(s->fd, s->outBuf, s->outLen, MSG_NOSIGNAL);
+        sendCalls++;
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return; /* EAGAIN: wait for EPOLLOUT */
+        }
+        memmove(s->outBuf, s->outBuf + n, s->outLen - n);
+        s->outLen -= n;
+    }
+}
+
+void simSendFrame(struct SimSession *s, uint8_t type, const struct FrameField *f, int n) {
+    size_t need = frameSize(f, n);
+    if(s->outLen + need > s->outCap) {
+        size_t cap = s->outCap ? s->outCap : 1024;
+        while(cap < s->outLen + need) cap *= 2;
+        char *nb = realloc(s->outBuf, cap);
+        if(!nb) return;
+        s->outBuf = nb;
+        s->outCap = cap;
+    }
+    s->outLen += frameEncode(s->outBuf + s->outLen, s->outCap - s->outLen, type, f, n);
+    /* a pipelined burst is written once, by issueOp when it ends */
+    if(++s->unflushed >= pipeline) {
+        s->unflushed = 0;
+        simFlush(s);
+    }
+}
+
+/* Build "<tag><sendTimeNs>|xxxx" padded to the payload size */
+int makePayload(char *buf, size_t cap, char tag) {
+    int len = snprintf(buf, cap, "%c%llu|", tag, (unsigned long long)nowNs());
+    while(len < payloadSize && len < (int)cap - 1) buf[len++] = 'x';
+    buf[len] = '\0';
+    return len;
+}
+
+/* Send time embedded by makePayload, 0 if the text is not one of ours */
+uint64_t payloadTime(const char *p, size_t len, char *tag) {
+    if(len < 2) return 0;
+    *tag = p[0];
+    uint64_t t = 0;
+    for(size_t i=1;i<len && p[i] >= '0' && p[i] <= '9';i++) t = t * 10 + (p[i] - '0');
+    return t;
+}
+
+void sendHeartbeat(struct SimSession *s) {
+    char hb[MAX_NAME * 2];
+    int len = snprintf(hb, sizeof(hb), "%s|%s", creds[s->campus].campus, s->dept);
+    sendto(s->udpFd, hb, len, 0, (struct sockaddr*)&udpServerAddr, sizeof(udpServerAddr));
+}
+
+/* The session issuing the current pipelined burst, and how many more operations it issues */
+struct SimSession *burstSession = NULL;
+int burstLeft = 0;
+
+/* Write out the current burst, if any */
+void endBurst(void) {
+    if(burstSession && burstSession->unflushed > 0) {
+        burstSession->unflushed = 0;
+        simFlush(burstSession);
+    }
+    burstSession = NULL;
+    burstLeft = 0;
+}
+
+/* Churn op: log in a short-lived session whose department carries the send
+   time; it says BYE CHURN_HOLD_MS after AUTH_OK. Returns -1 if none was started. */
+int churnStart(void) {
+    int slot = -1;
+    for(int i=0;i<CHURN_MAX && slot < 0;i++)
+        if(churn[i].fd < 0) slot = i;
+    if(slot < 0) return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tcpPort);
+    inet_pton(AF_INET, serverIp, &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        churnFailed++;
+        return -1;
+    }
+    setNonBlocking(fd);
+    int campus = rand() % liveCampuses;
+    char dept[MAX_NAME], out[256];
+    snprintf(dept, sizeof(dept), "J%llu", (unsigned long long)nowNs());
+    struct FrameField f[3] = { frameStr(creds[campus].campus), frameStr(dept), frameStr(creds[campus].password) };
+    size_t len = frameEncode(out, sizeof(out), FRAME_AUTH, f, 3);
+    if(send(fd, out, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        close(fd);
+        churnFailed++;
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = CHURN_TAG | slot;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    churn[slot].fd = fd;
+    churn[slot].len = 0;
+    churn[slot].leaveAt = 0;
+    churnCount++;
+    return 0;
+}
+
+void churnClose(struct ChurnConn *c) {
+    close(c->fd);
+    c->fd = -1;
+    churnCount--;
+}
+
+/* Churn sessions whose time is up leave for good, so the server drops them at once */
+void churnExpire(void) {
+    uint64_t now = nowNs();
+    char out[16];
+    size_t len = frameEncode(out, sizeof(out), FRAME_BYE, NULL, 0);
+    for(int i=0;churnCount && i<CHURN_MAX;i++) {
+        if(churn[i].fd < 0 || !churn[i].leaveAt || churn[i].leaveAt > now) continue;
+        send(churn[i].fd, out, len, MSG_NOSIGNAL);
+        churnClose(&churn[i]);
+    }
+}
+
+/* A churn session's reply to its AUTH */
+void churnReadable(int slot) {
+    struct ChurnConn *c = &churn[slot];
+    if(c->leaveAt) return;
+    while(1) {
+        ssize_t n = read(c->fd, c->in + c->len, sizeof(c->in) - c->len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && errno == EAGAIN) return;
+        if(n > 0) {
+            c->len += n;
+            struct Frame fr;
+            int used = frameParse(c->in, c->len, &fr);
+            if(used == 0 && c->len < sizeof(c->in)) continue;
+            if(used > 0 && fr.type == FRAME_AUTH_OK) {
+                c->leaveAt = nowNs() + CHURN_HOLD_MS * 1000000ull;
+                return;
+            }
+        }
+        churnFailed++;
+        churnClose(c);
+        return;
+    }
+}
+
+/* Issue one operation of the given type from a random session; with -b the
+   same session issues the next pipeline - 1 operations too */
+void issueOp(int op) {
+    if(burstLeft == 0) {
+        endBurst();
+        burstSession = &sims[rand() % numSessions];
+        burstLeft = pipeline;
+    }
+    struct SimSession *s = burstSession;
+    burstLeft--;
+    char payload[FRAME_MAX];
+    switch(op) {
+        case OP_UNICAST: {
+            struct SimSession *d = &sims[rand() % numSessions];
+            int len = makePayload(payload, sizeof(payload), 'U');
+            struct FrameField f[3] = { frameStr(creds[d->campus].campus), frameStr(d->dept),
+                                       { payload, (uint16_t)len } };
+            simSendFrame(s, FRAME_SEND, f, 3);
+            break;
+        }
+        case OP_FALLBACK: {
+            int len = makePayload(payload, sizeof(payload), 'F');
+            struct FrameField f[3] = { frameStr(creds[rand() % liveCampuses].campus), frameStr("NoSuchDept"),
+                                       { payload, (uint16_t)len } };
+            simSendFrame(s, FRAME_SEND, f, 3);
+            break;
+        }
+        case OP_LIST:
+            if(s->listCount == MAX_PENDING_LIST) return;
+            s->listSent[(s->listHead + s->listCount++) % MAX_PENDING_LIST] = nowNs();
+            simSendFrame(s, FRAME_LIST_REQ, NULL, 0);
+            break;
+        case OP_OFFLINE: {
+            if(s->storeCount == MAX_PENDING_STORE) return;
+            char dept[MAX_NAME];
+            snprintf(dept, sizeof(dept), "D%d", rand() % 16);
+            int len = makePayload(payload, sizeof(payload), 'O');
+            struct FrameField f[3] = { frameStr(creds[numCreds - 1].campus), frameStr(dept),
+                                       { payload, (uint16_t)len } };
+            s->storeSent[(s->storeHead + s->storeCount++) % MAX_PENDING_STORE] = nowNs();
+            simSendFrame(s, FRAME_SEND, f, 3);
+            break;
+        }
+        case OP_CHURN:
+            if(churnStart() < 0) return;
+            break;
+        case OP_HEARTBEAT:
+            sendHeartbeat(s);
+            opsCompleted[op]++;
+            break;
+        case OP_BROADCAST:
+            if(!serverStdin) return;
+            makePayload(payload, 256, 'B');
+            fprintf(serverStdin, "broadcast %s\n", payload);
+            fflush(serverStdin);
+            break;
+    }
+    opsIssued[op]++;
+}
+
+/* Offer the -X attachment from sims[0] to sims[1] */
+void fileOffer(void) {
+    char size[24];
+    snprintf(size, sizeof(size), "%llu", (unsigned long long)fileSize);
+    struct FrameField f[4] = { frameStr(creds[sims[1].campus].campus), frameStr(sims[1].dept),
+                               frameStr("bench.bin"), frameStr(size) };
+    fileStart = nowNs();
+    simSendFrame(&sims[0], FRAME_FILE_OFFER, f, 4);
+    sims[0].unflushed = 0;
+    simFlush(&sims[0]);
+}
+
+/* Queue more of the attachment once the server has answered the offer,
+   keeping only a few chunks in sims[0]'s send buffer */
+void filePump(void) {
+    static char chunk[FILE_CHUNK];
+    struct SimSession *s = &sims[0];
+    while(fileId[0] && fileSent < fileSize && s->outLen < 4 * FILE_CHUNK) {
+        size_t len = fileSize - fileSent < FILE_CHUNK ? fileSize - fileSent : FILE_CHUNK;
+        char off[24];
+        snprintf(off, sizeof(off), "%llu", (unsigned long long)fileSent);
+        memset(chunk, 'a' + (fileSent / FILE_CHUNK) % 26, len);
+        struct FrameField f[3] = { frameStr(fileId), frameStr(off), { chunk, (uint16_t)len } };
+        simSendFrame(s, FRAME_FILE_CHUNK, f, 3);
+        s->unflushed = 0;
+        simFlush(s);
+        fileSent += len;
+    }
+}
+
+/* A decimal number field */
+uint64_t fieldU64(struct FrameField f) {
+    char buf[24];
+    size_t n = f.len < sizeof(buf) - 1 ? f.len : sizeof(buf) - 1;
+    memcpy(buf, f.ptr, n);
+    buf[n] = 0;
+    return strtoull(buf, NULL, 10);
+}
+
+/* A presence delta seen by a subscribed session: every churn session that
+   joined completes a churn op here */
+void presenceDelta(struct SimSession *s, const struct Frame *fr, uint64_t now) {
+    uint64_t v = fieldU64(fr->f[0]);
+    if(v != s->presenceVersion + 1) {
+        presenceGaps++;
+        s->presenceSynced = 0;
+        simSendFrame(s, FRAME_PRESENCE_SUB, NULL, 0);
+        s->unflushed = 0;
+        simFlush(s);
+        return;
+    }
+    s->presenceVersion = v;
+    const char *p = fr->f[1].ptr, *end = p + fr->f[1].len;
+    while(p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if(!eol) eol = end;
+        const char *bar = eol;
+        while(bar > p && bar[-1] != '|') bar--;
+        if(*p == '+' && bar > p && bar < eol && *bar == 'J') {
+            char tag;
+            uint64_t t = payloadTime(bar, eol - bar, &tag);
+            if(t) {
+                opsCompleted[OP_CHURN]++;
+                addSample(&samples[OP_CHURN], now - t);
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+/* Handle one frame received by a session */
+void handleFrame(struct SimSession *s, const struct Frame *fr) {
+    uint64_t now = nowNs();
+    if(!s->authed) {
+        if(fr->type != FRAME_AUTH_OK) {
+            fprintf(stderr, "[BENCH] authentication failed for %s %s\n", creds[s->campus].campus, s->dept);
+            exit(1);
+        }
+        s->authed = 1;
+        authedCount++;
+        return;
+    }
+    if(fr->type == FRAME_DELIVER && fr->nfields == 5) {
+        char tag;
+        uint64_t t = payloadTime(fr->f[4].ptr, fr->f[4].len, &tag);
+        if(t == 0) return;
+        int op = tag == 'U' ? OP_UNICAST : OP_FALLBACK;
+        opsCompleted[op]++;
+        addSample(&samples[op], now - t);
+        if(s == &sims[1] && fileStart && !fileDone) addSample(&fileRecvSamples, now - t);
+    } else if(fr->type == FRAME_FILE_ACK && fr->nfields == 2 && s == &sims[0]) {
+        if(!fileId[0] && fr->f[0].len < sizeof(fileId)) memcpy(fileId, fr->f[0].ptr, fr->f[0].len);
+        fileHeld = fieldU64(fr->f[1]);
+        if(fileHeld == fileSize && !fileUploaded) fileUploaded = now;
+    } else if(fr->type == FRAME_FILE_CHUNK && fr->nfields == 3 && s == &sims[1]) {
+        fileGot += fr->f[2].len;
+        if(fileGot >= fileSize && !fileDone) fileDone = now;
+        /* confirm every MB and at the end, as the client does */
+        if(fileGot - fileConfirmed >= 1048576 || fileDone) {
+            char n[24];
+            snprintf(n, sizeof(n), "%llu", (unsigned long long)fileGot);
+            struct FrameField f[2] = { fr->f[0], frameStr(n) };
+            fileConfirmed = fileGot;
+            simSendFrame(s, FRAME_FILE_RECEIVED, f, 2);
+            s->unflushed = 0;
+            simFlush(s);
+        }
+    } else if(fr->type == FRAME_FILE_START) {
+        /* sims[1] only counts the chunks that follow */
+    } else if(fr->type == FRAME_PRESENCE_SNAP && fr->nfields >= 2) {
+        /* every part but the last says "more" */
+        presenceBytes += frameSize(fr->f, fr->nfields);
+        s->presenceVersion = fieldU64(fr->f[0]);
+        s->presenceSynced = fr->nfields == 2;
+    } else if(fr->type == FRAME_PRESENCE_DELTA && fr->nfields == 2) {
+        presenceBytes += frameSize(fr->f, fr->nfields);
+        /* before our snapshot: it already has these changes */
+        if(s->presenceSynced) presenceDelta(s, fr, now);
+    } else if(fr->type == FRAME_LIST) {
+        listBytes += frameSize(fr->f, fr->nfields);
+        if(s->listCount == 0) return;
+        uint64_t t = s->listSent[s->listHead];
+        s->listHead = (s->listHead + 1) % MAX_PENDING_LIST;
+        s->listCount--;
+        opsCompleted[OP_LIST]++;
+        addSample(&samples[OP_LIST], now - t);
+    } else if(fr->type == FRAME_NOTICE && fr->nfields == 1 && s->storeCount > 0 &&
+              fr->f[0].len >= 15 && memcmp(fr->f[0].ptr, "[SERVER] Stored", 15) == 0) {
+        uint64_t t = s->storeSent[s->storeHead];
+        s->storeHead = (s->storeHead + 1) % MAX_PENDING_STORE;
+        s->storeCount--;
+        opsCompleted[OP_OFFLINE]++;
+        addSample(&samples[OP_OFFLINE], now - t);
+    } else if(fr->type == FRAME_NOTICE) {
+        notices++;
+    }
+}
+
+/* Read everything available on a session's TCP socket, or READ_BUDGET
+   bytes of it so that a session receiving a file does not starve the others */
+void simReadable(struct SimSession *s) {
+    size_t budget = READ_BUDGET;
+    if(s->readPending) {
+        s->readPending = 0;
+        readPendingCount--;
+    }
+    while(1) {
+        if(budget == 0) {
+            s->readPending = 1;
+            readPendingCount++;
+            return;
+        }
+        if(s->inCap - s->inLen < 4096) {
+            size_t cap = s->inCap ? s->inCap * 2 : 8192;
+            char *nb = realloc(s->inBuf, cap);
+            if(!nb) return;
+            s->inBuf = nb;
+            s->inCap = cap;
+        }
+        ssize_t n = read(s->fd, s->inBuf + s->inLen, s->inCap - s->inLen);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) break;
+        if(n == 0) {
+            fprintf(stderr, "[BENCH] server closed session %s %s\n", creds[s->campus].campus, s->dept);
+            exit(1);
+        }
+        s->inLen += n;
+        bytesReceived += n;
+        budget = (size_t)n < budget ? budget - n : 0;
+        size_t off = 0;
+        struct Frame fr;
+        int used;
+        while((used = frameParse(s->inBuf + off, s->inLen - off, &fr)) > 0) {
+            handleFrame(s, &fr);
+            off += used;
+        }
+        if(used < 0) {
+            fprintf(stderr, "[BENCH] malformed frame from server\n");
+            exit(1);
+        }
+        memmove(s->inBuf, s->inBuf + off, s->inLen - off);
+        s->inLen -= off;
+    }
+}
+
+/* Read admin broadcasts that reached a session's UDP socket */
+void simUdpReadable(struct SimSession *s) {
+    char buf[2048];
+    while(1) {
+        ssize_t n = recv(s->udpFd, buf, sizeof(buf), 0);
+        if(n < 0) break;
+        /* sequenced announcements carry "ANN|epoch|seq|" before the text;
+           ANNSEQ/ANNGONE carry no payload and fail the tag check below */
+        char *p = buf;
+        if(n > 4 && memcmp(buf, "ANN|", 4) == 0) {
+            for(int bars = 0; p < buf + n && bars < 3; p++)
+                if(*p == '|') bars++;
+        }
+        char tag;
+        uint64_t t = payloadTime(p, n - (p - buf), &tag);
+        if(t == 0 || tag != 'B') continue;
+        opsCompleted[OP_BROADCAST]++;
+        addSample(&samples[OP_BROADCAST], nowNs() - t);
+    }
+}
+
+/* Handle every ready socket, waiting at most timeoutMs */
+void pollOnce(int timeoutMs) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, readPendingCount ? 0 : timeoutMs);
+    for(int i=0;i<n;i++) {
+        uint64_t tag = events[i].data.u64;
+        if(tag & CHURN_TAG) {
+            churnReadable((int)(tag & ~CHURN_TAG));
+            continue;
+        }
+        struct SimSession *s = &sims[tag >> 1];
+        if(tag & 1) {
+            simUdpReadable(s);
+        } else {
+            if(events[i].events & EPOLLOUT) simFlush(s);
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && !s->readPending) simReadable(s);
+        }
+    }
+    if(churnCount) churnExpire();
+    /* edge-triggered: sessions cut short by their budget are not reported again */
+    for(int i=0;readPendingCount && i<numSessions;i++)
+        if(sims[i].readPending) simReadable(&sims[i]);
+}
+
+/* CPU time (user + system) the spawned server has used, in seconds; 0 if not spawned */
+double serverCpuSeconds(void) {
+    if(serverPid <= 0) return 0;
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)serverPid);
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    size_t n = fread(buf, 1, sizeof(buf)-1, f);
+    fclose(f);
+    buf[n] = 0;
+    /* fields after the ")" of the command name: state is field 3, utime 14, stime 15 */
+    char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if(!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Read and write syscalls the spawned server has made (syscr + syscw); 0 if not spawned */
+unsigned long long serverSyscalls(void) {
+    if(serverPid <= 0) return 0;
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)serverPid);
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    unsigned long long v, total = 0;
+    while(fgets(line, sizeof(line), f)) {
+        if(sscanf(line, "syscr: %llu", &v) == 1 || sscanf(line, "syscw: %llu", &v) == 1) total += v;
+    }
+    fclose(f);
+    return total;
+}
+
+/* Resident memory of the spawned server in KB; 0 if not spawned */
+long serverRssKb(void) {
+    if(serverPid <= 0) return 0;
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)serverPid);
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    long kb = 0;
+    while(fgets(line, sizeof(line), f) && sscanf(line, "VmRSS: %ld", &kb) != 1) {}
+    fclose(f);
+    return kb;
+}
+
+/* Stop a spawned server however the benchmark exits */
+void stopServer(void) {
+    if(serverPid > 0) kill(serverPid, SIGTERM);
+    serverPid = -1;
+}
+
+/* Start the server under test with its stdin on a pipe, so broadcasts can be typed into its admin console */
+void spawnServer(const char *cmd) {
+    int fds[2];
+    if(pipe(fds) < 0) { perror("pipe"); exit(1); }
+    serverPid = fork();
+    if(serverPid < 0) { perror("fork"); exit(1); }
+    if(serverPid == 0) {
+        dup2(fds[0], 0);
+        close(fds[1]);
+        int devnull = open("/dev/null", O_WRONLY);
+        if(devnull >= 0) dup2(devnull, 1);
+        char line[1024];
+        snprintf(line, sizeof(line), "exec %s", cmd);
+        execl("/bin/sh", "sh", "-c", line, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[0]);
+    serverStdin = fdopen(fds[1], "w");
+    atexit(stopServer);
+    usleep(300000); /* give it time to bind */
+}
+
+/* Connect, authenticate and register every simulated session */
+void openSessions(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tcpPort);
+    inet_pton(AF_INET, serverIp, &addr.sin_addr);
+
+    for(int i=0;i<numSessions;i++) {
+        struct SimSession *s = &sims[i];
+        s->campus = i % liveCampuses;
+        snprintf(s->dept, sizeof(s->dept), "D%d", i / numCreds);
+
+        s->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(s->fd < 0) { perror("socket"); exit(1); }
+        int one = 1;
+        setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(connect(s->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("connect"); exit(1); }
+        setNonBlocking(s->fd);
+
+        s->udpFd = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(s->udpFd, (struct sockaddr*)&local, sizeof(local));
+        setNonBlocking(s->udpFd);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u64 = (uint64_t)i << 1;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = ((uint64_t)i << 1) | 1;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s->udpFd, &ev);
+
+        struct FrameField f[3] = { frameStr(creds[s->campus].campus), frameStr(s->dept),
+                                   frameStr(creds[s->campus].password) };
+        simSendFrame(s, FRAME_AUTH, f, 3);
+        s->unflushed = 0;
+        simFlush(s);
+        /* keep only a few handshakes in flight so the server's accept backlog never overflows
+           (a dropped SYN costs seconds of retransmit backoff and would skew setup time) */
+        uint64_t deadline = nowNs() + 10000000000ull;
+        while(i + 1 - authedCount >= MAX_CONNECTING || (i == numSessions - 1 && authedCount < numSessions)) {
+            if(nowNs() > deadline) {
+                fprintf(stderr, "[BENCH] only %d/%d sessions authenticated\n", authedCount, numSessions);
+                exit(1);
+            }
+            pollOnce(10);
+        }
+    }
+    /* register UDP addresses so broadcasts reach every session */
+    for(int i=0;i<numSessions;i++) sendHeartbeat(&sims[i]);
+    /* -Y: subscribe, and wait for the snapshots, which every session gets in full */
+    int synced = 0;
+    for(int i=0;presenceSub && i<numSessions;i++) {
+        simSendFrame(&sims[i], FRAME_PRESENCE_SUB, NULL, 0);
+        sims[i].unflushed = 0;
+        simFlush(&sims[i]);
+    }
+    uint64_t settle = nowNs() + 200000000ull, deadline = nowNs() + 10000000000ull;
+    while(nowNs() < settle || (presenceSub && synced < numSessions && nowNs() < deadline)) {
+        pollOnce(10);
+        synced = 0;
+        for(int i=0;presenceSub && i<numSessions;i++) synced += sims[i].presenceSynced;
+    }
+    if(presenceSub && synced < numSessions)
+        fprintf(stderr, "[BENCH] only %d/%d sessions got their presence snapshot\n", synced, numSessions);
+}
+
+/* One connect storm client: connect, AUTH, wait for the reply, hang up, repeat */
+struct StormClient {
+    int fd;
+    uint32_t gen;              /* carried in epoll events, so one for an earlier socket is ignored */
+    int campus;
+    int sentAuth;
+    uint64_t started;
+    char inBuf[256];
+    size_t inLen;
+};
+
+struct StormClient *storm;
+unsigned long stormLogins = 0, stormFailures = 0, stormErrors = 0;
+struct Samples stormSamples;
+struct sockaddr_in serverAddr;
+
+void stormStart(struct StormClient *c, int idx) {
+    c->gen++;
+    c->sentAuth = 0;
+    c->inLen = 0;
+    c->started = nowNs();
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(c->fd < 0) { perror("socket"); exit(1); }
+    /* hang up with RST: thousands of reconnects per second would run the
+       loopback out of ports if every close left a TIME_WAIT behind */
+    struct linger lg = { 1, 0 };
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(c->fd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u64 = (uint64_t)c->gen << 32 | (uint32_t)idx;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+void stormRestart(struct StormClient *c, int idx) {
+    close(c->fd);
+    stormStart(c, idx);
+}
+
+void stormEvent(int idx, uint32_t gen, uint32_t events) {
+    struct StormClient *c = &storm[idx];
+    if(c->gen != gen) return;
+    if(!c->sentAuth && (events & EPOLLOUT)) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        char dept[MAX_NAME], out[256];
+        snprintf(dept, sizeof(dept), "S%d", idx);
+        struct FrameField f[3] = { frameStr(creds[c->campus].campus), frameStr(dept),
+                                   frameStr(creds[c->campus].password) };
+        size_t n = frameEncode(out, sizeof(out), FRAME_AUTH, f, 3);
+        if(err || send(c->fd, out, n, MSG_NOSIGNAL) != (ssize_t)n) {
+            stormErrors++;
+            stormRestart(c, idx);
+            return;
+        }
+        c->sentAuth = 1;
+    }
+    if(!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+    while(1) {
+        ssize_t n = read(c->fd, c->inBuf + c->inLen, sizeof(c->inBuf) - c->inLen);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if(n <= 0) {
+            stormErrors++;
+            stormRestart(c, idx);
+            return;
+        }
+        c->inLen += n;
+        struct Frame fr;
+        int used = frameParse(c->inBuf, c->inLen, &fr);
+        if(used == 0 && c->inLen < sizeof(c->inBuf)) continue;
+        if(used > 0 && fr.type == FRAME_AUTH_OK) {
+            stormLogins++;
+            addSample(&stormSamples, nowNs() - c->started);
+            /* say BYE, or the server holds every session for a resume */
+            char bye[8];
+            size_t len = frameEncode(bye, sizeof(bye), FRAME_BYE, NULL, 0);
+            send(c->fd, bye, len, MSG_NOSIGNAL);
+        } else {
+            stormFailures++;
+        }
+        stormRestart(c, idx);
+        return;
+    }
+}
+
+/* Run the connect storm for the configured duration and print its results */
+void runStorm(void) {
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(tcpPort);
+    inet_pton(AF_INET, serverIp, &serverAddr.sin_addr);
+
+    int *idle = calloc(idleClients ? idleClients : 1, sizeof(int));
+    storm = calloc(stormClients, sizeof(*storm));
+    if(!idle || !storm) { perror("calloc"); exit(1); }
+    for(int i=0;i<idleClients;i++) {
+        idle[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if(idle[i] < 0 || connect(idle[i], (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            perror("idle connect");
+            exit(1);
+        }
+    }
+
+    double cpuStart = serverCpuSeconds();
+    uint64_t start = nowNs();
+    uint64_t end = start + (uint64_t)(duration * 1e9);
+    for(int i=0;i<stormClients;i++) {
+        storm[i].campus = i % numCreds;
+        stormStart(&storm[i], i);
+    }
+    struct epoll_event events[MAX_EVENTS];
+    while(nowNs() < end) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 10);
+        for(int i=0;i<n;i++)
+            stormEvent((int)(uint32_t)events[i].data.u64, (uint32_t)(events[i].data.u64 >> 32), events[i].events);
+    }
+    double elapsed = (nowNs() - start) / 1e9;
+    double serverCpu = serverCpuSeconds() - cpuStart;
+
+    /* idle connections the server has closed read EOF (or its AUTH_TIMEOUT reply) */
+    int idleClosed = 0;
+    for(int i=0;i<idleClients;i++) {
+        char b[64];
+        ssize_t r = recv(idle[i], b, sizeof(b), MSG_DONTWAIT);
+        if(r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) idleClosed++;
+        close(idle[i]);
+    }
+
+    qsort(stormSamples.v, stormSamples.n, sizeof(uint64_t), cmpU64);
+    printf("\n%d clients: %lu logins in %.2f s (%.0f logins/s), %lu failed, %lu connection errors\n",
+           stormClients, stormLogins, elapsed, stormLogins / elapsed, stormFailures, stormErrors);
+    printf("connect -> AUTH_OK p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+           percentileUs(&stormSamples, 0.50), percentileUs(&stormSamples, 0.99),
+           percentileUs(&stormSamples, 0.999), percentileUs(&stormSamples, 1.0));
+    if(idleClients) printf("%d of %d idle connections closed by the server\n", idleClosed, idleClients);
+    if(serverPid > 0)
+        printf("server used %.2f s of CPU, %.2f us per login\n", serverCpu, stormLogins ? serverCpu * 1e6 / stormLogins : 0.0);
+    printf("RESULT storm_clients=%d idle=%d logins_per_s=%.0f failed=%lu errors=%lu login_p50_us=%.1f "
+           "login_p99_us=%.1f login_p999_us=%.1f idle_closed=%d",
+           stormClients, idleClients, stormLogins / elapsed, stormFailures, stormErrors,
+           percentileUs(&stormSamples, 0.50), percentileUs(&stormSamples, 0.99),
+           percentileUs(&stormSamples, 0.999), idleClosed);
+    if(serverPid > 0)
+        printf(" server_cpu_s=%.2f server_cpu_us_per_login=%.2f", serverCpu, stormLogins ? serverCpu * 1e6 / stormLogins : 0.0);
+    printf("\n");
+}
+
+/* Log in idleHold sessions, keep them idle for the run time and report what they cost the server */
+void runIdle(void) {
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(tcpPort);
+    inet_pton(AF_INET, serverIp, &serverAddr.sin_addr);
+    int loopback = (ntohl(serverAddr.sin_addr.s_addr) >> 24) == 127;
+
+    int *fds = calloc(idleHold, sizeof(int));
+    if(!fds) { perror("calloc"); exit(1); }
+    long rssStart = serverRssKb();
+    uint64_t start = nowNs();
+    int opened = 0, inFlight = 0, authed = 0, failed = 0;
+    while(opened < idleHold || inFlight > 0) {
+        while(opened < idleHold && inFlight < IDLE_CONNECTING) {
+            int i = opened++;
+            int fd = fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+            if(fd < 0) { perror("socket"); exit(1); }
+            if(loopback) {
+                /* the port is picked at connect time, unique per (source, destination) */
+                int one = 1;
+                setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+                struct sockaddr_in local;
+                memset(&local, 0, sizeof(local));
+                local.sin_family = AF_INET;
+                local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i % IDLE_SOURCES);
+                bind(fd, (struct sockaddr*)&local, sizeof(local));
+            }
+            if(connect(fd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) { perror("connect"); exit(1); }
+            char dept[MAX_NAME], frame[256];
+            snprintf(dept, sizeof(dept), "I%d", i);
+            int campus = i % numCreds;
+            struct FrameField f[3] = { frameStr(creds[campus].campus), frameStr(dept), frameStr(creds[campus].password) };
+            size_t len = frameEncode(frame, sizeof(frame), FRAME_AUTH, f, 3);
+            if(send(fd, frame, len, 0) != (ssize_t)len) { perror("send"); exit(1); }
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = i;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            inFlight++;
+        }
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        if(n == 0 && nowNs() - start > 60000000000ull) {
+            fprintf(stderr, "[BENCH] only %d/%d sessions authenticated\n", authed, idleHold);
+            exit(1);
+        }
+        for(int k=0;k<n;k++) {
+            int fd = fds[events[k].data.u64];
+            char buf[512];
+            struct Frame fr;
+            ssize_t r = recv(fd, buf, sizeof(buf), MSG_PEEK);
+            int used = r > 0 ? frameParse(buf, r, &fr) : -1;
+            if(used == 0) continue;  /* the rest of the reply is on its way */
+            if(used > 0 && fr.type == FRAME_AUTH_OK) authed++;
+            else failed++;
+            if(used > 0) recv(fd, buf, used, 0);
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            inFlight--;
+        }
+    }
+    double loginSec = (nowNs() - start) / 1e9;
+    printf("[BENCH] %d sessions logged in in %.2f s (%.0f/s), %d failed\n",
+           authed, loginSec, authed / loginSec, failed);
+
+    /* the server has nothing to do for idle sessions but keep them */
+    uint64_t end = nowNs() + (uint64_t)(duration * 1e9);
+    while(nowNs() < end) usleep(100000);
+    long rssEnd = serverRssKb();
+    double perSession = authed ? (rssEnd - rssStart) * 1024.0 / authed : 0.0;
+    if(serverPid > 0)
+        printf("server RSS %ld KB -> %ld KB, %.0f bytes per idle session\n", rssStart, rssEnd, perSession);
+    printf("RESULT idle_sessions=%d failed=%d login_s=%.2f", authed, failed, loginSec);
+    if(serverPid > 0) printf(" server_rss_kb=%ld bytes_per_idle_session=%.0f", rssEnd, perSession);
+    printf("\n");
+    for(int i=0;i<opened;i++) close(fds[i]);
+    free(fds);
+}
+
+/* Parse -m unicast=70,fallback=10,... */
+void parseMix(const char *spec) {
+    for(int i=0;i<NUM_OPS;i++) weights[i] = 0;
+    char buf[256];
+    strncpy(buf, spec, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = 0;
+    for(char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        char *eq = strchr(tok, '=');
+        if(!eq) continue;
+        *eq = 0;
+        int found = 0;
+        for(int i=0;i<NUM_OPS;i++) {
+            if(strcmp(tok, opNames[i]) == 0) { weights[i] = atoi(eq + 1); found = 1; }
+        }
+        if(!found) { fprintf(stderr, "Unknown operation in mix: %s\n", tok); exit(1); }
+    }
+}
+
+int pickOp(int total) {
+    int r = rand() % total;
+    for(int i=0;i<NUM_OPS;i++) {
+        if(r < weights[i]) return i;
+        r -= weights[i];
+    }
+    return OP_UNICAST;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H ip          server address (default 127.0.0.1)\n"
+        "  -P port        server TCP port (default 5000)\n"
+        "  -U port        server UDP port (default 6000)\n"
+        "  -n sessions    simulated department sessions (default 100)\n"
+        "  -d seconds     measured run time (default 5)\n"
+        "  -r ops/sec     offered load, 0 = as fast as possible (default 1000)\n"
+        "  -s bytes       message payload size (default 64)\n"
+        "  -b depth       pipelining: operations each session issues per send() (default 1)\n"
+        "  -m mix         operation weights, e.g. unicast=70,fallback=10,list=5,heartbeat=10,broadcast=5,offline=0,churn=0\n"
+        "  -S command     spawn the server with this shell command (needed for broadcasts)\n"
+        "  -c clients     connect storm: clients log in and hang up in a loop instead of the mix\n"
+        "  -i idle        connect storm: also hold this many connections that never authenticate\n"
+        "  -I sessions    idle hold: log in this many sessions, keep them idle and report server memory per session\n"
+        "  -X MB          file transfer: the first session sends the second an attachment this big during the mix\n"
+        "  -Y             sessions subscribe to presence; churn ops are measured until their join is seen\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "H:P:U:n:d:r:s:m:S:c:i:I:b:X:Yh")) != -1) {
+        switch(opt) {
+            case 'H': serverIp = optarg; break;
+            case 'P': tcpPort = atoi(optarg); break;
+            case 'U': udpPort = atoi(optarg); break;
+            case 'n': numSessions = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 's': payloadSize = atoi(optarg); break;
+            case 'm': parseMix(optarg); break;
+            case 'S': spawnCmd = optarg; break;
+            case 'c': stormClients = atoi(optarg); break;
+            case 'b': pipeline = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'i': idleClients = atoi(optarg); break;
+            case 'I': idleHold = atoi(optarg); break;
+            case 'X': fileSize = (uint64_t)(atof(optarg) * 1048576); break;
+            case 'Y': presenceSub = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(numSessions < 1 || payloadSize < 24 || payloadSize > 60000) {
+        fprintf(stderr, "Need at least 1 session and a payload of 24..60000 bytes\n");
+        return 1;
+    }
+    if(fileSize > 0 && numSessions < 2) {
+        fprintf(stderr, "A file transfer (-X) needs at least 2 sessions\n");
+        return 1;
+    }
+    if(!spawnCmd && weights[OP_BROADCAST] > 0) {
+        fprintf(stderr, "[BENCH] no -S server command, broadcasts disabled\n");
+        weights[OP_BROADCAST] = 0;
+    }
+    if(weights[OP_OFFLINE] > 0) liveCampuses = numCreds - 1;
+    int totalWeight = 0;
+    for(int i=0;i<NUM_OPS;i++) totalWeight += weights[i];
+    if(totalWeight <= 0) { fprintf(stderr, "Empty operation mix\n"); return 1; }
+
+    /* two sockets per session plus slack */
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    signal(SIGPIPE, SIG_IGN);
+    srand(12345);
+
+    if(spawnCmd) spawnServer(spawnCmd);
+
+    memset(&udpServerAddr, 0, sizeof(udpServerAddr));
+    udpServerAddr.sin_family = AF_INET;
+    udpServerAddr.sin_port = htons(udpPort);
+    inet_pton(AF_INET, serverIp, &udpServerAddr.sin_addr);
+
+    sims = calloc(numSessions, sizeof(*sims));
+    epfd = epoll_create1(0);
+    if(!sims || epfd < 0) { perror("setup"); return 1; }
+    for(int i=0;i<CHURN_MAX;i++) churn[i].fd = -1;
+
+    if(stormClients > 0) {
+        runStorm();
+        return 0;
+    }
+    if(idleHold > 0) {
+        if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)idleHold + 64) {
+            fprintf(stderr, "[BENCH] -I %d needs an open file limit above %d (it is %llu)\n",
+                    idleHold, idleHold + 64, (unsigned long long)rl.rlim_cur);
+            return 1;
+        }
+        runIdle();
+        return 0;
+    }
+
+    uint64_t t0 = nowNs();
+    openSessions();
+    double setupSec = (nowNs() - t0) / 1e9;
+    printf("[BENCH] %d sessions authenticated in %.2f s\n", numSessions, setupSec);
+
+    /* Drive load: issue whatever the offered rate says is due, then service sockets */
+    double cpuStart = serverCpuSeconds();
+    unsigned long long syscallsStart = serverSyscalls();
+    unsigned long sendsStart = sendCalls;
+    unsigned long long presenceStart = presenceBytes, listStart = listBytes;
+    uint64_t start = nowNs();
+    uint64_t end = start + (uint64_t)(duration * 1e9);
+    unsigned long issued = 0;
+    if(fileSize > 0) fileOffer();
+    while(1) {
+        uint64_t now = nowNs();
+        if(now >= end) break;
+        unsigned long due = rate > 0 ? (unsigned long)((now - start) / 1e9 * rate) : issued + 256;
+        while(issued < due) {
+            issueOp(pickOp(totalWeight));
+            issued++;
+            if(rate <= 0 && issued % 256 == 0) break;
+        }
+        if(burstLeft == 0) endBurst();
+        filePump();
+        pollOnce(rate > 0 ? 1 : 0);
+    }
+    double elapsed = (nowNs() - start) / 1e9;
+    endBurst();
+    unsigned long sends = sendCalls - sendsStart;
+    /* let in-flight messages land */
+    uint64_t drain = nowNs() + 1000000000ull;
+    while(nowNs() < drain) pollOnce(10);
+    double serverCpu = serverCpuSeconds() - cpuStart;
+    /* presence bytes per session per second, subscribed and polled */
+    double presenceRate = (presenceBytes - presenceStart) / elapsed / numSessions;
+    double listRate = (listBytes - listStart) / elapsed / numSessions;
+    unsigned long long serverCalls = serverSyscalls() - syscallsStart;
+
+    unsigned long delivered = 0;
+    printf("\n%-10s %10s %10s %10s %10s %10s %10s\n", "op", "issued", "completed", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for(int i=0;i<NUM_OPS;i++) {
+        struct Samples *sm = &samples[i];
+        qsort(sm->v, sm->n, sizeof(uint64_t), cmpU64);
+        printf("%-10s %10lu %10lu %10.1f %10.1f %10.1f %10.1f\n", opNames[i], opsIssued[i], opsCompleted[i],
+               percentileUs(sm, 0.50), percentileUs(sm, 0.99), percentileUs(sm, 0.999), percentileUs(sm, 1.0));
+        delivered += opsCompleted[i];
+    }
+    printf("\nissued %lu ops in %.2f s (%.0f ops/s), completed %lu (%.0f/s), %lu server notices, %.1f MB received\n",
+           issued, elapsed, issued / elapsed, delivered, delivered / elapsed, notices, bytesReceived / 1e6);
+    printf("%.2f client sends per op (pipeline %d)\n", issued ? (double)sends / issued : 0.0, pipeline);
+    double fileSec = 0, fileMb = fileGot / 1048576.0;
+    if(fileSize > 0) {
+        fileSec = ((fileDone ? fileDone : nowNs()) - fileStart) / 1e9;
+        qsort(fileRecvSamples.v, fileRecvSamples.n, sizeof(uint64_t), cmpU64);
+        printf("file: %.1f of %.1f MB in %.2f s (%.1f MB/s)%s, upload %s\n", fileMb, fileSize / 1048576.0, fileSec,
+               fileMb / fileSec, fileDone ? "" : " (unfinished, raise -d)", fileUploaded ? "complete" : "unfinished");
+        printf("file: %zu messages to the receiver while it streamed, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+               fileRecvSamples.n, percentileUs(&fileRecvSamples, 0.50), percentileUs(&fileRecvSamples, 0.99),
+               percentileUs(&fileRecvSamples, 1.0));
+        if(serverPid > 0 && fileMb > 0)
+            printf("file: server used %.2f ms of CPU per MB moved (the mix included)\n", serverCpu * 1e3 / fileMb);
+    }
+    if(presenceSub || weights[OP_LIST] > 0 || weights[OP_CHURN] > 0)
+        printf("presence: %.0f bytes/s per session from subscriptions (%lu gaps), %.0f bytes/s per session from LIST"
+               " replies, %lu churn logins failed\n", presenceRate, presenceGaps, listRate, churnFailed);
+    if(serverPid > 0) {
+        printf("server used %.2f s of CPU, %.2f us per issued op\n", serverCpu, issued ? serverCpu * 1e6 / issued : 0.0);
+        printf("server made %llu read/write syscalls, %.2f per issued op\n", serverCalls,
+               issued ? (double)serverCalls / issued : 0.0);
+    }
+    printf("RESULT sessions=%d rate=%.0f payload=%d pipeline=%d setup_s=%.3f ops_per_s=%.0f completed_per_s=%.0f notices=%lu"
+           " client_sends_per_op=%.3f",
+           numSessions, rate, payloadSize, pipeline, setupSec, issued / elapsed, delivered / elapsed, notices,
+           issued ? (double)sends / issued : 0.0);
+    if(serverPid > 0)
+        printf(" server_cpu_s=%.2f server_cpu_us_per_op=%.2f server_syscalls_per_op=%.3f", serverCpu,
+               issued ? serverCpu * 1e6 / issued : 0.0, issued ? (double)serverCalls / issued : 0.0);
+    if(fileSize > 0) {
+        printf(" file_mb=%.1f file_mb_per_s=%.1f file_rx_p50_us=%.1f file_rx_p99_us=%.1f", fileMb, fileMb / fileSec,
+               percentileUs(&fileRecvSamples, 0.50), percentileUs(&fileRecvSamples, 0.99));
+        if(serverPid > 0 && fileMb > 0) printf(" server_cpu_ms_per_file_mb=%.2f", serverCpu * 1e3 / fileMb);
+    }
+    if(presenceSub || weights[OP_LIST] > 0)
+        printf(" presence_bytes_per_session_s=%.0f list_bytes_per_session_s=%.0f presence_gaps=%lu", presenceRate,
+               listRate, presenceGaps);
+    for(int i=0;i<NUM_OPS;i++) {
+        if(samples[i].n == 0) continue;
+        printf(" %s_p50_us=%.1f %s_p99_us=%.1f %s_p999_us=%.1f", opNames[i], percentileUs(&samples[i], 0.50),
+               opNames[i], percentileUs(&samples[i], 0.99), opNames[i], percentileUs(&samples[i], 0.999));
+    }
+    printf("\n");
+
+    return 0;
+}
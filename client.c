@@ -7,6 +7,13 @@
    2. Lets departments send/receive messages
    3. Shows announcements from admin
    4. Keeps track of all conversations
+   All TCP traffic uses the framed protocol from protocol.h.
+   Message history lives in a memory-mapped ring file per campus and
+   department (history-<Campus>-<Dept>.dat), so it survives restarts.
+   Files (menu option 6) go through the server's spool in chunks; a file
+   sent to us is saved as received-<Campus>-<Dept>-<name>.
+   Menu option 3 shows who is connected from a table the server keeps
+   current with presence updates, instead of asking it each time.
 */
 
 #include <stdio.h>
@@ -15,6 +22,13 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "protocol.h"
 
 #define TCP_PORT 5000
 #define SERVER_IP "127.0.0.1"   
@@ -22,7 +36,28 @@
 #define CLIENT_UDP_PORT 7000
 #define MAX_MSG 1024
 #define MAX_NAME 40
-#define MAX_HISTORY 50
+#define RECONNECT_MIN_MS 500    /* first retry after a lost connection */
+#define RECONNECT_MAX_MS 16000  /* the delay doubles up to this */
+#define FILE_RECV_MAX 16        /* files being received at once */
+#define FILE_PROGRESS (1 << 20) /* confirm received bytes this often, so a relay resumes close to where it stopped */
+#define FILE_ACK_WAIT 10        /* seconds to wait for the server to take a file offer */
+
+/* ./client [tcpPort [udpPort]] picks a hub when several servers run on one host */
+int tcpPort = TCP_PORT;
+int udpServerPort = UDP_SERVER_PORT;
+
+/* Message history: a ring of index entries plus a ring of message text in
+   one memory-mapped file. When either ring is full the oldest messages are
+   overwritten, so the file never grows. Each entry links back to the previous
+   entry of the same peer (campus and department), so a peer filter only
+   touches that peer's messages. Entry times never go backwards, so a time
+   filter is a binary search. */
+#define HISTORY_ENTRIES (1u << 21)     /* index slots, about 2M messages */
+#define HISTORY_DATA (256u << 20)      /* bytes of message text */
+#define HISTORY_PEERS 4096             /* peers with their own chain */
+#define HISTORY_PAGE 20                /* messages per page in the viewer */
+#define HISTORY_MAGIC 0x48495354u      /* "HIST" */
+#define HISTORY_VERSION 1
 
 /* Global variables for department and message history */
 char campusName[MAX_NAME];
@@ -30,37 +65,305 @@ char department[MAX_NAME];  /*Department field */
 int tcpSock = -1;
 int udpSock = -1;
 
-/*Message history storage */
-char messageHistory[MAX_HISTORY][MAX_MSG];
-int historyCount = 0;
+/* TCP receive buffer: may hold several frames, or part of one, after a read */
+char inBuf[FRAME_HDR + FRAME_MAX];
+size_t inLen = 0;
+
+/* TCP send buffer: frames queued by the menu thread, written with one send
+   when flushed, so a batch of messages is pipelined instead of one write each.
+   While the connection is down frames stay here until it is back.
+   tcpLock protects the buffer and tcpSock, which the receiver thread swaps
+   when it reconnects. */
+char outBuf[4 * (FRAME_HDR + FRAME_MAX)];
+size_t outLen = 0;
+unsigned long sendCalls = 0;
+pthread_mutex_t tcpLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Session resumption: the token from AUTH_OK and the number of DELIVER frames
+   received on this session. A reconnect sends both in a RESUME frame and the
+   server replays only what came after; the password is kept to log in again
+   when the server no longer holds the session. */
+char password[60];
+char resumeToken[64] = "";
+uint64_t deliverSeq = 0;
+int leaving = 0;                /* menu option 4: the connection closing is expected */
+
+/* Attachments. An upload runs on the menu thread and waits for the server's
+   FILE_ACK, which the receiver thread hands over under fileLock. Files being
+   received are only touched by the receiver thread. */
+pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fileCond = PTHREAD_COND_INITIALIZER;
+int offerPending = 0;           /* an offer is waiting for its FILE_ACK */
+int offerAnswered = 0;          /* 1 = FILE_ACK came, -1 = a notice turned it down */
+char upId[24] = "";             /* transfer id of the file being sent */
+uint64_t upAcked = 0;           /* bytes the server holds of it */
+
+struct Incoming {
+    char id[24];                /* empty if the slot is free */
+    char from[MAX_NAME * 2];
+    char path[256];
+    int fd;
+    uint64_t size, have, confirmed;
+};
+struct Incoming incoming[FILE_RECV_MAX];
+
+/* Who is connected, kept current by the server: we subscribe on every
+   connect, get a PRESENCE_SNAP with everyone and then PRESENCE_DELTAs with
+   what changed. The receiver thread writes the table, menu option 3 reads
+   it, both under presLock. */
+struct PresenceEntry {
+    uint64_t id;                /* the server's handle for the session */
+    int state;                  /* 0 online, 1 suspect, 2 offline */
+    char campus[MAX_NAME], dept[MAX_NAME];
+};
+struct PresenceEntry *presence = NULL;
+int presenceCount = 0, presenceCap = 0;
+uint64_t presenceVersion = 0;
+int presenceSynced = 0;         /* a whole snapshot arrived and no delta was missed since */
+int presenceSnapping = 0;       /* more parts of a snapshot are coming */
+pthread_mutex_t presLock = PTHREAD_MUTEX_INITIALIZER;
+const char *presenceStates[3] = { "online", "suspect", "offline" };
+
+struct HistPeer {
+    uint64_t lastSeq;             /* newest message of this peer, 0 if none */
+    uint64_t count;
+    char name[MAX_NAME * 2];      /* "Campus Dept", empty if the slot is free */
+};
+
+struct HistHeader {
+    uint32_t magic, version;
+    uint64_t entryCap, dataCap;
+    uint64_t nextSeq;             /* sequence number of the next message, from 1 */
+    uint64_t dataTail;            /* text bytes ever written, wrap padding included */
+    int64_t lastTime;
+    struct HistPeer peers[HISTORY_PEERS];
+};
+
+struct HistEntry {
+    uint64_t seq;
+    uint64_t off;                 /* absolute text offset, position is off % dataCap */
+    uint64_t prevPeer;            /* previous message of the same peer, 0 if none */
+    int64_t time;
+    uint32_t len;
+    uint32_t peer;                /* index into peers[], UINT32_MAX if the table was full */
+};
+
+/*Message history storage, shared by the receive threads and the menu */
+struct HistHeader *hist = NULL;
+struct HistEntry *histEntries = NULL;
+char *histData = NULL;
+pthread_mutex_t histLock = PTHREAD_MUTEX_INITIALIZER;
 
 void showMenu() {
     printf("\n===== %s Campus - %s Department =====\n", campusName, department);
     printf("1. Send message to another campus\n");
     printf("2. View message history\n");
-    printf("3. Check online campuses (from server)\n");
+    printf("3. Check online campuses\n");
     printf("4. Exit\n");
+    printf("5. Send several messages at once (pipelined)\n");
+    printf("6. Send a file\n");
     printf("Choice: ");
 }
 
-/*View message history function */
+/* Map the history file for this campus and department, creating or resetting
+   it when it does not match. Falls back to an anonymous mapping (history for
+   this run only) if the file cannot be used, e.g. another client holds it. */
+void openHistory() {
+    char path[MAX_NAME * 2 + 32];
+    snprintf(path, sizeof(path), "history-%s-%s.dat", campusName, department);
+    size_t hdr = (sizeof(struct HistHeader) + 4095) & ~(size_t)4095;
+    size_t len = hdr + (size_t)HISTORY_ENTRIES * sizeof(struct HistEntry) + HISTORY_DATA;
+
+    void *m = MAP_FAILED;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        struct stat st;
+        if(fstat(fd, &st) == 0 && (st.st_size == (off_t)len || ftruncate(fd, len) == 0))
+            m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(m == MAP_FAILED) {
+        /* the lock goes with the descriptor, so only keep it open on success */
+        if(fd >= 0) close(fd);
+        printf("[CLIENT] Cannot use %s, message history is kept for this session only.\n", path);
+        m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(m == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+    }
+    hist = m;
+    histEntries = (struct HistEntry *)((char *)m + hdr);
+    histData = (char *)m + hdr + (size_t)HISTORY_ENTRIES * sizeof(struct HistEntry);
+
+    if(hist->magic != HISTORY_MAGIC || hist->version != HISTORY_VERSION ||
+       hist->entryCap != HISTORY_ENTRIES || hist->dataCap != HISTORY_DATA ||
+       hist->nextSeq == 0) {
+        memset(hist, 0, sizeof(*hist));
+        hist->version = HISTORY_VERSION;
+        hist->entryCap = HISTORY_ENTRIES;
+        hist->dataCap = HISTORY_DATA;
+        hist->nextSeq = 1;
+        hist->magic = HISTORY_MAGIC;
+    }
+}
+
+/* Find a peer's slot in the header, claiming a free one if create is set. -1 if none. Caller holds histLock. */
+int histPeerSlot(const char *peer, int create) {
+    uint32_t h = 2166136261u;
+    for(const char *p = peer; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    for(int k=0;k<HISTORY_PEERS;k++) {
+        struct HistPeer *hp = &hist->peers[(h + k) % HISTORY_PEERS];
+        if(hp->name[0] == '\0') {
+            if(!create) return -1;
+            strncpy(hp->name, peer, sizeof(hp->name) - 1);
+            return (h + k) % HISTORY_PEERS;
+        }
+        if(strcmp(hp->name, peer) == 0) return (h + k) % HISTORY_PEERS;
+    }
+    return -1;
+}
+
+/* Still readable: neither its index slot nor its text has been overwritten. Caller holds histLock. */
+int histValid(uint64_t seq) {
+    if(seq == 0 || seq >= hist->nextSeq || hist->nextSeq - seq > hist->entryCap) return 0;
+    struct HistEntry *e = &histEntries[seq % hist->entryCap];
+    return e->seq == seq && e->off + hist->dataCap >= hist->dataTail;
+}
+
+/* Oldest readable message (nextSeq if there are none). Text offsets grow with
+   seq, so the overwritten entries are a prefix. Caller holds histLock. */
+uint64_t histOldest() {
+    uint64_t lo = hist->nextSeq > hist->entryCap ? hist->nextSeq - hist->entryCap : 1, hi = hist->nextSeq;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(histValid(mid)) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+/* First message at or after time t, searching from lo. Caller holds histLock. */
+uint64_t histFirstSince(uint64_t lo, int64_t t) {
+    uint64_t hi = hist->nextSeq;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(histEntries[mid % hist->entryCap].time >= t) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Append one message; peer is "Campus Dept" (or ADMIN / SERVER) and is what the viewer filters on */
+void historyAppend(const char *peer, const char *text) {
+    size_t len = strlen(text);
+    if(len > MAX_MSG) len = MAX_MSG;
+    pthread_mutex_lock(&histLock);
+    uint64_t seq = hist->nextSeq;
+    uint64_t off = hist->dataTail;
+    /* a message never wraps: skip to the start of the ring instead */
+    if(off % hist->dataCap + len > hist->dataCap) off += hist->dataCap - off % hist->dataCap;
+    memcpy(histData + off % hist->dataCap, text, len);
+
+    int64_t now = time(NULL);
+    if(now < hist->lastTime) now = hist->lastTime;
+    int p = histPeerSlot(peer, 1);
+    struct HistEntry *e = &histEntries[seq % hist->entryCap];
+    e->seq = seq;
+    e->off = off;
+    e->len = (uint32_t)len;
+    e->time = now;
+    e->peer = p < 0 ? UINT32_MAX : (uint32_t)p;
+    e->prevPeer = p < 0 ? 0 : hist->peers[p].lastSeq;
+    if(p >= 0) {
+        hist->peers[p].lastSeq = seq;
+        hist->peers[p].count++;
+    }
+    hist->dataTail = off + len;
+    hist->lastTime = now;
+    hist->nextSeq = seq + 1;
+    pthread_mutex_unlock(&histLock);
+}
+
+/*View message history function: pages from the newest message back, optionally
+  filtered by peer and by age */
 void viewMessageHistory() {
-    printf("\n===== MESSAGE HISTORY (%d messages) =====\n", historyCount);
-    if(historyCount == 0) {
-        printf("No messages yet.\n");
-    } else {
-        for(int i = 0; i < historyCount; i++) {
-            printf("%d. %s\n", i+1, messageHistory[i]);
+    char peer[MAX_NAME * 2] = "";
+    int64_t since = 0;
+    uint64_t end = 0;              /* show messages before this seq, 0 for the newest */
+    static char text[HISTORY_PAGE][MAX_MSG + 1];
+    uint64_t seqs[HISTORY_PAGE];
+    int64_t times[HISTORY_PAGE];
+
+    while(1) {
+        int n = 0;
+        uint64_t total;
+        pthread_mutex_lock(&histLock);
+        uint64_t oldest = histOldest();
+        if(since) oldest = histFirstSince(oldest, since);
+        if(end == 0 || end > hist->nextSeq) end = hist->nextSeq;
+        if(peer[0]) {
+            int p = histPeerSlot(peer, 0);
+            total = p < 0 ? 0 : hist->peers[p].count;
+            uint64_t s = p < 0 ? 0 : hist->peers[p].lastSeq;
+            while(n < HISTORY_PAGE && s >= oldest && histValid(s)) {
+                if(s < end) seqs[n++] = s;
+                s = histEntries[s % hist->entryCap].prevPeer;
+            }
+        } else {
+            total = hist->nextSeq - oldest;
+            for(uint64_t s = end; s > oldest && n < HISTORY_PAGE; s--) seqs[n++] = s - 1;
+        }
+        for(int i=0;i<n;i++) {
+            struct HistEntry *e = &histEntries[seqs[i] % hist->entryCap];
+            memcpy(text[i], histData + e->off % hist->dataCap, e->len);
+            text[i][e->len] = '\0';
+            times[i] = e->time;
+        }
+        pthread_mutex_unlock(&histLock);
+
+        if(peer[0]) printf("\n===== MESSAGE HISTORY with %s (%llu in all, oldest may be overwritten) =====\n",
+                           peer, (unsigned long long)total);
+        else printf("\n===== MESSAGE HISTORY (%llu messages) =====\n", (unsigned long long)total);
+        if(n == 0) printf("No messages yet.\n");
+        for(int i = n - 1; i >= 0; i--) {
+            char when[32];
+            time_t t = (time_t)times[i];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+            printf("%llu. [%s] %s\n", (unsigned long long)seqs[i], when, text[i]);
+        }
+        printf("=====================================\n");
+        printf("o = older, l = latest, p <Campus> <Dept> = only that peer, t <minutes> = last minutes,\n"
+               "a = all messages, q = back to menu: ");
+
+        char line[MAX_MSG];
+        if(!fgets(line, sizeof(line), stdin)) return;
+        line[strcspn(line, "\n")] = 0;
+        if(line[0] == 'o') {
+            if(n == HISTORY_PAGE) end = seqs[n - 1];
+            else printf("No older messages.\n");
+        } else if(line[0] == 'l') {
+            end = 0;
+        } else if(line[0] == 'p' && line[1] == ' ') {
+            snprintf(peer, sizeof(peer), "%.*s", (int)sizeof(peer) - 1, line + 2);
+            end = 0;
+        } else if(line[0] == 't' && line[1] == ' ') {
+            since = (int64_t)time(NULL) - atol(line + 2) * 60;
+            end = 0;
+        } else if(line[0] == 'a') {
+            peer[0] = '\0';
+            since = 0;
+            end = 0;
+        } else {
+            return;
         }
     }
-    printf("=====================================\n");
 }
 
 /* UDP: send heartbeat every 10s */
 void *udpHeartbeat(void *arg) {
     struct sockaddr_in serverAddr;
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(UDP_SERVER_PORT);
+    serverAddr.sin_port = htons(udpServerPort);
     inet_pton(AF_INET, SERVER_IP, &serverAddr.sin_addr);
 
     while(1) {
@@ -73,52 +376,740 @@ void *udpHeartbeat(void *arg) {
     return NULL;
 }
 
-/* UDP receive: listen for broadcasts */
+/* Sequenced announcements. The server numbers every broadcast
+   ("ANN|epoch|seq|text") and they are shown in order. A gap holds the later
+   ones back while one NACK datagram asks for every missing number at once,
+   every ANN_NACK_MS, until the gap is repaired, the server says the numbers
+   are gone (ANNGONE) or ANN_TRIES NACKs went unanswered. ANNSEQ carries the
+   latest number, so a lost last announcement is noticed too. Only the
+   receiver thread touches this state. */
+#define ANN_HOLD 256           /* announcements held back behind a gap */
+#define ANN_NACK_MS 200
+#define ANN_TRIES 5
+#define ANN_NACK_MAX 240       /* the server reads NACKs into 256-byte buffers */
+struct AnnSlot {
+    uint32_t seq;
+    int state;                 /* 0 = missing, 1 = received, 2 = lost */
+    int tries;
+    char text[MAX_MSG];
+};
+struct AnnSlot annSlots[ANN_HOLD];
+uint32_t annEpoch = 0;
+uint32_t annNext = 1;          /* next number to show */
+uint32_t annHigh = 0;          /* highest number known to exist */
+unsigned annLost = 0;          /* lost since the last one shown */
+long long annLastNack = 0;
+
+long long nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void annShow(const char *text) {
+    if(annLost) {
+        printf("\n[ADMIN BROADCAST] (%u announcement(s) lost)\n", annLost);
+        annLost = 0;
+    }
+    printf("\n[ADMIN BROADCAST] %s\n", text);
+    /* Store broadcast in history */
+    char formatted[MAX_MSG + 16];
+    snprintf(formatted, sizeof(formatted), "[BROADCAST] %s", text);
+    historyAppend("ADMIN", formatted);
+}
+
+/* Show everything that is no longer waiting on a gap */
+void annDeliver() {
+    while(annNext <= annHigh) {
+        struct AnnSlot *a = &annSlots[annNext % ANN_HOLD];
+        if(a->state == 0) break;
+        if(a->state == 1) annShow(a->text);
+        else annLost++;
+        annNext++;
+    }
+}
+
+/* Start over on a new epoch (server restart); nothing before next is ours to repair */
+void annReset(uint32_t epoch, uint32_t next) {
+    annEpoch = epoch;
+    annNext = next;
+    annHigh = next - 1;
+    annLost = 0;
+}
+
+/* Learn that announcements up to high exist */
+void annExtend(uint32_t high) {
+    if(high <= annHigh) return;
+    if(high - annNext >= ANN_HOLD) {
+        /* too far behind to hold on: give up on the oldest */
+        uint32_t newNext = high - ANN_HOLD + 1;
+        for(; annNext < newNext && annNext <= annHigh; annNext++) {
+            struct AnnSlot *a = &annSlots[annNext % ANN_HOLD];
+            if(a->state == 1) annShow(a->text);
+            else annLost++;
+        }
+        if(annNext < newNext) {
+            annLost += newNext - annNext;
+            annNext = newNext;
+        }
+        if(annHigh < annNext - 1) annHigh = annNext - 1;
+    }
+    for(uint32_t s = annHigh + 1; s <= high; s++) {
+        struct AnnSlot *a = &annSlots[s % ANN_HOLD];
+        a->seq = s;
+        a->state = 0;
+        a->tries = 0;
+    }
+    annHigh = high;
+}
+
+/* One announcement datagram: ANN, ANNSEQ or ANNGONE */
+void annReceive(char *buf) {
+    unsigned epoch, seq;
+    int off = 0;
+    if(sscanf(buf, "ANN|%u|%u|%n", &epoch, &seq, &off) == 2 && off > 0) {
+        if(epoch != annEpoch) annReset(epoch, seq);
+        if(seq < annNext) return;   /* a repair we no longer need */
+        annExtend(seq);
+        struct AnnSlot *a = &annSlots[seq % ANN_HOLD];
+        if(a->state != 1) {
+            snprintf(a->text, sizeof(a->text), "%s", buf + off);
+            a->state = 1;
+        }
+        annDeliver();
+    } else if(sscanf(buf, "ANNSEQ|%u|%u", &epoch, &seq) == 2) {
+        if(epoch != annEpoch) annReset(epoch, seq + 1);
+        else annExtend(seq);
+    } else if(sscanf(buf, "ANNGONE|%u|%n", &epoch, &off) == 1 && off > 0) {
+        if(epoch != annEpoch) return;
+        for(char *p = buf + off; *p; ) {
+            char *end;
+            unsigned long s = strtoul(p, &end, 10);
+            if(end == p) break;
+            p = *end == ',' ? end + 1 : end;
+            struct AnnSlot *a = &annSlots[s % ANN_HOLD];
+            if(s >= annNext && s <= annHigh && a->seq == s && a->state == 0) a->state = 2;
+        }
+        annDeliver();
+    } else {
+        /* an older server: plain text */
+        annShow(buf);
+    }
+}
+
+/* Ask for every missing announcement in one NACK, as ranges */
+void annNackDue(const struct sockaddr_in *server) {
+    long long now = nowMs();
+    if(annNext > annHigh || now - annLastNack < ANN_NACK_MS) return;
+    char nack[ANN_NACK_MAX + 16];
+    int len = snprintf(nack, sizeof(nack), "NACK|%s|%s|%u|", campusName, department, annEpoch);
+    int start = len, gave = 0;
+    for(uint32_t s = annNext; s <= annHigh && len < ANN_NACK_MAX; s++) {
+        struct AnnSlot *a = &annSlots[s % ANN_HOLD];
+        if(a->state != 0) continue;
+        if(++a->tries > ANN_TRIES) {
+            a->state = 2;
+            gave = 1;
+            continue;
+        }
+        /* extend a run of missing numbers into one range */
+        uint32_t e = s;
+        while(e < annHigh && annSlots[(e + 1) % ANN_HOLD].state == 0 &&
+              annSlots[(e + 1) % ANN_HOLD].tries < ANN_TRIES) {
+            e++;
+            annSlots[e % ANN_HOLD].tries++;
+        }
+        len += e > s ? snprintf(nack + len, sizeof(nack) - len, "%s%u-%u", len > start ? "," : "", s, e)
+                     : snprintf(nack + len, sizeof(nack) - len, "%s%u", len > start ? "," : "", s);
+        s = e;
+    }
+    if(len > start)
+        sendto(udpSock, nack, len, 0, (struct sockaddr*)server, sizeof(*server));
+    annLastNack = now;
+    if(gave) annDeliver();
+}
+
+/* UDP receive: listen for broadcasts, wake up now and then to send NACKs */
 void *udpReceiver(void *arg) {
-    char buf[MAX_MSG];
+    char buf[MAX_MSG + 64];
     struct sockaddr_in from;
     socklen_t flen = sizeof(from);
+    struct sockaddr_in serverAddr;
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(udpServerPort);
+    inet_pton(AF_INET, SERVER_IP, &serverAddr.sin_addr);
+    struct timeval tv = { 0, 50000 };
+    setsockopt(udpSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     while(1) {
+        flen = sizeof(from);
         ssize_t n = recvfrom(udpSock, buf, sizeof(buf)-1, 0, (struct sockaddr*)&from, &flen);
         if(n > 0) {
             buf[n] = '\0';
-            printf("\n[ADMIN BROADCAST] %s\n", buf);
-            
-            /* Store broadcast in history */
-            if(historyCount < MAX_HISTORY) {
-                char formatted[MAX_MSG];
-                snprintf(formatted, sizeof(formatted), "[BROADCAST] %s", buf);
-                strcpy(messageHistory[historyCount++], formatted);
+            annReceive(buf);
+        }
+        annNackDue(&serverAddr);
+    }
+    return NULL;
+}
+
+/* Write everything queued in outBuf. If there is no connection or it fails,
+   every frame that did not go out whole stays queued for the next one.
+   Caller holds tcpLock. Returns -1 if frames were held back. */
+int flushFramesLocked() {
+    size_t off = 0;
+    while(off < outLen && tcpSock >= 0) {
+        ssize_t n = send(tcpSock, outBuf + off, outLen - off, MSG_NOSIGNAL);
+        sendCalls++;
+        if(n <= 0) break;
+        off += n;
+    }
+    if(off == outLen) {
+        outLen = 0;
+        return 0;
+    }
+    size_t pos = 0;
+    while(pos < outLen) {
+        uint32_t blen;
+        memcpy(&blen, outBuf + pos, 4);
+        size_t size = FRAME_HDR + ntohl(blen);
+        if(pos + size > off) break;
+        pos += size;
+    }
+    memmove(outBuf, outBuf + pos, outLen - pos);
+    outLen -= pos;
+    return -1;
+}
+
+int flushFrames() {
+    pthread_mutex_lock(&tcpLock);
+    int rc = flushFramesLocked();
+    pthread_mutex_unlock(&tcpLock);
+    return rc;
+}
+
+/* Queue one frame without sending it; the buffer is flushed first if it is full */
+int queueFrame(uint8_t type, const struct FrameField *fields, int n) {
+    pthread_mutex_lock(&tcpLock);
+    int rc = -1;
+    if(outLen + frameSize(fields, n) <= sizeof(outBuf) || flushFramesLocked() == 0) {
+        size_t len = frameEncode(outBuf + outLen, sizeof(outBuf) - outLen, type, fields, n);
+        outLen += len;
+        rc = len ? 0 : -1;
+    }
+    pthread_mutex_unlock(&tcpLock);
+    return rc;
+}
+
+/* Send one frame on the TCP connection. Returns -1 if it is held for the next connection. */
+int sendFrame(uint8_t type, const struct FrameField *fields, int n) {
+    if(queueFrame(type, fields, n) < 0) return -1;
+    return flushFrames();
+}
+
+/* Split a "TargetCampus,TargetDept,Message" line into SEND fields and record
+   it in history; a leading '!' sends it urgent. Returns the number of
+   fields, or -1 if the line is malformed. */
+int prepareSend(char *line, struct FrameField f[4]) {
+    int urgent = line[0] == '!';
+    if(urgent) line++;
+    char *c1 = strchr(line, ',');
+    char *c2 = c1 ? strchr(c1 + 1, ',') : NULL;
+    if(!c2) return -1;
+    f[0].ptr = line;
+    f[0].len = (uint16_t)(c1 - line);
+    f[1].ptr = c1 + 1;
+    f[1].len = (uint16_t)(c2 - c1 - 1);
+    f[2] = frameStr(c2 + 1);
+    char peer[MAX_NAME * 2], sent[MAX_MSG + 16];
+    snprintf(peer, sizeof(peer), "%.*s %.*s", f[0].len, f[0].ptr, f[1].len, f[1].ptr);
+    snprintf(sent, sizeof(sent), "[You -> %s]%s %s", peer, urgent ? " (urgent)" : "", c2 + 1);
+    historyAppend(peer, sent);
+    f[3] = frameStr(FRAME_URGENT);
+    return urgent ? 4 : 3;
+}
+
+/* Read until at least one complete frame is buffered, then return it.
+   The frame's fields point into inBuf and stay valid until consumeFrame().
+   Returns the frame size, or -1 if the connection closed or sent garbage. */
+int readFrame(int fd, struct Frame *fr) {
+    while(1) {
+        int used = frameParse(inBuf, inLen, fr);
+        if(used != 0) return used;
+        ssize_t n = read(fd, inBuf + inLen, sizeof(inBuf) - inLen);
+        if(n <= 0) return -1;
+        inLen += n;
+    }
+}
+
+/* Drop a handled frame from the front of inBuf */
+void consumeFrame(int used) {
+    memmove(inBuf, inBuf + used, inLen - used);
+    inLen -= used;
+}
+
+/* Open a TCP connection, send one handshake frame and read the reply.
+   Returns the socket with the reply in *fr, or -1 if the server could not be reached. */
+int handshake(uint8_t type, const struct FrameField *fields, int n, struct Frame *fr, int *used) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in servAddr;
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_port = htons(tcpPort);
+    inet_pton(AF_INET, SERVER_IP, &servAddr.sin_addr);
+    char out[FRAME_HDR + 512];
+    size_t len = frameEncode(out, sizeof(out), type, fields, n);
+    inLen = 0;
+    if(fd < 0 || connect(fd, (struct sockaddr*)&servAddr, sizeof(servAddr)) < 0 ||
+       send(fd, out, len, MSG_NOSIGNAL) != (ssize_t)len || (*used = readFrame(fd, fr)) < 0) {
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Connect and start a session: resume the old one if we have a token, log in
+   with the password otherwise (or when the server no longer holds it).
+   Returns 1 once authenticated, 0 if the server refused us, -1 to try again later. */
+int connectServer() {
+    struct Frame fr;
+    int used, fd = -1;
+    char reply[MAX_MSG] = "unexpected reply";
+    if(resumeToken[0]) {
+        char seqStr[24];
+        snprintf(seqStr, sizeof(seqStr), "%llu", (unsigned long long)deliverSeq);
+        struct FrameField res[4] = { frameStr(campusName), frameStr(department), frameStr(resumeToken), frameStr(seqStr) };
+        if((fd = handshake(FRAME_RESUME, res, 4, &fr, &used)) < 0) return -1;
+        if(fr.type != FRAME_AUTH_OK) {
+            if(fr.nfields >= 1) frameFieldCopy(reply, sizeof(reply), fr.f[0]);
+            close(fd);
+            /* the server has not noticed the old connection drop yet */
+            if(strcmp(reply, "RESUME_BUSY") == 0) return -1;
+            printf("[CLIENT] Session could not be resumed, logging in again; messages sent meanwhile may be lost.\n");
+            resumeToken[0] = '\0';
+            fd = -1;
+        }
+    }
+    if(fd < 0) {
+        struct FrameField cred[3] = { frameStr(campusName), frameStr(department), frameStr(password) };
+        if((fd = handshake(FRAME_AUTH, cred, 3, &fr, &used)) < 0) return -1;
+        if(fr.type != FRAME_AUTH_OK) {
+            if(fr.nfields >= 1) frameFieldCopy(reply, sizeof(reply), fr.f[0]);
+            printf("Authentication failed: %s\n", reply);
+            close(fd);
+            return 0;
+        }
+    }
+    /* AUTH_OK: resume token and where our DELIVER count stands; none from a server without resumption */
+    resumeToken[0] = '\0';
+    deliverSeq = 0;
+    if(fr.nfields >= 2) {
+        char seqStr[24];
+        frameFieldCopy(resumeToken, sizeof(resumeToken), fr.f[0]);
+        frameFieldCopy(seqStr, sizeof(seqStr), fr.f[1]);
+        deliverSeq = strtoull(seqStr, NULL, 10);
+    }
+    consumeFrame(used);
+    pthread_mutex_lock(&tcpLock);
+    tcpSock = fd;
+    /* whatever was sent while we were away goes out now */
+    flushFramesLocked();
+    pthread_mutex_unlock(&tcpLock);
+    /* deltas from before the drop may be missing: start over from a snapshot */
+    pthread_mutex_lock(&presLock);
+    presenceSynced = 0;
+    presenceSnapping = 0;
+    pthread_mutex_unlock(&presLock);
+    sendFrame(FRAME_PRESENCE_SUB, NULL, 0);
+    return 1;
+}
+
+/* The connection dropped: reconnect with exponential backoff and jitter, so
+   a restarted server is not hit by every campus at the same instant */
+void reconnect() {
+    pthread_mutex_lock(&tcpLock);
+    close(tcpSock);
+    tcpSock = -1;
+    pthread_mutex_unlock(&tcpLock);
+    int delay = RECONNECT_MIN_MS;
+    while(1) {
+        int wait = delay / 2 + rand() % (delay / 2 + 1);
+        printf("\n[CLIENT] Connection to server lost, reconnecting in %d ms...\n", wait);
+        usleep(wait * 1000);
+        int rc = connectServer();
+        if(rc > 0) break;
+        if(rc == 0) exit(1);
+        if(delay < RECONNECT_MAX_MS) delay *= 2;
+    }
+    printf("\n[CLIENT] Reconnected as %s - %s Department.\n", campusName, department);
+}
+
+/* Tell the server how much of an incoming file we have */
+void fileConfirm(struct Incoming *in) {
+    char n[24];
+    snprintf(n, sizeof(n), "%llu", (unsigned long long)in->have);
+    struct FrameField f[2] = { frameStr(in->id), frameStr(n) };
+    sendFrame(FRAME_FILE_RECEIVED, f, 2);
+    in->confirmed = in->have;
+}
+
+/* Keep a name the server sent to one path component we write ourselves */
+void pathComponent(char *s) {
+    for(char *p = s; *p; p++) if(*p == '/' || (p == s && *p == '.')) *p = '_';
+}
+
+/* FILE_START, FILE_CHUNK and FILE_ACK from the server. A relay that starts
+   again after a reconnect finds its slot, and we say how far we got. */
+void handleFileFrame(const struct Frame *fr) {
+    char id[24];
+    if(fr->nfields < 2) return;
+    frameFieldCopy(id, sizeof(id), fr->f[0]);
+    if(fr->type == FRAME_FILE_ACK) {
+        char n[24];
+        frameFieldCopy(n, sizeof(n), fr->f[1]);
+        pthread_mutex_lock(&fileLock);
+        if(offerPending || strcmp(id, upId) == 0) {
+            strcpy(upId, id);
+            upAcked = strtoull(n, NULL, 10);
+            offerAnswered = 1;
+            pthread_cond_broadcast(&fileCond);
+        }
+        pthread_mutex_unlock(&fileLock);
+        return;
+    }
+    struct Incoming *in = NULL, *freeSlot = NULL;
+    for(int i=0;i<FILE_RECV_MAX;i++) {
+        if(strcmp(incoming[i].id, id) == 0) in = &incoming[i];
+        else if(!incoming[i].id[0] && !freeSlot) freeSlot = &incoming[i];
+    }
+    if(fr->type == FRAME_FILE_START && fr->nfields == 5) {
+        char name[128], size[24];
+        frameFieldCopy(name, sizeof(name), fr->f[3]);
+        frameFieldCopy(size, sizeof(size), fr->f[4]);
+        if(in) {
+            /* the server starts over from what we confirmed; skip it ahead to what we have */
+            if(in->have > in->confirmed) fileConfirm(in);
+            return;
+        }
+        if(!(in = freeSlot)) {
+            printf("\n[FILE] Too many files arriving at once, %s is waiting.\n", name);
+            return;
+        }
+        /* the sender's campus and department go into the path too */
+        char campus[MAX_NAME], dept[MAX_NAME];
+        frameFieldCopy(campus, sizeof(campus), fr->f[1]);
+        frameFieldCopy(dept, sizeof(dept), fr->f[2]);
+        snprintf(in->from, sizeof(in->from), "%s %s", campus, dept);
+        pathComponent(name);
+        pathComponent(campus);
+        pathComponent(dept);
+        snprintf(in->path, sizeof(in->path), "received-%s-%s-%s", campus, dept, name);
+        in->fd = open(in->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(in->fd < 0) {
+            perror(in->path);
+            return;
+        }
+        strcpy(in->id, id);
+        in->size = strtoull(size, NULL, 10);
+        in->have = in->confirmed = 0;
+        printf("\n[FILE] Receiving %s (%llu bytes) from %s\n", name, (unsigned long long)in->size, in->from);
+    } else if(fr->type == FRAME_FILE_CHUNK && fr->nfields == 3 && in) {
+        char offStr[24];
+        frameFieldCopy(offStr, sizeof(offStr), fr->f[1]);
+        uint64_t off = strtoull(offStr, NULL, 10);
+        /* a chunk we already have is sent again after a reconnect; a gap cannot happen */
+        if(off > in->have || off + fr->f[2].len <= in->have) return;
+        if(pwrite(in->fd, fr->f[2].ptr, fr->f[2].len, off) != fr->f[2].len) {
+            perror(in->path);
+            return;
+        }
+        in->have = off + fr->f[2].len;
+        if(in->have < in->size && in->have - in->confirmed < FILE_PROGRESS) return;
+        fileConfirm(in);
+        if(in->have < in->size) return;
+        char text[MAX_MSG];
+        snprintf(text, sizeof(text), "[FILE] Received %llu bytes from %s, saved as %s",
+                 (unsigned long long)in->size, in->from, in->path);
+        printf("\n%s\n", text);
+        historyAppend(in->from, text);
+        close(in->fd);
+        in->id[0] = '\0';
+    }
+}
+
+/* Menu option 6: offer a file to TargetCampus,TargetDept and upload it in
+   chunks. If the connection drops the upload waits for the reconnect, offers
+   the same transfer again and carries on from what the server already holds. */
+void sendFile(char *line) {
+    char *c1 = strchr(line, ',');
+    char *c2 = c1 ? strchr(c1 + 1, ',') : NULL;
+    if(!c2) {
+        printf("Invalid format. Use TargetCampus,TargetDept,path\n");
+        return;
+    }
+    *c1 = *c2 = '\0';
+    const char *path = c2 + 1;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        printf("Cannot send %s: %s\n", path, fd < 0 ? strerror(errno) : "empty or unreadable");
+        if(fd >= 0) close(fd);
+        return;
+    }
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    char size[24], offStr[24], chunk[FILE_CHUNK];
+    snprintf(size, sizeof(size), "%llu", (unsigned long long)st.st_size);
+    uint64_t off = 0;
+    long long started = nowMs();
+    pthread_mutex_lock(&fileLock);
+    upId[0] = '\0';
+    pthread_mutex_unlock(&fileLock);
+    while(1) {
+        /* offer it, or ask where the server is with a transfer we started */
+        char id[24];
+        pthread_mutex_lock(&fileLock);
+        strcpy(id, upId);
+        offerPending = 1;
+        offerAnswered = 0;
+        pthread_mutex_unlock(&fileLock);
+        struct FrameField f[5] = { frameStr(line), frameStr(c1 + 1), frameStr(base), frameStr(size), frameStr(id) };
+        sendFrame(FRAME_FILE_OFFER, f, id[0] ? 5 : 4);
+        pthread_mutex_lock(&fileLock);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += FILE_ACK_WAIT;
+        while(!offerAnswered && pthread_cond_timedwait(&fileCond, &fileLock, &ts) == 0) {}
+        int answer = offerAnswered;
+        strcpy(id, upId);
+        off = upAcked;
+        offerPending = 0;
+        pthread_mutex_unlock(&fileLock);
+        if(answer <= 0) {
+            printf("The server did not take the file%s.\n", answer < 0 ? " (see its notice)" : "");
+            close(fd);
+            return;
+        }
+        while(off < (uint64_t)st.st_size) {
+            ssize_t n = pread(fd, chunk, sizeof(chunk), off);
+            if(n <= 0) {
+                printf("Cannot read %s: %s\n", path, n < 0 ? strerror(errno) : "file shrank");
+                close(fd);
+                return;
             }
+            snprintf(offStr, sizeof(offStr), "%llu", (unsigned long long)off);
+            struct FrameField cf[3] = { frameStr(id), frameStr(offStr), { chunk, (uint16_t)n } };
+            /* -1: the connection is down, what is queued goes out after the reconnect */
+            if(sendFrame(FRAME_FILE_CHUNK, cf, 3) < 0) break;
+            off += n;
         }
+        if(off >= (uint64_t)st.st_size) break;
+        while(tcpSock < 0 || flushFrames() < 0) usleep(100000);
+        printf("Reconnected, resuming the upload of %s.\n", base);
     }
+    close(fd);
+    double secs = (nowMs() - started) / 1000.0;
+    char peer[MAX_NAME * 2], text[MAX_MSG];
+    snprintf(peer, sizeof(peer), "%s %s", line, c1 + 1);
+    snprintf(text, sizeof(text), "[You -> %s] (file) %s, %llu bytes", peer, base, (unsigned long long)st.st_size);
+    historyAppend(peer, text);
+    printf("Sent %s: %llu bytes in %.2f s (%.1f MB/s). The server relays it to %s.\n", base,
+           (unsigned long long)st.st_size, secs, secs > 0 ? st.st_size / secs / 1e6 : 0.0, peer);
+}
+
+/* A session in the presence table, NULL if we do not have it. Caller holds presLock. */
+struct PresenceEntry *presenceFind(uint64_t id) {
+    for(int i=0;i<presenceCount;i++) if(presence[i].id == id) return &presence[i];
     return NULL;
 }
 
+/* Apply one entry line: "id|state|campus|dept" from a snapshot, or a delta's
+   "+id|state|campus|dept", "-id" or "=id|state". Applying a line twice
+   changes nothing. Returns the text to show for a change, or NULL.
+   Caller holds presLock. */
+const char *presenceApply(char *line, char *out, size_t outSize, char *peer, size_t peerSize) {
+    char op = 0;
+    if(*line == '+' || *line == '-' || *line == '=') op = *line++;
+    char *f[4] = { line, NULL, NULL, NULL };
+    int nf = 1;
+    for(char *q = line; *q && nf < 4; q++)
+        if(*q == '|') {
+            *q = '\0';
+            f[nf++] = q + 1;
+        }
+    uint64_t id = strtoull(f[0], NULL, 16);
+    struct PresenceEntry *e = presenceFind(id);
+    int state = nf >= 2 ? atoi(f[1]) : 0;
+    if(state < 0 || state > 2) state = 0;
+    if(op == '-') {
+        if(!e) return NULL;
+        snprintf(peer, peerSize, "%s %s", e->campus, e->dept);
+        snprintf(out, outSize, "[PRESENCE] %s left", peer);
+        *e = presence[--presenceCount];
+        return out;
+    }
+    if(op == '=') {
+        if(!e || e->state == state) return NULL;
+        e->state = state;
+        snprintf(peer, peerSize, "%s %s", e->campus, e->dept);
+        snprintf(out, outSize, "[PRESENCE] %s is now %s", peer, presenceStates[state]);
+        return out;
+    }
+    if(nf < 4) return NULL;
+    int joined = !e;
+    if(!e) {
+        if(presenceCount == presenceCap) {
+            int cap = presenceCap ? presenceCap * 2 : 64;
+            struct PresenceEntry *np = realloc(presence, cap * sizeof(*np));
+            if(!np) return NULL;
+            presence = np;
+            presenceCap = cap;
+        }
+        e = &presence[presenceCount++];
+        e->id = id;
+    }
+    e->state = state;
+    snprintf(e->campus, sizeof(e->campus), "%s", f[2]);
+    snprintf(e->dept, sizeof(e->dept), "%s", f[3]);
+    if(op != '+' || !joined) return NULL;
+    snprintf(peer, peerSize, "%s %s", e->campus, e->dept);
+    snprintf(out, outSize, "[PRESENCE] %s joined", peer);
+    return out;
+}
+
+/* PRESENCE_SNAP and PRESENCE_DELTA. A snapshot replaces the table (its first
+   part clears it); a delta must be the next version, otherwise one was missed
+   and we subscribe again. Deltas arriving before the snapshot we asked for
+   are already part of it. */
+void handlePresenceFrame(const struct Frame *fr) {
+    char ver[24], line[2 * MAX_NAME + 48], text[MAX_MSG], peer[MAX_NAME * 2];
+    if(fr->nfields < 2) return;
+    frameFieldCopy(ver, sizeof(ver), fr->f[0]);
+    uint64_t v = strtoull(ver, NULL, 10);
+    int snap = fr->type == FRAME_PRESENCE_SNAP;
+    pthread_mutex_lock(&presLock);
+    if(snap) {
+        if(!presenceSnapping) presenceCount = 0;
+        presenceSnapping = fr->nfields >= 3;
+        presenceVersion = v;
+    } else if(!presenceSynced) {
+        pthread_mutex_unlock(&presLock);
+        return;
+    } else if(v != presenceVersion + 1) {
+        presenceSynced = 0;
+        pthread_mutex_unlock(&presLock);
+        printf("\n[PRESENCE] Missed an update (version %llu after %llu), asking for a fresh list.\n",
+               (unsigned long long)v, (unsigned long long)presenceVersion);
+        sendFrame(FRAME_PRESENCE_SUB, NULL, 0);
+        return;
+    } else {
+        presenceVersion = v;
+    }
+    const char *p = fr->f[1].ptr, *end = p + fr->f[1].len;
+    while(p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if(!eol) eol = end;
+        size_t n = eol - p;
+        if(n > 0 && n < sizeof(line)) {
+            memcpy(line, p, n);
+            line[n] = '\0';
+            if(presenceApply(line, text, sizeof(text), peer, sizeof(peer))) {
+                printf("\n%s\n", text);
+                historyAppend(peer, text);
+            }
+        }
+        p = eol + 1;
+    }
+    if(snap && !presenceSnapping) {
+        presenceSynced = 1;
+        printf("\n[PRESENCE] %d session(s) connected, updates follow as they happen (menu option 3).\n", presenceCount);
+    }
+    pthread_mutex_unlock(&presLock);
+}
+
+int cmpPresenceEntry(const void *a, const void *b) {
+    const struct PresenceEntry *x = a, *y = b;
+    int c = strcmp(x->campus, y->campus);
+    return c ? c : strcmp(x->dept, y->dept);
+}
+
+/* Menu option 3 with a current presence table: print it. Returns -1 when
+   there is none yet, so the caller asks the server instead. */
+int showPresence() {
+    pthread_mutex_lock(&presLock);
+    if(!presenceSynced) {
+        pthread_mutex_unlock(&presLock);
+        return -1;
+    }
+    qsort(presence, presenceCount, sizeof(*presence), cmpPresenceEntry);
+    printf("\n===== Connected sessions (%d) =====\n", presenceCount);
+    for(int i=0;i<presenceCount;i++)
+        printf("  %-12s %-12s %s\n", presence[i].campus, presence[i].dept, presenceStates[presence[i].state]);
+    printf("==================================\n");
+    pthread_mutex_unlock(&presLock);
+    return 0;
+}
+
 /* TCP  receive direct messages routed by server */
 void *tcpReceiver(void *arg) {
     char buf[MAX_MSG];
+    char peer[MAX_NAME * 2];
+    struct Frame fr;
     while(1) {
-        ssize_t n = read(tcpSock, buf, sizeof(buf)-1);
-        if(n <= 0) {
-            printf("[CLIENT] Server closed TCP connection.\n");
-            close(tcpSock);
-            exit(0);
+        int used = readFrame(tcpSock, &fr);
+        if(used < 0) {
+            if(leaving) return NULL;
+            reconnect();
+            continue;
+        }
+        if(fr.type == FRAME_FILE_START || fr.type == FRAME_FILE_CHUNK || fr.type == FRAME_FILE_ACK) {
+            handleFileFrame(&fr);
+            consumeFrame(used);
+            continue;
+        }
+        if(fr.type == FRAME_PRESENCE_SNAP || fr.type == FRAME_PRESENCE_DELTA) {
+            handlePresenceFrame(&fr);
+            consumeFrame(used);
+            continue;
+        }
+        if(fr.type == FRAME_NOTICE) {
+            /* a file offer that gets a notice instead of FILE_ACK was turned down */
+            pthread_mutex_lock(&fileLock);
+            if(offerPending && !offerAnswered) {
+                offerAnswered = -1;
+                pthread_cond_broadcast(&fileCond);
+            }
+            pthread_mutex_unlock(&fileLock);
         }
-        buf[n] = '\0';
+        snprintf(peer, sizeof(peer), "SERVER");
+        if(fr.type == FRAME_DELIVER) deliverSeq++;
+        if(fr.type == FRAME_DELIVER && fr.nfields == 5) {
+            snprintf(peer, sizeof(peer), "%.*s %.*s", fr.f[0].len, fr.f[0].ptr, fr.f[1].len, fr.f[1].ptr);
+            snprintf(buf, sizeof(buf), "[%.*s %.*s -> %.*s %.*s] %.*s",
+                     fr.f[0].len, fr.f[0].ptr, fr.f[1].len, fr.f[1].ptr,
+                     fr.f[2].len, fr.f[2].ptr, fr.f[3].len, fr.f[3].ptr,
+                     fr.f[4].len, fr.f[4].ptr);
+        } else if(fr.type == FRAME_PRESENCE && fr.nfields == 3) {
+            snprintf(peer, sizeof(peer), "%.*s %.*s", fr.f[0].len, fr.f[0].ptr, fr.f[1].len, fr.f[1].ptr);
+            snprintf(buf, sizeof(buf), "[PRESENCE] %.*s %.*s is now %.*s",
+                     fr.f[0].len, fr.f[0].ptr, fr.f[1].len, fr.f[1].ptr, fr.f[2].len, fr.f[2].ptr);
+        } else if(fr.nfields >= 1) {
+            /* LIST and NOTICE frames carry ready-to-print text */
+            frameFieldCopy(buf, sizeof(buf), fr.f[0]);
+        } else {
+            snprintf(buf, sizeof(buf), "[SERVER] frame type %d", fr.type);
+        }
+        consumeFrame(used);
         printf("\n[MSG] %s\n", buf);
         
         /* Store message in history */
-        if(historyCount < MAX_HISTORY) {
-            strcpy(messageHistory[historyCount++], buf);
-        }
+        historyAppend(peer, buf);
     }
     return NULL;
 }
 
-int main() {
-    char password[60];
+int main(int argc, char **argv) {
     char choice[10];
+    if(argc > 1) tcpPort = atoi(argv[1]);
+    if(argc > 2) udpServerPort = atoi(argv[2]);
+    srand(time(NULL) ^ getpid());
 
     printf("===== FAST-NUCES Campus Client =====\n");
     
@@ -151,33 +1142,15 @@ int main() {
     fgets(password, sizeof(password), stdin);
     password[strcspn(password, "\n")] = 0;
 
-    /* Create TCP socket and connect */
-    tcpSock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in servAddr;
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_port = htons(TCP_PORT);
-    inet_pton(AF_INET, SERVER_IP, &servAddr.sin_addr);
-    if(connect(tcpSock, (struct sockaddr*)&servAddr, sizeof(servAddr)) < 0) {
+    /* Connect and log in */
+    int rc = connectServer();
+    if(rc < 0) {
         perror("connect");
         return 1;
     }
+    if(rc == 0) return 1;
 
-    /* Send credentials */
-    char cred[120];
-    snprintf(cred, sizeof(cred), "%s:%s:%s", campusName, department, password);
-    send(tcpSock, cred, strlen(cred), 0);
-
-    /* Wait for auth response */
-    char authResponse[50];
-    ssize_t authBytes = read(tcpSock, authResponse, sizeof(authResponse)-1);
-    if(authBytes > 0) {
-        authResponse[authBytes] = '\0';
-        if(strcmp(authResponse, "AUTH_OK") != 0) {
-            printf("Authentication failed: %s\n", authResponse);
-            close(tcpSock);
-            return 1;
-        }
-    }
+    openHistory();
 
     /* Create UDP socket and bind to CLIENT_UDP_PORT so server can send broadcast here */
     udpSock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -201,6 +1174,9 @@ int main() {
     printf("- To send message: TargetCampus,TargetDept,Message\n");
     printf("- Example: Karachi,IT,Hello from Lahore Admissions\n");
     printf("- Departments: Admissions, Academics, IT, Sports\n");
+    printf("- Use * for any campus or department (Karachi,*,Hi / *,IT,Hi) or @group,*,Message for a group\n");
+    printf("- Start with ! to send it urgent, ahead of bulk traffic: !Karachi,IT,Fire drill at 3\n");
+    printf("- To send a file (option 6): TargetCampus,TargetDept,path/to/file\n");
     
     while(1) {
         showMenu();
@@ -215,8 +1191,15 @@ int main() {
                 if(!fgets(line, sizeof(line), stdin)) continue;
                 line[strcspn(line, "\n")] = 0;
                 if(strlen(line) == 0) continue;
-                send(tcpSock, line, strlen(line), 0);
-                printf("Message sent.\n");
+                /* split TargetCampus,TargetDept,Message into frame fields */
+                struct FrameField f[4];
+                int nf = prepareSend(line, f);
+                if(nf < 0) {
+                    printf("Invalid format. Use TargetCampus,TargetDept,Message\n");
+                    break;
+                }
+                if(sendFrame(FRAME_SEND, f, nf) < 0) printf("Not connected, the message will be sent after reconnecting.\n");
+                else printf("Message sent.\n");
                 break;
             }
             case '2': {
@@ -225,21 +1208,55 @@ int main() {
                 break;
             }
             case '3': {
-                /* Check online campuses, send a request to server */
-                char request[] = "LIST_REQUEST";
-                send(tcpSock, request, strlen(request), 0);
+                /* Check online campuses: the presence table once it is current, the server's list until then */
+                if(showPresence() == 0) break;
+                sendFrame(FRAME_LIST_REQ, NULL, 0);
                 printf("Request sent to server. Check received messages.\n");
                 break;
             }
             case '4': {
                 /* Exit */
                 printf("Exiting...\n");
+                /* tell the server not to hold the session for a resume */
+                leaving = 1;
+                sendFrame(FRAME_BYE, NULL, 0);
                 close(tcpSock);
                 close(udpSock);
                 exit(0);
             }
+            case '5': {
+                /* Send a batch: every line is queued, then all of them go out in as few writes as fit */
+                char line[MAX_MSG];
+                int queued = 0;
+                unsigned long callsBefore = sendCalls;
+                printf("\nEnter messages (TargetCampus,TargetDept,Message), one per line, empty line to send:\n");
+                while(printf("> "), fflush(stdout), fgets(line, sizeof(line), stdin)) {
+                    line[strcspn(line, "\n")] = 0;
+                    if(strlen(line) == 0) break;
+                    struct FrameField f[4];
+                    int nf = prepareSend(line, f);
+                    if(nf < 0) {
+                        printf("Invalid format, skipped. Use TargetCampus,TargetDept,Message\n");
+                        continue;
+                    }
+                    if(queueFrame(FRAME_SEND, f, nf) < 0) break;
+                    queued++;
+                }
+                flushFrames();
+                printf("%d messages sent in %lu writes.\n", queued, sendCalls - callsBefore);
+                break;
+            }
+            case '6': {
+                char line[512];
+                printf("\nEnter TargetCampus,TargetDept,path:\n> ");
+                if(!fgets(line, sizeof(line), stdin)) continue;
+                line[strcspn(line, "\n")] = 0;
+                if(strlen(line) == 0) continue;
+                sendFile(line);
+                break;
+            }
             default: {
-                printf("Invalid choice. Please enter 1-4.\n");
+                printf("Invalid choice. Please enter 1-6.\n");
                 break;
             }
         }
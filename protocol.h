@@ -0,0 +1,209 @@
+/* protocol.h
+   Framed TCP wire format shared by server.c and client.c, and the traffic
+   trace format shared by server.c and replay.c
+
+   Every TCP message is one frame:
+
+     +-----------+---------+------------+-----------------------------------+
+     | length(4) | type(1) | nfields(1) | nfields x { flen(2) | bytes }     |
+     +-----------+---------+------------+-----------------------------------+
+
+   - length is the number of bytes after the length header, network byte order
+   - flen is the length of one field, network byte order; fields are raw bytes
+     (not NUL terminated) so text may contain commas, colons or newlines
+   - a frame never exceeds FRAME_MAX bytes, so the first byte on the wire is
+     always 0. The server uses that to tell framed clients from legacy clients
+     that send plain "Campus:Dept:Password" text.
+
+   The parser is incremental and zero-copy: frameParse() looks at whatever is
+   in a receive buffer and, when a whole frame is present, fills a struct Frame
+   whose fields point straight into that buffer. Callers loop over it to pull
+   every complete frame out of one read() and keep the partial tail for later.
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define FRAME_HDR 4
+#define FRAME_MAX 65535         /* largest frame body on the wire */
+#define FRAME_MAX_FIELDS 8
+
+/* Frame types */
+enum {
+    FRAME_AUTH = 1,        /* client -> server: campus, dept, password */
+    FRAME_AUTH_OK,         /* server -> client: resume token and delivery seq, or (none) */
+    FRAME_AUTH_FAIL,       /* server -> client: reason */
+    FRAME_SEND,            /* client -> server: targetCampus, targetDept, text[, "urgent"] */
+    FRAME_DELIVER,         /* server -> client: fromCampus, fromDept, toCampus, toDept, text */
+    FRAME_LIST_REQ,        /* client -> server: (none) */
+    FRAME_LIST,            /* server -> client: text */
+    FRAME_NOTICE,          /* server -> client: text (errors, routing notices) */
+    FRAME_PRESENCE,        /* server -> client: campus, dept, state (online/suspect/offline) */
+    /* server <-> server federation links */
+    FRAME_PEER_HELLO,      /* node name, nonce[, proof]: the dialer's challenge, then the acceptor's answer */
+    FRAME_PEER_PRESENCE,   /* campus, dept, "up" or "down" */
+    FRAME_PEER_FORWARD,    /* fromCampus, fromDept, toCampus, toDept, text[, "urgent"] */
+    FRAME_PEER_NOTICE,     /* campus, dept, text: a notice for a session on the receiving node */
+    /* session resumption */
+    FRAME_RESUME,          /* client -> server: campus, dept, resume token, DELIVER frames received */
+    FRAME_BYE,             /* client -> server: (none), leaving for good, do not hold the session */
+    /* attachments: chunked, resumable file transfer through the server's spool */
+    FRAME_FILE_OFFER,      /* client -> server: targetCampus, targetDept, name, size[, id of a transfer to resume] */
+    FRAME_FILE_ACK,        /* server -> client: transfer id, bytes the server holds (all of them once uploaded) */
+    FRAME_FILE_CHUNK,      /* either way: transfer id, offset, bytes */
+    FRAME_FILE_START,      /* server -> client: transfer id, fromCampus, fromDept, name, size */
+    FRAME_FILE_RECEIVED,   /* client -> server: transfer id, bytes received so far (all of them when done) */
+    /* presence subscription: a snapshot, then versioned deltas once per server tick */
+    FRAME_PRESENCE_SUB,    /* client -> server: (none), (re)subscribe */
+    FRAME_PRESENCE_SNAP,   /* server -> client: version, entries[, "more" if another part follows] */
+    FRAME_PRESENCE_DELTA,  /* server -> client: version (one more than the last), entries */
+    /* federation handshake, last step */
+    FRAME_PEER_PROOF       /* dialer -> acceptor: node name, proof */
+};
+
+/* Federation links authenticate with a challenge-response over the shared
+   secret. The dialer sends PEER_HELLO with its name and a random nonce (32 hex
+   digits); the acceptor answers PEER_HELLO with its name, its own nonce and
+   its proof; the dialer checks that and sends PEER_PROOF. A proof is the hex
+   HMAC-SHA256, under the secret, of the role ('A' acceptor or 'D' dialer)
+   followed by the dialer's nonce, the acceptor's nonce, the dialer's name and
+   the acceptor's name, each NUL terminated. */
+
+/* Presence entries are lines of '|' separated text. A snapshot line is
+   "id|state|campus|dept"; a delta line is "+id|state|campus|dept" (joined),
+   "-id" (left) or "=id|state" (liveness changed). id is the server's handle
+   for the session in hex, state 0 online, 1 suspect, 2 offline. */
+
+/* Attachment bytes per FILE_CHUNK a client uploads; the frame fits the
+   server's default 16 KB receive buffer. Chunks the server relays are larger. */
+#define FILE_CHUNK 12288
+
+/* Traffic traces written by server -D and read by replay.c. The file is a
+   TraceHeader and then records, each a TraceRec followed by its bytes, in the
+   order the server received them. Both structs are in host byte order.
+   - TRACE_OPEN: a client connected; conn is its id from here on
+   - TRACE_DATA: bytes read from connection conn (frames or legacy text, cut
+     wherever read() cut them)
+   - TRACE_CLOSE: connection conn is gone
+   - TRACE_UDP: one datagram on the UDP port (conn is 0)
+   - TRACE_GAP: the server dropped records to keep up (conn is 0). The bytes
+     are a uint32 count of records dropped, then the uint32 ids of connections
+     that lost a DATA or CLOSE record; nothing more of those is recorded
+   Traces hold passwords and resume tokens as the clients sent them.
+   Version 1 traces have no TRACE_GAP records. */
+#define TRACE_MAGIC 0x5254554eu     /* "NUTR" */
+#define TRACE_VERSION 2
+
+enum { TRACE_OPEN = 1, TRACE_DATA, TRACE_CLOSE, TRACE_UDP, TRACE_GAP };
+
+struct TraceHeader {
+    uint32_t magic, version;
+    int64_t started;            /* Unix time the server started recording */
+};
+
+struct TraceRec {
+    uint32_t us;                /* microseconds since the previous record (saturates after 71 minutes) */
+    uint32_t conn;
+    uint32_t kindLen;           /* kind << 24 | number of bytes that follow */
+};
+
+struct FrameField {
+    const char *ptr;
+    uint16_t len;
+};
+
+struct Frame {
+    uint8_t type;
+    uint8_t nfields;
+    struct FrameField f[FRAME_MAX_FIELDS];
+};
+
+/* Build a field from a NUL terminated string */
+static inline struct FrameField frameStr(const char *s) {
+    struct FrameField f;
+    size_t n = strlen(s);
+    f.ptr = s;
+    f.len = n > 0xffff ? 0xffff : (uint16_t)n;
+    return f;
+}
+
+/* Optional last field of SEND and PEER_FORWARD: the message overtakes
+   bulk traffic in the receiver's queue */
+#define FRAME_URGENT "urgent"
+
+/* Does field k of fr exist and say FRAME_URGENT? */
+static inline int frameUrgent(const struct Frame *fr, int k) {
+    return fr->nfields > k && fr->f[k].len == sizeof(FRAME_URGENT) - 1 &&
+           memcmp(fr->f[k].ptr, FRAME_URGENT, sizeof(FRAME_URGENT) - 1) == 0;
+}
+
+/* Copy a field into a C string, truncating to cap-1 bytes */
+static inline void frameFieldCopy(char *dst, size_t cap, struct FrameField f) {
+    size_t n = f.len < cap - 1 ? f.len : cap - 1;
+    memcpy(dst, f.ptr, n);
+    dst[n] = '\0';
+}
+
+/* Encoded size of a frame with the given fields, header included */
+static inline size_t frameSize(const struct FrameField *fields, int n) {
+    size_t sz = FRAME_HDR + 2;
+    for(int i=0;i<n;i++) sz += 2 + fields[i].len;
+    return sz;
+}
+
+/* Encode a frame into out. Returns the number of bytes written, 0 if it does not fit. */
+static inline size_t frameEncode(char *out, size_t cap, uint8_t type,
+                                 const struct FrameField *fields, int n) {
+    size_t sz = frameSize(fields, n);
+    if(n > FRAME_MAX_FIELDS || sz > cap || sz - FRAME_HDR > FRAME_MAX) return 0;
+    uint32_t blen = htonl((uint32_t)(sz - FRAME_HDR));
+    memcpy(out, &blen, 4);
+    out[4] = (char)type;
+    out[5] = (char)n;
+    size_t off = FRAME_HDR + 2;
+    for(int i=0;i<n;i++) {
+        uint16_t flen = htons(fields[i].len);
+        memcpy(out + off, &flen, 2);
+        memcpy(out + off + 2, fields[i].ptr, fields[i].len);
+        off += 2 + fields[i].len;
+    }
+    return off;
+}
+
+/* Try to parse one frame from buf[0..len).
+   Returns the number of bytes the frame occupies, 0 if more data is needed,
+   or -1 if the stream is malformed and the connection should be dropped. */
+static inline int frameParse(const char *buf, size_t len, struct Frame *fr) {
+    if(len < FRAME_HDR) return 0;
+    uint32_t blen;
+    memcpy(&blen, buf, 4);
+    blen = ntohl(blen);
+    if(blen < 2 || blen > FRAME_MAX) return -1;
+    if(len < FRAME_HDR + blen) return 0;
+
+    const char *p = buf + FRAME_HDR;
+    const char *end = p + blen;
+    fr->type = (uint8_t)p[0];
+    fr->nfields = (uint8_t)p[1];
+    if(fr->nfields > FRAME_MAX_FIELDS) return -1;
+    p += 2;
+    for(int i=0;i<fr->nfields;i++) {
+        if(end - p < 2) return -1;
+        uint16_t flen;
+        memcpy(&flen, p, 2);
+        flen = ntohs(flen);
+        p += 2;
+        if(end - p < flen) return -1;
+        fr->f[i].ptr = p;
+        fr->f[i].len = flen;
+        p += flen;
+    }
+    if(p != end) return -1;
+    return (int)(FRAME_HDR + blen);
+}
+
+#endif
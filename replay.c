@@ -0,0 +1,447 @@
+/* replay.c
+   Plays a traffic trace recorded by the server (-D file) back against a
+   server. Every recorded connection is opened again and sends exactly the
+   bytes its client sent, cut where they were cut, and every recorded UDP
+   datagram is sent again. Records go out in the recorded order, at the
+   recorded pace or -x times faster (-x 0: as fast as the server takes them).
+   Whatever the server sends back is read and counted, not checked. Replaying
+   one trace against two builds of the server compares them under the same,
+   realistic mix; with -S the replay spawns the server and reports its CPU
+   time. The last line of output is a RESULT line like bench's.
+
+   Lag is how late each record went out against its schedule. A large lag
+   means the server (or this machine) could not keep up with the pace, so the
+   run did not reproduce the recorded timing.
+
+   The server must accept the credentials in the trace. Resume tokens in it
+   belong to the server that recorded it, so resumed sessions are refused and
+   the client's next login (also in the trace) takes over.
+
+   Build: gcc -O2 -Wall -o replay replay.c
+   Example: ./server -D /tmp/trace.bin     (run the load, then stop the server)
+            ./replay -S "./server -t 5100 -u 6100" -P 5100 -U 6100 -x 10 /tmp/trace.bin
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "protocol.h"
+
+#define MAX_EVENTS 256
+#define SERVICE_EVERY 32        /* records sent between reads of the server's replies */
+#define DRAIN_SECS 10           /* at the end, how long to wait for queued bytes to go out */
+#define UDP_TAG (1ull << 63)
+
+/* One replayed connection, indexed by its id in the trace */
+struct ReplayConn {
+    int fd;                     /* -1 when not open */
+    char *out;                  /* bytes the socket did not take yet */
+    size_t outLen, outCap;
+    int closing;                /* the trace closed it, close once out is sent */
+};
+
+/* Lag samples, in nanoseconds */
+struct Samples {
+    uint64_t *v;
+    size_t n, cap;
+};
+
+/* Settings */
+const char *serverIp = "127.0.0.1";
+int tcpPort = 5000;
+int udpPort = 6000;
+double speed = 1.0;             /* -x: 1 = recorded pace, 0 = as fast as possible */
+const char *spawnCmd = NULL;
+
+struct ReplayConn *conns = NULL;
+size_t connCap = 0;
+int epfd, udpFd;
+struct sockaddr_in tcpAddr, udpAddr;
+FILE *serverStdin = NULL;
+pid_t serverPid = -1;
+
+struct Samples lag;
+unsigned long connsOpened = 0, connectFailed = 0, serverClosed = 0, datagrams = 0;
+unsigned long recordsDropped = 0, connsCut = 0;   /* TRACE_GAP: what the recording server lost */
+unsigned long long bytesOut = 0, bytesIn = 0;
+
+uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void addSample(struct Samples *s, uint64_t v) {
+    if(s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        uint64_t *nv = realloc(s->v, cap * sizeof(*nv));
+        if(!nv) return;
+        s->v = nv;
+        s->cap = cap;
+    }
+    s->v[s->n++] = v;
+}
+
+int cmpU64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Percentile of sorted samples, in microseconds */
+double percentileUs(struct Samples *s, double p) {
+    if(s->n == 0) return 0;
+    size_t i = (size_t)(p * (s->n - 1) + 0.5);
+    return s->v[i] / 1000.0;
+}
+
+int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* The connection with this id, growing the table to hold it */
+struct ReplayConn *connGet(uint32_t id) {
+    if(id >= connCap) {
+        size_t cap = connCap ? connCap : 1024;
+        while(cap <= id) cap *= 2;
+        struct ReplayConn *nc = realloc(conns, cap * sizeof(*nc));
+        if(!nc) return NULL;
+        for(size_t i=connCap;i<cap;i++) {
+            memset(&nc[i], 0, sizeof(nc[i]));
+            nc[i].fd = -1;
+        }
+        conns = nc;
+        connCap = cap;
+    }
+    return &conns[id];
+}
+
+void connClose(struct ReplayConn *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->outLen = 0;
+    c->closing = 0;
+}
+
+/* Write what the socket takes; a connection the trace closed goes once it is all out */
+void connFlush(struct ReplayConn *c) {
+    while(c->outLen > 0) {
+        ssize_t n = send(c->fd, c->out, c->outLen, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && errno == EAGAIN) return;
+        if(n < 0) {
+            /* the server hung up; what is left of this connection in the trace is dropped */
+            serverClosed++;
+            connClose(c);
+            return;
+        }
+        bytesOut += n;
+        memmove(c->out, c->out + n, c->outLen - n);
+        c->outLen -= n;
+    }
+    if(c->closing) connClose(c);
+}
+
+/* Read and count whatever the server sent */
+void connReadable(struct ReplayConn *c) {
+    static char buf[65536];
+    while(c->fd >= 0) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && errno == EAGAIN) return;
+        if(n <= 0) {
+            serverClosed++;
+            connClose(c);
+            return;
+        }
+        bytesIn += n;
+    }
+}
+
+/* Handle every ready socket, waiting at most timeoutMs */
+void pollOnce(int timeoutMs) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeoutMs);
+    for(int i=0;i<n;i++) {
+        uint64_t tag = events[i].data.u64;
+        if(tag == UDP_TAG) {
+            static char buf[65536];
+            ssize_t got;
+            while((got = recv(udpFd, buf, sizeof(buf), 0)) > 0) bytesIn += got;
+            continue;
+        }
+        struct ReplayConn *c = &conns[tag];
+        if(c->fd < 0) continue;
+        if(events[i].events & EPOLLOUT) connFlush(c);
+        if(c->fd >= 0 && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) connReadable(c);
+    }
+}
+
+/* A recorded connection opens again */
+void replayOpen(uint32_t id) {
+    struct ReplayConn *c = connGet(id);
+    if(!c) return;
+    if(c->fd >= 0) connClose(c);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&tcpAddr, sizeof(tcpAddr)) < 0) {
+        if(fd >= 0) close(fd);
+        connectFailed++;
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setNonBlocking(fd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u64 = id;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    c->fd = fd;
+    connsOpened++;
+}
+
+/* Bytes a recorded client sent, queued behind anything not yet written */
+void replayData(uint32_t id, const char *data, size_t len) {
+    struct ReplayConn *c = id < connCap ? &conns[id] : NULL;
+    if(!c || c->fd < 0) return;
+    if(c->outLen + len > c->outCap) {
+        size_t cap = c->outCap ? c->outCap : 4096;
+        while(cap < c->outLen + len) cap *= 2;
+        char *nb = realloc(c->out, cap);
+        if(!nb) return;
+        c->out = nb;
+        c->outCap = cap;
+    }
+    memcpy(c->out + c->outLen, data, len);
+    c->outLen += len;
+    connFlush(c);
+}
+
+void replayClose(uint32_t id) {
+    struct ReplayConn *c = id < connCap ? &conns[id] : NULL;
+    if(!c || c->fd < 0) return;
+    c->closing = 1;
+    connFlush(c);
+}
+
+/* The recording server dropped records: the connections named lost part of
+   their bytes, so they close once what was recorded before the hole is out */
+void replayGap(const char *data, size_t len) {
+    uint32_t v;
+    if(len < sizeof(v)) return;
+    memcpy(&v, data, sizeof(v));
+    recordsDropped += v;
+    for(size_t off = sizeof(v); off + sizeof(v) <= len; off += sizeof(v)) {
+        memcpy(&v, data + off, sizeof(v));
+        connsCut++;
+        replayClose(v);
+    }
+}
+
+/* CPU time (user + system) the spawned server has used, in seconds; 0 if not spawned */
+double serverCpuSeconds(void) {
+    if(serverPid <= 0) return 0;
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)serverPid);
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    size_t n = fread(buf, 1, sizeof(buf)-1, f);
+    fclose(f);
+    buf[n] = 0;
+    /* fields after the ")" of the command name: state is field 3, utime 14, stime 15 */
+    char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if(!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Stop a spawned server however the replay exits */
+void stopServer(void) {
+    if(serverPid > 0) kill(serverPid, SIGTERM);
+    serverPid = -1;
+}
+
+/* Start the server under test; its stdin stays open so its admin console keeps running */
+void spawnServer(const char *cmd) {
+    int fds[2];
+    if(pipe(fds) < 0) { perror("pipe"); exit(1); }
+    serverPid = fork();
+    if(serverPid < 0) { perror("fork"); exit(1); }
+    if(serverPid == 0) {
+        dup2(fds[0], 0);
+        close(fds[1]);
+        int devnull = open("/dev/null", O_WRONLY);
+        if(devnull >= 0) dup2(devnull, 1);
+        char line[1024];
+        snprintf(line, sizeof(line), "exec %s", cmd);
+        execl("/bin/sh", "sh", "-c", line, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[0]);
+    serverStdin = fdopen(fds[1], "w");
+    atexit(stopServer);
+    usleep(300000); /* give it time to bind */
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options] trace\n"
+        "  -H ip          server address (default 127.0.0.1)\n"
+        "  -P port        server TCP port (default 5000)\n"
+        "  -U port        server UDP port (default 6000)\n"
+        "  -x speed       pace: 1 = as recorded, 10 = ten times faster, 0 = as fast as possible (default 1)\n"
+        "  -S command     spawn the server with this shell command and report its CPU time\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "H:P:U:x:S:h")) != -1) {
+        switch(opt) {
+            case 'H': serverIp = optarg; break;
+            case 'P': tcpPort = atoi(optarg); break;
+            case 'U': udpPort = atoi(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            case 'S': spawnCmd = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(optind != argc - 1 || speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* the whole trace is mapped; records are read in place */
+    const char *path = argv[optind];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0) { perror(path); return 1; }
+    if((size_t)st.st_size < sizeof(struct TraceHeader)) { fprintf(stderr, "%s: not a trace\n", path); return 1; }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) { perror("mmap"); return 1; }
+    close(fd);
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+    struct TraceHeader h;
+    memcpy(&h, map, sizeof(h));
+    if(h.magic != TRACE_MAGIC || h.version < 1 || h.version > TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace this replay reads (magic %08x, version %u)\n", path, h.magic, h.version);
+        return 1;
+    }
+
+    /* one socket per recorded connection that is open at once */
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    signal(SIGPIPE, SIG_IGN);
+
+    if(spawnCmd) spawnServer(spawnCmd);
+
+    memset(&tcpAddr, 0, sizeof(tcpAddr));
+    tcpAddr.sin_family = AF_INET;
+    tcpAddr.sin_port = htons(tcpPort);
+    inet_pton(AF_INET, serverIp, &tcpAddr.sin_addr);
+    udpAddr = tcpAddr;
+    udpAddr.sin_port = htons(udpPort);
+
+    epfd = epoll_create1(0);
+    udpFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(epfd < 0 || udpFd < 0) { perror("setup"); return 1; }
+    setNonBlocking(udpFd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = UDP_TAG;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, udpFd, &ev);
+
+    time_t started = (time_t)h.started;
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&started));
+    printf("[REPLAY] %s: %.1f MB recorded %s, replaying at %s\n", path, st.st_size / 1e6, when,
+           speed > 0 ? (speed == 1 ? "the recorded pace" : "a faster pace") : "full speed");
+
+    double cpuStart = serverCpuSeconds();
+    uint64_t start = nowNs();
+    uint64_t traceNs = 0;          /* recorded time of the current record, from the first */
+    unsigned long records = 0;
+    size_t off = sizeof(struct TraceHeader);
+    while(off + sizeof(struct TraceRec) <= (size_t)st.st_size) {
+        struct TraceRec r;
+        memcpy(&r, map + off, sizeof(r));
+        int kind = r.kindLen >> 24;
+        size_t len = r.kindLen & 0xffffff;
+        if(off + sizeof(r) + len > (size_t)st.st_size) break;   /* cut short by a killed server */
+        const char *data = map + off + sizeof(r);
+        off += sizeof(r) + len;
+        traceNs += (uint64_t)r.us * 1000;
+
+        if(speed > 0) {
+            /* wait for the record's time, reading replies meanwhile */
+            uint64_t due = start + (uint64_t)(traceNs / speed), now;
+            while((now = nowNs()) + 1000000 <= due) pollOnce((int)((due - now) / 1000000));
+            addSample(&lag, now > due ? now - due : 0);
+        }
+        switch(kind) {
+            case TRACE_OPEN: replayOpen(r.conn); break;
+            case TRACE_DATA: replayData(r.conn, data, len); break;
+            case TRACE_CLOSE: replayClose(r.conn); break;
+            case TRACE_GAP: replayGap(data, len); break;
+            case TRACE_UDP:
+                if(sendto(udpFd, data, len, 0, (struct sockaddr*)&udpAddr, sizeof(udpAddr)) == (ssize_t)len) datagrams++;
+                break;
+        }
+        if(++records % SERVICE_EVERY == 0) pollOnce(0);
+    }
+    double elapsed = (nowNs() - start) / 1e9;
+
+    /* let what is still queued go out, then the server's last replies come in */
+    uint64_t deadline = nowNs() + DRAIN_SECS * 1000000000ull;
+    int pending = 1;
+    while(pending && nowNs() < deadline) {
+        pollOnce(10);
+        pending = 0;
+        for(size_t i=0;i<connCap && !pending;i++) pending = conns[i].fd >= 0 && conns[i].outLen > 0;
+    }
+    uint64_t settle = nowNs() + 500000000ull;
+    while(nowNs() < settle) pollOnce(10);
+    double serverCpu = serverCpuSeconds() - cpuStart;
+    int stillOpen = 0;
+    for(size_t i=0;i<connCap;i++) {
+        if(conns[i].fd < 0) continue;
+        stillOpen++;
+        connClose(&conns[i]);
+    }
+
+    double traceSec = traceNs / 1e9;
+    qsort(lag.v, lag.n, sizeof(uint64_t), cmpU64);
+    printf("[REPLAY] %lu records covering %.2f s of traffic replayed in %.2f s (%.1fx)%s\n", records, traceSec, elapsed,
+           elapsed > 0 ? traceSec / elapsed : 0.0, off < (size_t)st.st_size ? ", the trace ends in a torn record" : "");
+    printf("[REPLAY] %lu connections (%lu refused, %lu closed by the server first, %d left open by the trace), "
+           "%.1f MB sent, %lu datagrams, %.1f MB back from the server\n", connsOpened, connectFailed, serverClosed,
+           stillOpen, bytesOut / 1e6, datagrams, bytesIn / 1e6);
+    if(recordsDropped || connsCut)
+        printf("[REPLAY] the recording server dropped %lu records; %lu connections were cut short there\n",
+               recordsDropped, connsCut);
+    if(speed > 0)
+        printf("[REPLAY] lag behind the schedule p50 %.1f us, p99 %.1f us, max %.1f us\n", percentileUs(&lag, 0.50),
+               percentileUs(&lag, 0.99), percentileUs(&lag, 1.0));
+    if(serverPid > 0) printf("[REPLAY] server used %.2f s of CPU\n", serverCpu);
+    printf("RESULT records=%lu trace_s=%.2f replay_s=%.2f speed=%.1f connections=%lu connect_failed=%lu server_closed=%lu"
+           " datagrams=%lu mb_out=%.1f mb_in=%.1f trace_dropped=%lu cut=%lu", records, traceSec, elapsed, speed,
+           connsOpened, connectFailed, serverClosed, datagrams, bytesOut / 1e6, bytesIn / 1e6, recordsDropped, connsCut);
+    if(speed > 0)
+        printf(" lag_p50_us=%.1f lag_p99_us=%.1f lag_max_us=%.1f", percentileUs(&lag, 0.50), percentileUs(&lag, 0.99),
+               percentileUs(&lag, 1.0));
+    if(serverPid > 0) printf(" server_cpu_s=%.2f", serverCpu);
+    printf("\n");
+    return 0;
+}
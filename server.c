@@ -1,394 +1,6251 @@
 /* server.c
    Central Server for Multi-Campus Communication System
    Features:
-   - TCP port 5000: Handles client connections, authentication, and messaging
-   - UDP port 6000: Receives heartbeats and sends broadcast messages  
+   - TCP port 5000 (-t): Handles client connections, authentication, and messaging
+   - UDP port 6000 (-u): Receives heartbeats and sends broadcast messages  
    - Admin console: Commands "list" (show connected campuses) 
      and "broadcast <message>"
    - Department-level routing: Messages can be sent to specific departments within campuses
+   - Fan-out: "Campus,*", "*,Dept", "*,*" and "@group" targets reach every
+     matching session; the payload is encoded once and the same reference
+     counted buffer sits in every receiver's queue
+   - Event loop: a small, fixed set of epoll reactor threads (-r N) owns the
+     listening socket, the UDP heartbeat socket and every client socket
+   - Shards (-s N): every reactor accepts on its own SO_REUSEPORT listening
+     socket and takes session slots from its own partition; a routed message
+     whose receiver lives on another reactor is handed to that reactor through
+     a lock-free MPSC inbox, so each socket is only written by its owner
+   - Framed TCP protocol (protocol.h); legacy plain-text clients are still
+     accepted unless the server runs with -S (strict framing)
+   - Session table: stable slots with generation-checked handles, indexed by
+     interned (campus, dept) ids so routing and heartbeats are O(1); -n only
+     reserves the table, memory is committed as sessions arrive
+   - Capacity (-c file, -n, -b, -i): a config file or options set ports,
+     listen backlog, session limit and receive buffer size; idle connections
+     hold no receive buffer, and the admin 'mem' command shows the cost of a
+     session
+   - Outbound queues: every session owns a bounded queue drained with
+     non-blocking writev; -w high:low and -p drop|block|disconnect decide what
+     happens when a receiver falls behind
+   - Priority lanes: each outbound queue has an urgent lane, for server
+     replies (LIST responses, notices, presence) and messages sent as urgent,
+     that is written ahead of the bulk lane without splitting a frame
+   - Rate limits (-q, -Q): token buckets per session and per campus; a client
+     over its rate is not read until it has tokens again, so TCP pushes back
+   - Write coalescing: the owner writes a session's queue once at the end of
+     its event batch, or (-W usec) once its oldest unsent message is that old,
+     so bursts of small messages share one writev and fewer TCP segments
+   - Heartbeat liveness: a hierarchical timing wheel tracks every session's
+     heartbeat deadline; sessions that miss -H interval:suspect:offline
+     heartbeats are marked suspect, then evicted, and presence changes are
+     pushed to framed clients
+   - Batched UDP: heartbeats are read with recvmmsg and applied under one lock
+     per batch; broadcasts go out with sendmmsg on one long-lived socket
+   - Store-and-forward (-L dir): messages for departments that are not
+     connected go to a memory-mapped, segmented message log and are streamed
+     to the department when it logs in; fsyncs are batched (group commit)
+   - Buffer pool: outbound buffers, handoffs and connections come from
+     size-classed slabs with per-thread free lists; a routed payload is
+     copied once, from the sender's input buffer into the shared buffer
+   - Event log: hot-path threads record log lines as binary records in
+     per-thread lock-free rings; a logger thread formats and writes them.
+     -l (or the admin 'loglevel' command) filters by level, overflow is counted
+   - Metrics: per-thread counters and log-linear latency histograms, summed on
+     demand by the admin 'stats' command ('stats json' for a one-line dump)
+   - Presence snapshots: LIST_REQUEST and the admin 'list' read an immutable,
+     pre-serialized snapshot protected by hazard pointers, so they never take
+     clientsLock; the snapshot is rebuilt on reactor 0 when presence changes
+   - Presence subscriptions: after PRESENCE_SUB a client gets one snapshot and
+     then a versioned delta per tick with the joins, leaves and liveness
+     changes, coalesced per session and encoded once for all subscribers
+   - Credentials (-C file): salted PBKDF2-HMAC-SHA256 hashes in a hashed
+     lookup table; ./server -P Campus:Password prints a line for the file.
+     Full derivations run on auth worker threads, off the reactors.
+     Connections that do not finish the handshake within -A seconds are closed
+   - Federation (-F host:port,... -N name -K secret): regional hub servers
+     link up as peers, announce which departments they hold and forward
+     messages for a department connected to another hub
+   - Session resumption (-R grace:window): AUTH_OK carries a resume token;
+     a framed session whose connection drops stays routable for grace
+     seconds and keeps its last window DELIVER frames, so a client that
+     comes back with RESUME gets only what it had not received
+   - Attachments (-T dir, -Z sendfile|copy): files are uploaded in chunks,
+     spooled to disk and relayed to the receiving department with sendfile;
+     both legs resume from the last acknowledged offset
+   - Traffic traces (-D file): inbound TCP bytes and UDP datagrams are
+     recorded with timestamps into a compact binary trace that replay.c
+     plays back against a server, at the original or a faster pace
 */
 
+#define _GNU_SOURCE   /* recvmmsg / sendmmsg */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <netdb.h>
+#include "protocol.h"
 
-#define MAX_CLIENTS 10
+#define MAX_CLIENTS 65536  /* default -n; slots only cost memory once used */
+#define MAX_SESSIONS_LIMIT (1 << 24)
 #define TCP_PORT 5000
 #define UDP_PORT 6000
 #define MAX_NAME 40
 #define MAX_MSG 1024
+#define MAX_REACTORS 16
+#define MAX_EVENTS 64
+#define CONN_INBUF 16384  /* default -i: per-connection receive buffer, bounds the largest inbound frame */
+#define OUTQ_INITIAL 4     /* first outbound ring, doubled as needed; small so idle sessions stay cheap */
+#define MAX_IOV 64         /* queued buffers handed to one writev */
+#define COALESCE_BYTES 65536  /* a queue this large is written without waiting for the window */
+#define XFER_RELAY_CHUNK 49152  /* attachment bytes per FILE_CHUNK relayed to a receiver */
+#define READ_BUDGET 65536  /* bytes read from one framed connection before its reactor serves the others */
+#define UDP_BATCH 64       /* datagrams per recvmmsg / sendmmsg */
+#define HEARTBEAT_MAX 256
 
-/* credentials */
-struct Cred { char campus[MAX_NAME]; char password[MAX_NAME]; };
-struct Cred validCreds[] = {
+/* epoll data.ptr tags for the two shared sockets, client sockets carry their struct Conn* */
+#define TAG_LISTEN ((void*)1)
+#define TAG_UDP    ((void*)2)
+#define TAG_TIMER  ((void*)3)
+#define TAG_INBOX  ((void*)4)
+
+/* Timing wheel: 100 ms ticks, level 0 covers 25.6 s, level 1 covers ~27 min */
+#define TICK_MS 100
+#define WHEEL0_BITS 8
+#define WHEEL0_SLOTS (1 << WHEEL0_BITS)
+#define WHEEL1_SLOTS 64
+
+/* Credentials. Only salted PBKDF2-HMAC-SHA256 hashes are kept, in a table
+   hashed by campus name. They come from the -C file; without one the
+   development passwords below are hashed at startup. A successful login also
+   leaves a keyed one-pass tag of the password behind, so reconnects with the
+   same password skip the slow derivation. The derivation itself runs on a
+   few auth worker threads, never on a reactor, so a stream of bad passwords
+   costs the workers, not every session the reactor serves. */
+#define CRED_BUCKETS 256
+#define CRED_SALT 16
+#define CRED_ITERATIONS 10000
+#define AUTH_WORKERS 2          /* threads running full derivations */
+#define AUTH_QUEUE_MAX 256      /* logins waiting for a worker; more are turned away */
+struct Cred {
+    char campus[MAX_NAME];
+    int iterations;
+    uint8_t salt[CRED_SALT];
+    uint8_t hash[32];
+    uint8_t fastTag[32];   /* HMAC(credKey, password) of the last good login, under credLock */
+    int fastValid;
+    int next;              /* next credential in the same bucket, -1 terminates */
+};
+struct Cred *creds = NULL;
+int numCreds = 0, credCap = 0;
+int credBuckets[CRED_BUCKETS];
+pthread_mutex_t credLock = PTHREAD_MUTEX_INITIALIZER;
+const char *credFile = NULL;
+struct { const char *campus, *password; } devCreds[] = {
     {"Lahore","NU-LHR-123"},
     {"Karachi","NU-KHI-123"},
     {"Peshawar","NU-PSH-123"},
     {"CFD","NU-CFD-123"},
     {"Multan","NU-MTN-123"}
 };
-int numCreds = 5;
 
-/* Per-client info */
-int tcpSockets[MAX_CLIENTS];
-char clientCampus[MAX_CLIENTS][MAX_NAME];
-char clientDept[MAX_CLIENTS][MAX_NAME];  /* Department field */
-int clientCount = 0;
+/* Connections must send valid credentials within this many seconds (-A) */
+int authTimeoutSecs = 10;
+
+/* Rate limits (-q per session, -Q per campus): token buckets of rate
+   messages a second holding up to burst, kept in GCRA form as one time per
+   bucket, tat, when the bucket is full again. A message takes a token by
+   moving tat one interval on; the bucket is empty when that would put tat
+   more than burst past now. */
+struct RateLimit {
+    uint64_t interval;     /* ns per token, 0 = no limit */
+    uint64_t burst;        /* ns worth of tokens the bucket holds */
+};
+struct RateLimit sessionRate, campusRate;
+
+/* Interned campus/department names. Every distinct name gets a small integer id
+   the first time a session uses it; ids are never freed (there are only a
+   handful of campuses and departments), so they can be compared instead of strings. */
+#define NAME_BUCKETS 4096
+struct Name {
+    char str[MAX_NAME];
+    int hashNext;      /* next id in the same bucket, -1 terminates */
+    int campusHead;    /* first/last session of this campus in connection order */
+    int campusTail;
+    int deptHead;      /* first/last session of this department, any campus */
+    int deptTail;
+    /* traffic of this name as a campus, protected by clientsLock */
+    unsigned long msgsOut, bytesOut;   /* routed from sessions of this campus */
+    unsigned long msgsIn, bytesIn;     /* routed to sessions of this campus */
+    int remoteHead;    /* first federation remote entry of this campus, -1 if none */
+    uint64_t *rateTat; /* -Q bucket of this campus, allocated with its first session, never freed */
+};
+struct Name *names = NULL;
+int nameCount = 0, nameCap = 0;
+int nameBuckets[NAME_BUCKETS];
+
+/* Outbound priority lanes: a session's urgent lane (server replies, urgent
+   messages) is written before its bulk lane */
+enum { LANE_URGENT = 0, LANE_BULK, LANES };
+
+/* One encoded outbound message. Reference counted so the same bytes can sit
+   in more than one queue; the payload follows the header. */
+struct OutBuf {
+    int refs;
+    uint8_t lane;      /* LANE_URGENT or LANE_BULK */
+    uint8_t file;      /* data is a struct OutFile: an attachment chunk sent from its spool file */
+    uint8_t logged;    /* a stored message: its log seq follows the wire bytes, see logStream() */
+    size_t len;        /* bytes on the wire */
+    char data[];
+};
+
+/* An attachment chunk queued for a receiver: the FILE_CHUNK frame header is
+   kept here and the payload stays in the spool file until sendfile() sends it */
+struct Xfer;
+struct OutFile {
+    struct Xfer *x;    /* holds a reference, so the spool file stays open */
+    int fd;            /* the transfer's spool file */
+    uint64_t off;      /* payload offset in the file */
+    size_t hdrLen;
+    char hdr[64];
+};
+void xferRelease(struct Xfer *x);
+
+/* What to do when a receiver's queue is above the high watermark */
+enum { POLICY_DROP = 0, POLICY_BLOCK, POLICY_DISCONNECT };
+const char *policyNames[] = { "drop", "block", "disconnect" };
+int backpressurePolicy = POLICY_BLOCK;
+size_t highWatermark = 1024 * 1024;
+size_t lowWatermark = 256 * 1024;
+uint64_t coalesceNs = 0;    /* -W: extra time a session's output may wait to be coalesced, 0 = end of batch */
+
+struct Conn;
+
+/* Intrusive timer. Lives inside the object it times, so arming and cancelling
+   only relink list pointers. */
+struct Timer {
+    struct Timer *next, *prev;   /* NULL while not armed */
+    uint64_t expires;            /* absolute tick */
+};
+
+/* Heartbeat liveness of a session */
+enum { LIVE_ONLINE = 0, LIVE_SUSPECT, LIVE_OFFLINE };
+const char *liveNames[] = { "online", "suspect", "offline" };
+int heartbeatSecs = 10;     /* clients heartbeat every 10 s */
+int suspectAfter = 2;       /* missed intervals before a session is suspect */
+int offlineAfter = 3;       /* missed intervals before it is evicted, 0 = never evict */
+
+/* One lane of a session's outbound queue */
+struct OutEntry {
+    struct OutBuf *b;
+    uint64_t queuedNs : 63;      /* when it was queued */
+    uint64_t numbered : 1;       /* already in the resume window (a replay) */
+};
+struct OutLane {
+    struct OutEntry *q;
+    int head, count, cap;
+};
+
+/* Per-session state. Slots never move, a disconnect only bumps gen and returns the
+   slot to the free list, so handles held elsewhere are safe to check and reuse. */
+typedef uint64_t SessionHandle;   /* (gen << 32) | slot */
+#define NO_SESSION ((SessionHandle)0)
+struct Session {
+    uint32_t gen;      /* odd while in use, bumped on allocate and on free */
+    int fd;
+    int framed;        /* 1 = framed protocol, 0 = legacy text */
+    int campusId, deptId;
+    char campus[MAX_NAME];
+    char dept[MAX_NAME];  /* Department field */
+    /* For UDP broadcast: last known UDP sockaddr_in and timestamp */
+    struct sockaddr_in udpAddr;
+    time_t lastSeen;
+    int udpKnown;      /* 0 = unknown, 1 = known */
+    int routeNext;     /* next slot in the same (campus, dept) route bucket */
+    int campusNext, campusPrev;  /* sessions of the same campus */
+    int deptNext, deptPrev;      /* sessions of the same department */
+    int allNext, allPrev;        /* every session, in connection order */
+    int freeNext;
+    struct Conn *conn;           /* owning connection, only valid while the slot is in use */
+    /* Outbound queue: one ring of buffers waiting for the socket per lane, protected by outLock */
+    pthread_mutex_t outLock;
+    struct OutLane lanes[LANES];
+    size_t outBytes;             /* queued bytes not yet written */
+    size_t outOff;               /* bytes of the head buffer of lane outOffLane already written */
+    int outOffLane;
+    unsigned long outDropped;
+    SessionHandle *waiters;      /* senders paused by POLICY_BLOCK until we drain */
+    int waitCount, waitCap;
+    /* Heartbeat liveness, protected by clientsLock */
+    struct Timer hbTimer;        /* fires when the next heartbeat is overdue */
+    int missed;                  /* consecutive heartbeat intervals missed */
+    int liveness;
+    int presenceSub;             /* PSUB_*: subscribed to presence deltas, protected by clientsLock */
+    int logBacklog;              /* stored messages still being streamed, set under logLock */
+    uint64_t logWritten;         /* log seq of the last stored message written to the socket, under outLock */
+    int xferBacklog;             /* attachment chunks waiting for room in the queue, set under xferLock */
+    int owner;                   /* reactor that owns the connection and writes the socket */
+    int home;                    /* reactor whose free list the slot belongs to */
+    int flushPending;            /* owner only: on the owner's deferred flush list */
+    uint64_t flushDue;           /* owner only: when the deferred flush must happen */
+    /* Resumption (framed clients, -R). DELIVER frames are numbered from 1 in
+       the order they reach the socket (urgent ones can overtake bulk ones in
+       the queue), and the last resumeWindow of them stay referenced in
+       sent[seq % resumeWindow], protected by outLock. When the connection drops
+       the session is parked: it keeps its slot, handle and route entries, so
+       messages keep arriving in sent[], until a RESUME with the token from
+       AUTH_OK reattaches it or resumeGraceSecs pass. */
+    int resumable;
+    int parked;                  /* no connection, waiting for a RESUME; set under clientsLock and outLock */
+    uint8_t resumeKey[16];
+    uint64_t deliverSeq;         /* DELIVER frames numbered so far */
+    struct OutBuf **sent;        /* allocated on the first delivery */
+};
+struct Session *sessions = NULL;
+void wakeWaitersLocked(SessionHandle *list, int count);
+void resumeNumberLocked(struct Session *s, struct OutBuf *b);
+void logStream(struct Session *s);
+void logDetach(struct Session *s);
+void xferStream(struct Session *s);
+void xferDetach(struct Session *s);
+void presenceNote(struct Session *s, int op);
+int remoteFind(const char *campus, const char *dept);
+void peerAnnounce(int cid, int did, int up);
+void peerDown(struct Conn *c);
+void peerRetry(int d);
+void peerDialDue(void);
+void annSpmTick(void);
+int maxSessions = MAX_CLIENTS;
+int slotsCommitted = 0;     /* slots touched so far, the rest of the table is only reserved */
+int resumeGraceSecs = 30;   /* -R: how long a dropped session waits for its client, 0 = no resumption */
+int resumeWindow = 256;     /* DELIVER frames kept per session for a resume */
+char *spoolDir = NULL;      /* -T: attachment spool directory, NULL = attachments off */
+char *logDir = NULL;        /* -L: message log directory, NULL = no store-and-forward */
+int clientCount = 0;
+int allHead = -1, allTail = -1;
+int presenceDirty = 1;      /* membership or liveness changed since the last presence snapshot */
+int presenceStale = 0;      /* only last-seen times changed */
+enum { PRES_JOIN = 0, PRES_LEAVE, PRES_STATE };   /* presence changes, see presenceNote() */
+enum { PSUB_NONE = 0, PSUB_WAIT, PSUB_LIVE };     /* Session.presenceSub: not, waiting for a snapshot, subscribed */
+int *routeBuckets = NULL;   /* (campusId, deptId) hash -> first slot */
+unsigned routeMask = 0;
+
+/* Listening ports (-t, -u), so several nodes can run on one host */
+int tcpPort = TCP_PORT;
+int udpPort = UDP_PORT;
+int listenBacklog = SOMAXCONN;   /* -b */
+size_t connBufSize = CONN_INBUF; /* -i */
+int inBufsHeld = 0;              /* connections holding a partial frame, for 'mem' */
+
+/* Compatibility mode: accept legacy "Campus:Dept:Password" / "Campus,Dept,Message" text clients */
+int legacyCompat = 1;
+
+pthread_mutex_t clientsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Connection state owned by one reactor. A connection starts in CONN_HANDSHAKE
+   waiting for credentials and becomes CONN_ACTIVE after AUTH_OK; it sits in
+   CONN_AUTH, unread, while an auth worker checks its password. The first byte
+   received decides whether it speaks the framed protocol or legacy text.
+   Federation links to other servers are CONN_PEER once their HELLO checks
+   out; the ones we dial sit in CONN_DIAL until the connect completes. */
+enum { CONN_HANDSHAKE = 0, CONN_ACTIVE = 1, CONN_DIAL, CONN_PEER, CONN_AUTH };
+struct Conn {
+    int fd;
+    int state;
+    int framed;            /* -1 = not known yet, 1 = framed, 0 = legacy text */
+    SessionHandle session; /* set once authenticated */
+    int epfd;              /* owning reactor's epoll set */
+    int reactor;           /* owning reactor's index */
+    uint64_t acceptedNs;   /* accept time, for the accept-to-AUTH_OK histogram */
+    int paused;            /* POLICY_BLOCK: stop reading until a receiver drains */
+    char campus[MAX_NAME];
+    char dept[MAX_NAME];
+    char *inBuf;           /* partial frames carried over between reads (connBufSize
+                              bytes from the pool), NULL while nothing is carried */
+    size_t inLen;
+    struct Conn *hsNext, *hsPrev; /* owner's handshake list, while in CONN_HANDSHAKE */
+    uint64_t hsDeadline;          /* nowNs() by which the handshake must be done */
+    int hsLinked;
+    int peer;                     /* CONN_PEER: index into peers[] */
+    int dial;                     /* -F entry this connection was dialled for, -1 if accepted */
+    int bye;                      /* the client said BYE: end the session instead of parking it */
+    uint64_t rateTat;             /* -q bucket of this connection */
+    uint64_t *campusTat;          /* -Q bucket of its campus */
+    struct Conn *thrNext, *thrPrev;   /* owner's throttled list, while held back by a rate limit or its read budget */
+    uint64_t thrUntil;                /* nowNs() when it has a token again */
+    int throttled;
+    uint32_t traceId;                 /* -D: this connection's id in the trace, 0 if it is not recorded */
+};
+
+/* A routed message on its way to the reactor that owns the receiver, or a
+   finished password check coming back to the connection's reactor */
+struct AuthJob;
+struct Handoff {
+    struct Handoff *next;
+    SessionHandle dest;
+    struct OutBuf *b;
+    struct AuthJob *auth;        /* set instead of dest and b for a password check */
+};
+
+/* A login whose password needs the full derivation. The reactor queues it
+   for an auth worker, which posts it back through the reactor's inbox. */
+struct AuthJob {
+    struct AuthJob *next;
+    struct Handoff done;         /* the worker's inbox entry */
+    struct Conn *c;              /* not freed while the job is out, see closeConn() */
+    int reactor;
+    struct Cred *cred;
+    char campus[MAX_NAME], dept[MAX_NAME], pass[MAX_NAME];
+    uint8_t tag[32];             /* fast tag of pass, kept if it turns out right */
+    int ok;
+};
+
+/* Reactor threads: each has its own epoll set, reactor 0 also owns the UDP socket
+   and, unless sharded, the only listening socket */
+struct Reactor {
+    int epfd;
+    pthread_t thread;
+    int listenFd;                /* -1 if this reactor does not accept */
+    int freeHead;                /* free session slots of this reactor's partition */
+    int freshNext, freshEnd;     /* the partition's slots never used yet */
+    struct Handoff *inbox;       /* MPSC stack: any thread pushes, the owner takes all */
+    int inboxFd;                 /* eventfd that wakes the owner when the inbox was empty */
+    unsigned long handoffsIn, wakeups;   /* owner only, shown by the admin 'shards' command */
+    struct Conn *hsHead, *hsTail;        /* connections still in the handshake, oldest first (owner only) */
+    SessionHandle *deferred;             /* sessions waiting for a coalesced flush, oldest first (owner only) */
+    struct Conn *thrHead, *thrTail;      /* connections held back by a rate limit, soonest first (owner only) */
+    struct AuthJob *authDone;            /* password checks back from the workers, handled after the batch (owner only) */
+    int deferCount, deferCap;
+};
+struct Reactor reactors[MAX_REACTORS];
+int numReactors = 1;
+int sharded = 0;       /* -s: one SO_REUSEPORT listener per reactor */
+int nextReactor = 0;   /* round-robin assignment of accepted sockets, only touched by reactor 0 */
+__thread int currentReactor = -1;   /* reactor running on this thread, -1 elsewhere */
+
+int udpSock = -1;
+int bcastSock = -1;    /* long-lived socket for admin broadcasts */
+
+/* Federation (-F host:port,...): hubs in different regions link up as peers.
+   Each node tells its peers which (campus, dept) pairs it has sessions for,
+   and a message for a session that lives on a peer is forwarded over that
+   peer's link and delivered there. Peers form a full mesh, so a forwarded
+   message is only ever delivered locally, never forwarded again. A link is a
+   Conn in CONN_PEER whose outbound queue is a session slot that is in no
+   route index. Peers, dials and the remote table are protected by clientsLock. */
+#define MAX_PEERS 32
+#define REMOTE_BUCKETS 4096
+#define PEER_BACKOFF_MAX 16      /* seconds between redials, at most */
+struct PeerDial {                /* one -F address, dialled by reactor 0 */
+    char addr[64];
+    struct sockaddr_in sa;
+    char name[MAX_NAME];         /* node name from its HELLO, "" until the first link */
+    int dialing;
+    uint64_t nextDial;           /* nowNs() of the next attempt */
+    int backoff;                 /* seconds */
+};
+struct Peer {                    /* a node we have linked with, by name */
+    char name[MAX_NAME];
+    struct Conn *conn;           /* live link, NULL while down */
+    SessionHandle session;       /* the link's outbound queue */
+    int dialledByUs;
+    int remoteCount;             /* (campus, dept) pairs it announced */
+    unsigned long fwdOut, fwdIn;
+};
+struct Remote {                  /* a (campus, dept) with a session on a peer */
+    int campusId, deptId;
+    int peer;                    /* -1 while on the free list */
+    int hashNext;                /* same bucket, or the next free entry */
+    int campusNext;              /* remote entries of the same campus */
+};
+struct PeerDial dials[MAX_PEERS];
+int dialCount = 0;
+struct Peer peers[MAX_PEERS];
+int peerCount = 0;
+struct Remote *remotes = NULL;
+int remoteCap = 0, remoteFree = -1;
+int remoteBuckets[REMOTE_BUCKETS];
+char nodeName[MAX_NAME] = "";
+const char *federationSecret = NULL;   /* -K: links must prove they know it */
+
+/* Metrics. Every thread that records owns one slot (threadSlot) and is the
+   only writer of it, so recording is a plain add on memory no other core
+   writes; the admin 'stats' command sums the slots on demand. Values are
+   stored with relaxed atomics only so that a reader never sees a torn word.
+   Histograms are log-linear like HDR histograms: 16 linear sub-buckets per
+   power of two, so every recorded value is kept to within about 6%. */
+#define MAX_THREAD_SLOTS (MAX_REACTORS + 2 + AUTH_WORKERS)   /* reactors, admin console, log flusher, auth workers */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB)           /* up to 2^43 ns, a couple of hours */
+
+enum { M_ACCEPTS = 0, M_AUTH_OK, M_AUTH_FAIL, M_ROUTED, M_ROUTED_BYTES, M_FALLBACK, M_ROUTE_MISS,
+       M_STORED, M_DROPS, M_LIST, M_HEARTBEATS, M_HEARTBEAT_UNKNOWN, M_WRITEV, M_BYTES_OUT,
+       M_FANOUT, M_FANOUT_RECIPIENTS, M_AUTH_TIMEOUT, M_FORWARDED, M_FORWARDED_IN,
+       M_RESUMED, M_RESUME_REPLAYED, M_RESUME_LOST, M_POOL_ALLOCS, M_POOL_SLABS, M_POOL_LARGE,
+       M_COPIES, M_COPY_BYTES, M_EVLOG_DROPPED, M_URGENT, M_RATE_LIMITED, M_FILE_SPOOLED,
+       M_FILE_RELAYED, M_SENDFILE, M_PRESENCE_DELTAS, M_PRESENCE_SNAPS, M_PRESENCE_BYTES, M_TRACE_BYTES,
+       M_TRACE_DROPPED, M_COUNTERS };
+const char *counterNames[M_COUNTERS] = {
+    "accepts", "auth_ok", "auth_fail", "routed", "routed_bytes", "campus_fallback", "route_miss",
+    "stored", "drops", "list_requests", "heartbeats", "heartbeats_unknown", "writev_calls", "bytes_out",
+    "fanout", "fanout_recipients", "auth_timeouts", "forwarded_out", "forwarded_in",
+    "resumed", "resume_replayed", "resume_lost", "pool_allocs", "pool_slabs", "pool_large",
+    "payload_copies", "payload_copy_bytes", "log_dropped", "urgent_queued", "rate_limited",
+    "file_bytes_spooled", "file_bytes_relayed", "sendfile_calls", "presence_deltas", "presence_snapshots",
+    "presence_bytes", "trace_bytes", "trace_dropped"
+};
+enum { H_AUTH = 0, H_ROUTE, H_QUEUE, H_QUEUE_URGENT, H_HISTS };
+const char *histNames[H_HISTS] = { "accept_to_auth_ok", "route_lookup", "enqueue_to_send", "urgent_to_send" };
+
+struct Metrics {
+    unsigned long counters[M_COUNTERS];
+    unsigned long hist[H_HISTS][HIST_BUCKETS];
+} __attribute__((aligned(64)));
+struct Metrics metrics[MAX_THREAD_SLOTS];
+__thread int threadSlot = 0;   /* this thread's metrics and hazard pointer slot; main runs reactor 0 */
+uint64_t startNs = 0;
+
+uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metricAdd(int m, unsigned long n) {
+    unsigned long *p = &metrics[threadSlot].counters[m];
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+int histIndex(uint64_t v) {
+    if(v < HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    int i = (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/* Smallest value that lands in bucket i */
+uint64_t histValue(int i) {
+    if(i < HIST_SUB) return i;
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+void histRecord(int h, uint64_t ns) {
+    unsigned long *p = &metrics[threadSlot].hist[h][histIndex(ns)];
+    __atomic_store_n(p, *p + 1, __ATOMIC_RELAXED);
+}
+
+/* Event log. Threads on the hot path do not printf: evLog() checks the level,
+   then copies the format pointer and the raw arguments into a fixed-size
+   record in the calling thread's own ring (single producer, single consumer,
+   no lock). The evLogger thread merges the rings in time order, formats the
+   records and writes them to stdout in batches, every EV_NAP_MS or as soon as
+   a ring is half full (the producer that fills it to half pokes an eventfd,
+   the only syscall a record can cost). A full ring drops the record and
+   counts it (log_dropped in 'stats'); nothing ever waits for stdout.
+   Strings are copied into the record and cut short if they do not fit. */
+enum { EV_DEBUG = 0, EV_INFO, EV_WARN, EV_ERROR, EV_LEVELS };
+const char *evLevelNames[EV_LEVELS] = { "debug", "info", "warn", "error" };
+int evLevel = EV_DEBUG;              /* -l and the admin 'loglevel' command */
+
+#define EV_REC_SIZE 384
+#define EV_MAX_ARGS 8
+#define EV_RING 2048                 /* records per thread, a power of two */
+#define EV_MAX_RINGS (MAX_THREAD_SLOTS + 8)
+#define EV_NAP_MS 100                /* formatter nap when no ring is filling up */
+
+struct EvRec {
+    uint64_t ns;
+    const char *fmt;                 /* a string literal, so it outlives the record */
+    uint8_t level, nargs;
+    uint16_t textLen;
+    uint64_t args[EV_MAX_ARGS];      /* integers, doubles, or a string's offset into text */
+    char text[EV_REC_SIZE - 24 - 8 * EV_MAX_ARGS];
+};
+
+struct EvRing {
+    uint64_t head __attribute__((aligned(64)));   /* written by the producer */
+    uint64_t tail __attribute__((aligned(64)));   /* written by the formatter */
+    unsigned long dropped, dropsReported;
+    struct EvRec recs[EV_RING];
+};
+struct EvRing *evRings[EV_MAX_RINGS];
+int evRingCount = 0;
+__thread struct EvRing *evMyRing = NULL;
+int evWakeFd = -1;
+
+/* This thread's ring, set up on its first record. NULL if there are too many threads. */
+struct EvRing *evRing(void) {
+    if(evMyRing) return evMyRing;
+    int i = __atomic_fetch_add(&evRingCount, 1, __ATOMIC_RELAXED);
+    if(i >= EV_MAX_RINGS) return NULL;
+    struct EvRing *r = calloc(1, sizeof(*r));
+    if(!r) return NULL;
+    __atomic_store_n(&evRings[i], r, __ATOMIC_RELEASE);
+    return evMyRing = r;
+}
+
+/* Step over one printf conversion, from the '%' to its conversion letter.
+   Sets the number of '*' it takes, whether it has an l/ll/z/j/t length, and
+   its precision: -1 if it has none, EV_PREC_ARG if it is the last '*'
+   argument, the number otherwise. */
+#define EV_PREC_ARG -2
+const char *evSpecEnd(const char *p, int *stars, int *longLen, int *prec) {
+    *stars = 0;
+    *longLen = 0;
+    *prec = -1;
+    for(p++; *p && strchr("-+ #0", *p); p++) {}
+    /* width */
+    if(*p == '*') {
+        (*stars)++;
+        p++;
+    }
+    while(*p >= '0' && *p <= '9') p++;
+    if(*p == '.') {
+        p++;
+        if(*p == '*') {
+            (*stars)++;
+            *prec = EV_PREC_ARG;
+            p++;
+        } else {
+            for(*prec = 0; *p >= '0' && *p <= '9'; p++) *prec = *prec * 10 + (*p - '0');
+        }
+    }
+    for(; *p && strchr("hlzjtL", *p); p++) if(*p != 'h') *longLen = 1;
+    return p;
+}
+
+void evLogWrite(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void evLogWrite(int level, const char *fmt, ...) {
+    struct EvRing *r = evRing();
+    if(!r) return;
+    uint64_t head = r->head, used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if(used == EV_RING) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        metricAdd(M_EVLOG_DROPPED, 1);
+        return;
+    }
+    struct EvRec *e = &r->recs[head & (EV_RING - 1)];
+    e->ns = nowNs();
+    e->fmt = fmt;
+    e->level = level;
+    e->nargs = 0;
+    e->textLen = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    for(const char *p = strchr(fmt, '%'); p; p = strchr(p + 1, '%')) {
+        if(p[1] == '%') {
+            p++;
+            continue;
+        }
+        int stars, longLen, prec;
+        const char *end = evSpecEnd(p, &stars, &longLen, &prec);
+        for(int k=0;k<stars && e->nargs < EV_MAX_ARGS;k++) {
+            int a = va_arg(ap, int);
+            e->args[e->nargs++] = a;
+            /* a negative precision argument means none, as in printf */
+            if(prec == EV_PREC_ARG && k == stars - 1) prec = a < 0 ? -1 : a;
+        }
+        if(e->nargs == EV_MAX_ARGS || !*end) break;
+        uint64_t v;
+        if(*end == 's') {
+            /* %.*s strings need not be terminated: copy at most the precision */
+            const char *str = va_arg(ap, const char *);
+            if(e->textLen >= sizeof(e->text) - 1) {
+                /* the record is full: an empty string, the terminator of the last one */
+                v = sizeof(e->text) - 1;
+                e->text[v] = 0;
+            } else {
+                size_t room = sizeof(e->text) - e->textLen - 1;
+                size_t len = strnlen(str, prec >= 0 && (size_t)prec < room ? (size_t)prec : room);
+                memcpy(e->text + e->textLen, str, len);
+                e->text[e->textLen + len] = 0;
+                v = e->textLen;
+                e->textLen += len + 1;
+            }
+        } else if(strchr("eEfFgGaA", *end)) {
+            double d = va_arg(ap, double);
+            memcpy(&v, &d, sizeof(v));
+        } else if(*end == 'p') {
+            v = (uintptr_t)va_arg(ap, void *);
+        } else {
+            v = longLen ? va_arg(ap, unsigned long long) : va_arg(ap, unsigned int);
+            /* keep the sign of a plain int for %d */
+            if(!longLen && strchr("di", *end)) v = (uint64_t)(long long)(int)v;
+        }
+        e->args[e->nargs++] = v;
+        p = end;
+    }
+    va_end(ap);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    if(used + 1 == EV_RING / 2 && evWakeFd >= 0) {
+        uint64_t one = 1;
+        if(write(evWakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("log eventfd");
+    }
+}
+
+/* Level index for a name, -1 if there is no such level */
+int evLevelParse(const char *name) {
+    for(int i=0;i<EV_LEVELS;i++) if(strcmp(evLevelNames[i], name) == 0) return i;
+    return -1;
+}
+
+#define evLog(level, ...) do { \
+        if((level) >= __atomic_load_n(&evLevel, __ATOMIC_RELAXED)) evLogWrite(level, __VA_ARGS__); \
+    } while(0)
+
+/* Format one record the way printf would have, appending to out */
+size_t evFormat(const struct EvRec *e, char *out, size_t cap) {
+    size_t n = 0;
+    int a = 0;
+    for(const char *p = e->fmt; *p && n < cap - 1; ) {
+        if(*p != '%' || p[1] == '%') {
+            out[n++] = *p;
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+        int stars, longLen, prec;
+        const char *end = evSpecEnd(p, &stars, &longLen, &prec);
+        if(!*end) break;
+        /* plain %s, %d and %u (the common case) without snprintf */
+        int plain = !stars && strspn(p + 1, "lz") == (size_t)(end - p - 1);
+        if(plain && (*end == 's' || *end == 'd' || *end == 'u') && a < e->nargs) {
+            uint64_t v = e->args[a++];
+            if(*end == 's') {
+                const char *str = v < sizeof(e->text) ? e->text + v : "";
+                while(*str && n < cap - 1) out[n++] = *str++;
+            } else {
+                char digits[24];
+                int k = 0, neg = *end == 'd' && (int64_t)v < 0;
+                if(neg) v = -(int64_t)v;
+                do digits[k++] = '0' + v % 10; while((v /= 10) && k < 20);
+                if(neg) digits[k++] = '-';
+                while(k > 0 && n < cap - 1) out[n++] = digits[--k];
+            }
+            p = end + 1;
+            continue;
+        }
+        /* rebuild the conversion with any '*' filled in and the length widened */
+        char spec[48];
+        size_t k = 0;
+        for(const char *q = p; q < end && k < sizeof(spec) - 24; q++) {
+            if(*q == '*') k += snprintf(spec + k, sizeof(spec) - k, "%d", a < e->nargs ? (int)e->args[a++] : 0);
+            else if(!strchr("hlzjtL", *q)) spec[k++] = *q;
+        }
+        uint64_t v = a < e->nargs ? e->args[a++] : 0;
+        int w;
+        if(*end == 's') {
+            spec[k++] = 's';
+            spec[k] = 0;
+            w = snprintf(out + n, cap - n, spec, v < sizeof(e->text) ? e->text + v : "");
+        } else if(strchr("eEfFgGaA", *end)) {
+            double d;
+            memcpy(&d, &v, sizeof(d));
+            spec[k++] = *end;
+            spec[k] = 0;
+            w = snprintf(out + n, cap - n, spec, d);
+        } else if(*end == 'p' || *end == 'c') {
+            spec[k++] = *end;
+            spec[k] = 0;
+            w = *end == 'p' ? snprintf(out + n, cap - n, spec, (void *)(uintptr_t)v)
+                            : snprintf(out + n, cap - n, spec, (int)v);
+        } else {
+            spec[k++] = 'l';
+            spec[k++] = 'l';
+            spec[k++] = *end;
+            spec[k] = 0;
+            w = strchr("di", *end) ? snprintf(out + n, cap - n, spec, (long long)v)
+                                   : snprintf(out + n, cap - n, spec, (unsigned long long)v);
+        }
+        if(w > 0) n += (size_t)w < cap - n ? (size_t)w : cap - n - 1;
+        p = end + 1;
+    }
+    out[n] = 0;
+    return n;
+}
+
+/* Merge every thread's ring in time order and write the lines out */
+void *evLogger(void *arg) {
+    (void)arg;
+    static char out[65536];
+    while(1) {
+        size_t len = 0;
+        int full = 0;
+        while(!(full = len >= sizeof(out) - 2 * EV_REC_SIZE - 64)) {
+            /* the oldest record at the front of any ring goes next */
+            struct EvRing *best = NULL;
+            struct EvRec *bestRec = NULL;
+            int count = __atomic_load_n(&evRingCount, __ATOMIC_RELAXED);
+            for(int i=0;i<count && i<EV_MAX_RINGS;i++) {
+                struct EvRing *r = __atomic_load_n(&evRings[i], __ATOMIC_ACQUIRE);
+                if(!r || r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) continue;
+                struct EvRec *e = &r->recs[r->tail & (EV_RING - 1)];
+                if(!bestRec || e->ns < bestRec->ns) {
+                    best = r;
+                    bestRec = e;
+                }
+            }
+            if(!best) break;
+            len += evFormat(bestRec, out + len, sizeof(out) - len);
+            __atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+        }
+        for(int i=0;i<__atomic_load_n(&evRingCount, __ATOMIC_RELAXED) && i<EV_MAX_RINGS;i++) {
+            struct EvRing *r = __atomic_load_n(&evRings[i], __ATOMIC_ACQUIRE);
+            unsigned long dropped = r ? __atomic_load_n(&r->dropped, __ATOMIC_RELAXED) : 0;
+            if(dropped == (r ? r->dropsReported : 0)) continue;
+            len += snprintf(out + len, sizeof(out) - len, "[SERVER] %lu log line(s) dropped: stdout could not keep up.\n",
+                            dropped - r->dropsReported);
+            r->dropsReported = dropped;
+            if(len > sizeof(out) - 128) break;
+        }
+        if(len) {
+            fwrite(out, 1, len, stdout);
+            fflush(stdout);
+        }
+        /* napping between batches keeps them large and the writes few */
+        if(!full) {
+            struct pollfd pfd = { evWakeFd, POLLIN, 0 };
+            uint64_t n;
+            if(poll(&pfd, 1, EV_NAP_MS) > 0 && read(evWakeFd, &n, sizeof(n)) < 0) perror("log eventfd");
+        }
+    }
+    return NULL;
+}
+
+/* UDP counters, shown by the admin 'udpstats' command */
+unsigned long udpDatagramsIn = 0, udpRecvCalls = 0;
+unsigned long udpDatagramsOut = 0, udpSendCalls = 0;   /* atomic: the admin console and reactor 0 both send */
+
+/* Sequenced announcements. Every admin broadcast is "ANN|epoch|seq|text",
+   where the epoch identifies this server run. The last ANN_WINDOW datagrams
+   are kept so a client that sees a gap can ask for them again with
+   "NACK|Campus|Dept|epoch|ranges"; what has left the window is answered with
+   "ANNGONE|epoch|ranges". A lost last announcement leaves no gap, so shortly
+   after a broadcast, and once more a second later, the latest sequence goes
+   out as "ANNSEQ|epoch|seq". Protected by annLock. */
+#define ANN_WINDOW 1024
+#define ANN_MAX (MAX_MSG + 64)             /* largest announcement datagram */
+#define ANN_REPAIR_MAX 32                  /* datagrams resent for one NACK; the client asks again for the rest */
+#define ANN_SPM_FIRST (100 * 1000000ull)   /* ns from a broadcast to the first ANNSEQ */
+#define ANN_SPM_LATER (1000 * 1000000ull)  /* and to the second */
+struct Announcement {
+    uint32_t seq;                          /* 0 = empty */
+    uint16_t len;
+    char data[ANN_MAX];
+};
+struct Announcement annWindow[ANN_WINDOW];
+uint32_t annEpoch = 0, annSeq = 0;
+uint64_t annSpmDue = 0;
+int annSpmLeft = 0;
+unsigned long annNacks = 0, annRepairs = 0, annGone = 0;
+pthread_mutex_t annLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Put a socket into non-blocking mode for the reactor */
+int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Hash for names (FNV-1a) */
+unsigned hashName(const char *s) {
+    unsigned h = 2166136261u;
+    while(*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+/* SHA-256 (FIPS 180-4), enough for HMAC and PBKDF2 */
+struct Sha256 {
+    uint32_t h[8];
+    uint8_t block[64];
+    uint64_t total;
+    size_t fill;
+};
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256Block(uint32_t h[8], const uint8_t *p) {
+    uint32_t w[64];
+    for(int i=0;i<16;i++) w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    for(int i=16;i<64;i++) {
+        uint32_t s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for(int i=0;i<64;i++) {
+        uint32_t t1 = k + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+void sha256Init(struct Sha256 *s) {
+    static const uint32_t iv[8] = { 0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,
+                                    0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19 };
+    memcpy(s->h, iv, sizeof(iv));
+    s->total = 0;
+    s->fill = 0;
+}
+
+void sha256Update(struct Sha256 *s, const void *data, size_t len) {
+    const uint8_t *p = data;
+    s->total += len;
+    while(len > 0) {
+        size_t n = 64 - s->fill < len ? 64 - s->fill : len;
+        memcpy(s->block + s->fill, p, n);
+        s->fill += n;
+        p += n;
+        len -= n;
+        if(s->fill == 64) {
+            sha256Block(s->h, s->block);
+            s->fill = 0;
+        }
+    }
+}
+
+void sha256Final(struct Sha256 *s, uint8_t out[32]) {
+    uint64_t bits = s->total * 8;
+    uint8_t pad = 0x80;
+    sha256Update(s, &pad, 1);
+    pad = 0;
+    while(s->fill != 56) sha256Update(s, &pad, 1);
+    uint8_t len[8];
+    for(int i=0;i<8;i++) len[i] = (uint8_t)(bits >> (56 - 8*i));
+    sha256Update(s, len, 8);
+    for(int i=0;i<8;i++) {
+        out[4*i] = s->h[i] >> 24; out[4*i+1] = s->h[i] >> 16;
+        out[4*i+2] = s->h[i] >> 8; out[4*i+3] = s->h[i];
+    }
+}
+
+/* HMAC-SHA256 key schedule: the inner and outer states after the padded key,
+   so each PBKDF2 round costs two compressions instead of four */
+struct HmacKey { struct Sha256 inner, outer; };
+
+void hmacInit(struct HmacKey *k, const void *key, size_t len) {
+    uint8_t block[64] = {0}, pad[64];
+    if(len > 64) {
+        struct Sha256 s;
+        sha256Init(&s);
+        sha256Update(&s, key, len);
+        sha256Final(&s, block);
+    } else {
+        memcpy(block, key, len);
+    }
+    for(int i=0;i<64;i++) pad[i] = block[i] ^ 0x36;
+    sha256Init(&k->inner);
+    sha256Update(&k->inner, pad, 64);
+    for(int i=0;i<64;i++) pad[i] = block[i] ^ 0x5c;
+    sha256Init(&k->outer);
+    sha256Update(&k->outer, pad, 64);
+}
+
+void hmacSha256(const struct HmacKey *k, const void *data, size_t len, uint8_t out[32]) {
+    struct Sha256 s = k->inner;
+    sha256Update(&s, data, len);
+    sha256Final(&s, out);
+    s = k->outer;
+    sha256Update(&s, out, 32);
+    sha256Final(&s, out);
+}
+
+/* PBKDF2-HMAC-SHA256 (RFC 8018) with a single 32-byte output block */
+void pbkdf2Sha256(const char *pass, const uint8_t *salt, size_t saltLen, int iterations, uint8_t out[32]) {
+    struct HmacKey k;
+    hmacInit(&k, pass, strlen(pass));
+    uint8_t first[CRED_SALT + 4], u[32];
+    if(saltLen > CRED_SALT) saltLen = CRED_SALT;
+    memcpy(first, salt, saltLen);
+    memcpy(first + saltLen, "\0\0\0\1", 4);   /* block index 1 */
+    hmacSha256(&k, first, saltLen + 4, u);
+    memcpy(out, u, 32);
+    for(int i=1;i<iterations;i++) {
+        hmacSha256(&k, u, 32, u);
+        for(int j=0;j<32;j++) out[j] ^= u[j];
+    }
+}
+
+/* Compare without an early exit, so timing does not reveal how much matched */
+int equalConstTime(const uint8_t *a, const uint8_t *b, size_t len) {
+    uint8_t d = 0;
+    for(size_t i=0;i<len;i++) d |= a[i] ^ b[i];
+    return d == 0;
+}
+
+void hexEncode(char *out, const uint8_t *p, size_t len) {
+    for(size_t i=0;i<len;i++) sprintf(out + 2*i, "%02x", p[i]);
+}
+
+/* Decode exactly len bytes of hex. Returns 0 on success. */
+int hexDecode(uint8_t *out, size_t len, const char *hex) {
+    if(strlen(hex) != 2 * len) return -1;
+    for(size_t i=0;i<len;i++) {
+        unsigned v;
+        if(sscanf(hex + 2*i, "%2x", &v) != 1) return -1;
+        out[i] = (uint8_t)v;
+    }
+    return 0;
+}
+
+/* Per-process random key for the fast tags, schedule computed once at startup */
+struct HmacKey credKey;
+
+/* Find a campus's credential, NULL if it cannot log in. The table is only written before the reactors start. */
+struct Cred *credFind(const char *campus) {
+    for(int i = credBuckets[hashName(campus) % CRED_BUCKETS]; i >= 0; i = creds[i].next)
+        if(strcmp(creds[i].campus, campus) == 0) return &creds[i];
+    return NULL;
+}
+
+/* Add or replace a campus's credential */
+int credAdd(const char *campus, int iterations, const uint8_t *salt, const uint8_t *hash) {
+    struct Cred *c = credFind(campus);
+    if(!c) {
+        if(numCreds == credCap) {
+            int cap = credCap ? credCap * 2 : 16;
+            struct Cred *nc = realloc(creds, cap * sizeof(*nc));
+            if(!nc) return -1;
+            creds = nc;
+            credCap = cap;
+        }
+        c = &creds[numCreds];
+        memset(c, 0, sizeof(*c));
+        strncpy(c->campus, campus, MAX_NAME-1);
+        unsigned b = hashName(campus) % CRED_BUCKETS;
+        c->next = credBuckets[b];
+        credBuckets[b] = numCreds++;
+    }
+    c->iterations = iterations;
+    memcpy(c->salt, salt, CRED_SALT);
+    memcpy(c->hash, hash, 32);
+    c->fastValid = 0;
+    return 0;
+}
+
+/* Hash a password with a fresh salt into a credential file line */
+int credFormat(char *out, size_t cap, const char *campus, const char *pass) {
+    uint8_t salt[CRED_SALT], hash[32];
+    if(getrandom(salt, sizeof(salt), 0) != sizeof(salt)) return -1;
+    pbkdf2Sha256(pass, salt, sizeof(salt), CRED_ITERATIONS, hash);
+    char saltHex[2*CRED_SALT+1], hashHex[65];
+    hexEncode(saltHex, salt, sizeof(salt));
+    hexEncode(hashHex, hash, sizeof(hash));
+    snprintf(out, cap, "%s:%d:%s:%s", campus, CRED_ITERATIONS, saltHex, hashHex);
+    return 0;
+}
+
+/* Load credentials: "Campus:iterations:salthex:hashhex" lines from credFile,
+   or the development passwords when there is no file. Returns -1 on error. */
+int credLoad(void) {
+    for(int i=0;i<CRED_BUCKETS;i++) credBuckets[i] = -1;
+    uint8_t key[32];
+    if(getrandom(key, sizeof(key), 0) != sizeof(key)) return -1;
+    hmacInit(&credKey, key, sizeof(key));
+    if(!credFile) {
+        evLog(EV_INFO, "[SERVER] No credential file (-C), using the built-in development passwords.\n");
+        for(size_t i=0;i<sizeof(devCreds)/sizeof(devCreds[0]);i++) {
+            char line[256];
+            uint8_t salt[CRED_SALT], hash[32];
+            if(credFormat(line, sizeof(line), devCreds[i].campus, devCreds[i].password) < 0) return -1;
+            char *p = strrchr(line, ':');
+            hexDecode(hash, 32, p + 1);
+            *p = 0;
+            hexDecode(salt, CRED_SALT, strrchr(line, ':') + 1);
+            credAdd(devCreds[i].campus, CRED_ITERATIONS, salt, hash);
+        }
+        return 0;
+    }
+    FILE *f = fopen(credFile, "r");
+    if(!f) return -1;
+    char line[512];
+    int lineNo = 0;
+    while(fgets(line, sizeof(line), f)) {
+        lineNo++;
+        line[strcspn(line, "\r\n")] = 0;
+        if(line[0] == '#' || line[0] == 0) continue;
+        char campus[MAX_NAME], saltHex[2*CRED_SALT+1], hashHex[65];
+        int iterations;
+        uint8_t salt[CRED_SALT], hash[32];
+        if(sscanf(line, "%39[^:]:%d:%32[0-9a-fA-F]:%64[0-9a-fA-F]", campus, &iterations, saltHex, hashHex) != 4 ||
+           iterations < 1 || hexDecode(salt, CRED_SALT, saltHex) < 0 || hexDecode(hash, 32, hashHex) < 0) {
+            fprintf(stderr, "%s:%d: expected Campus:iterations:salthex:hashhex\n", credFile, lineNo);
+            fclose(f);
+            return -1;
+        }
+        if(credAdd(campus, iterations, salt, hash) < 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    evLog(EV_INFO, "[SERVER] Loaded %d credentials from %s\n", numCreds, credFile);
+    return 0;
+}
+
+/* Is this one of the campuses that can log in? */
+int isCampus(const char *campus) {
+    return credFind(campus) != NULL;
+}
+
+/* Does pass match the fast tag of the last good login? tag gets the password's
+   tag either way, for authWorker() to keep if the full derivation agrees. */
+int authFast(struct Cred *c, const char *pass, uint8_t tag[32]) {
+    hmacSha256(&credKey, pass, strlen(pass), tag);
+    pthread_mutex_lock(&credLock);
+    int fast = c->fastValid && equalConstTime(c->fastTag, tag, 32);
+    pthread_mutex_unlock(&credLock);
+    return fast;
+}
+
+/* Timing wheel for heartbeat deadlines. Level 0 has one slot per tick for the
+   next 256 ticks, level 1 one slot per 256 ticks; a level 1 slot is cascaded
+   down when level 0 wraps. Arming, cancelling and each tick are O(1) per
+   timer touched, however many sessions exist. Protected by clientsLock. */
+struct Timer wheel0[WHEEL0_SLOTS];
+struct Timer wheel1[WHEEL1_SLOTS];
+uint64_t wheelNow = 0;    /* current tick */
+int timerFd = -1;
+
+void wheelInit(void) {
+    for(int i=0;i<WHEEL0_SLOTS;i++) wheel0[i].next = wheel0[i].prev = &wheel0[i];
+    for(int i=0;i<WHEEL1_SLOTS;i++) wheel1[i].next = wheel1[i].prev = &wheel1[i];
+}
+
+void timerCancel(struct Timer *t) {
+    if(!t->next) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void timerArm(struct Timer *t, uint64_t expires) {
+    timerCancel(t);
+    if(expires < wheelNow) expires = wheelNow;
+    t->expires = expires;
+    struct Timer *head;
+    if(expires - wheelNow < WHEEL0_SLOTS)
+        head = &wheel0[expires & (WHEEL0_SLOTS - 1)];
+    else if((expires >> WHEEL0_BITS) - (wheelNow >> WHEEL0_BITS) < WHEEL1_SLOTS)
+        head = &wheel1[(expires >> WHEEL0_BITS) & (WHEEL1_SLOTS - 1)];
+    else  /* beyond the wheel: park in the last level 1 slot, re-placed when it cascades */
+        head = &wheel1[((wheelNow >> WHEEL0_BITS) + WHEEL1_SLOTS - 1) & (WHEEL1_SLOTS - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* Buffer pool. Outbound buffers, handoffs, connections and queue arrays
+   come from size-classed slabs instead of malloc: a block is a power of two
+   from 64 bytes to 128 KB with a 16 byte header naming its class, carved out
+   of slabs that are never given back. Each thread allocates and frees from
+   its own free list per class without a lock. A buffer is usually freed by
+   another thread than the one that made it, so a thread holding more than
+   POOL_CACHE_MAX free blocks of a class moves POOL_BATCH of them to the shared
+   depot, and a thread that runs dry takes a batch back: the depot lock is
+   taken once per POOL_BATCH blocks. Bigger requests go to malloc. */
+#define POOL_MIN_SHIFT 6
+#define POOL_CLASSES 12                 /* 64 B .. 128 KB */
+#define POOL_SLAB (256 * 1024)
+#define POOL_BATCH 32
+#define POOL_CACHE_MAX (2 * POOL_BATCH)
+#define POOL_LARGE 0xffffu
+
+struct PoolHdr {
+    uint32_t cls;
+    uint32_t pad[3];                    /* keep the user data 16 byte aligned */
+};
+
+/* A free block; the first block of a depot batch also links the next batch */
+struct PoolBlock {
+    struct PoolBlock *next;
+    struct PoolBlock *nextBatch;
+};
+
+struct PoolDepot {
+    pthread_mutex_t lock;
+    struct PoolBlock *batches;
+    int count;                          /* batches */
+} poolDepot[POOL_CLASSES];
+
+struct PoolCache {
+    struct PoolBlock *head[POOL_CLASSES];
+    int count[POOL_CLASSES];
+};
+__thread struct PoolCache poolCache;
+size_t poolSlabBytes = 0;
+
+void poolInit(void) {
+    for(int c=0;c<POOL_CLASSES;c++) pthread_mutex_init(&poolDepot[c].lock, NULL);
+}
+
+/* Smallest class whose blocks hold need bytes, -1 if none does */
+int poolClass(size_t need) {
+    if(need <= (1u << POOL_MIN_SHIFT)) return 0;
+    int c = 64 - __builtin_clzll(need - 1) - POOL_MIN_SHIFT;
+    return c < POOL_CLASSES ? c : -1;
+}
+
+/* Fill this thread's empty list of a class from the depot, or from a new slab */
+int poolRefill(int cls) {
+    struct PoolCache *pc = &poolCache;
+    struct PoolDepot *d = &poolDepot[cls];
+    pthread_mutex_lock(&d->lock);
+    struct PoolBlock *batch = d->batches;
+    if(batch) {
+        d->batches = batch->nextBatch;
+        d->count--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if(batch) {
+        pc->head[cls] = batch;
+        pc->count[cls] = POOL_BATCH;
+        return 0;
+    }
+    size_t size = (size_t)1 << (cls + POOL_MIN_SHIFT);
+    size_t n = POOL_SLAB / size < 4 ? 4 : POOL_SLAB / size;
+    char *slab = malloc(n * size);
+    if(!slab) return -1;
+    metricAdd(M_POOL_SLABS, 1);
+    __atomic_add_fetch(&poolSlabBytes, n * size, __ATOMIC_RELAXED);
+    for(size_t i=0;i<n;i++) {
+        struct PoolBlock *b = (struct PoolBlock*)(slab + i * size);
+        b->next = pc->head[cls];
+        pc->head[cls] = b;
+    }
+    pc->count[cls] += n;
+    return 0;
+}
+
+/* Hand POOL_BATCH blocks of this thread's list of a class to the depot */
+void poolSpill(int cls) {
+    struct PoolCache *pc = &poolCache;
+    struct PoolBlock *batch = pc->head[cls], *last = batch;
+    for(int i=1;i<POOL_BATCH;i++) last = last->next;
+    pc->head[cls] = last->next;
+    pc->count[cls] -= POOL_BATCH;
+    last->next = NULL;
+    struct PoolDepot *d = &poolDepot[cls];
+    pthread_mutex_lock(&d->lock);
+    batch->nextBatch = d->batches;
+    d->batches = batch;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Memory a poolAlloc(size) really takes */
+size_t poolBlockSize(size_t size) {
+    size_t need = size + sizeof(struct PoolHdr);
+    int cls = poolClass(need);
+    return cls < 0 ? need : (size_t)1 << (cls + POOL_MIN_SHIFT);
+}
+
+void *poolAlloc(size_t size) {
+    size_t need = size + sizeof(struct PoolHdr);
+    int cls = poolClass(need);
+    struct PoolHdr *h;
+    if(cls < 0) {
+        if(!(h = malloc(need))) return NULL;
+        h->cls = POOL_LARGE;
+        metricAdd(M_POOL_LARGE, 1);
+    } else {
+        struct PoolCache *pc = &poolCache;
+        if(!pc->head[cls] && poolRefill(cls) < 0) return NULL;
+        struct PoolBlock *b = pc->head[cls];
+        pc->head[cls] = b->next;
+        pc->count[cls]--;
+        h = (struct PoolHdr*)b;
+        h->cls = cls;
+    }
+    metricAdd(M_POOL_ALLOCS, 1);
+    return h + 1;
+}
+
+void *poolCalloc(size_t size) {
+    void *p = poolAlloc(size);
+    if(p) memset(p, 0, size);
+    return p;
+}
+
+void poolFree(void *p) {
+    if(!p) return;
+    struct PoolHdr *h = (struct PoolHdr*)p - 1;
+    if(h->cls == POOL_LARGE) {
+        free(h);
+        return;
+    }
+    int cls = h->cls;
+    struct PoolCache *pc = &poolCache;
+    struct PoolBlock *b = (struct PoolBlock*)h;
+    b->next = pc->head[cls];
+    pc->head[cls] = b;
+    if(++pc->count[cls] > POOL_CACHE_MAX) poolSpill(cls);
+}
+
+/* Free blocks waiting in the depot, in bytes */
+size_t poolDepotBytes(void) {
+    size_t bytes = 0;
+    for(int c=0;c<POOL_CLASSES;c++) {
+        pthread_mutex_lock(&poolDepot[c].lock);
+        bytes += (size_t)poolDepot[c].count * POOL_BATCH << (c + POOL_MIN_SHIFT);
+        pthread_mutex_unlock(&poolDepot[c].lock);
+    }
+    return bytes;
+}
+
+/* Count a payload copied into an outbound buffer */
+void copyCount(size_t len) {
+    metricAdd(M_COPIES, 1);
+    metricAdd(M_COPY_BYTES, len);
+}
+
+/* Allocate an outbound buffer with room for len bytes, one reference held, for the bulk lane */
+struct OutBuf *outBufNew(size_t len) {
+    struct OutBuf *b = poolAlloc(sizeof(*b) + len);
+    if(!b) return NULL;
+    b->refs = 1;
+    b->lane = LANE_BULK;
+    b->file = 0;
+    b->logged = 0;
+    b->len = len;
+    return b;
+}
+
+void outBufRelease(struct OutBuf *b) {
+    if(__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if(b->file) xferRelease(((struct OutFile*)b->data)->x);
+        poolFree(b);
+    }
+}
+
+/* Encode a server reply: a frame of the given type for framed clients
+   (AUTH_OK carries no field), the bare text for legacy clients. Replies
+   take the urgent lane. */
+struct OutBuf *makeReply(int framed, uint8_t type, const char *text) {
+    struct FrameField f = frameStr(text);
+    /* a reply is a single field: type, count and field length take 4 bytes of the body */
+    if(framed && f.len > FRAME_MAX - 4) f.len = FRAME_MAX - 4;
+    int nf = type == FRAME_AUTH_OK ? 0 : 1;
+    size_t len = framed ? frameSize(&f, nf) : f.len;
+    struct OutBuf *b = outBufNew(len);
+    if(!b) return NULL;
+    if(framed) frameEncode(b->data, len, type, &f, nf);
+    else memcpy(b->data, text, len);
+    b->lane = LANE_URGENT;
+    copyCount(len);
+    return b;
+}
+
+/* Encode a routed message for one receiver: a DELIVER frame for framed
+   clients, the "[from -> to] text" line for legacy ones. The payload is
+   copied once, straight from the sender's input buffer into the pooled one. */
+struct OutBuf *encodeDeliver(int framed, const char *fromCampus, const char *fromDept,
+                             const char *tgtCampus, const char *tgtDept,
+                             const char *message, size_t msgLen) {
+    struct OutBuf *b;
+    if(framed) {
+        struct FrameField f[5] = { frameStr(fromCampus), frameStr(fromDept),
+                                   frameStr(tgtCampus), frameStr(tgtDept),
+                                   { message, (uint16_t)msgLen } };
+        size_t len = frameSize(f, 5);
+        if(!(b = outBufNew(len))) return NULL;
+        frameEncode(b->data, len, FRAME_DELIVER, f, 5);
+    } else {
+        int len = snprintf(NULL, 0, "[%s %s -> %s %s] %.*s",
+                fromCampus, fromDept, tgtCampus, tgtDept, (int)msgLen, message);
+        if(len >= MAX_MSG) len = MAX_MSG - 1;
+        /* room for the terminator snprintf writes, which is not sent */
+        if(!(b = outBufNew(len + 1))) return NULL;
+        snprintf(b->data, len + 1, "[%s %s -> %s %s] %.*s",
+                 fromCampus, fromDept, tgtCampus, tgtDept, (int)msgLen, message);
+        b->len = len;
+    }
+    copyCount(b->len);
+    return b;
+}
+
+/* Look up a name id, -1 if the name has never been seen. Caller holds clientsLock. */
+int lookupName(const char *str) {
+    for(int id = nameBuckets[hashName(str) % NAME_BUCKETS]; id >= 0; id = names[id].hashNext)
+        if(strcmp(names[id].str, str) == 0) return id;
+    return -1;
+}
+
+/* Look up a name id, creating it if needed. Caller holds clientsLock. */
+int internName(const char *str) {
+    int id = lookupName(str);
+    if(id >= 0) return id;
+    if(nameCount == nameCap) {
+        int cap = nameCap ? nameCap * 2 : 64;
+        struct Name *n = realloc(names, cap * sizeof(*n));
+        if(!n) return -1;
+        names = n;
+        nameCap = cap;
+    }
+    id = nameCount++;
+    strncpy(names[id].str, str, MAX_NAME-1);
+    names[id].str[MAX_NAME-1] = 0;
+    unsigned b = hashName(str) % NAME_BUCKETS;
+    names[id].hashNext = nameBuckets[b];
+    names[id].campusHead = names[id].campusTail = -1;
+    names[id].deptHead = names[id].deptTail = -1;
+    names[id].remoteHead = -1;
+    names[id].msgsOut = names[id].bytesOut = names[id].msgsIn = names[id].bytesIn = 0;
+    nameBuckets[b] = id;
+    return id;
+}
+
+unsigned routeHash(int campusId, int deptId) {
+    return ((unsigned)campusId * 2654435761u ^ (unsigned)deptId * 40503u) & routeMask;
+}
+
+/* Reserve the session table and allocate its route index. The table is
+   mapped for capacity slots up front, so slots never move, but the kernel
+   only backs the pages that sessions have touched: memory grows with the
+   number of sessions ever connected at once, not with -n. */
+int initSessions(int capacity) {
+    maxSessions = capacity;
+    sessions = mmap(NULL, (size_t)capacity * sizeof(*sessions), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(sessions == MAP_FAILED) {
+        sessions = NULL;
+        return -1;
+    }
+    unsigned buckets = 16;
+    while(buckets < (unsigned)capacity * 2) buckets <<= 1;
+    routeBuckets = malloc(buckets * sizeof(int));
+    if(!routeBuckets) return -1;
+    routeMask = buckets - 1;
+    for(unsigned i=0;i<buckets;i++) routeBuckets[i] = -1;
+    for(int i=0;i<NAME_BUCKETS;i++) nameBuckets[i] = -1;
+    for(int i=0;i<REMOTE_BUCKETS;i++) remoteBuckets[i] = -1;
+    /* one contiguous partition of slots per reactor, handed out in slot order
+       so the first sessions get the low slots */
+    for(int r=0;r<numReactors;r++) {
+        reactors[r].freeHead = -1;
+        reactors[r].freshNext = (int)((long)capacity * r / numReactors);
+        reactors[r].freshEnd = (int)((long)capacity * (r + 1) / numReactors);
+    }
+    return 0;
+}
+
+/* Next slot of a reactor's partition: a freed one, else one never used
+   (set up here, on first use). -1 if the partition is full. Caller holds clientsLock. */
+int slotTake(struct Reactor *r) {
+    int i = r->freeHead;
+    if(i >= 0) {
+        r->freeHead = sessions[i].freeNext;
+        return i;
+    }
+    if(r->freshNext == r->freshEnd) return -1;
+    i = r->freshNext++;
+    pthread_mutex_init(&sessions[i].outLock, NULL);
+    sessions[i].home = r - reactors;
+    sessions[i].fd = -1;
+    slotsCommitted++;
+    return i;
+}
+
+SessionHandle makeHandle(int slot) {
+    return ((SessionHandle)sessions[slot].gen << 32) | (uint32_t)slot;
+}
+
+/* Resolve a handle to its session, NULL if that session has since gone away. Caller holds clientsLock. */
+struct Session *sessionGet(SessionHandle h) {
+    uint32_t slot = (uint32_t)h;
+    if(h == NO_SESSION || slot >= (uint32_t)maxSessions) return NULL;
+    struct Session *s = &sessions[slot];
+    return s->gen == (uint32_t)(h >> 32) ? s : NULL;
+}
+
+/* Find the first session of a campus, -1 if not found. Caller holds clientsLock. */
+int findClientByCampus(const char *campus) {
+    int cid = lookupName(campus);
+    return cid < 0 ? -1 : names[cid].campusHead;
+}
+
+/* Find the first session of an interned (campus, dept), -1 if none. Caller holds clientsLock. */
+int findClientByIds(int cid, int did) {
+    for(int i = routeBuckets[routeHash(cid, did)]; i >= 0; i = sessions[i].routeNext)
+        if(sessions[i].campusId == cid && sessions[i].deptId == did) return i;
+    return -1;
+}
+
+/* Find client by campus AND department, -1 if not found. Caller holds clientsLock. */
+int findClientByCampusAndDept(const char *campus, const char *dept) {
+    int cid = lookupName(campus), did = lookupName(dept);
+    if(cid < 0 || did < 0) return -1;
+    return findClientByIds(cid, did);
+}
+
+/* Take a free slot for a connection's outbound queue, not indexed anywhere yet.
+   Caller holds clientsLock. Returns the slot, or -1 when the table is full. */
+int slotAlloc(struct Conn *c, int fd, int framed) {
+    /* prefer a slot from the connection's own reactor, borrow one if its partition is full */
+    int i = -1;
+    for(int k=0;k<numReactors && i < 0;k++) i = slotTake(&reactors[(c->reactor + k) % numReactors]);
+    if(i < 0) return -1;
+    struct Session *s = &sessions[i];
+    s->gen++;
+    s->fd = fd;
+    s->conn = c;
+    s->owner = c->reactor;
+    s->framed = framed;
+    s->outDropped = 0;
+    s->flushPending = 0;
+    s->resumable = 0;
+    s->parked = 0;
+    s->deliverSeq = 0;
+    s->logWritten = 0;
+    s->presenceSub = 0;
+    return i;
+}
+
+/* Take a free slot and index it under (campus, dept). Caller holds clientsLock.
+   Returns the slot, or -1 when the table is full. */
+int addSession(struct Conn *c, int fd, int framed, const char *campus, const char *dept) {
+    int cid = internName(campus), did = internName(dept);
+    if(cid < 0 || did < 0) return -1;
+    int i = slotAlloc(c, fd, framed);
+    if(i < 0) return -1;
+    struct Session *s = &sessions[i];
+    /* peers route to this node once the first session of a (campus, dept) is here */
+    if(findClientByIds(cid, did) < 0) peerAnnounce(cid, did, 1);
+    s->campusId = cid;
+    s->deptId = did;
+    if(campusRate.interval && !names[cid].rateTat) names[cid].rateTat = calloc(1, sizeof(uint64_t));
+    c->campusTat = names[cid].rateTat;
+    strcpy(s->campus, names[cid].str);
+    strcpy(s->dept, names[did].str);
+    s->udpKnown = 0;
+    s->lastSeen = 0;
+    s->missed = 0;
+    s->liveness = LIVE_ONLINE;
+    /* legacy clients cannot send RESUME */
+    s->resumable = framed && resumeGraceSecs > 0 && getrandom(s->resumeKey, sizeof(s->resumeKey), 0) == sizeof(s->resumeKey);
+
+    unsigned b = routeHash(cid, did);
+    s->routeNext = routeBuckets[b];
+    routeBuckets[b] = i;
+
+    s->campusNext = -1;
+    s->campusPrev = names[cid].campusTail;
+    if(s->campusPrev >= 0) sessions[s->campusPrev].campusNext = i;
+    else names[cid].campusHead = i;
+    names[cid].campusTail = i;
+
+    s->deptNext = -1;
+    s->deptPrev = names[did].deptTail;
+    if(s->deptPrev >= 0) sessions[s->deptPrev].deptNext = i;
+    else names[did].deptHead = i;
+    names[did].deptTail = i;
+
+    s->allNext = -1;
+    s->allPrev = allTail;
+    if(allTail >= 0) sessions[allTail].allNext = i;
+    else allHead = i;
+    allTail = i;
+
+    clientCount++;
+    presenceDirty = 1;
+    presenceNote(s, PRES_JOIN);
+    return i;
+}
+
+/* Release everything queued for the socket in both lanes. Caller holds s->outLock. */
+void queueDropLocked(struct Session *s) {
+    size_t queued = 0;
+    for(int l=0;l<LANES;l++) {
+        struct OutLane *q = &s->lanes[l];
+        for(int k=0;k<q->count;k++) {
+            queued += q->q[(q->head + k) % q->cap].b->len;
+            outBufRelease(q->q[(q->head + k) % q->cap].b);
+        }
+        q->head = q->count = 0;
+    }
+    /* what is left of outBytes is on its way through the owner's inbox */
+    s->outBytes -= queued - s->outOff;
+    s->outOff = 0;
+}
+
+/* Buffers queued for the socket in both lanes. Caller holds s->outLock. */
+int queueCountLocked(struct Session *s) {
+    return s->lanes[LANE_URGENT].count + s->lanes[LANE_BULK].count;
+}
+
+/* Drop whatever a slot still has queued and return it to its free list. Caller holds clientsLock. */
+void slotFree(int i) {
+    struct Session *s = &sessions[i];
+    /* release anything still queued for this receiver */
+    pthread_mutex_lock(&s->outLock);
+    queueDropLocked(s);
+    /* handoffs still in the inbox carry the old generation and are dropped uncounted */
+    s->outBytes = 0;
+    /* nobody is going to drain this queue now, let its paused senders go */
+    wakeWaitersLocked(s->waiters, s->waitCount);
+    s->waitCount = 0;
+    if(s->sent) {
+        for(int k=0;k<resumeWindow;k++) if(s->sent[k]) outBufRelease(s->sent[k]);
+        poolFree(s->sent);
+        s->sent = NULL;
+    }
+    s->parked = 0;
+    /* bumped under the queue lock: senders holding a handle check it there */
+    s->gen++;
+    pthread_mutex_unlock(&s->outLock);
+
+    timerCancel(&s->hbTimer);
+    s->logBacklog = 0;
+    s->xferBacklog = 0;
+    s->fd = -1;
+    s->conn = NULL;
+    s->freeNext = reactors[s->home].freeHead;
+    reactors[s->home].freeHead = i;
+}
+
+/* Unlink a session from every index and free its slot. Caller holds clientsLock. */
+void removeSession(int i) {
+    struct Session *s = &sessions[i];
+    int *pp = &routeBuckets[routeHash(s->campusId, s->deptId)];
+    while(*pp != i) pp = &sessions[*pp].routeNext;
+    *pp = s->routeNext;
+
+    if(s->campusPrev >= 0) sessions[s->campusPrev].campusNext = s->campusNext;
+    else names[s->campusId].campusHead = s->campusNext;
+    if(s->campusNext >= 0) sessions[s->campusNext].campusPrev = s->campusPrev;
+    else names[s->campusId].campusTail = s->campusPrev;
+
+    if(s->deptPrev >= 0) sessions[s->deptPrev].deptNext = s->deptNext;
+    else names[s->deptId].deptHead = s->deptNext;
+    if(s->deptNext >= 0) sessions[s->deptNext].deptPrev = s->deptPrev;
+    else names[s->deptId].deptTail = s->deptPrev;
+
+    if(s->allPrev >= 0) sessions[s->allPrev].allNext = s->allNext;
+    else allHead = s->allNext;
+    if(s->allNext >= 0) sessions[s->allNext].allPrev = s->allPrev;
+    else allTail = s->allPrev;
+
+    if(findClientByIds(s->campusId, s->deptId) < 0) peerAnnounce(s->campusId, s->deptId, 0);
+    if(spoolDir) xferDetach(s);
+    if(logDir) logDetach(s);
+    presenceNote(s, PRES_LEAVE);
+    slotFree(i);
+    clientCount--;
+    presenceDirty = 1;
+}
+
+/* Write the attachment chunk at the head of a lane: the rest of its frame
+   header, then the payload straight from the spool file with sendfile(), so
+   it never passes through a user-space buffer. Caller holds s->outLock.
+   Returns 1 once the whole chunk is out, 0 if the socket is full or gone. */
+int flushFileLocked(struct Session *s, int lane) {
+    struct OutLane *q = &s->lanes[lane];
+    struct OutEntry *e = &q->q[q->head];
+    struct OutFile *f = (struct OutFile*)e->b->data;
+    while(1) {
+        size_t off = s->outOff;
+        ssize_t w;
+        if(off < f->hdrLen) {
+            /* MSG_MORE: the header leaves in the same segment as the payload */
+            w = send(s->fd, f->hdr + off, f->hdrLen - off, MSG_MORE | MSG_NOSIGNAL);
+            metricAdd(M_WRITEV, 1);
+        } else {
+            off_t pos = f->off + (off - f->hdrLen);
+            w = sendfile(s->fd, f->fd, &pos, e->b->len - off);
+            metricAdd(M_SENDFILE, 1);
+        }
+        if(w < 0 && errno == EINTR) continue;
+        if(w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if(w <= 0) {
+            /* a spool file shorter than promised would leave the frame unfinished: end the connection */
+            if(w == 0) evLog(EV_ERROR, "[FILE] Spool file ended early while relaying to %s %s.\n", s->campus, s->dept);
+            /* a resumable session keeps its queue: sessionPark() numbers what is in it */
+            if(!s->resumable) queueDropLocked(s);
+            shutdown(s->fd, SHUT_RDWR);
+            return 0;
+        }
+        s->outBytes -= w;
+        s->outOff = off + w;
+        s->outOffLane = lane;
+        metricAdd(M_BYTES_OUT, w);
+        if(s->outOff < e->b->len) continue;
+        histRecord(lane == LANE_URGENT ? H_QUEUE_URGENT : H_QUEUE, nowNs() - e->queuedNs);
+        outBufRelease(e->b);
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        s->outOff = 0;
+        return 1;
+    }
+}
+
+/* A stored message is all on the socket: logConsume() may now mark it
+   consumed. Caller holds s->outLock. */
+void logWrittenLocked(struct Session *s, struct OutBuf *b) {
+    uint64_t seq;
+    memcpy(&seq, b->data + b->len, sizeof(seq));
+    /* a resumed session may write one again; seqs only ever go up */
+    if(seq > s->logWritten) s->logWritten = seq;
+}
+
+/* Write as much of a session's queue as the socket takes (non-blocking writev).
+   A partly written buffer is finished first, then the urgent lane goes out
+   ahead of the bulk lane. A DELIVER frame gets its resume number when its
+   first byte is written; an attachment chunk goes out on its own, with
+   flushFileLocked(). Caller holds s->outLock. Whatever is left waits for
+   the next EPOLLOUT. */
+void flushLocked(struct Session *s) {
+    while(queueCountLocked(s) > 0) {
+        struct iovec iov[MAX_IOV];
+        int laneOf[MAX_IOV], n = 0, fileLane = -1, stop = 0;
+        size_t off = s->outOff;
+        if(off > 0) {
+            struct OutLane *q = &s->lanes[s->outOffLane];
+            struct OutBuf *b = q->q[q->head].b;
+            if(b->file) {
+                fileLane = s->outOffLane;
+                stop = 1;
+            } else {
+                iov[0].iov_base = b->data + off;
+                iov[0].iov_len = b->len - off;
+                laneOf[n++] = s->outOffLane;
+            }
+        }
+        for(int l=0;l<LANES && !stop;l++) {
+            struct OutLane *q = &s->lanes[l];
+            for(int k = off > 0 && l == s->outOffLane; k<q->count && n<MAX_IOV; k++) {
+                struct OutBuf *b = q->q[(q->head + k) % q->cap].b;
+                if(b->file) {
+                    /* write what is ahead of it first */
+                    if(n == 0) fileLane = l;
+                    stop = 1;
+                    break;
+                }
+                iov[n].iov_base = b->data;
+                iov[n].iov_len = b->len;
+                laneOf[n++] = l;
+            }
+        }
+        if(fileLane >= 0) {
+            if(!flushFileLocked(s, fileLane)) return;
+            continue;
+        }
+
+        ssize_t w = writev(s->fd, iov, n);
+        metricAdd(M_WRITEV, 1);
+        if(w < 0) {
+            if(errno == EINTR) continue;
+            /* peer is gone: the reactor sees the hangup and closes. A resumable
+               session keeps its queue for sessionPark() to number; others drop it */
+            if(errno != EAGAIN && errno != EWOULDBLOCK && !s->resumable) queueDropLocked(s);
+            return;
+        }
+        s->outBytes -= w;
+        metricAdd(M_BYTES_OUT, w);
+        uint64_t now = nowNs();
+        /* iov takes each lane from its head, so every buffer written is the head of its lane */
+        for(int k=0;k<n && w>0;k++) {
+            struct OutLane *q = &s->lanes[laneOf[k]];
+            struct OutEntry *e = &q->q[q->head];
+            if(!e->numbered) {
+                resumeNumberLocked(s, e->b);
+                e->numbered = 1;
+            }
+            if((size_t)w < iov[k].iov_len) {
+                s->outOff = (k == 0 ? off : 0) + w;
+                s->outOffLane = laneOf[k];
+                return; /* short write: socket buffer is full */
+            }
+            w -= iov[k].iov_len;
+            histRecord(laneOf[k] == LANE_URGENT ? H_QUEUE_URGENT : H_QUEUE, now - e->queuedNs);
+            if(e->b->logged) logWrittenLocked(s, e->b);
+            outBufRelease(e->b);
+            q->head = (q->head + 1) % q->cap;
+            q->count--;
+            s->outOff = 0;
+        }
+    }
+}
+
+/* Resume senders that POLICY_BLOCK paused on a receiver. Caller holds clientsLock. */
+void wakeWaitersLocked(SessionHandle *list, int count) {
+    for(int k=0;k<count;k++) {
+        struct Session *w = sessionGet(list[k]);
+        if(!w || !w->conn) continue;
+        struct Conn *wc = w->conn;
+        __atomic_store_n(&wc->paused, 0, __ATOMIC_RELEASE);
+        /* re-arming an edge-triggered fd reports it again if it is ready,
+           so the owning reactor picks up the input it left unread */
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = wc;
+        epoll_ctl(wc->epfd, EPOLL_CTL_MOD, wc->fd, &ev);
+    }
+}
+
+/* Resume paused senders once a receiver has drained. Called without any session lock held. */
+void wakeWaiters(SessionHandle *list, int count) {
+    pthread_mutex_lock(&clientsLock);
+    wakeWaitersLocked(list, count);
+    pthread_mutex_unlock(&clientsLock);
+}
+
+/* Flush a session and wake paused senders once it is below the low watermark */
+void flushSession(struct Session *s) {
+    SessionHandle woken[64];
+    int count = 0;
+    pthread_mutex_lock(&s->outLock);
+    flushLocked(s);
+    if(s->waitCount > 0 && s->outBytes <= lowWatermark) {
+        /* wake in batches so the list can be handled without the queue lock */
+        count = s->waitCount < 64 ? s->waitCount : 64;
+        memcpy(woken, s->waiters + s->waitCount - count, count * sizeof(SessionHandle));
+        s->waitCount -= count;
+    }
+    int resume = __atomic_load_n(&s->logBacklog, __ATOMIC_ACQUIRE) && s->outBytes <= lowWatermark;
+    int relay = __atomic_load_n(&s->xferBacklog, __ATOMIC_ACQUIRE) && s->outBytes < lowWatermark;
+    pthread_mutex_unlock(&s->outLock);
+    if(count > 0) {
+        wakeWaiters(woken, count);
+        if(s->waitCount > 0) flushSession(s);
+    }
+    /* the queue drained far enough to take more stored messages, or attachment chunks */
+    if(resume) logStream(s);
+    if(relay) xferStream(s);
+}
+
+/* Apply the backpressure policy to one more buffer b for s. Urgent buffers
+   may go as far again past the high watermark, so a receiver buried in bulk
+   traffic still gets its control replies. from is the sending connection
+   (NULL for server replies) and is paused when the receiver is over the
+   limit under POLICY_BLOCK. Caller holds s->outLock.
+   Returns 0 if the buffer may be queued, -1 if it is dropped. */
+int admitLocked(struct Session *s, struct OutBuf *b, struct Conn *from) {
+    size_t limit = b->lane == LANE_URGENT ? 2 * highWatermark : highWatermark;
+    if(s->outBytes + b->len > limit) {
+        int policy = backpressurePolicy;
+        if(policy == POLICY_BLOCK && !from) policy = POLICY_DROP;
+        if(policy == POLICY_DROP) {
+            s->outDropped++;
+            metricAdd(M_DROPS, 1);
+            return -1;
+        }
+        if(policy == POLICY_DISCONNECT) {
+            /* the receiver's reactor sees the shutdown and tears the session down */
+            s->outDropped++;
+            metricAdd(M_DROPS, 1);
+            evLog(EV_WARN, "[SERVER] %s %s is %zu bytes behind, disconnecting.\n", s->campus, s->dept, s->outBytes);
+            /* a resume would only replay the backlog it could not take */
+            s->resumable = 0;
+            shutdown(s->fd, SHUT_RDWR);
+            return -1;
+        }
+        /* POLICY_BLOCK: accept this one, then stop reading from the sender */
+        if(s->waitCount == s->waitCap) {
+            int cap = s->waitCap ? s->waitCap * 2 : 8;
+            SessionHandle *nw = realloc(s->waiters, cap * sizeof(*nw));
+            if(nw) { s->waiters = nw; s->waitCap = cap; }
+        }
+        if(s->waitCount < s->waitCap) {
+            s->waiters[s->waitCount++] = from->session;
+            __atomic_store_n(&from->paused, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return 0;
+}
+
+/* Append a buffer to one lane of the socket queue; the queue takes its own
+   reference. numbered says it is already in the resume window (a replay).
+   Caller holds s->outLock. Returns -1 if the lane could not grow. */
+int queuePushLocked(struct Session *s, struct OutBuf *b, int lane, int numbered) {
+    struct OutLane *q = &s->lanes[lane];
+    if(q->count == q->cap) {
+        int cap = q->cap ? q->cap * 2 : OUTQ_INITIAL;
+        struct OutEntry *nq = poolAlloc(cap * sizeof(*nq));
+        if(!nq) {
+            s->outDropped++;
+            metricAdd(M_DROPS, 1);
+            return -1;
+        }
+        for(int k=0;k<q->count;k++) nq[k] = q->q[(q->head + k) % q->cap];
+        poolFree(q->q);
+        q->q = nq;
+        q->head = 0;
+        q->cap = cap;
+    }
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    struct OutEntry *e = &q->q[(q->head + q->count) % q->cap];
+    e->b = b;
+    e->queuedNs = nowNs();
+    e->numbered = numbered;
+    q->count++;
+    s->outBytes += b->len;
+    if(lane == LANE_URGENT) metricAdd(M_URGENT, 1);
+    return 0;
+}
+
+/* Number a DELIVER frame for a resumable session and keep it in the resume
+   window, replacing the one resumeWindow older. Anything else is left alone.
+   Caller holds s->outLock. */
+void resumeNumberLocked(struct Session *s, struct OutBuf *b) {
+    if(!s->resumable || b->file || b->len <= FRAME_HDR || (uint8_t)b->data[FRAME_HDR] != FRAME_DELIVER) return;
+    if(!s->sent) s->sent = poolCalloc(resumeWindow * sizeof(*s->sent));
+    /* without a window the seq still counts, a resume reports these as lost */
+    uint64_t seq = ++s->deliverSeq;
+    if(!s->sent) return;
+    struct OutBuf **slot = &s->sent[seq % resumeWindow];
+    if(*slot) outBufRelease(*slot);
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    *slot = b;
+}
+
+/* Append a buffer to a session's queue; the queue takes its own reference.
+   While the session is parked DELIVER frames only go into its resume window.
+   Caller holds s->outLock. Returns -1 if the queue could not grow. */
+int queueAppendLocked(struct Session *s, struct OutBuf *b) {
+    if(s->parked) {
+        resumeNumberLocked(s, b);
+        return 0;
+    }
+    return queuePushLocked(s, b, b->lane, 0);
+}
+
+/* Put a session that has just been queued to on its owner's deferred flush
+   list: it is written at the end of the owner's event batch, or with -W once
+   its oldest unsent message is that old. A queue that already fills a writev
+   is written now, and so is urgent output rather than wait out -W.
+   Caller holds s->outLock and runs on s's owner. */
+void flushDeferLocked(struct Session *s) {
+    if(queueCountLocked(s) >= MAX_IOV || s->outBytes >= COALESCE_BYTES ||
+       (coalesceNs && s->lanes[LANE_URGENT].count > 0)) {
+        flushLocked(s);
+        return;
+    }
+    if(s->flushPending) return;
+    struct Reactor *r = &reactors[s->owner];
+    if(r->deferCount == r->deferCap) {
+        int cap = r->deferCap ? r->deferCap * 2 : 64;
+        SessionHandle *nd = realloc(r->deferred, cap * sizeof(*nd));
+        if(!nd) {
+            flushLocked(s);
+            return;
+        }
+        r->deferred = nd;
+        r->deferCap = cap;
+    }
+    s->flushPending = 1;
+    s->flushDue = nowNs() + coalesceNs;
+    r->deferred[r->deferCount++] = makeHandle(s - sessions);
+}
+
+/* Write the deferred sessions that are due; all of them when there is no -W
+   window. Called by the owner after each event batch. */
+void flushDeferred(struct Reactor *r) {
+    uint64_t now = coalesceNs ? nowNs() : UINT64_MAX;
+    int done = 0;
+    while(done < r->deferCount) {
+        SessionHandle h = r->deferred[done];
+        struct Session *s = &sessions[(uint32_t)h];
+        pthread_mutex_lock(&s->outLock);
+        int live = s->gen == (uint32_t)(h >> 32);
+        if(live && s->flushDue > now) {
+            pthread_mutex_unlock(&s->outLock);
+            break;
+        }
+        if(live) s->flushPending = 0;
+        pthread_mutex_unlock(&s->outLock);
+        done++;
+        if(live) flushSession(s);
+    }
+    memmove(r->deferred, r->deferred + done, (r->deferCount - done) * sizeof(SessionHandle));
+    r->deferCount -= done;
+}
+
+/* Queue a buffer for a session and write it: coalesced when we own the
+   session, straight away from any other thread. The queue takes its own
+   reference; from is handled as in admitLocked().
+   Returns 0 if queued, -1 if the message was dropped. */
+int sessionEnqueue(struct Session *s, struct OutBuf *b, struct Conn *from) {
+    pthread_mutex_lock(&s->outLock);
+    if(admitLocked(s, b, from) < 0 || queueAppendLocked(s, b) < 0) {
+        pthread_mutex_unlock(&s->outLock);
+        return -1;
+    }
+    if(s->owner == currentReactor) flushDeferLocked(s);
+    else flushLocked(s);
+    pthread_mutex_unlock(&s->outLock);
+    return 0;
+}
+
+/* Push a handoff onto a reactor's inbox. Only the push that finds the inbox
+   empty wakes the owner; later ones ride along with that wakeup. */
+void handoffPush(struct Reactor *r, struct Handoff *h) {
+    struct Handoff *old = __atomic_load_n(&r->inbox, __ATOMIC_RELAXED);
+    do {
+        h->next = old;
+    } while(!__atomic_compare_exchange_n(&r->inbox, &old, h, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if(!old) {
+        uint64_t one = 1;
+        if(write(r->inboxFd, &one, sizeof(one)) < 0) perror("inbox eventfd");
+    }
+}
+
+/* Send a routed message to the session behind a handle, without clientsLock.
+   The handle is checked against the slot's generation under the receiver's
+   queue lock, so a session that has gone (or a reused slot) is never written
+   to. The backpressure policy is applied here, on the sender's thread; the
+   receiver's own reactor queues and writes the message, directly if that is
+   us, through its inbox otherwise (the bytes count against its watermark
+   from now on). Returns 0 if sent, -1 if dropped, -2 if the session is gone. */
+int sessionSend(SessionHandle h, struct OutBuf *b, struct Conn *from) {
+    struct Session *s = &sessions[(uint32_t)h];
+    struct Handoff *ho = poolAlloc(sizeof(*ho));
+    if(!ho) return -1;
+    pthread_mutex_lock(&s->outLock);
+    if(s->gen != (uint32_t)(h >> 32)) {
+        pthread_mutex_unlock(&s->outLock);
+        poolFree(ho);
+        return -2;
+    }
+    if(admitLocked(s, b, from) < 0) {
+        pthread_mutex_unlock(&s->outLock);
+        poolFree(ho);
+        return -1;
+    }
+    if(s->owner == currentReactor) {
+        int rc = queueAppendLocked(s, b);
+        if(rc == 0) flushDeferLocked(s);
+        pthread_mutex_unlock(&s->outLock);
+        poolFree(ho);
+        return rc;
+    }
+    s->outBytes += b->len;
+    struct Reactor *r = &reactors[s->owner];
+    pthread_mutex_unlock(&s->outLock);
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    ho->dest = h;
+    ho->b = b;
+    ho->auth = NULL;
+    handoffPush(r, ho);
+    return 0;
+}
+
+/* Inbox eventfd readable: queue every handed-off message; each receiver is
+   flushed once with the rest of the batch, so a burst from other reactors
+   becomes one writev per socket */
+void handleInbox(struct Reactor *r) {
+    uint64_t n;
+    if(read(r->inboxFd, &n, sizeof(n)) < 0 && errno != EAGAIN) perror("inbox eventfd");
+    r->wakeups++;
+    struct Handoff *list = __atomic_exchange_n(&r->inbox, NULL, __ATOMIC_ACQUIRE);
+    /* the stack is newest first, reverse it to keep each sender's order */
+    struct Handoff *fifo = NULL;
+    while(list) {
+        struct Handoff *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while(fifo) {
+        struct Handoff *h = fifo;
+        fifo = h->next;
+        if(h->auth) {
+            /* it may close its connection, which an event later in this batch could name */
+            h->auth->next = r->authDone;
+            r->authDone = h->auth;
+            continue;
+        }
+        r->handoffsIn++;
+        struct Session *s = &sessions[(uint32_t)h->dest];
+        pthread_mutex_lock(&s->outLock);
+        if(s->gen == (uint32_t)(h->dest >> 32)) {
+            /* the sender already counted these bytes */
+            s->outBytes -= h->b->len;
+            /* a resumed session may have moved to another reactor meanwhile */
+            if(queueAppendLocked(s, h->b) == 0) {
+                if(s->owner == currentReactor) flushDeferLocked(s);
+                else flushLocked(s);
+            }
+        }
+        pthread_mutex_unlock(&s->outLock);
+        outBufRelease(h->b);
+        poolFree(h);
+    }
+}
+
+/* The session of an authenticated connection. Only the owning reactor frees
+   it, so the connection's own thread can use it without clientsLock. */
+struct Session *connSession(struct Conn *c) {
+    return &sessions[(uint32_t)c->session];
+}
+
+/* Queue a server reply (notice, list, error) to an authenticated client */
+void queueReply(struct Conn *c, uint8_t type, const char *text) {
+    struct OutBuf *b = makeReply(c->framed, type, text);
+    if(!b) return;
+    sessionEnqueue(connSession(c), b, NULL);
+    outBufRelease(b);
+}
+
+/* Write a handshake message on a socket that has no session yet, without
+   waiting: nothing was written to the socket before, so it fits the empty
+   send buffer, and a socket that somehow does not take it loses it rather
+   than stalling every other connection of the reactor */
+void sendHandshake(int sock, const char *buf, size_t len) {
+    ssize_t n;
+    while((n = send(sock, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0 && errno == EINTR) {}
+    if(n != (ssize_t)len) evLog(EV_DEBUG, "[SERVER] Handshake reply did not fit the socket, dropped.\n");
+}
+
+/* Send a reply on a socket that has no session yet (handshake) */
+void sendReply(int sock, int framed, uint8_t type, const char *text) {
+    struct OutBuf *b = makeReply(framed, type, text);
+    if(!b) return;
+    sendHandshake(sock, b->data, b->len);
+    outBufRelease(b);
+}
+
+/* Password checks waiting for an auth worker, oldest first */
+struct AuthJob *authHead = NULL, *authTail = NULL;
+int authQueued = 0;
+pthread_mutex_t authLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t authCond = PTHREAD_COND_INITIALIZER;
+
+/* Queue a password check for the workers. Returns -1 if too many are waiting. */
+int authSubmit(struct AuthJob *j) {
+    pthread_mutex_lock(&authLock);
+    if(authQueued >= AUTH_QUEUE_MAX) {
+        pthread_mutex_unlock(&authLock);
+        return -1;
+    }
+    j->next = NULL;
+    if(authTail) authTail->next = j;
+    else authHead = j;
+    authTail = j;
+    authQueued++;
+    pthread_cond_signal(&authCond);
+    pthread_mutex_unlock(&authLock);
+    return 0;
+}
+
+/* Auth worker: run the full derivation for each queued login and post the
+   answer back to the connection's reactor */
+void *authWorker(void *arg) {
+    threadSlot = (int)(intptr_t)arg;
+    while(1) {
+        pthread_mutex_lock(&authLock);
+        while(!authHead) pthread_cond_wait(&authCond, &authLock);
+        struct AuthJob *j = authHead;
+        if(!(authHead = j->next)) authTail = NULL;
+        authQueued--;
+        pthread_mutex_unlock(&authLock);
+
+        uint8_t hash[32];
+        pbkdf2Sha256(j->pass, j->cred->salt, CRED_SALT, j->cred->iterations, hash);
+        j->ok = equalConstTime(hash, j->cred->hash, 32);
+        memset(j->pass, 0, sizeof(j->pass));
+        if(j->ok) {
+            pthread_mutex_lock(&credLock);
+            memcpy(j->cred->fastTag, j->tag, 32);
+            j->cred->fastValid = 1;
+            pthread_mutex_unlock(&credLock);
+        }
+        j->done.auth = j;
+        handoffPush(&reactors[j->reactor], &j->done);
+    }
+    return NULL;
+}
+
+/* Durable store-and-forward log (-L dir). A message for a department that is
+   not connected is appended to a memory-mapped segment file and streamed to
+   that department when it logs in. Every record is a frame behind a small
+   header: a DELIVER frame for a stored message, or a CONSUMED marker saying
+   how far one recipient has been delivered. A message only counts as
+   delivered once all of it has been written to the recipient's socket; one
+   still queued when its session goes away is streamed again to the next
+   session of that department, and after a crash. Replaying the segments at startup
+   rebuilds every mailbox. A flusher thread msyncs everything appended since
+   its last pass, so one disk flush covers a whole batch of records (group
+   commit), and only then tells the senders their messages are stored.
+   Segments whose messages have all been delivered are deleted oldest first.
+   Protected by logLock; the lock order is clientsLock, logLock, outLock. */
+#define LOG_SEGMENT_SIZE (8 * 1024 * 1024)
+#define LOG_CONSUMED 0x80    /* record type: recipient campus, dept, last delivered seq */
+#define MAIL_BUCKETS 1024
+
+struct LogRecHdr {
+    uint32_t len;            /* frame bytes that follow, 0 ends the segment */
+    uint32_t sum;            /* FNV-1a of the frame bytes, catches torn writes */
+    uint64_t seq;            /* log-wide record number */
+};
+
+struct LogSegment {
+    unsigned id;
+    int fd;
+    char *map;
+    size_t size;
+    size_t used;             /* bytes of valid records */
+    size_t synced;           /* bytes known to be on disk */
+    int live;                /* stored messages in this segment not yet delivered */
+};
+
+/* One undelivered message, in log order */
+struct LogEntry {
+    struct LogEntry *next;
+    struct LogSegment *seg;
+    size_t off;              /* offset of the record header */
+    uint64_t seq;
+    SessionHandle to;        /* session it is queued to, NO_SESSION while it waits, LOG_WRITTEN */
+};
+#define LOG_WRITTEN ((SessionHandle)-1)   /* LogEntry.to: written to a session that has gone since */
+
+/* Undelivered messages of one (campus, dept). The ones at the head may be
+   queued to a session already; they are dropped as their bytes reach it. */
+struct Mailbox {
+    int campusId, deptId;
+    int hashNext;
+    struct LogEntry *head, *tail;
+    struct LogEntry *unsent; /* first entry not queued to any session, NULL if none */
+    int count;
+};
+
+/* A "stored" notice to send once the record is on disk */
+struct LogAck {
+    SessionHandle to;
+    uint64_t seq;
+    char campus[MAX_NAME];
+    char dept[MAX_NAME];
+};
+
+pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t logCond = PTHREAD_COND_INITIALIZER;
+struct LogSegment **logSegs = NULL;   /* oldest first, the last one takes appends */
+int logSegCount = 0, logSegCap = 0;
+struct Mailbox *mailboxes = NULL;
+int mailboxCount = 0, mailboxCap = 0;
+int mailBuckets[MAIL_BUCKETS];
+uint64_t logSeq = 0;                  /* last record appended */
+uint64_t logDurable = 0;              /* every record up to here is on disk */
+struct LogAck *logAcks = NULL;        /* in seq order */
+int logAckCount = 0, logAckCap = 0;
+unsigned long logStored = 0, logDelivered = 0, logSyncs = 0, logSyncedRecords = 0, logSyncErrors = 0;
+
+uint32_t logChecksum(const char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for(size_t i=0;i<len;i++) { h ^= (unsigned char)p[i]; h *= 16777619u; }
+    return h;
+}
+
+/* Open (or create) a segment file, map it and add it to the end of logSegs */
+struct LogSegment *logOpenSegment(unsigned id, int create) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/seg-%08u.log", logDir, id);
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if(fd < 0) return NULL;
+    struct stat st;
+    if(fstat(fd, &st) < 0) { close(fd); return NULL; }
+    size_t size = st.st_size > LOG_SEGMENT_SIZE ? (size_t)st.st_size : LOG_SEGMENT_SIZE;
+    /* reserve the blocks up front: a store into a hole on a full disk would be SIGBUS */
+    if((size_t)st.st_size < size && posix_fallocate(fd, 0, size) != 0) { close(fd); return NULL; }
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    struct LogSegment *seg = malloc(sizeof(*seg));
+    if(logSegCount == logSegCap) {
+        int cap = logSegCap ? logSegCap * 2 : 16;
+        struct LogSegment **ns = realloc(logSegs, cap * sizeof(*ns));
+        if(ns) { logSegs = ns; logSegCap = cap; }
+    }
+    if(map == MAP_FAILED || !seg || logSegCount == logSegCap) {
+        if(map != MAP_FAILED) munmap(map, size);
+        free(seg);
+        close(fd);
+        return NULL;
+    }
+    seg->id = id;
+    seg->fd = fd;
+    seg->map = map;
+    seg->size = size;
+    seg->used = seg->synced = 0;
+    seg->live = 0;
+    logSegs[logSegCount++] = seg;
+    return seg;
+}
+
+/* Find the mailbox of (campus, dept), creating it if asked. Caller holds logLock. */
+struct Mailbox *mailboxFind(int campusId, int deptId, int create) {
+    unsigned b = ((unsigned)campusId * 2654435761u ^ (unsigned)deptId * 40503u) % MAIL_BUCKETS;
+    for(int i = mailBuckets[b]; i >= 0; i = mailboxes[i].hashNext)
+        if(mailboxes[i].campusId == campusId && mailboxes[i].deptId == deptId) return &mailboxes[i];
+    if(!create) return NULL;
+    if(mailboxCount == mailboxCap) {
+        int cap = mailboxCap ? mailboxCap * 2 : 64;
+        struct Mailbox *nm = realloc(mailboxes, cap * sizeof(*nm));
+        if(!nm) return NULL;
+        mailboxes = nm;
+        mailboxCap = cap;
+    }
+    struct Mailbox *m = &mailboxes[mailboxCount];
+    memset(m, 0, sizeof(*m));
+    m->campusId = campusId;
+    m->deptId = deptId;
+    m->hashNext = mailBuckets[b];
+    mailBuckets[b] = mailboxCount++;
+    return m;
+}
+
+int mailboxAdd(struct Mailbox *m, struct LogSegment *seg, size_t off, uint64_t seq) {
+    struct LogEntry *e = malloc(sizeof(*e));
+    if(!e) return -1;
+    e->next = NULL;
+    e->seg = seg;
+    e->off = off;
+    e->seq = seq;
+    e->to = NO_SESSION;
+    if(m->tail) m->tail->next = e;
+    else m->head = e;
+    m->tail = e;
+    if(!m->unsent) m->unsent = e;
+    m->count++;
+    seg->live++;
+    return 0;
+}
+
+/* The first entry from e on that no session has queued */
+struct LogEntry *mailboxUnsent(struct LogEntry *e) {
+    while(e && e->to != NO_SESSION) e = e->next;
+    return e;
+}
+
+/* Drop the head of a mailbox once it has been delivered */
+void mailboxPop(struct Mailbox *m) {
+    struct LogEntry *e = m->head;
+    m->head = e->next;
+    if(!m->head) m->tail = NULL;
+    if(m->unsent == e) m->unsent = mailboxUnsent(e->next);
+    m->count--;
+    e->seg->live--;
+    free(e);
+}
+
+/* Append one record, starting a new segment when the current one is full.
+   Returns its seq (0 on failure) and where it landed. Caller holds logLock. */
+uint64_t logAppend(uint8_t type, const struct FrameField *f, int n, struct LogSegment **segOut, size_t *offOut) {
+    size_t flen = frameSize(f, n);
+    size_t need = sizeof(struct LogRecHdr) + flen;
+    struct LogSegment *seg = logSegCount ? logSegs[logSegCount - 1] : NULL;
+    if(!seg || seg->used + need > seg->size) {
+        seg = logOpenSegment(seg ? seg->id + 1 : 1, 1);
+        if(!seg) {
+            perror("[LOG] new segment");
+            return 0;
+        }
+    }
+    char *rec = seg->map + seg->used;
+    if(frameEncode(rec + sizeof(struct LogRecHdr), flen, type, f, n) != flen) return 0;
+    struct LogRecHdr hdr = { (uint32_t)flen, logChecksum(rec + sizeof(hdr), flen), ++logSeq };
+    memcpy(rec, &hdr, sizeof(hdr));
+    copyCount(flen);
+    if(segOut) *segOut = seg;
+    if(offOut) *offOut = seg->used;
+    seg->used += need;
+    pthread_cond_signal(&logCond);
+    return hdr.seq;
+}
+
+/* Persist a message for tgtCampus/tgtDept. dest is the recipient's session if
+   it is connected but still has older stored messages streaming (the message
+   joins the end of the line), NULL if nobody is connected (the sender gets a
+   notice once the message is durable). Caller holds clientsLock.
+   Returns 0 if stored. */
+int logStore(struct Conn *from, struct Session *dest, const char *tgtCampus, const char *tgtDept,
+             const char *message, size_t msgLen) {
+    int cid = internName(tgtCampus), did = internName(tgtDept);
+    if(cid < 0 || did < 0) return -1;
+    struct FrameField f[5] = { frameStr(from->campus), frameStr(from->dept),
+                               frameStr(names[cid].str), frameStr(names[did].str),
+                               { message, (uint16_t)msgLen } };
+    pthread_mutex_lock(&logLock);
+    struct Mailbox *m = mailboxFind(cid, did, 1);
+    struct LogSegment *seg;
+    size_t off;
+    uint64_t seq = m ? logAppend(FRAME_DELIVER, f, 5, &seg, &off) : 0;
+    if(!seq || mailboxAdd(m, seg, off, seq) < 0) {
+        pthread_mutex_unlock(&logLock);
+        return -1;
+    }
+    logStored++;
+    if(dest) {
+        dest->logBacklog = 1;
+    } else {
+        if(logAckCount == logAckCap) {
+            int cap = logAckCap ? logAckCap * 2 : 64;
+            struct LogAck *na = realloc(logAcks, cap * sizeof(*na));
+            if(na) { logAcks = na; logAckCap = cap; }
+        }
+        if(logAckCount < logAckCap) {
+            struct LogAck *a = &logAcks[logAckCount++];
+            a->to = from->session;
+            a->seq = seq;
+            strcpy(a->campus, names[cid].str);
+            strcpy(a->dept, names[did].str);
+        }
+    }
+    pthread_mutex_unlock(&logLock);
+    return 0;
+}
+
+/* Drop the messages at the head of a mailbox whose bytes have all reached
+   their session's socket, and log how far its recipient (campus, dept) got.
+   Caller holds logLock. */
+void logConsume(struct Mailbox *m, const char *campus, const char *dept) {
+    uint64_t last = 0;
+    while(m->head && m->head->to != NO_SESSION) {
+        struct LogEntry *e = m->head;
+        int written = e->to == LOG_WRITTEN;
+        if(!written) {
+            struct Session *s = &sessions[(uint32_t)e->to];
+            pthread_mutex_lock(&s->outLock);
+            written = s->gen == (uint32_t)(e->to >> 32) && s->logWritten >= e->seq;
+            pthread_mutex_unlock(&s->outLock);
+        }
+        if(!written) break;
+        last = e->seq;
+        mailboxPop(m);
+        logDelivered++;
+    }
+    if(last) {
+        char seqStr[24];
+        snprintf(seqStr, sizeof(seqStr), "%llu", (unsigned long long)last);
+        struct FrameField f[3] = { frameStr(campus), frameStr(dept), frameStr(seqStr) };
+        logAppend(LOG_CONSUMED, f, 3, NULL, NULL);
+    }
+}
+
+/* Queue stored messages for a connected session until its queue reaches the
+   high watermark; flushSession calls back in once it drains to the low one.
+   Each buffer carries its log seq behind the wire bytes, so the flush that
+   writes its last byte can tell logConsume() it is delivered.
+   Safe from the session's reactor, or from anywhere with clientsLock held. */
+void logStream(struct Session *s) {
+    /* a parked session picks the stream up again when it resumes */
+    if(__atomic_load_n(&s->parked, __ATOMIC_ACQUIRE)) return;
+    SessionHandle h = makeHandle(s - sessions);
+    pthread_mutex_lock(&logLock);
+    struct Mailbox *m = mailboxFind(s->campusId, s->deptId, 0);
+    if(m) logConsume(m, s->campus, s->dept);
+    while(m && m->unsent) {
+        struct LogEntry *e = m->unsent;
+        struct LogRecHdr hdr;
+        memcpy(&hdr, e->seg->map + e->off, sizeof(hdr));
+        const char *rec = e->seg->map + e->off + sizeof(hdr);
+        struct OutBuf *b;
+        if(s->framed) {
+            if(!(b = outBufNew(hdr.len + sizeof(e->seq)))) break;
+            memcpy(b->data, rec, hdr.len);
+            b->len = hdr.len;
+            copyCount(hdr.len);
+        } else {
+            struct Frame fr;
+            char fc[MAX_NAME], fd[MAX_NAME], tc[MAX_NAME], td[MAX_NAME];
+            frameParse(rec, hdr.len, &fr);
+            frameFieldCopy(fc, sizeof(fc), fr.f[0]);
+            frameFieldCopy(fd, sizeof(fd), fr.f[1]);
+            frameFieldCopy(tc, sizeof(tc), fr.f[2]);
+            frameFieldCopy(td, sizeof(td), fr.f[3]);
+            struct OutBuf *text = encodeDeliver(0, fc, fd, tc, td, fr.f[4].ptr, fr.f[4].len);
+            b = text ? outBufNew(text->len + sizeof(e->seq)) : NULL;
+            if(b) {
+                memcpy(b->data, text->data, text->len);
+                b->len = text->len;
+            }
+            if(text) outBufRelease(text);
+            if(!b) break;
+        }
+        b->logged = 1;
+        memcpy(b->data + b->len, &e->seq, sizeof(e->seq));
+        pthread_mutex_lock(&s->outLock);
+        size_t queued = s->outBytes;
+        pthread_mutex_unlock(&s->outLock);
+        /* a non-empty queue means the socket is full and EPOLLOUT will bring us back */
+        if((queued > 0 && queued + b->len > highWatermark) || sessionEnqueue(s, b, NULL) < 0) {
+            outBufRelease(b);
+            break;
+        }
+        outBufRelease(b);
+        e->to = h;
+        m->unsent = mailboxUnsent(e->next);
+    }
+    /* what the queue wrote out at once */
+    if(m) logConsume(m, s->campus, s->dept);
+    if(!m || !m->unsent) __atomic_store_n(&s->logBacklog, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&logLock);
+}
+
+/* Mark consumed the stored messages written out since the last tick, for
+   sessions whose queues drained without calling back into logStream().
+   Runs on reactor 0's tick; caller holds clientsLock. */
+void logSweep(void) {
+    pthread_mutex_lock(&logLock);
+    for(int i=0;i<mailboxCount;i++) {
+        struct Mailbox *m = &mailboxes[i];
+        if(m->head && m->head->to != NO_SESSION) logConsume(m, names[m->campusId].str, names[m->deptId].str);
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+/* A session is going away for good: what it was sent in full is delivered,
+   what it was not goes back in line for the next session of its department.
+   Caller holds clientsLock. */
+void logDetach(struct Session *s) {
+    SessionHandle h = makeHandle(s - sessions);
+    pthread_mutex_lock(&logLock);
+    struct Mailbox *m = mailboxFind(s->campusId, s->deptId, 0);
+    if(!m) {
+        pthread_mutex_unlock(&logLock);
+        return;
+    }
+    pthread_mutex_lock(&s->outLock);
+    uint64_t written = s->logWritten;
+    pthread_mutex_unlock(&s->outLock);
+    int requeued = 0;
+    for(struct LogEntry *e = m->head; e; e = e->next) {
+        if(e->to != h) continue;
+        /* written, but behind a message another session has not finished yet */
+        if(e->seq <= written) e->to = LOG_WRITTEN;
+        else {
+            e->to = NO_SESSION;
+            requeued++;
+        }
+    }
+    m->unsent = mailboxUnsent(m->head);
+    logConsume(m, s->campus, s->dept);
+    pthread_mutex_unlock(&logLock);
+    if(!requeued) return;
+    evLog(EV_INFO, "[LOG] %d stored message(s) for %s %s were not delivered before it left; keeping them.\n",
+                   requeued, s->campus, s->dept);
+    /* the session is out of the route index already */
+    int other = findClientByIds(s->campusId, s->deptId);
+    if(other >= 0) {
+        __atomic_store_n(&sessions[other].logBacklog, 1, __ATOMIC_RELEASE);
+        logStream(&sessions[other]);
+    }
+}
+
+/* A session just logged in: start streaming whatever was stored for it. Caller holds clientsLock. */
+void logAttach(struct Session *s) {
+    pthread_mutex_lock(&logLock);
+    struct Mailbox *m = mailboxFind(s->campusId, s->deptId, 0);
+    s->logBacklog = m && m->head;
+    if(s->logBacklog)
+        evLog(EV_DEBUG, "[LOG] Streaming %d stored message(s) to %s %s.\n", m->count, s->campus, s->dept);
+    pthread_mutex_unlock(&logLock);
+    if(s->logBacklog) logStream(s);
+}
+
+/* Rebuild mailboxes from one segment. Stops at the first zero or damaged record. */
+void logReplay(struct LogSegment *seg) {
+    size_t off = 0;
+    while(off + sizeof(struct LogRecHdr) <= seg->size) {
+        struct LogRecHdr hdr;
+        memcpy(&hdr, seg->map + off, sizeof(hdr));
+        if(hdr.len == 0) break;
+        const char *rec = seg->map + off + sizeof(hdr);
+        struct Frame fr;
+        if(hdr.len > seg->size - off - sizeof(hdr) || logChecksum(rec, hdr.len) != hdr.sum ||
+           frameParse(rec, hdr.len, &fr) != (int)hdr.len) {
+            /* torn tail from a crash: clear it so new appends do not run into old bytes */
+            evLog(EV_ERROR, "[LOG] Segment %u: damaged record at offset %zu, truncating.\n", seg->id, off);
+            memset(seg->map + off, 0, seg->size - off);
+            break;
+        }
+        if(hdr.seq > logSeq) logSeq = hdr.seq;
+        char campus[MAX_NAME], dept[MAX_NAME];
+        if(fr.type == FRAME_DELIVER && fr.nfields == 5) {
+            frameFieldCopy(campus, sizeof(campus), fr.f[2]);
+            frameFieldCopy(dept, sizeof(dept), fr.f[3]);
+            struct Mailbox *m = mailboxFind(internName(campus), internName(dept), 1);
+            if(m) mailboxAdd(m, seg, off, hdr.seq);
+        } else if(fr.type == LOG_CONSUMED && fr.nfields == 3) {
+            char seqStr[24];
+            frameFieldCopy(campus, sizeof(campus), fr.f[0]);
+            frameFieldCopy(dept, sizeof(dept), fr.f[1]);
+            frameFieldCopy(seqStr, sizeof(seqStr), fr.f[2]);
+            uint64_t upTo = strtoull(seqStr, NULL, 10);
+            int cid = lookupName(campus), did = lookupName(dept);
+            struct Mailbox *m = cid >= 0 && did >= 0 ? mailboxFind(cid, did, 0) : NULL;
+            while(m && m->head && m->head->seq <= upTo) mailboxPop(m);
+        }
+        off += sizeof(hdr) + hdr.len;
+    }
+    seg->used = seg->synced = off;
+}
+
+int compareUnsigned(const void *a, const void *b) {
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Open the log directory and replay every segment in order. Runs before any thread starts. */
+int logOpen(void) {
+    for(int i=0;i<MAIL_BUCKETS;i++) mailBuckets[i] = -1;
+    if(mkdir(logDir, 0755) < 0 && errno != EEXIST) return -1;
+    DIR *d = opendir(logDir);
+    if(!d) return -1;
+    unsigned *ids = NULL;
+    int count = 0, cap = 0;
+    struct dirent *de;
+    while((de = readdir(d))) {
+        unsigned id;
+        char tail;
+        if(sscanf(de->d_name, "seg-%8u.lo%c", &id, &tail) != 2 || tail != 'g') continue;
+        if(count == cap) {
+            cap = cap ? cap * 2 : 16;
+            unsigned *ni = realloc(ids, cap * sizeof(*ni));
+            if(!ni) { free(ids); closedir(d); return -1; }
+            ids = ni;
+        }
+        ids[count++] = id;
+    }
+    closedir(d);
+    qsort(ids, count, sizeof(*ids), compareUnsigned);
+    for(int i=0;i<count;i++) {
+        struct LogSegment *seg = logOpenSegment(ids[i], 0);
+        if(!seg) { free(ids); return -1; }
+        logReplay(seg);
+    }
+    free(ids);
+    logDurable = logSeq;
+    int pending = 0;
+    for(int i=0;i<mailboxCount;i++) pending += mailboxes[i].count;
+    evLog(EV_INFO, "[LOG] Message log %s: %d segment(s), %d stored message(s) waiting.\n", logDir, logSegCount, pending);
+    return 0;
+}
+
+/* Delete the oldest segments once every message in them has been delivered. Caller holds logLock. */
+void logCollect(void) {
+    while(logSegCount > 1 && logSegs[0]->live == 0 && logSegs[0]->synced == logSegs[0]->used) {
+        struct LogSegment *seg = logSegs[0];
+        char path[512];
+        snprintf(path, sizeof(path), "%s/seg-%08u.log", logDir, seg->id);
+        munmap(seg->map, seg->size);
+        close(seg->fd);
+        unlink(path);
+        free(seg);
+        memmove(logSegs, logSegs + 1, --logSegCount * sizeof(*logSegs));
+    }
+}
+
+/* Group commit: flush everything appended since the last pass with one msync
+   per dirty segment, then send the "stored" notices that are now durable.
+   Appends keep going while a flush is in progress and are picked up by the
+   next pass, so the disk is hit once per batch rather than once per message.
+   Nothing is acknowledged until its msync succeeded; a failed batch is
+   retried whole after a nap. */
+void logFlusherNap(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    pthread_cond_timedwait(&logCond, &logLock, &ts);
+}
+
+void *logFlusher(void *arg) {
+    (void)arg;
+    threadSlot = MAX_REACTORS + 1;
+    long page = sysconf(_SC_PAGESIZE);
+    int retry = 0;                   /* the last batch failed: wait before trying again */
+    pthread_mutex_lock(&logLock);
+    while(1) {
+        if(logDurable == logSeq || retry) {
+            logFlusherNap();
+            retry = 0;
+            logCollect();
+            continue;
+        }
+        uint64_t target = logSeq;
+        /* only this thread deletes segments, so the pointers stay valid unlocked */
+        int n = 0;
+        struct LogSegment **dirty = malloc(logSegCount * sizeof(*dirty));
+        size_t *upTo = malloc(logSegCount * sizeof(*upTo));
+        if(!dirty || !upTo) {
+            free(dirty);
+            free(upTo);
+            retry = 1;
+            continue;
+        }
+        for(int i=0;i<logSegCount;i++) {
+            if(logSegs[i]->used > logSegs[i]->synced) {
+                dirty[n] = logSegs[i];
+                upTo[n++] = logSegs[i]->used;
+            }
+        }
+        pthread_mutex_unlock(&logLock);
+
+        int failed = 0;
+        for(int i=0;i<n;i++) {
+            size_t start = dirty[i]->synced & ~(size_t)(page - 1);
+            if(msync(dirty[i]->map + start, upTo[i] - start, MS_SYNC) < 0) {
+                evLog(EV_ERROR, "[LOG] msync of segment %u failed: %s\n", dirty[i]->id, strerror(errno));
+                failed = 1;
+            }
+        }
+
+        pthread_mutex_lock(&logLock);
+        if(failed) {
+            free(dirty);
+            free(upTo);
+            logSyncErrors++;
+            retry = 1;
+            continue;
+        }
+        for(int i=0;i<n;i++) dirty[i]->synced = upTo[i];
+        free(dirty);
+        free(upTo);
+        logSyncs++;
+        logSyncedRecords += target - logDurable;
+        logDurable = target;
+        int k = 0;
+        while(k < logAckCount && logAcks[k].seq <= target) k++;
+        if(k == 0) continue;
+        struct LogAck *acks = malloc(k * sizeof(*acks));
+        if(!acks) {
+            /* the notices stay queued for the next pass */
+            logFlusherNap();
+            continue;
+        }
+        memcpy(acks, logAcks, k * sizeof(*acks));
+        memmove(logAcks, logAcks + k, (logAckCount - k) * sizeof(*logAcks));
+        logAckCount -= k;
+        pthread_mutex_unlock(&logLock);
+
+        char text[MAX_MSG];
+        pthread_mutex_lock(&clientsLock);
+        for(int i=0;i<k;i++) {
+            struct Session *s = sessionGet(acks[i].to);
+            if(!s) continue;
+            snprintf(text, sizeof(text), "[SERVER] Stored message for %s %s (offline); it will be delivered when they connect.",
+                     acks[i].campus, acks[i].dept);
+            struct OutBuf *b = makeReply(s->framed, FRAME_NOTICE, text);
+            if(!b) continue;
+            sessionEnqueue(s, b, NULL);
+            outBufRelease(b);
+        }
+        pthread_mutex_unlock(&clientsLock);
+        free(acks);
+        pthread_mutex_lock(&logLock);
+    }
+    return NULL;
+}
+
+/* Traffic trace (-D file): every connection opened, every byte read from a
+   client connection and every UDP datagram, time-stamped, in the format
+   described in protocol.h, so replay can feed it to another server. Reactors
+   append records to an in-memory chunk under traceLock, taking the time under
+   the lock so records stay in order across reactors; full chunks go to a
+   writer thread, which also writes out the current one every TRACE_FLUSH_MS,
+   so a killed server loses no more than that. When TRACE_BACKLOG chunks are
+   waiting for the disk, records are dropped and counted instead of holding
+   up the reactors. A connection that loses a DATA or CLOSE record is cut: it
+   is not recorded any more, and once there is room again a TRACE_GAP record
+   names it and says how many records were dropped, so replay never sends a
+   byte stream with a hole in it. Connections the server dials to federation
+   peers are not recorded. traceLock is taken last, under any other lock. */
+#define TRACE_CHUNK (1 << 20)
+#define TRACE_BACKLOG 64          /* full chunks waiting for the writer */
+#define TRACE_FLUSH_MS 200
+#define TRACE_GAP_IDS 1024        /* cut connections named per TRACE_GAP record */
+
+struct TraceChunk {
+    struct TraceChunk *next;
+    size_t len;
+    char data[TRACE_CHUNK];
+};
+
+char *traceFile = NULL;
+int traceFd = -1;
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t traceCond = PTHREAD_COND_INITIALIZER;
+struct TraceChunk *traceCur = NULL;                                   /* records are appended here */
+struct TraceChunk *traceFull = NULL, **traceFullTail = &traceFull;   /* waiting for the writer, oldest first */
+int traceFullCount = 0;
+uint64_t traceLastNs = 0;        /* time of the last record, in whole microseconds since the first */
+uint32_t traceNextConn = 0;
+/* dropped since the last TRACE_GAP: how many records, and the connections they cut */
+uint32_t traceLost = 0;
+uint32_t *traceCuts = NULL;
+size_t traceCutCount = 0, traceCutCap = 0;
+
+/* Make room for need bytes in traceCur. Returns -1 when the backlog is full
+   or memory ran out. Caller holds traceLock. */
+int traceRoomLocked(size_t need) {
+    if(traceCur && traceCur->len + need > TRACE_CHUNK) {
+        if(traceFullCount >= TRACE_BACKLOG) return -1;
+        *traceFullTail = traceCur;
+        traceFullTail = &traceCur->next;
+        traceFullCount++;
+        traceCur = NULL;
+        pthread_cond_signal(&traceCond);
+    }
+    if(!traceCur) {
+        if(!(traceCur = malloc(sizeof(*traceCur)))) return -1;
+        traceCur->next = NULL;
+        traceCur->len = 0;
+    }
+    return 0;
+}
+
+/* Write one record into traceCur, which has room for it. Caller holds traceLock. */
+void tracePutLocked(int kind, uint32_t conn, const void *data, size_t len) {
+    /* the gap is rounded down and the remainder carried, so long traces do not drift */
+    uint64_t us = (nowNs() - traceLastNs) / 1000;
+    struct TraceRec r = { us > UINT32_MAX ? UINT32_MAX : (uint32_t)us, conn, (uint32_t)kind << 24 | (uint32_t)len };
+    traceLastNs += us * 1000;
+    memcpy(traceCur->data + traceCur->len, &r, sizeof(r));
+    if(len) memcpy(traceCur->data + traceCur->len + sizeof(r), data, len);
+    traceCur->len += sizeof(r) + len;
+    metricAdd(M_TRACE_BYTES, sizeof(r) + len);
+}
+
+/* Write out what was dropped since the trace last had room as TRACE_GAP
+   records. Returns -1 if there is still no room. Caller holds traceLock. */
+int traceGapLocked(void) {
+    uint32_t gap[1 + TRACE_GAP_IDS];
+    while(traceLost || traceCutCount) {
+        size_t n = traceCutCount < TRACE_GAP_IDS ? traceCutCount : TRACE_GAP_IDS;
+        size_t len = (1 + n) * sizeof(uint32_t);
+        if(traceRoomLocked(sizeof(struct TraceRec) + len) < 0) return -1;
+        gap[0] = traceLost;
+        memcpy(gap + 1, traceCuts + traceCutCount - n, n * sizeof(uint32_t));
+        tracePutLocked(TRACE_GAP, 0, gap, len);
+        traceLost = 0;
+        traceCutCount -= n;
+    }
+    return 0;
+}
+
+/* Append one record. Returns -1 if it was dropped; a dropped DATA or CLOSE
+   cuts the connection, and the caller stops recording it. Caller holds traceLock. */
+int traceAppendLocked(int kind, uint32_t conn, const void *data, size_t len) {
+    if(traceGapLocked() < 0 || traceRoomLocked(sizeof(struct TraceRec) + len) < 0) {
+        metricAdd(M_TRACE_DROPPED, 1);
+        if(traceLost < UINT32_MAX) traceLost++;
+        if(kind != TRACE_DATA && kind != TRACE_CLOSE) return -1;
+        if(traceCutCount == traceCutCap) {
+            size_t cap = traceCutCap ? traceCutCap * 2 : 256;
+            uint32_t *nc = realloc(traceCuts, cap * sizeof(*nc));
+            if(!nc) return -1;   /* replay will see the connection left open */
+            traceCuts = nc;
+            traceCutCap = cap;
+        }
+        traceCuts[traceCutCount++] = conn;
+        return -1;
+    }
+    tracePutLocked(kind, conn, data, len);
+    return 0;
+}
+
+int traceRecord(int kind, uint32_t conn, const void *data, size_t len) {
+    pthread_mutex_lock(&traceLock);
+    int rc = traceAppendLocked(kind, conn, data, len);
+    pthread_mutex_unlock(&traceLock);
+    return rc;
+}
+
+/* A new connection: its id in the trace, 0 if its OPEN was dropped and it is not recorded */
+uint32_t traceConnOpen(void) {
+    pthread_mutex_lock(&traceLock);
+    uint32_t id = ++traceNextConn;
+    if(traceAppendLocked(TRACE_OPEN, id, NULL, 0) < 0) id = 0;
+    pthread_mutex_unlock(&traceLock);
+    return id;
+}
+
+/* Write chunks out as they fill, and the current one when it has waited TRACE_FLUSH_MS */
+void *traceWriter(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&traceLock);
+    while(1) {
+        if(!traceFull) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+            if(ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&traceCond, &traceLock, &ts);
+            if(!traceFull && traceCur && traceCur->len > 0) {
+                traceFull = traceCur;
+                traceFullTail = &traceCur->next;
+                traceCur = NULL;
+            }
+            if(!traceFull) continue;
+        }
+        struct TraceChunk *list = traceFull;
+        traceFull = NULL;
+        traceFullTail = &traceFull;
+        traceFullCount = 0;
+        pthread_mutex_unlock(&traceLock);
+        while(list) {
+            struct TraceChunk *next = list->next;
+            for(size_t off = 0; off < list->len;) {
+                ssize_t n = write(traceFd, list->data + off, list->len - off);
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) {
+                    perror("[TRACE] write");
+                    break;
+                }
+                off += n;
+            }
+            free(list);
+            list = next;
+        }
+        pthread_mutex_lock(&traceLock);
+        /* there is room again: record what was lost without waiting for more traffic */
+        traceGapLocked();
+    }
+    return NULL;
+}
+
+/* Create the trace file (-D) and start its writer */
+int traceOpen(void) {
+    traceFd = open(traceFile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(traceFd < 0) return -1;
+    struct TraceHeader h = { TRACE_MAGIC, TRACE_VERSION, (int64_t)time(NULL) };
+    if(write(traceFd, &h, sizeof(h)) != sizeof(h)) return -1;
+    traceLastNs = nowNs();
+    pthread_t writer;
+    pthread_create(&writer, NULL, traceWriter, NULL);
+    pthread_detach(writer);
+    return 0;
+}
+
+/* Attachments (-T dir): chunked, resumable file transfer between departments.
+   The sender offers a file (FILE_OFFER) and uploads it in FILE_CHUNK frames;
+   each chunk is written to a spool file in dir straight from the connection's
+   receive buffer. The receiving department gets FILE_START and then the file
+   in FILE_CHUNK frames relayed from the spool with sendfile() (-Z copy reads
+   them into pooled buffers instead, to compare). Relay chunks take the bulk
+   lane and are only queued while the receiver's queue is below the low
+   watermark; flushSession tops them up as it drains, like the stored-message
+   stream, so an attachment never holds a message back by more than that.
+   Both legs resume: FILE_ACK tells a returning sender how much is spooled,
+   and a relay restarts from the last offset the receiver confirmed with
+   FILE_RECEIVED. Transfers live in memory, so spool files left by an earlier
+   run are removed at startup, and they are not relayed between federated
+   nodes. Protected by xferLock; the lock order is clientsLock, logLock,
+   xferLock, outLock. */
+#define XFER_NAME 128
+#define XFER_EXPIRE_SECS 3600    /* a transfer with no progress for this long is dropped */
+
+struct Xfer {
+    struct Xfer *next;
+    uint64_t id;                 /* random, names the transfer on the wire */
+    int refs;                    /* the table's, plus one per relay chunk queued */
+    int fd;                      /* spool file */
+    char name[XFER_NAME];
+    char fromCampus[MAX_NAME], fromDept[MAX_NAME];
+    int toCampus, toDept;        /* interned name ids */
+    uint64_t size;
+    uint64_t spooled;            /* bytes on disk, always a prefix of the file */
+    uint64_t acked;              /* bytes the receiver has confirmed */
+    uint64_t queued;             /* bytes queued to the session relaying it */
+    SessionHandle to;            /* that session, NO_SESSION until the department logs in */
+    time_t touched;              /* last progress, for expiry */
+};
+
+int xferCopy = 0;                /* -Z copy: relay through pooled buffers instead of sendfile() */
+pthread_mutex_t xferLock = PTHREAD_MUTEX_INITIALIZER;
+struct Xfer *xfers = NULL;
+unsigned long xferDone = 0, xferExpired = 0;
+
+void xferPath(char *out, size_t cap, uint64_t id) {
+    snprintf(out, cap, "%s/%016llx.part", spoolDir, (unsigned long long)id);
+}
+
+/* The last close of a deleted spool frees the file's pages, which takes a
+   while for a big one: it is done on a thread of its own, not a reactor */
+void *xferCloser(void *arg) {
+    close((int)(intptr_t)arg);
+    return NULL;
+}
+
+void xferRelease(struct Xfer *x) {
+    if(__atomic_sub_fetch(&x->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_t t;
+        if(pthread_create(&t, NULL, xferCloser, (void*)(intptr_t)x->fd) == 0) pthread_detach(t);
+        else close(x->fd);
+        free(x);
+    }
+}
+
+/* Find a transfer by its id field. Caller holds xferLock. */
+struct Xfer *xferFind(struct FrameField idField) {
+    char hex[24], *end;
+    frameFieldCopy(hex, sizeof(hex), idField);
+    uint64_t id = strtoull(hex, &end, 16);
+    if(!hex[0] || *end) return NULL;
+    for(struct Xfer *x = xfers; x; x = x->next)
+        if(x->id == id) return x;
+    return NULL;
+}
+
+/* Take a transfer out of the table and delete its spool file; chunks still
+   queued keep the file open until they are sent. Caller holds xferLock. */
+void xferRemove(struct Xfer *x) {
+    struct Xfer **pp = &xfers;
+    while(*pp != x) pp = &(*pp)->next;
+    *pp = x->next;
+    char path[512];
+    xferPath(path, sizeof(path), x->id);
+    unlink(path);
+    xferRelease(x);
+}
+
+/* Queue a FILE_ACK or FILE_START style reply of string fields, in the urgent lane */
+void xferReply(struct Session *s, uint8_t type, const struct FrameField *f, int n) {
+    size_t len = frameSize(f, n);
+    struct OutBuf *b = outBufNew(len);
+    if(!b) return;
+    frameEncode(b->data, len, type, f, n);
+    b->lane = LANE_URGENT;
+    sessionEnqueue(s, b, NULL);
+    outBufRelease(b);
+}
+
+/* FILE_ACK: transfer id and the bytes spooled so far */
+void xferAck(struct Conn *c, uint64_t id, uint64_t spooled) {
+    char idStr[24], n[24];
+    snprintf(idStr, sizeof(idStr), "%016llx", (unsigned long long)id);
+    snprintf(n, sizeof(n), "%llu", (unsigned long long)spooled);
+    struct FrameField f[2] = { frameStr(idStr), frameStr(n) };
+    xferReply(connSession(c), FRAME_FILE_ACK, f, 2);
+}
+
+/* Header of a FILE_CHUNK frame carrying len bytes from off. The payload is
+   not part of it: the frame and its last field are stretched over the bytes
+   that follow on the wire. */
+size_t xferChunkHeader(char *out, size_t cap, const struct Xfer *x, uint64_t off, size_t len) {
+    char idStr[24], offStr[24];
+    snprintf(idStr, sizeof(idStr), "%016llx", (unsigned long long)x->id);
+    snprintf(offStr, sizeof(offStr), "%llu", (unsigned long long)off);
+    struct FrameField f[3] = { frameStr(idStr), frameStr(offStr), { "", 0 } };
+    size_t n = frameEncode(out, cap, FRAME_FILE_CHUNK, f, 3);
+    uint32_t blen = htonl((uint32_t)(n - FRAME_HDR + len));
+    uint16_t flen = htons((uint16_t)len);
+    memcpy(out, &blen, 4);
+    memcpy(out + n - 2, &flen, 2);
+    return n;
+}
+
+/* One relay chunk: a file buffer that flushFileLocked() sends from the
+   spool, or with -Z copy the payload read into the buffer. Caller holds xferLock. */
+struct OutBuf *xferChunk(struct Xfer *x, uint64_t off, size_t len) {
+    struct OutBuf *b;
+    if(xferCopy) {
+        char hdr[64];
+        size_t hdrLen = xferChunkHeader(hdr, sizeof(hdr), x, off, len);
+        if(!(b = outBufNew(hdrLen + len))) return NULL;
+        memcpy(b->data, hdr, hdrLen);
+        if(pread(x->fd, b->data + hdrLen, len, off) != (ssize_t)len) {
+            outBufRelease(b);
+            return NULL;
+        }
+        copyCount(len);
+        return b;
+    }
+    if(!(b = outBufNew(sizeof(struct OutFile)))) return NULL;
+    struct OutFile *f = (struct OutFile*)b->data;
+    __atomic_add_fetch(&x->refs, 1, __ATOMIC_RELAXED);
+    f->x = x;
+    f->fd = x->fd;
+    f->off = off;
+    f->hdrLen = xferChunkHeader(f->hdr, sizeof(f->hdr), x, off, len);
+    b->file = 1;
+    b->len = f->hdrLen + len;
+    return b;
+}
+
+/* Queue attachment chunks for a connected session of the receiving
+   department while its queue is below the low watermark; flushSession calls
+   back in as it drains. The first session of the department to get here
+   takes a relay over, starting with FILE_START, from what the receiver has
+   confirmed. Safe from the session's reactor, or from anywhere with clientsLock held. */
+void xferStream(struct Session *s) {
+    if(!s->framed || __atomic_load_n(&s->parked, __ATOMIC_ACQUIRE)) return;
+    SessionHandle h = makeHandle(s - sessions);
+    int backlog = 0;
+    pthread_mutex_lock(&xferLock);
+    for(struct Xfer *x = xfers; x; x = x->next) {
+        if(x->toCampus != s->campusId || x->toDept != s->deptId) continue;
+        if(x->to != h) {
+            /* another live session of the department is relaying it */
+            if(x->to != NO_SESSION &&
+               __atomic_load_n(&sessions[(uint32_t)x->to].gen, __ATOMIC_ACQUIRE) == (uint32_t)(x->to >> 32)) continue;
+            x->to = h;
+            x->queued = x->acked;
+            char idStr[24], size[24];
+            snprintf(idStr, sizeof(idStr), "%016llx", (unsigned long long)x->id);
+            snprintf(size, sizeof(size), "%llu", (unsigned long long)x->size);
+            struct FrameField f[5] = { frameStr(idStr), frameStr(x->fromCampus), frameStr(x->fromDept),
+                                       frameStr(x->name), frameStr(size) };
+            xferReply(s, FRAME_FILE_START, f, 5);
+            evLog(EV_DEBUG, "[FILE] Relaying %s to %s %s from byte %llu.\n", x->name, s->campus, s->dept,
+                            (unsigned long long)x->queued);
+        }
+        while(x->queued < x->spooled) {
+            size_t len = x->spooled - x->queued < XFER_RELAY_CHUNK ? x->spooled - x->queued : XFER_RELAY_CHUNK;
+            pthread_mutex_lock(&s->outLock);
+            size_t queued = s->outBytes;
+            pthread_mutex_unlock(&s->outLock);
+            if(queued > 0 && queued + len > lowWatermark) {
+                backlog = 1;
+                break;
+            }
+            struct OutBuf *b = xferChunk(x, x->queued, len);
+            int rc = b ? sessionEnqueue(s, b, NULL) : -1;
+            if(b) outBufRelease(b);
+            if(rc < 0) {
+                backlog = 1;
+                break;
+            }
+            x->queued += len;
+            metricAdd(M_FILE_RELAYED, len);
+        }
+    }
+    __atomic_store_n(&s->xferBacklog, backlog, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&xferLock);
+}
+
+/* A session's connection went away: its relays start over, from what the
+   receiver confirmed, on another connected session of the department if
+   there is one, or on the next to log in. Caller holds clientsLock. */
+void xferDetach(struct Session *s) {
+    SessionHandle h = makeHandle(s - sessions);
+    int moved = 0;
+    pthread_mutex_lock(&xferLock);
+    for(struct Xfer *x = xfers; x; x = x->next) {
+        if(x->to != h) continue;
+        x->to = NO_SESSION;
+        moved = 1;
+    }
+    pthread_mutex_unlock(&xferLock);
+    for(int i = names[s->campusId].campusHead; moved && i >= 0; i = sessions[i].campusNext) {
+        if(&sessions[i] == s || sessions[i].deptId != s->deptId || sessions[i].parked) continue;
+        xferStream(&sessions[i]);
+        break;
+    }
+}
+
+/* FILE_OFFER: targetCampus, targetDept, name, size[, id]. Starts a transfer,
+   or finds the one a returning sender names, and answers with FILE_ACK. */
+void xferOffer(struct Conn *c, const struct Frame *fr) {
+    char tgtCampus[MAX_NAME], tgtDept[MAX_NAME], name[XFER_NAME], sizeStr[24], reply[MAX_MSG];
+    frameFieldCopy(tgtCampus, sizeof(tgtCampus), fr->f[0]);
+    frameFieldCopy(tgtDept, sizeof(tgtDept), fr->f[1]);
+    frameFieldCopy(name, sizeof(name), fr->f[2]);
+    frameFieldCopy(sizeStr, sizeof(sizeStr), fr->f[3]);
+    uint64_t size = strtoull(sizeStr, NULL, 10);
+    /* only the last path component travels, so the receiver cannot be made to write elsewhere */
+    const char *base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+    if(size == 0 || !base[0] || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        queueReply(c, FRAME_NOTICE, "[SERVER] Error: bad file offer");
+        return;
+    }
+    pthread_mutex_lock(&clientsLock);
+    int known = isCampus(tgtCampus);
+    int remote = known && findClientByCampusAndDept(tgtCampus, tgtDept) == -1 && remoteFind(tgtCampus, tgtDept) != -1;
+    int cid = known ? internName(tgtCampus) : -1, did = known ? internName(tgtDept) : -1;
+    pthread_mutex_unlock(&clientsLock);
+    if(cid < 0 || did < 0 || remote) {
+        snprintf(reply, sizeof(reply), remote ? "[SERVER] %s %s is on another server; attachments are not relayed between servers."
+                                              : "[SERVER] Target campus %s not known.", tgtCampus, tgtDept);
+        queueReply(c, FRAME_NOTICE, reply);
+        return;
+    }
+
+    pthread_mutex_lock(&xferLock);
+    struct Xfer *x = fr->nfields == 5 ? xferFind(fr->f[4]) : NULL;
+    if(x && (strcmp(x->fromCampus, c->campus) != 0 || strcmp(x->fromDept, c->dept) != 0 ||
+             x->size != size || x->toCampus != cid || x->toDept != did)) x = NULL;
+    if(!x) {
+        char path[512];
+        x = calloc(1, sizeof(*x));
+        if(x) x->fd = -1;
+        if(x && getrandom(&x->id, sizeof(x->id), 0) == sizeof(x->id)) {
+            xferPath(path, sizeof(path), x->id);
+            x->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        }
+        if(!x || x->fd < 0) {
+            pthread_mutex_unlock(&xferLock);
+            free(x);
+            queueReply(c, FRAME_NOTICE, "[SERVER] Error: cannot spool the file now");
+            return;
+        }
+        x->refs = 1;
+        snprintf(x->name, sizeof(x->name), "%s", base);
+        strcpy(x->fromCampus, c->campus);
+        strcpy(x->fromDept, c->dept);
+        x->toCampus = cid;
+        x->toDept = did;
+        x->size = size;
+        x->to = NO_SESSION;
+        x->next = xfers;
+        xfers = x;
+        evLog(EV_INFO, "[FILE] %s %s is sending %s (%llu bytes) to %s %s.\n", c->campus, c->dept, x->name,
+                       (unsigned long long)size, tgtCampus, tgtDept);
+    }
+    x->touched = time(NULL);
+    uint64_t id = x->id, spooled = x->spooled;
+    pthread_mutex_unlock(&xferLock);
+    xferAck(c, id, spooled);
+}
+
+/* FILE_CHUNK from the sender: id, offset, bytes. Written to the spool from
+   the receive buffer; anything but the next bytes in order is answered with
+   a FILE_ACK saying where the spool is, unless it is a resend of bytes we have. */
+void xferUpload(struct Conn *c, const struct Frame *fr) {
+    char offStr[24];
+    frameFieldCopy(offStr, sizeof(offStr), fr->f[1]);
+    uint64_t off = strtoull(offStr, NULL, 10);
+    size_t len = fr->f[2].len;
+    pthread_mutex_lock(&xferLock);
+    struct Xfer *x = xferFind(fr->f[0]);
+    if(!x || strcmp(x->fromCampus, c->campus) != 0 || strcmp(x->fromDept, c->dept) != 0) {
+        pthread_mutex_unlock(&xferLock);
+        queueReply(c, FRAME_NOTICE, "[SERVER] Error: no such file transfer, offer the file again");
+        return;
+    }
+    uint64_t id = x->id, spooled = x->spooled;
+    if(off != x->spooled || len == 0 || off + len > x->size) {
+        pthread_mutex_unlock(&xferLock);
+        if(off + len > spooled) xferAck(c, id, spooled);
+        return;
+    }
+    /* only this connection's reactor appends to the spool, so it is written without the lock */
+    __atomic_add_fetch(&x->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&xferLock);
+    ssize_t w = pwrite(x->fd, fr->f[2].ptr, len, off);
+    pthread_mutex_lock(&xferLock);
+    int ok = w == (ssize_t)len && x->spooled == off;
+    if(ok) {
+        x->spooled += len;
+        x->touched = time(NULL);
+    }
+    int complete = x->spooled == x->size;
+    SessionHandle to = x->to;
+    pthread_mutex_unlock(&xferLock);
+    if(!ok) {
+        evLog(EV_ERROR, "[FILE] Cannot write the spool of %s: %s\n", x->name, w < 0 ? strerror(errno) : "short write");
+        queueReply(c, FRAME_NOTICE, "[SERVER] Error: cannot spool the file now");
+        xferRelease(x);
+        return;
+    }
+    metricAdd(M_FILE_SPOOLED, len);
+    if(complete) {
+        xferAck(c, id, off + len);
+        evLog(EV_INFO, "[FILE] %s from %s %s is spooled (%llu bytes).\n", x->name, c->campus, c->dept,
+                       (unsigned long long)x->size);
+    }
+    /* hand the new bytes to the relay, unless it is waiting for room anyway */
+    pthread_mutex_lock(&clientsLock);
+    struct Session *s = sessionGet(to);
+    if(!s) {
+        int i = findClientByIds(x->toCampus, x->toDept);
+        s = i >= 0 ? &sessions[i] : NULL;
+    }
+    if(s && !__atomic_load_n(&s->xferBacklog, __ATOMIC_ACQUIRE)) xferStream(s);
+    pthread_mutex_unlock(&clientsLock);
+    xferRelease(x);
+}
+
+/* FILE_RECEIVED from the receiver: id and the bytes it has. Once it has all
+   of them the transfer is done: the spool is deleted and the sender told. */
+void xferReceived(struct Conn *c, const struct Frame *fr) {
+    char nStr[24], name[XFER_NAME], fromCampus[MAX_NAME], fromDept[MAX_NAME], reply[MAX_MSG];
+    frameFieldCopy(nStr, sizeof(nStr), fr->f[1]);
+    uint64_t have = strtoull(nStr, NULL, 10);
+    struct Session *s = connSession(c);
+    pthread_mutex_lock(&xferLock);
+    struct Xfer *x = xferFind(fr->f[0]);
+    if(!x || x->toCampus != s->campusId || x->toDept != s->deptId) {
+        pthread_mutex_unlock(&xferLock);
+        return;
+    }
+    if(have > x->spooled) have = x->spooled;
+    if(have > x->acked) {
+        x->acked = have;
+        x->touched = time(NULL);
+    }
+    /* a receiver that already had part of the file from an earlier connection skips it */
+    if(x->to == c->session && x->queued < x->acked) x->queued = x->acked;
+    int done = x->acked == x->size;
+    if(done) {
+        strcpy(name, x->name);
+        strcpy(fromCampus, x->fromCampus);
+        strcpy(fromDept, x->fromDept);
+        xferRemove(x);
+        xferDone++;
+    }
+    pthread_mutex_unlock(&xferLock);
+    if(!done) return;
+    evLog(EV_INFO, "[FILE] %s from %s %s delivered to %s %s.\n", name, fromCampus, fromDept, c->campus, c->dept);
+    snprintf(reply, sizeof(reply), "[SERVER] File %s delivered to %s %s.", name, c->campus, c->dept);
+    pthread_mutex_lock(&clientsLock);
+    int i = findClientByCampusAndDept(fromCampus, fromDept);
+    struct OutBuf *b = i != -1 ? makeReply(sessions[i].framed, FRAME_NOTICE, reply) : NULL;
+    if(b) {
+        sessionEnqueue(&sessions[i], b, NULL);
+        outBufRelease(b);
+    }
+    pthread_mutex_unlock(&clientsLock);
+}
+
+/* Drop transfers that have not moved for XFER_EXPIRE_SECS, once a second. Caller holds clientsLock. */
+void xferExpire(void) {
+    static time_t lastRun = 0;
+    time_t now = time(NULL);
+    if(now == lastRun) return;
+    lastRun = now;
+    pthread_mutex_lock(&xferLock);
+    struct Xfer *x = xfers;
+    while(x) {
+        struct Xfer *next = x->next;
+        if(x->touched + XFER_EXPIRE_SECS < now) {
+            evLog(EV_WARN, "[FILE] Transfer of %s from %s %s expired at %llu of %llu bytes.\n", x->name,
+                           x->fromCampus, x->fromDept, (unsigned long long)x->acked, (unsigned long long)x->size);
+            xferRemove(x);
+            xferExpired++;
+        }
+        x = next;
+    }
+    pthread_mutex_unlock(&xferLock);
+}
+
+/* Create the spool directory and clear what an earlier run left in it. Runs before any thread starts. */
+int xferOpen(void) {
+    if(mkdir(spoolDir, 0700) < 0 && errno != EEXIST) return -1;
+    DIR *d = opendir(spoolDir);
+    if(!d) return -1;
+    struct dirent *de;
+    int stale = 0;
+    while((de = readdir(d))) {
+        size_t n = strlen(de->d_name);
+        if(n < 5 || strcmp(de->d_name + n - 5, ".part") != 0) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", spoolDir, de->d_name);
+        if(unlink(path) == 0) stale++;
+    }
+    closedir(d);
+    evLog(EV_INFO, "[FILE] Spooling attachments in %s (relay by %s)%s.\n", spoolDir, xferCopy ? "copy" : "sendfile",
+                   stale ? ", removed the spool of an earlier run" : "");
+    return 0;
+}
+
+void armHeartbeat(struct Session *s) {
+    timerArm(&s->hbTimer, wheelNow + (uint64_t)heartbeatSecs * 1000 / TICK_MS);
+}
+
+/* Tell every framed client that a session's liveness changed: subscribers
+   with the next presence delta, the others at once. One encoded frame is
+   shared by all the queues. Caller holds clientsLock. */
+void publishPresence(struct Session *s, int state) {
+    presenceDirty = 1;
+    presenceNote(s, PRES_STATE);
+    evLog(EV_INFO, "[PRESENCE] %s %s is now %s.\n", s->campus, s->dept, liveNames[state]);
+    struct FrameField f[3] = { frameStr(s->campus), frameStr(s->dept), frameStr(liveNames[state]) };
+    size_t len = frameSize(f, 3);
+    struct OutBuf *b = outBufNew(len);
+    if(!b) return;
+    frameEncode(b->data, len, FRAME_PRESENCE, f, 3);
+    b->lane = LANE_URGENT;
+    for(int i = allHead; i >= 0; i = sessions[i].allNext) {
+        if(&sessions[i] != s && sessions[i].framed && !sessions[i].presenceSub) sessionEnqueue(&sessions[i], b, NULL);
+    }
+    outBufRelease(b);
+}
+
+/* A session's heartbeat deadline passed. Caller holds clientsLock. */
+void heartbeatExpired(struct Session *s) {
+    if(s->parked) {
+        /* for a parked session the timer is the resume deadline */
+        evLog(EV_INFO, "[SERVER] %s %s did not resume within %d s, session closed.\n", s->campus, s->dept, resumeGraceSecs);
+        s->liveness = LIVE_OFFLINE;
+        publishPresence(s, LIVE_OFFLINE);
+        removeSession(s - sessions);
+        return;
+    }
+    s->missed++;
+    if(offlineAfter > 0 && s->missed >= offlineAfter) {
+        s->liveness = LIVE_OFFLINE;
+        publishPresence(s, LIVE_OFFLINE);
+        evLog(EV_WARN, "[SERVER] Evicting %s %s: no heartbeat for %d intervals.\n", s->campus, s->dept, s->missed);
+        /* the owning reactor sees the shutdown and removes the session */
+        shutdown(s->fd, SHUT_RDWR);
+        return;
+    }
+    if(s->missed >= suspectAfter && s->liveness == LIVE_ONLINE) {
+        s->liveness = LIVE_SUSPECT;
+        publishPresence(s, LIVE_SUSPECT);
+    }
+    armHeartbeat(s);
+}
+
+/* Advance the wheel one tick and expire what is due. Caller holds clientsLock. */
+void wheelTick(void) {
+    wheelNow++;
+    if((wheelNow & (WHEEL0_SLOTS - 1)) == 0) {
+        /* cascade the level 1 slot covering the next 256 ticks */
+        struct Timer *head = &wheel1[(wheelNow >> WHEEL0_BITS) & (WHEEL1_SLOTS - 1)];
+        struct Timer moved = { head->next, head->prev, 0 };
+        if(moved.next == head) moved.next = moved.prev = NULL;
+        head->next = head->prev = head;
+        struct Timer *t = moved.next;
+        while(t) {
+            struct Timer *next = t == moved.prev ? NULL : t->next;
+            t->next = t->prev = NULL;
+            timerArm(t, t->expires);
+            t = next;
+        }
+    }
+    struct Timer *head = &wheel0[wheelNow & (WHEEL0_SLOTS - 1)];
+    while(head->next != head) {
+        struct Timer *t = head->next;
+        timerCancel(t);
+        struct Session *s = (struct Session*)((char*)t - offsetof(struct Session, hbTimer));
+        heartbeatExpired(s);
+    }
+}
+
+/* Presence snapshots. Readers (LIST_REQUEST on any reactor, the admin 'list')
+   never take clientsLock: they pick up the current snapshot through a hazard
+   pointer and use it as is. A snapshot is immutable once published and carries
+   the LIST reply already encoded for framed and legacy clients, so answering a
+   LIST is one enqueue. Reactor 0 builds a new snapshot at most once per tick
+   when sessions come or go or change liveness, and at most once a second when
+   only last-seen times moved; the replaced snapshot is freed once no reader's
+   hazard pointer names it. */
+struct PresenceEntry {
+    SessionHandle handle;
+    char campus[MAX_NAME];
+    char dept[MAX_NAME];
+    int fd;
+    int udpKnown;
+    time_t lastSeen;
+    int liveness;
+};
+
+struct PresenceSnap {
+    time_t built;
+    int count;
+    struct OutBuf *framedList;    /* encoded LIST replies */
+    struct OutBuf *legacyList;
+    struct PresenceSnap *retiredNext;
+    struct PresenceEntry entries[];
+};
+
+struct PresenceSnap *presenceSnap = NULL;        /* current snapshot */
+struct PresenceSnap *hazards[MAX_THREAD_SLOTS];  /* one per thread, indexed by threadSlot */
+struct PresenceSnap *retiredSnaps = NULL;        /* replaced, maybe still read; touched by reactor 0 only */
+
+/* Take the current snapshot; it stays valid until presenceRelease() */
+struct PresenceSnap *presenceAcquire(void) {
+    struct PresenceSnap *p;
+    do {
+        p = __atomic_load_n(&presenceSnap, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&hazards[threadSlot], p, __ATOMIC_SEQ_CST);
+    } while(p != __atomic_load_n(&presenceSnap, __ATOMIC_SEQ_CST));
+    return p;
+}
+
+void presenceRelease(void) {
+    __atomic_store_n(&hazards[threadSlot], NULL, __ATOMIC_RELEASE);
+}
+
+void presenceFree(struct PresenceSnap *p) {
+    if(p->framedList) outBufRelease(p->framedList);
+    if(p->legacyList) outBufRelease(p->legacyList);
+    free(p);
+}
+
+/* Build a snapshot of every session and its LIST text. Caller holds clientsLock. */
+struct PresenceSnap *presenceBuild(void) {
+    struct PresenceSnap *p = malloc(sizeof(*p) + (size_t)clientCount * sizeof(struct PresenceEntry));
+    if(!p) return NULL;
+    p->built = time(NULL);
+    p->count = 0;
+    p->retiredNext = NULL;
+
+    /* the framed reply is capped at one frame, no point formatting more than that */
+    size_t cap = 128 + (size_t)clientCount * 100, len = 0;
+    if(cap > FRAME_MAX + 128) cap = FRAME_MAX + 128;
+    char *listMsg = malloc(cap);
+    if(!listMsg) { free(p); return NULL; }
+    len += snprintf(listMsg + len, cap - len, "[SERVER] Connected Campuses:\n");
+    if(clientCount == 0)
+        len += snprintf(listMsg + len, cap - len, "  No campuses connected.\n");
+
+    for(int i = allHead; i >= 0; i = sessions[i].allNext) {
+        struct Session *s = &sessions[i];
+        struct PresenceEntry *e = &p->entries[p->count++];
+        e->handle = makeHandle(i);
+        strcpy(e->campus, s->campus);
+        strcpy(e->dept, s->dept);
+        e->fd = s->fd;
+        e->udpKnown = s->udpKnown;
+        e->lastSeen = s->lastSeen;
+        e->liveness = s->liveness;
+        if(len + 128 >= cap) continue;
+        char tsbuf[64] = "never";
+        if(s->udpKnown) {
+            struct tm tm;
+            localtime_r(&s->lastSeen, &tm);
+            strftime(tsbuf, sizeof(tsbuf), "%H:%M:%S", &tm);
+        }
+        len += snprintf(listMsg + len, cap - len, "  %d. %s - %s (Last seen: %s)\n", 
+                p->count, s->campus, s->dept, tsbuf);
+    }
+    snprintf(listMsg + len, cap - len, "----------------------------\n");
+
+    p->framedList = makeReply(1, FRAME_LIST, listMsg);
+    p->legacyList = makeReply(0, FRAME_LIST, listMsg);
+    free(listMsg);
+    if(!p->framedList || !p->legacyList) {
+        presenceFree(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* Publish a new snapshot if presence changed. Runs on reactor 0 with clientsLock held. */
+void presenceMaybePublish(void) {
+    struct PresenceSnap *cur = presenceSnap;
+    if(!presenceDirty && !(presenceStale && (!cur || time(NULL) > cur->built))) return;
+    struct PresenceSnap *p = presenceBuild();
+    if(!p) return;
+    presenceDirty = presenceStale = 0;
+    struct PresenceSnap *old = __atomic_exchange_n(&presenceSnap, p, __ATOMIC_SEQ_CST);
+    if(old) {
+        old->retiredNext = retiredSnaps;
+        retiredSnaps = old;
+    }
+    /* free every retired snapshot no reader still points at */
+    struct PresenceSnap **pp = &retiredSnaps;
+    while(*pp) {
+        struct PresenceSnap *r = *pp;
+        int inUse = 0;
+        for(int i=0;i<MAX_THREAD_SLOTS;i++)
+            if(__atomic_load_n(&hazards[i], __ATOMIC_SEQ_CST) == r) inUse = 1;
+        if(inUse) {
+            pp = &r->retiredNext;
+        } else {
+            *pp = r->retiredNext;
+            presenceFree(r);
+        }
+    }
+}
+
+/* Presence subscriptions. Instead of polling LIST, a client sends
+   PRESENCE_SUB once. At the next tick it gets a snapshot of every session,
+   and from then on at most one PRESENCE_DELTA per tick with the joins, leaves
+   and liveness changes since the last one, coalesced per session, so one that
+   came and went within the tick is not mentioned at all. The same encoded
+   frames go to every subscriber. Deltas are numbered one after the other from
+   the snapshot's version; a client that sees a gap (a frame dropped for
+   backpressure, a resumed session) subscribes again. Changes are only
+   recorded while someone is subscribed. Everything here runs under
+   clientsLock, the flush on reactor 0 right after the tick. */
+#define PRESENCE_PART 60000      /* entry text per SNAP or DELTA frame */
+
+struct PresenceChange {
+    SessionHandle h;
+    uint32_t seq;                /* keeps a session's changes in order when sorted */
+    uint8_t op;                  /* PRES_* */
+};
+
+struct PresenceChange *presenceChanges = NULL;
+int presenceChangeCount = 0, presenceChangeCap = 0;
+SessionHandle *presenceSubs = NULL;      /* subscribed sessions; stale handles are dropped by the flush */
+int presenceSubCount = 0, presenceSubCap = 0;
+int presenceWaiting = 0;                 /* subscribers still waiting for their snapshot */
+int presenceResync = 0;                  /* a change could not be recorded: send everyone a snapshot */
+uint64_t presenceVersion = 0;            /* version of the last delta */
+
+/* Record that a session joined, left or changed liveness. Caller holds clientsLock. */
+void presenceNote(struct Session *s, int op) {
+    if(presenceSubCount == 0) return;
+    if(presenceChangeCount == presenceChangeCap) {
+        int cap = presenceChangeCap ? presenceChangeCap * 2 : 64;
+        struct PresenceChange *nc = realloc(presenceChanges, cap * sizeof(*nc));
+        if(!nc) {
+            presenceResync = 1;
+            return;
+        }
+        presenceChanges = nc;
+        presenceChangeCap = cap;
+    }
+    struct PresenceChange *pc = &presenceChanges[presenceChangeCount];
+    pc->h = makeHandle(s - sessions);
+    pc->seq = presenceChangeCount++;
+    pc->op = op;
+}
+
+int cmpPresenceChange(const void *a, const void *b) {
+    const struct PresenceChange *x = a, *y = b;
+    if(x->h != y->h) return x->h < y->h ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Frames of entry text being built: lines are added until a frame is full,
+   then it is encoded and the next one started */
+struct PresenceParts {
+    uint8_t type;                /* FRAME_PRESENCE_SNAP or FRAME_PRESENCE_DELTA */
+    char text[PRESENCE_PART];
+    size_t len;
+    struct OutBuf **frames;
+    int count, cap;
+    int failed;
+};
+
+/* Encode the text so far as one frame. A snapshot's parts share its version
+   and all but the last say "more"; every delta frame takes the next version
+   and so stands alone, with no "more". */
+void presencePartEnd(struct PresenceParts *pp, int more) {
+    if(pp->failed) return;
+    if(pp->count == pp->cap) {
+        int cap = pp->cap ? pp->cap * 2 : 4;
+        struct OutBuf **nf = realloc(pp->frames, cap * sizeof(*nf));
+        if(!nf) {
+            pp->failed = 1;
+            return;
+        }
+        pp->frames = nf;
+        pp->cap = cap;
+    }
+    char ver[24];
+    snprintf(ver, sizeof(ver), "%llu", (unsigned long long)(pp->type == FRAME_PRESENCE_DELTA ? ++presenceVersion
+                                                                                            : presenceVersion));
+    struct FrameField f[3] = { frameStr(ver), { pp->text, (uint16_t)pp->len }, frameStr("more") };
+    if(pp->type == FRAME_PRESENCE_DELTA) more = 0;
+    size_t len = frameSize(f, more ? 3 : 2);
+    struct OutBuf *b = outBufNew(len);
+    if(!b) {
+        pp->failed = 1;
+        return;
+    }
+    frameEncode(b->data, len, pp->type, f, more ? 3 : 2);
+    b->lane = LANE_URGENT;
+    pp->frames[pp->count++] = b;
+    pp->len = 0;
+}
+
+void presencePut(struct PresenceParts *pp, const char *line, int n) {
+    if(pp->len + n > PRESENCE_PART) presencePartEnd(pp, 1);
+    memcpy(pp->text + pp->len, line, n);
+    pp->len += n;
+}
+
+void presencePartsFree(struct PresenceParts *pp) {
+    for(int i=0;i<pp->count;i++) outBufRelease(pp->frames[i]);
+    free(pp->frames);
+    pp->frames = NULL;
+    pp->count = pp->cap = 0;
+    pp->len = 0;
+    pp->failed = 0;
+}
+
+/* Turn the recorded changes into delta frames: per session only the net
+   effect, "+" for one that is here now but was not, "-" for one that was and
+   is gone, "=" with its current liveness otherwise */
+void presenceDeltaBuild(struct PresenceParts *pp) {
+    qsort(presenceChanges, presenceChangeCount, sizeof(*presenceChanges), cmpPresenceChange);
+    char line[2 * MAX_NAME + 48];
+    for(int i=0;i<presenceChangeCount;) {
+        int j = i;
+        while(j + 1 < presenceChangeCount && presenceChanges[j + 1].h == presenceChanges[i].h) j++;
+        SessionHandle h = presenceChanges[i].h;
+        int before = presenceChanges[i].op != PRES_JOIN, after = presenceChanges[j].op != PRES_LEAVE;
+        struct Session *s = sessionGet(h);
+        int n = 0;
+        if(after && s && !before)
+            n = snprintf(line, sizeof(line), "+%llx|%d|%s|%s\n", (unsigned long long)h, s->liveness, s->campus, s->dept);
+        else if(after && s)
+            n = snprintf(line, sizeof(line), "=%llx|%d\n", (unsigned long long)h, s->liveness);
+        else if(before && !after)
+            n = snprintf(line, sizeof(line), "-%llx\n", (unsigned long long)h);
+        if(n > 0) presencePut(pp, line, n);
+        i = j + 1;
+    }
+    if(pp->len > 0) presencePartEnd(pp, 0);
+    presenceChangeCount = 0;
+}
+
+/* Every session as it is now, at the current version */
+void presenceSnapBuild(struct PresenceParts *pp) {
+    char line[2 * MAX_NAME + 48];
+    for(int i = allHead; i >= 0; i = sessions[i].allNext) {
+        struct Session *s = &sessions[i];
+        int n = snprintf(line, sizeof(line), "%llx|%d|%s|%s\n", (unsigned long long)makeHandle(i), s->liveness,
+                         s->campus, s->dept);
+        presencePut(pp, line, n);
+    }
+    presencePartEnd(pp, 0);
+}
+
+/* PRESENCE_SUB: answered at the next tick with a snapshot. Caller holds clientsLock. */
+void presenceSubscribe(struct Session *s) {
+    if(s->presenceSub == PSUB_WAIT) return;
+    if(s->presenceSub == PSUB_NONE) {
+        if(presenceSubCount == presenceSubCap) {
+            int cap = presenceSubCap ? presenceSubCap * 2 : 64;
+            SessionHandle *ns = realloc(presenceSubs, cap * sizeof(*ns));
+            if(!ns) return;
+            presenceSubs = ns;
+            presenceSubCap = cap;
+        }
+        presenceSubs[presenceSubCount++] = makeHandle(s - sessions);
+    }
+    s->presenceSub = PSUB_WAIT;
+    presenceWaiting++;
+}
+
+/* Once per tick: send the delta to subscribers and snapshots to new ones.
+   Runs on reactor 0 with clientsLock held. */
+void presenceFlush(void) {
+    static struct PresenceParts delta = { .type = FRAME_PRESENCE_DELTA }, snap = { .type = FRAME_PRESENCE_SNAP };
+    if(presenceResync) {
+        /* a change was lost: start everyone over from a snapshot */
+        presenceResync = 0;
+        presenceChangeCount = 0;
+        for(int k=0;k<presenceSubCount;k++) {
+            struct Session *s = sessionGet(presenceSubs[k]);
+            if(s && s->presenceSub == PSUB_LIVE) presenceSubscribe(s);
+        }
+    }
+    if(presenceChangeCount > 0) presenceDeltaBuild(&delta);
+    if(presenceWaiting > 0) presenceSnapBuild(&snap);
+    /* subscribers that miss a delta need a snapshot; a snapshot that failed is tried again next tick */
+    if(delta.failed) presenceResync = 1;
+    if(delta.count == 0 && presenceWaiting == 0) {
+        presencePartsFree(&delta);
+        presencePartsFree(&snap);
+        return;
+    }
+    if(delta.count) metricAdd(M_PRESENCE_DELTAS, delta.count);
+    for(int k=0;k<presenceSubCount;) {
+        struct Session *s = sessionGet(presenceSubs[k]);
+        if(!s || s->presenceSub == PSUB_NONE) {
+            presenceSubs[k] = presenceSubs[--presenceSubCount];
+            continue;
+        }
+        /* a new subscriber's snapshot already has this tick's changes */
+        struct PresenceParts *pp = s->presenceSub == PSUB_WAIT ? &snap : &delta;
+        if(!pp->failed) {
+            for(int f=0;f<pp->count;f++) {
+                sessionEnqueue(s, pp->frames[f], NULL);
+                metricAdd(M_PRESENCE_BYTES, pp->frames[f]->len);
+            }
+            if(pp == &snap) {
+                s->presenceSub = PSUB_LIVE;
+                metricAdd(M_PRESENCE_SNAPS, 1);
+            }
+        }
+        k++;
+    }
+    if(!snap.failed) presenceWaiting = 0;
+    presencePartsFree(&delta);
+    presencePartsFree(&snap);
+}
+
+/* timerfd readable: run the ticks that elapsed */
+void handleTimer(void) {
+    uint64_t ticks;
+    if(read(timerFd, &ticks, sizeof(ticks)) != sizeof(ticks)) return;
+    pthread_mutex_lock(&clientsLock);
+    while(ticks-- > 0) wheelTick();
+    presenceMaybePublish();
+    if(presenceSubCount) presenceFlush();
+    if(dialCount) peerDialDue();
+    if(spoolDir) xferExpire();
+    if(logDir) logSweep();
+    pthread_mutex_unlock(&clientsLock);
+    annSpmTick();
+}
+
+/* Record a heartbeat for a session: store its UDP address, push the deadline
+   out and report recovery if it was suspect. Caller holds clientsLock. */
+void recordHeartbeat(struct Session *s, const struct sockaddr_in *from) {
+    s->udpAddr = *from;
+    s->lastSeen = time(NULL);
+    s->udpKnown = 1;
+    s->missed = 0;
+    presenceStale = 1;
+    /* heartbeats do not stretch a parked session's resume deadline */
+    if(s->parked) return;
+    if(s->liveness != LIVE_ONLINE) {
+        s->liveness = LIVE_ONLINE;
+        publishPresence(s, LIVE_ONLINE);
+    }
+    armHeartbeat(s);
+}
+
+/* Handle LIST_REQUEST from client: queue the pre-encoded list of the current snapshot */
+void handleListRequest(struct Conn *c) {
+    metricAdd(M_LIST, 1);
+    struct PresenceSnap *p = presenceAcquire();
+    if(p) sessionEnqueue(connSession(c), c->framed ? p->framedList : p->legacyList, NULL);
+    presenceRelease();
+    evLog(EV_DEBUG, "[SERVER] Sent campus list to %s %s\n", c->campus, c->dept);
+}
+
+/* Track a connection on its owner's handshake list. Deadlines are all
+   accept time + authTimeoutSecs, so appending keeps the list sorted. */
+void handshakeLink(struct Reactor *r, struct Conn *c) {
+    c->hsDeadline = c->acceptedNs + (uint64_t)authTimeoutSecs * 1000000000ull;
+    c->hsNext = NULL;
+    c->hsPrev = r->hsTail;
+    if(r->hsTail) r->hsTail->hsNext = c;
+    else r->hsHead = c;
+    r->hsTail = c;
+    c->hsLinked = 1;
+}
+
+void handshakeUnlink(struct Conn *c) {
+    if(!c->hsLinked) return;
+    struct Reactor *r = &reactors[c->reactor];
+    if(c->hsPrev) c->hsPrev->hsNext = c->hsNext;
+    else r->hsHead = c->hsNext;
+    if(c->hsNext) c->hsNext->hsPrev = c->hsPrev;
+    else r->hsTail = c->hsPrev;
+    c->hsLinked = 0;
+}
+
+void handleConnReadable(struct Conn *c);
+
+/* Take one token from a bucket. Returns 0, or how many ns until it has one
+   when it is empty. Buckets are shared between reactors, hence the CAS. */
+uint64_t rateTake(uint64_t *tat, const struct RateLimit *rl, uint64_t now) {
+    uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED), next;
+    do {
+        next = (old > now ? old : now) + rl->interval;
+        if(next - now > rl->burst) return next - now - rl->burst;
+    } while(!__atomic_compare_exchange_n(tat, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/* Hold a framed connection back until until: it is not read, and what it
+   has buffered stays there, until throttleExpire() lets it go. The sender's
+   TCP window fills meanwhile, so nothing is lost. Owner only. */
+void throttleLink(struct Conn *c, uint64_t until) {
+    struct Reactor *r = &reactors[c->reactor];
+    struct Conn *after = r->thrTail;
+    while(after && after->thrUntil > until) after = after->thrPrev;
+    c->thrUntil = until;
+    c->thrPrev = after;
+    c->thrNext = after ? after->thrNext : r->thrHead;
+    if(c->thrNext) c->thrNext->thrPrev = c;
+    else r->thrTail = c;
+    if(after) after->thrNext = c;
+    else r->thrHead = c;
+    c->throttled = 1;
+}
+
+void throttleUnlink(struct Conn *c) {
+    if(!c->throttled) return;
+    struct Reactor *r = &reactors[c->reactor];
+    if(c->thrPrev) c->thrPrev->thrNext = c->thrNext;
+    else r->thrHead = c->thrNext;
+    if(c->thrNext) c->thrNext->thrPrev = c->thrPrev;
+    else r->thrTail = c->thrPrev;
+    c->throttled = 0;
+}
+
+/* Take a token for one message from c's session and campus buckets.
+   Returns 0, or how many ns until the emptier one has a token. Owner only. */
+uint64_t rateWait(struct Conn *c, uint64_t now) {
+    uint64_t wait = 0;
+    if(sessionRate.interval) wait = rateTake(&c->rateTat, &sessionRate, now);
+    if(!wait && campusRate.interval && c->campusTat) {
+        wait = rateTake(c->campusTat, &campusRate, now);
+        /* the campus is out of tokens: the session keeps the one it gave */
+        if(wait && sessionRate.interval) c->rateTat -= sessionRate.interval;
+    }
+    if(wait) metricAdd(M_RATE_LIMITED, 1);
+    return wait;
+}
+
+/* Let one framed message from c through the rate limits, or hold c back
+   until it has a token. Returns 1 if the message may be routed now. */
+int rateAdmit(struct Conn *c) {
+    if(!sessionRate.interval && !campusRate.interval) return 1;
+    uint64_t now = nowNs(), wait = rateWait(c, now);
+    if(!wait) return 1;
+    evLog(EV_DEBUG, "[SERVER] %s %s is over its rate limit, reading again in %llu us.\n",
+                    c->campus, c->dept, (unsigned long long)(wait / 1000));
+    throttleLink(c, now + wait);
+    return 0;
+}
+
+/* "off" or "R msg/s, burst B" for the admin 'list' */
+const char *rateDescribe(const struct RateLimit *rl, char *buf, size_t cap) {
+    if(!rl->interval) return "off";
+    snprintf(buf, cap, "%.1f msg/s, burst %llu", 1e9 / rl->interval, (unsigned long long)(rl->burst / rl->interval));
+    return buf;
+}
+
+/* Let go every connection whose rate limit wait is over, or that used up its read budget */
+void throttleExpire(struct Reactor *r) {
+    uint64_t now = nowNs();
+    while(r->thrHead && r->thrHead->thrUntil <= now) {
+        struct Conn *c = r->thrHead;
+        throttleUnlink(c);
+        /* edge-triggered: nothing reports what it left unread, so pick it up here */
+        handleConnReadable(c);
+    }
+}
+
+/* A resumable session lost its connection: drop what was queued for the
+   socket, numbering the DELIVER frames not written yet into the resume window
+   in the order they would have gone out, and keep the session routable
+   without a connection until it resumes or resumeGraceSecs pass.
+   Caller holds clientsLock. */
+void sessionPark(struct Session *s) {
+    pthread_mutex_lock(&s->outLock);
+    size_t queued = 0;
+    if(s->outOff > 0) {
+        /* numbered when it started going out; the client never saw all of it */
+        struct OutLane *q = &s->lanes[s->outOffLane];
+        queued += q->q[q->head].b->len;
+        outBufRelease(q->q[q->head].b);
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+    for(int l=0;l<LANES;l++) {
+        struct OutLane *q = &s->lanes[l];
+        for(int k=0;k<q->count;k++) {
+            struct OutEntry *e = &q->q[(q->head + k) % q->cap];
+            if(!e->numbered) resumeNumberLocked(s, e->b);
+            queued += e->b->len;
+            outBufRelease(e->b);
+        }
+        q->head = q->count = 0;
+    }
+    /* what is left of outBytes is on its way through the owner's inbox */
+    s->outBytes -= queued - s->outOff;
+    s->outOff = 0;
+    wakeWaitersLocked(s->waiters, s->waitCount);
+    s->waitCount = 0;
+    s->fd = -1;
+    s->conn = NULL;
+    __atomic_store_n(&s->parked, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s->outLock);
+    /* the attachment chunks it dropped are relayed again */
+    if(spoolDir) xferDetach(s);
+    timerArm(&s->hbTimer, wheelNow + (uint64_t)resumeGraceSecs * 1000 / TICK_MS);
+    if(s->liveness == LIVE_ONLINE) {
+        s->liveness = LIVE_SUSPECT;
+        publishPresence(s, LIVE_SUSPECT);
+    }
+}
+
+/* Close a client socket and drop its session, or park it for a resume */
+void closeConn(struct Conn *c) {
+    handshakeUnlink(c);
+    throttleUnlink(c);
+    if(c->traceId) traceRecord(TRACE_CLOSE, c->traceId, NULL, 0);
+    if(c->state == CONN_ACTIVE) {
+        pthread_mutex_lock(&clientsLock);
+        struct Session *s = sessionGet(c->session);
+        /* an evicted session is not coming back */
+        if(s && s->resumable && !c->bye && s->liveness != LIVE_OFFLINE) {
+            evLog(EV_INFO, "[SERVER] %s %s disconnected, holding the session %d s for a resume.\n",
+                           c->campus, c->dept, resumeGraceSecs);
+            sessionPark(s);
+        } else {
+            evLog(EV_INFO, "[SERVER] %s %s disconnected or socket closed.\n", c->campus, c->dept);
+            if(s) removeSession(s - sessions);
+        }
+        pthread_mutex_unlock(&clientsLock);
+    } else if(c->state == CONN_PEER || c->dial >= 0) {
+        pthread_mutex_lock(&clientsLock);
+        if(c->state == CONN_PEER) peerDown(c);
+        if(c->dial >= 0) peerRetry(c->dial);
+        pthread_mutex_unlock(&clientsLock);
+    }
+    /* closing the fd also removes it from the reactor's epoll set */
+    close(c->fd);
+    if(c->inBuf) {
+        poolFree(c->inBuf);
+        c->inBuf = NULL;
+        __atomic_sub_fetch(&inBufsHeld, 1, __ATOMIC_RELAXED);
+    }
+    /* an auth worker still has it: authFinish() frees it when the answer comes */
+    if(c->state == CONN_AUTH) {
+        c->fd = -1;
+        return;
+    }
+    poolFree(c);
+}
+
+/* Deliver a routed message to one destination, encoded for that client,
+   in the urgent lane if the sender asked for it. Runs without clientsLock;
+   see sessionSend(). */
+void deliverMessage(SessionHandle dest, int framed, struct Conn *from, const char *tgtCampus, const char *tgtDept,
+                    const char *message, size_t msgLen, int urgent) {
+    struct OutBuf *b = encodeDeliver(framed, from->campus, from->dept, tgtCampus, tgtDept, message, msgLen);
+    if(!b) return;
+    if(urgent) b->lane = LANE_URGENT;
+    int rc = sessionSend(dest, b, from);
+    if(rc < 0) {
+        char reply[MAX_MSG];
+        snprintf(reply, sizeof(reply), rc == -1 ? "[SERVER] Message to %s %s dropped: receiver is falling behind."
+                                                : "[SERVER] Message to %s %s dropped: receiver disconnected.",
+                 tgtCampus, tgtDept);
+        queueReply(from, FRAME_NOTICE, reply);
+    }
+    outBufRelease(b);
+}
+
+/* Federation links: remote presence, dialling and forwarding (tables next to the reactors) */
+unsigned remoteHash(int campusId, int deptId) {
+    return ((unsigned)campusId * 2654435761u ^ (unsigned)deptId * 40503u) % REMOTE_BUCKETS;
+}
+
+/* The peer with a session for (campus, dept), -1 if none. Caller holds clientsLock. */
+int remoteFind(const char *campus, const char *dept) {
+    int cid = lookupName(campus), did = lookupName(dept);
+    if(cid < 0 || did < 0) return -1;
+    for(int e = remoteBuckets[remoteHash(cid, did)]; e >= 0; e = remotes[e].hashNext)
+        if(remotes[e].campusId == cid && remotes[e].deptId == did) return remotes[e].peer;
+    return -1;
+}
+
+/* A peer with any session of a campus, -1 if none. Caller holds clientsLock. */
+int remoteFindCampus(const char *campus) {
+    int cid = lookupName(campus);
+    return cid < 0 || names[cid].remoteHead < 0 ? -1 : remotes[names[cid].remoteHead].peer;
+}
+
+/* Record that a peer has (campus, dept). Caller holds clientsLock. */
+void remoteAdd(int peer, int cid, int did) {
+    unsigned b = remoteHash(cid, did);
+    for(int e = remoteBuckets[b]; e >= 0; e = remotes[e].hashNext)
+        if(remotes[e].campusId == cid && remotes[e].deptId == did && remotes[e].peer == peer) return;
+    if(remoteFree < 0) {
+        int cap = remoteCap ? remoteCap * 2 : 64;
+        struct Remote *n = realloc(remotes, cap * sizeof(*n));
+        if(!n) return;
+        remotes = n;
+        for(int e=cap-1;e>=remoteCap;e--) {
+            remotes[e].peer = -1;
+            remotes[e].hashNext = remoteFree;
+            remoteFree = e;
+        }
+        remoteCap = cap;
+    }
+    int e = remoteFree;
+    remoteFree = remotes[e].hashNext;
+    remotes[e].campusId = cid;
+    remotes[e].deptId = did;
+    remotes[e].peer = peer;
+    remotes[e].hashNext = remoteBuckets[b];
+    remoteBuckets[b] = e;
+    remotes[e].campusNext = names[cid].remoteHead;
+    names[cid].remoteHead = e;
+    peers[peer].remoteCount++;
+}
+
+/* Forget that a peer has (campus, dept). Caller holds clientsLock. */
+void remoteRemove(int peer, int cid, int did) {
+    int *pp = &remoteBuckets[remoteHash(cid, did)];
+    while(*pp >= 0 && !(remotes[*pp].campusId == cid && remotes[*pp].deptId == did && remotes[*pp].peer == peer))
+        pp = &remotes[*pp].hashNext;
+    int e = *pp;
+    if(e < 0) return;
+    *pp = remotes[e].hashNext;
+    pp = &names[cid].remoteHead;
+    while(*pp != e) pp = &remotes[*pp].campusNext;
+    *pp = remotes[e].campusNext;
+    remotes[e].peer = -1;
+    remotes[e].hashNext = remoteFree;
+    remoteFree = e;
+    peers[peer].remoteCount--;
+}
+
+/* Encode a server-to-server frame; control frames take the urgent lane */
+struct OutBuf *peerFrame(uint8_t type, const struct FrameField *f, int n) {
+    size_t len = frameSize(f, n);
+    struct OutBuf *b = outBufNew(len);
+    if(b && !frameEncode(b->data, len, type, f, n)) {
+        outBufRelease(b);
+        return NULL;
+    }
+    if(!b) return NULL;
+    if(type != FRAME_PEER_FORWARD) b->lane = LANE_URGENT;
+    copyCount(len);
+    return b;
+}
+
+/* Queue a control frame on a peer's link. Presence updates must not be lost,
+   so this skips the watermark check. Caller holds clientsLock. */
+void peerQueue(struct Peer *p, struct OutBuf *b) {
+    struct Session *s = sessionGet(p->session);
+    if(!s) return;
+    pthread_mutex_lock(&s->outLock);
+    if(queueAppendLocked(s, b) == 0) {
+        if(s->owner == currentReactor) flushDeferLocked(s);
+        else flushLocked(s);
+    }
+    pthread_mutex_unlock(&s->outLock);
+}
+
+/* Tell every linked peer that this node gained its first or lost its last
+   session of (campus, dept). Caller holds clientsLock. */
+void peerAnnounce(int cid, int did, int up) {
+    struct OutBuf *b = NULL;
+    for(int p=0;p<peerCount;p++) {
+        if(!peers[p].conn) continue;
+        if(!b) {
+            struct FrameField f[3] = { frameStr(names[cid].str), frameStr(names[did].str), frameStr(up ? "up" : "down") };
+            if(!(b = peerFrame(FRAME_PEER_PRESENCE, f, 3))) return;
+        }
+        peerQueue(&peers[p], b);
+    }
+    if(b) outBufRelease(b);
+}
+
+/* Send a new link everything this node has. Caller holds clientsLock. */
+void peerSnapshot(struct Peer *p) {
+    for(int i = allHead; i >= 0; i = sessions[i].allNext) {
+        struct FrameField f[3] = { frameStr(sessions[i].campus), frameStr(sessions[i].dept), frameStr("up") };
+        struct OutBuf *b = peerFrame(FRAME_PEER_PRESENCE, f, 3);
+        if(!b) return;
+        peerQueue(p, b);
+        outBufRelease(b);
+    }
+}
+
+/* Find a peer by node name, optionally adding it. Caller holds clientsLock. */
+int peerFind(const char *name, int create) {
+    for(int p=0;p<peerCount;p++)
+        if(strcmp(peers[p].name, name) == 0) return p;
+    if(!create || peerCount == MAX_PEERS) return -1;
+    struct Peer *p = &peers[peerCount];
+    memset(p, 0, sizeof(*p));
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    return peerCount++;
+}
+
+/* Federation handshake. Each side proves it knows the shared secret with a
+   MAC over both node names and a fresh nonce from each side, so a HELLO or
+   proof captured on one link is worth nothing on another:
+     dialer -> acceptor   PEER_HELLO  dialer name, dialer nonce
+     acceptor -> dialer   PEER_HELLO  acceptor name, acceptor nonce, acceptor proof
+     dialer -> acceptor   PEER_PROOF  dialer name, dialer proof
+   Until the link is up, c->campus holds our nonce in hex and, on the
+   acceptor, c->dept holds the dialer's. */
+#define PEER_NONCE 16
+
+/* Proof of the dialer ('D') or the acceptor ('A'): HMAC-SHA256 under the
+   federation secret of the role, both nonces and both names, each NUL
+   terminated so no two inputs run together the same way */
+void peerProof(uint8_t out[32], char role, const char *dialerNonce, const char *acceptorNonce,
+               const char *dialer, const char *acceptor) {
+    char buf[1 + 4 * MAX_NAME];
+    const char *parts[4] = { dialerNonce, acceptorNonce, dialer, acceptor };
+    size_t n = 0;
+    buf[n++] = role;
+    for(int i=0;i<4;i++) {
+        size_t len = strnlen(parts[i], MAX_NAME - 1);
+        memcpy(buf + n, parts[i], len);
+        buf[n + len] = 0;
+        n += len + 1;
+    }
+    struct HmacKey k;
+    hmacInit(&k, federationSecret, strlen(federationSecret));
+    hmacSha256(&k, buf, n, out);
+}
+
+/* A fresh nonce for our side of a handshake, in hex. Returns -1 without randomness. */
+int peerNonce(char hex[2 * PEER_NONCE + 1]) {
+    uint8_t n[PEER_NONCE];
+    if(getrandom(n, sizeof(n), 0) != sizeof(n)) return -1;
+    hexEncode(hex, n, sizeof(n));
+    return 0;
+}
+
+/* Send a handshake frame on a link that has no session yet */
+void peerSendHandshake(int fd, uint8_t type, const struct FrameField *f, int n) {
+    char buf[256];
+    size_t len = frameEncode(buf, sizeof(buf), type, f, n);
+    if(len) sendHandshake(fd, buf, len);
+}
+
+/* A dial failed or its link went down: try again later, backing off. Caller holds clientsLock. */
+void peerRetry(int d) {
+    struct PeerDial *pd = &dials[d];
+    pd->dialing = 0;
+    pd->nextDial = nowNs() + (uint64_t)pd->backoff * 1000000000ull;
+    if(pd->backoff < PEER_BACKOFF_MAX) pd->backoff *= 2;
+}
+
+/* Start a non-blocking connect to a -F address on reactor 0. Caller holds clientsLock. */
+void peerDial(int d) {
+    struct PeerDial *pd = &dials[d];
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct Conn *c = fd >= 0 ? poolCalloc(sizeof(*c)) : NULL;
+    if(!c) {
+        if(fd >= 0) close(fd);
+        peerRetry(d);
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(fd, (struct sockaddr*)&pd->sa, sizeof(pd->sa)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        poolFree(c);
+        peerRetry(d);
+        return;
+    }
+    c->fd = fd;
+    c->state = CONN_DIAL;
+    c->framed = 1;
+    c->dial = d;
+    c->peer = -1;
+    c->reactor = 0;
+    c->epfd = reactors[0].epfd;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if(epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        poolFree(c);
+        peerRetry(d);
+        return;
+    }
+    pd->dialing = 1;
+}
+
+/* Dial every -F address that is due and not already linked. Runs on reactor 0's tick, caller holds clientsLock. */
+void peerDialDue(void) {
+    uint64_t now = nowNs();
+    for(int d=0;d<dialCount;d++) {
+        struct PeerDial *pd = &dials[d];
+        if(pd->dialing || now < pd->nextDial) continue;
+        /* the other side may have dialled us first */
+        int p = pd->name[0] ? peerFind(pd->name, 0) : -1;
+        if(p >= 0 && peers[p].conn) continue;
+        peerDial(d);
+    }
+}
+
+/* A dialled connect finished: introduce ourselves and wait for the peer's HELLO */
+void peerConnected(struct Conn *c) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if(err) {
+        evLog(EV_WARN, "[FEDERATION] Could not reach peer %s: %s\n", dials[c->dial].addr, strerror(err));
+        closeConn(c);
+        return;
+    }
+    c->state = CONN_HANDSHAKE;
+    c->acceptedNs = nowNs();
+    handshakeLink(&reactors[c->reactor], c);
+    if(peerNonce(c->campus) < 0) {
+        closeConn(c);
+        return;
+    }
+    struct FrameField f[2] = { frameStr(nodeName), frameStr(c->campus) };
+    peerSendHandshake(c->fd, FRAME_PEER_HELLO, f, 2);
+    handleConnReadable(c);
+}
+
+int peerReject(struct Conn *c, const char *name) {
+    evLog(EV_WARN, "[FEDERATION] Peer handshake from %s rejected.\n", name);
+    sendReply(c->fd, 1, FRAME_AUTH_FAIL, "PEER_REJECTED");
+    return 0;
+}
+
+/* Turn a connection whose peer proved itself into a federation link.
+   Returns 0 if the socket must be closed. */
+int peerLink(struct Conn *c, const char *name) {
+    int dialledByUs = c->dial >= 0;
+    pthread_mutex_lock(&clientsLock);
+    if(dialledByUs) snprintf(dials[c->dial].name, MAX_NAME, "%s", name);
+    int p = peerFind(name, 1);
+    if(p < 0) {
+        pthread_mutex_unlock(&clientsLock);
+        evLog(EV_WARN, "[FEDERATION] Peer table full, refusing %s.\n", name);
+        return 0;
+    }
+    struct Peer *pr = &peers[p];
+    if(pr->conn) {
+        /* both sides dialled: each end keeps the link dialled by the lower node
+           name, so they agree; a redial by the same side replaces the old link */
+        const char *oldDialer = pr->dialledByUs ? nodeName : name;
+        const char *newDialer = dialledByUs ? nodeName : name;
+        if(strcmp(newDialer, oldDialer) > 0) {
+            pthread_mutex_unlock(&clientsLock);
+            evLog(EV_WARN, "[FEDERATION] Already linked with %s, dropping the second link.\n", name);
+            return 0;
+        }
+        /* its reactor sees the shutdown and closes it; the remote table is rebuilt from the new link */
+        for(int e=0;e<remoteCap;e++)
+            if(remotes[e].peer == p) remoteRemove(p, remotes[e].campusId, remotes[e].deptId);
+        shutdown(pr->conn->fd, SHUT_RDWR);
+        pr->conn = NULL;
+    }
+    int slot = slotAlloc(c, c->fd, 1);
+    if(slot < 0) {
+        pthread_mutex_unlock(&clientsLock);
+        evLog(EV_WARN, "[FEDERATION] No session slot for peer %s.\n", name);
+        return 0;
+    }
+    c->session = makeHandle(slot);
+    c->peer = p;
+    c->state = CONN_PEER;
+    pr->conn = c;
+    pr->session = c->session;
+    pr->dialledByUs = dialledByUs;
+    if(dialledByUs) {
+        dials[c->dial].dialing = 0;
+        dials[c->dial].backoff = 1;
+    }
+    peerSnapshot(pr);
+    pthread_mutex_unlock(&clientsLock);
+
+    strcpy(c->campus, "peer");
+    strcpy(c->dept, name);
+    handshakeUnlink(c);
+    evLog(EV_INFO, "[FEDERATION] Linked with peer %s (%s).\n", name, dialledByUs ? "dialled" : "accepted");
+    return 1;
+}
+
+/* A PEER_HELLO. On a link we accepted it is the dialer's challenge: answer
+   with ours and our proof. On a link we dialled it is that answer: check the
+   proof, send ours, and the link is up. Returns 0 if the socket must be closed. */
+int peerHello(struct Conn *c, const struct Frame *fr) {
+    char name[MAX_NAME], nonce[MAX_NAME], hex[65];
+    uint8_t proof[32], want[32];
+    int dialledByUs = c->dial >= 0;
+    if(!federationSecret) {
+        evLog(EV_WARN, "[FEDERATION] Refusing a peer link: federation is off (start with -K secret).\n");
+        sendReply(c->fd, 1, FRAME_AUTH_FAIL, "FEDERATION_OFF");
+        return 0;
+    }
+    if(fr->nfields < 2) return peerReject(c, "?");
+    frameFieldCopy(name, sizeof(name), fr->f[0]);
+    frameFieldCopy(nonce, sizeof(nonce), fr->f[1]);
+    /* one challenge per link, and never from ourselves */
+    if(fr->nfields != (dialledByUs ? 3 : 2) || (!dialledByUs && c->dept[0]) ||
+       strlen(nonce) != 2 * PEER_NONCE || strcmp(name, nodeName) == 0)
+        return peerReject(c, name);
+    if(!dialledByUs) {
+        if(peerNonce(c->campus) < 0) return 0;
+        snprintf(c->dept, sizeof(c->dept), "%s", nonce);
+        peerProof(proof, 'A', c->dept, c->campus, name, nodeName);
+        hexEncode(hex, proof, sizeof(proof));
+        struct FrameField f[3] = { frameStr(nodeName), frameStr(c->campus), frameStr(hex) };
+        peerSendHandshake(c->fd, FRAME_PEER_HELLO, f, 3);
+        return 1;
+    }
+    frameFieldCopy(hex, sizeof(hex), fr->f[2]);
+    peerProof(want, 'A', c->campus, nonce, nodeName, name);
+    if(hexDecode(proof, sizeof(proof), hex) < 0 || !equalConstTime(proof, want, sizeof(want)))
+        return peerReject(c, name);
+    peerProof(proof, 'D', c->campus, nonce, nodeName, name);
+    hexEncode(hex, proof, sizeof(proof));
+    struct FrameField f[2] = { frameStr(nodeName), frameStr(hex) };
+    peerSendHandshake(c->fd, FRAME_PEER_PROOF, f, 2);
+    return peerLink(c, name);
+}
+
+/* PEER_PROOF: the dialer's answer to the challenge in our HELLO.
+   Returns 0 if the socket must be closed. */
+int peerCheckProof(struct Conn *c, const struct Frame *fr) {
+    char name[MAX_NAME], hex[65];
+    uint8_t proof[32], want[32];
+    if(c->dial >= 0 || !c->campus[0] || fr->nfields != 2) return peerReject(c, "?");
+    frameFieldCopy(name, sizeof(name), fr->f[0]);
+    frameFieldCopy(hex, sizeof(hex), fr->f[1]);
+    peerProof(want, 'D', c->dept, c->campus, name, nodeName);
+    if(hexDecode(proof, sizeof(proof), hex) < 0 || !equalConstTime(proof, want, sizeof(want)) ||
+       strcmp(name, nodeName) == 0)
+        return peerReject(c, name);
+    return peerLink(c, name);
+}
+
+/* A federation link closed: forget what its peer had, unless a newer link took over. Caller holds clientsLock. */
+void peerDown(struct Conn *c) {
+    struct Peer *pr = &peers[c->peer];
+    if(pr->conn == c) {
+        for(int e=0;e<remoteCap;e++)
+            if(remotes[e].peer == c->peer) remoteRemove(c->peer, remotes[e].campusId, remotes[e].deptId);
+        pr->conn = NULL;
+        pr->session = NO_SESSION;
+        evLog(EV_INFO, "[FEDERATION] Link to peer %s is down.\n", pr->name);
+    }
+    struct Session *s = sessionGet(c->session);
+    if(s) slotFree(s - sessions);
+}
+
+/* Forward a message to the peer that has its target; an urgent one says so
+   in a sixth field and overtakes bulk traffic on the link too. Runs without
+   clientsLock. */
+void peerForward(SessionHandle link, struct Conn *from, const char *tgtCampus, const char *tgtDept,
+                 const char *message, size_t msgLen, int urgent) {
+    struct FrameField f[6] = { frameStr(from->campus), frameStr(from->dept),
+                               frameStr(tgtCampus), frameStr(tgtDept), { message, (uint16_t)msgLen },
+                               frameStr(FRAME_URGENT) };
+    struct OutBuf *b = peerFrame(FRAME_PEER_FORWARD, f, urgent ? 6 : 5);
+    if(!b) return;
+    if(urgent) b->lane = LANE_URGENT;
+    int rc = sessionSend(link, b, from);
+    if(rc < 0) {
+        char reply[MAX_MSG];
+        snprintf(reply, sizeof(reply), rc == -1 ? "[SERVER] Message to %s %s dropped: the link to its node is falling behind."
+                                                : "[SERVER] Message to %s %s dropped: the link to its node went down.",
+                 tgtCampus, tgtDept);
+        queueReply(from, FRAME_NOTICE, reply);
+    }
+    outBufRelease(b);
+}
+
+/* Named groups: admin-defined lists of (campus, dept) members, addressed as
+   "@name". Members are interned ids, so a group can name departments that
+   are not connected yet. Protected by clientsLock. */
+struct GroupMember { int campusId, deptId; };
+struct Group {
+    char name[MAX_NAME];
+    struct GroupMember *members;
+    int count, cap;
+};
+struct Group *groups = NULL;
+int groupCount = 0, groupCap = 0;
+
+/* Find a group by name (without the '@'), NULL if there is none. Caller holds clientsLock. */
+struct Group *findGroup(const char *name) {
+    for(int i=0;i<groupCount;i++)
+        if(strcmp(groups[i].name, name) == 0) return &groups[i];
+    return NULL;
+}
+
+/* Add a member to a group, creating the group. Returns 0 on success, -1 if it is already there. Caller holds clientsLock. */
+int groupAdd(const char *name, const char *campus, const char *dept) {
+    struct Group *g = findGroup(name);
+    if(!g) {
+        if(groupCount == groupCap) {
+            int cap = groupCap ? groupCap * 2 : 8;
+            struct Group *ng = realloc(groups, cap * sizeof(*ng));
+            if(!ng) return -1;
+            groups = ng;
+            groupCap = cap;
+        }
+        g = &groups[groupCount++];
+        memset(g, 0, sizeof(*g));
+        strncpy(g->name, name, MAX_NAME-1);
+    }
+    int cid = internName(campus), did = internName(dept);
+    if(cid < 0 || did < 0) return -1;
+    for(int i=0;i<g->count;i++)
+        if(g->members[i].campusId == cid && g->members[i].deptId == did) return -1;
+    if(g->count == g->cap) {
+        int cap = g->cap ? g->cap * 2 : 8;
+        struct GroupMember *nm = realloc(g->members, cap * sizeof(*nm));
+        if(!nm) return -1;
+        g->members = nm;
+        g->cap = cap;
+    }
+    g->members[g->count].campusId = cid;
+    g->members[g->count].deptId = did;
+    g->count++;
+    return 0;
+}
+
+/* Remove a member; the group goes away with its last member. Returns -1 if it was not there. Caller holds clientsLock. */
+int groupRemove(const char *name, const char *campus, const char *dept) {
+    struct Group *g = findGroup(name);
+    int cid = lookupName(campus), did = lookupName(dept);
+    if(!g || cid < 0 || did < 0) return -1;
+    for(int i=0;i<g->count;i++) {
+        if(g->members[i].campusId != cid || g->members[i].deptId != did) continue;
+        g->members[i] = g->members[--g->count];
+        if(g->count == 0) {
+            free(g->members);
+            *g = groups[--groupCount];
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* A target with a '*' campus or department, or an "@group" campus */
+int isFanoutTarget(const char *tgtCampus, const char *tgtDept) {
+    return tgtCampus[0] == '@' || strcmp(tgtCampus, "*") == 0 || strcmp(tgtDept, "*") == 0;
+}
+
+/* Deliver one message to every session a wildcard or group target names,
+   except the sender. Receivers are collected under clientsLock; after it the
+   payload is encoded at most twice (framed and legacy) and every receiver's
+   queue takes a reference to the same buffer. Wildcards also go to every
+   linked peer, which delivers them to its own sessions; forwarded is set when
+   c is the link such a copy arrived on, and then nothing is reported back. */
+void routeFanout(struct Conn *c, const char *fromCampus, const char *fromDept,
+                 const char *tgtCampus, const char *tgtDept,
+                 const char *message, size_t msgLen, int forwarded, int urgent) {
+    SessionHandle self = c->session;
+    pthread_mutex_lock(&clientsLock);
+    SessionHandle *dests = poolAlloc((clientCount ? clientCount : 1) * sizeof(*dests));
+    char *framed = poolAlloc(clientCount ? clientCount : 1);
+    if(!dests || !framed) {
+        pthread_mutex_unlock(&clientsLock);
+        poolFree(dests);
+        poolFree(framed);
+        return;
+    }
+    int n = 0, unknown = 0;
+#define FANOUT_ADD(i) do { if(makeHandle(i) != self) { dests[n] = makeHandle(i); framed[n++] = sessions[i].framed; \
+        names[sessions[i].campusId].msgsIn++; names[sessions[i].campusId].bytesIn += msgLen; } } while(0)
+    if(tgtCampus[0] == '@') {
+        struct Group *g = findGroup(tgtCampus + 1);
+        if(!g) unknown = 1;
+        for(int k=0;g && k<g->count;k++) {
+            int i = findClientByIds(g->members[k].campusId, g->members[k].deptId);
+            if(i >= 0) FANOUT_ADD(i);
+        }
+    } else if(strcmp(tgtCampus, "*") == 0 && strcmp(tgtDept, "*") == 0) {
+        for(int i = allHead; i >= 0; i = sessions[i].allNext) FANOUT_ADD(i);
+    } else if(strcmp(tgtCampus, "*") == 0) {
+        int did = lookupName(tgtDept);
+        for(int i = did >= 0 ? names[did].deptHead : -1; i >= 0; i = sessions[i].deptNext) FANOUT_ADD(i);
+    } else {
+        int cid = lookupName(tgtCampus);
+        for(int i = cid >= 0 ? names[cid].campusHead : -1; i >= 0; i = sessions[i].campusNext) FANOUT_ADD(i);
+    }
+#undef FANOUT_ADD
+    /* groups are defined per node, only wildcards cross to the peers */
+    SessionHandle links[MAX_PEERS];
+    int nLinks = 0;
+    if(!forwarded) {
+        struct Session *me = connSession(c);
+        names[me->campusId].msgsOut++;
+        names[me->campusId].bytesOut += msgLen;
+        for(int p=0;tgtCampus[0] != '@' && p<peerCount;p++) {
+            if(!peers[p].conn) continue;
+            links[nLinks++] = peers[p].session;
+            peers[p].fwdOut++;
+        }
+    } else {
+        peers[c->peer].fwdIn++;
+    }
+    pthread_mutex_unlock(&clientsLock);
+    for(int k=0;k<nLinks;k++) peerForward(links[k], c, tgtCampus, tgtDept, message, msgLen, urgent);
+    if(forwarded) metricAdd(M_FORWARDED_IN, 1);
+    else metricAdd(M_FORWARDED, nLinks);
+
+    metricAdd(M_FANOUT, 1);
+    metricAdd(M_FANOUT_RECIPIENTS, n);
+    struct OutBuf *bufs[2] = { NULL, NULL };   /* legacy, framed */
+    int sent = 0, dropped = 0;
+    for(int k=0;k<n;k++) {
+        struct OutBuf **b = &bufs[(int)framed[k]];
+        if(!*b) {
+            if(!(*b = encodeDeliver(framed[k], fromCampus, fromDept, tgtCampus, tgtDept, message, msgLen))) continue;
+            if(urgent) (*b)->lane = LANE_URGENT;
+        }
+        int rc = sessionSend(dests[k], *b, c);
+        if(rc == 0) sent++;
+        else if(rc == -1) dropped++;
+    }
+    for(int k=0;k<2;k++) if(bufs[k]) outBufRelease(bufs[k]);
+    poolFree(dests);
+    poolFree(framed);
+
+    evLog(EV_DEBUG, "[SERVER] Fan-out from %s %s to %s %s: %d of %d receivers%s.\n",
+                    fromCampus, fromDept, tgtCampus, tgtDept, sent, n, forwarded ? " (from a peer)" : "");
+    if(forwarded) return;
+    char reply[MAX_MSG];
+    if(unknown) {
+        snprintf(reply, sizeof(reply), "[SERVER] Unknown group %s.", tgtCampus);
+        queueReply(c, FRAME_NOTICE, reply);
+    } else if(n == 0 && nLinks == 0) {
+        snprintf(reply, sizeof(reply), "[SERVER] No connected sessions match %s %s.", tgtCampus, tgtDept);
+        queueReply(c, FRAME_NOTICE, reply);
+    } else if(dropped > 0) {
+        snprintf(reply, sizeof(reply), "[SERVER] Message to %s %s dropped for %d of %d receivers: they are falling behind.",
+                 tgtCampus, tgtDept, dropped, n);
+        queueReply(c, FRAME_NOTICE, reply);
+    }
+}
+
+/* Route one message from an authenticated client to TargetCampus/TargetDept.
+   An urgent message takes the urgent lane of every queue on its way, except
+   the store-and-forward log, which keeps one order per mailbox. */
+void routeMessage(struct Conn *c, const char *tgtCampus, const char *tgtDept,
+                  const char *message, size_t msgLen, int urgent) {
+    if(isFanoutTarget(tgtCampus, tgtDept)) {
+        routeFanout(c, c->campus, c->dept, tgtCampus, tgtDept, message, msgLen, 0, urgent);
+        return;
+    }
+    /* clientsLock only covers the lookup, the delivery itself runs after it */
+    SessionHandle dest = NO_SESSION, link = NO_SESSION;
+    int destFramed = 0;
+    uint64_t t0 = nowNs();
+    pthread_mutex_lock(&clientsLock);
+    int destIdx = findClientByCampusAndDept(tgtCampus, tgtDept);
+    /* the exact department on a peer node beats a campus fallback here */
+    int peer = destIdx == -1 ? remoteFind(tgtCampus, tgtDept) : -1;
+    /* Try to find any client from that campus if department not found */
+    int campusIdx = destIdx == -1 && peer == -1 ? findClientByCampus(tgtCampus) : -1;
+    if(destIdx == -1 && peer == -1 && campusIdx == -1) peer = remoteFindCampus(tgtCampus);
+    histRecord(H_ROUTE, nowNs() - t0);
+    struct Name *fromName = &names[connSession(c)->campusId];
+    fromName->msgsOut++;
+    fromName->bytesOut += msgLen;
+    int hit = destIdx != -1 ? destIdx : campusIdx;
+    if(hit != -1) {
+        names[sessions[hit].campusId].msgsIn++;
+        names[sessions[hit].campusId].bytesIn += msgLen;
+        metricAdd(M_ROUTED, 1);
+        metricAdd(M_ROUTED_BYTES, msgLen);
+    }
+    if(peer != -1) {
+        /* the session lives on another node: its peer delivers it */
+        metricAdd(M_FORWARDED, 1);
+        link = peers[peer].session;
+        peers[peer].fwdOut++;
+        evLog(EV_DEBUG, "[SERVER] Forwarded message from %s %s to %s %s via peer %s.\n",
+                        c->campus, c->dept, tgtCampus, tgtDept, peers[peer].name);
+    } else if(destIdx == -1) {
+        if(campusIdx == -1 && logDir && isCampus(tgtCampus) &&
+           logStore(c, NULL, tgtCampus, tgtDept, message, msgLen) == 0) {
+            /* the sender hears back once the flusher has it on disk */
+            metricAdd(M_STORED, 1);
+            evLog(EV_DEBUG, "[SERVER] Stored message from %s %s for offline %s %s.\n",
+                            c->campus, c->dept, tgtCampus, tgtDept);
+        } else if(campusIdx == -1) {
+            metricAdd(M_ROUTE_MISS, 1);
+            char reply[MAX_MSG];
+            snprintf(reply, sizeof(reply), "[SERVER] Target campus %s not connected.", tgtCampus);
+            queueReply(c, FRAME_NOTICE, reply);
+            evLog(EV_INFO, "[SERVER] Could not route message from %s %s to %s %s (not connected).\n", 
+                           c->campus, c->dept, tgtCampus, tgtDept);
+        } else {
+            /* Forward to any department in that campus */
+            metricAdd(M_FALLBACK, 1);
+            dest = makeHandle(campusIdx);
+            destFramed = sessions[campusIdx].framed;
+            evLog(EV_DEBUG, "[SERVER] Routed message from %s %s to %s (department %s not found, sent to campus).\n", 
+                            c->campus, c->dept, tgtCampus, tgtDept);
+        }
+    } else if(__atomic_load_n(&sessions[destIdx].logBacklog, __ATOMIC_ACQUIRE) &&
+              logStore(c, &sessions[destIdx], tgtCampus, tgtDept, message, msgLen) == 0) {
+        /* older stored messages are still streaming: queue behind them to keep the order */
+        logStream(&sessions[destIdx]);
+        evLog(EV_DEBUG, "[SERVER] Routed message from %s %s to %s %s (behind stored messages).\n", 
+                        c->campus, c->dept, tgtCampus, tgtDept);
+    } else {
+        /* Exact match found - send to specific department */
+        dest = makeHandle(destIdx);
+        destFramed = sessions[destIdx].framed;
+        evLog(EV_DEBUG, "[SERVER] Routed message from %s %s to %s %s.\n", 
+                        c->campus, c->dept, tgtCampus, tgtDept);
+    }
+    pthread_mutex_unlock(&clientsLock);
+    if(dest != NO_SESSION) deliverMessage(dest, destFramed, c, tgtCampus, tgtDept, message, msgLen, urgent);
+    if(link != NO_SESSION) peerForward(link, c, tgtCampus, tgtDept, message, msgLen, urgent);
+}
+
+/* Deliver a message a peer forwarded, on this node only: to the exact
+   department, else to anyone of the campus. A miss or a drop goes back to
+   the sender's node as a notice. */
+void peerDeliver(struct Conn *c, const char *fromCampus, const char *fromDept,
+                 const char *tgtCampus, const char *tgtDept, const char *message, size_t msgLen, int urgent) {
+    if(isFanoutTarget(tgtCampus, tgtDept)) {
+        routeFanout(c, fromCampus, fromDept, tgtCampus, tgtDept, message, msgLen, 1, urgent);
+        return;
+    }
+    SessionHandle dest = NO_SESSION;
+    int destFramed = 0;
+    pthread_mutex_lock(&clientsLock);
+    peers[c->peer].fwdIn++;
+    int i = findClientByCampusAndDept(tgtCampus, tgtDept);
+    if(i == -1) i = findClientByCampus(tgtCampus);
+    if(i != -1) {
+        dest = makeHandle(i);
+        destFramed = sessions[i].framed;
+        names[sessions[i].campusId].msgsIn++;
+        names[sessions[i].campusId].bytesIn += msgLen;
+    }
+    pthread_mutex_unlock(&clientsLock);
+    metricAdd(M_FORWARDED_IN, 1);
+
+    char reply[MAX_MSG] = "";
+    if(dest == NO_SESSION) {
+        snprintf(reply, sizeof(reply), "[SERVER] Target campus %s not connected.", tgtCampus);
+    } else {
+        struct OutBuf *b = encodeDeliver(destFramed, fromCampus, fromDept, tgtCampus, tgtDept, message, msgLen);
+        if(b && urgent) b->lane = LANE_URGENT;
+        int rc = b ? sessionSend(dest, b, c) : -1;
+        if(b) outBufRelease(b);
+        if(rc < 0)
+            snprintf(reply, sizeof(reply), rc == -1 ? "[SERVER] Message to %s %s dropped: receiver is falling behind."
+                                                    : "[SERVER] Message to %s %s dropped: receiver disconnected.",
+                     tgtCampus, tgtDept);
+    }
+    evLog(EV_DEBUG, "[FEDERATION] %s message from %s %s (peer %s) to %s %s.\n", reply[0] ? "Could not deliver" : "Delivered",
+                    fromCampus, fromDept, c->dept, tgtCampus, tgtDept);
+    if(!reply[0]) return;
+    struct FrameField f[3] = { frameStr(fromCampus), frameStr(fromDept), frameStr(reply) };
+    struct OutBuf *b = peerFrame(FRAME_PEER_NOTICE, f, 3);
+    if(!b) return;
+    pthread_mutex_lock(&clientsLock);
+    peerQueue(&peers[c->peer], b);
+    pthread_mutex_unlock(&clientsLock);
+    outBufRelease(b);
+}
+
+/* handle one frame on a federation link */
+void handlePeerFrame(struct Conn *c, const struct Frame *fr) {
+    char campus[MAX_NAME], dept[MAX_NAME], tgtCampus[MAX_NAME], tgtDept[MAX_NAME];
+    /* a link that lost a both-dialled race is only waiting to be closed */
+    if(peers[c->peer].conn != c) return;
+    if(fr->type == FRAME_PEER_PRESENCE && fr->nfields == 3) {
+        frameFieldCopy(campus, sizeof(campus), fr->f[0]);
+        frameFieldCopy(dept, sizeof(dept), fr->f[1]);
+        int up = fr->f[2].len == 2 && memcmp(fr->f[2].ptr, "up", 2) == 0;
+        pthread_mutex_lock(&clientsLock);
+        int cid = internName(campus), did = internName(dept);
+        if(cid >= 0 && did >= 0) {
+            if(up) remoteAdd(c->peer, cid, did);
+            else remoteRemove(c->peer, cid, did);
+        }
+        pthread_mutex_unlock(&clientsLock);
+        evLog(EV_INFO, "[FEDERATION] %s %s is %s on peer %s.\n", campus, dept, up ? "up" : "down", c->dept);
+    } else if(fr->type == FRAME_PEER_FORWARD && (fr->nfields == 5 || fr->nfields == 6)) {
+        frameFieldCopy(campus, sizeof(campus), fr->f[0]);
+        frameFieldCopy(dept, sizeof(dept), fr->f[1]);
+        frameFieldCopy(tgtCampus, sizeof(tgtCampus), fr->f[2]);
+        frameFieldCopy(tgtDept, sizeof(tgtDept), fr->f[3]);
+        peerDeliver(c, campus, dept, tgtCampus, tgtDept, fr->f[4].ptr, fr->f[4].len, frameUrgent(fr, 5));
+    } else if(fr->type == FRAME_PEER_NOTICE && fr->nfields == 3) {
+        char text[MAX_MSG];
+        frameFieldCopy(campus, sizeof(campus), fr->f[0]);
+        frameFieldCopy(dept, sizeof(dept), fr->f[1]);
+        frameFieldCopy(text, sizeof(text), fr->f[2]);
+        pthread_mutex_lock(&clientsLock);
+        int i = findClientByCampusAndDept(campus, dept);
+        SessionHandle dest = i != -1 ? makeHandle(i) : NO_SESSION;
+        int framed = i != -1 ? sessions[i].framed : 0;
+        pthread_mutex_unlock(&clientsLock);
+        struct OutBuf *b = dest != NO_SESSION ? makeReply(framed, FRAME_NOTICE, text) : NULL;
+        if(b) {
+            sessionSend(dest, b, NULL);
+            outBufRelease(b);
+        }
+    } else {
+        evLog(EV_WARN, "[FEDERATION] Unexpected frame type %d from peer %s\n", fr->type, c->dept);
+    }
+}
+
+/* handle one legacy text message (TargetCampus,Dept,Message or LIST_REQUEST;
+   a leading '!' marks the message urgent) */
+void handleLegacyMessage(struct Conn *c, char *buf) {
+    evLog(EV_DEBUG, "[TCP][%s %s] >> %s\n", c->campus, c->dept, buf);
+
+    /* Check if this is a LIST_REQUEST */
+    if(strcmp(buf, "LIST_REQUEST") == 0) {
+        handleListRequest(c);
+        return;
+    }
+
+    /* legacy text has no framing to hold back a read with, so over its rate a message is dropped */
+    if((sessionRate.interval || campusRate.interval) && rateWait(c, nowNs())) {
+        queueReply(c, FRAME_NOTICE, "[SERVER] Message dropped: over the rate limit, slow down.");
+        return;
+    }
 
-/* For UDP broadcast: store last known UDP sockaddr_in for each campus and timestamp */
-struct sockaddr_in udpAddr[MAX_CLIENTS];
-time_t lastSeen[MAX_CLIENTS];
-int udpKnown[MAX_CLIENTS]; /* 0 = unknown, 1 = known */
+    char tgtCampus[MAX_NAME], tgtDept[MAX_NAME];
+    int urgent = buf[0] == '!';
+    if(urgent) buf++;
+    
+    char *firstPipe = strchr(buf, ',');
+    if(firstPipe == NULL) {
+        evLog(EV_WARN, "[SERVER] Invalid message format from %s. Use TargetCampus,Dept,Message\n", c->campus);
+        queueReply(c, FRAME_NOTICE, "[SERVER] Error: Use format TargetCampus,Dept,Message");
+        return;
+    }
+    int pos1 = firstPipe - buf;
+    if(pos1 >= MAX_NAME) pos1 = MAX_NAME-1;
+    strncpy(tgtCampus, buf, pos1); 
+    tgtCampus[pos1] = '\0';
+    
+    char *secondPipe = strchr(firstPipe + 1, ',');
+    if(secondPipe == NULL) {
+        evLog(EV_WARN, "[SERVER] Invalid message format from %s. Use TargetCampus,Dept,Message\n", c->campus);
+        queueReply(c, FRAME_NOTICE, "[SERVER] Error: Use format TargetCampus,Dept,Message");
+        return;
+    }
+    int pos2 = secondPipe - (firstPipe + 1);
+    if(pos2 >= MAX_NAME) pos2 = MAX_NAME-1;
+    strncpy(tgtDept, firstPipe + 1, pos2);
+    tgtDept[pos2] = '\0';
+    
+    /* Message is everything after the second comma */
+    routeMessage(c, tgtCampus, tgtDept, secondPipe + 1, strlen(secondPipe + 1), urgent);
+}
 
-pthread_mutex_t clientsLock = PTHREAD_MUTEX_INITIALIZER;
+/* handle one frame from an authenticated client */
+void handleFrame(struct Conn *c, const struct Frame *fr) {
+    if(fr->type == FRAME_LIST_REQ) {
+        evLog(EV_DEBUG, "[TCP][%s %s] >> LIST_REQUEST\n", c->campus, c->dept);
+        handleListRequest(c);
+        return;
+    }
+    if(fr->type == FRAME_PRESENCE_SUB) {
+        evLog(EV_DEBUG, "[TCP][%s %s] >> PRESENCE_SUB\n", c->campus, c->dept);
+        pthread_mutex_lock(&clientsLock);
+        presenceSubscribe(connSession(c));
+        pthread_mutex_unlock(&clientsLock);
+        return;
+    }
+    if(fr->type == FRAME_FILE_OFFER || fr->type == FRAME_FILE_CHUNK || fr->type == FRAME_FILE_RECEIVED) {
+        if(!spoolDir) queueReply(c, FRAME_NOTICE, "[SERVER] Attachments are not enabled on this server.");
+        else if(fr->type == FRAME_FILE_OFFER && (fr->nfields == 4 || fr->nfields == 5)) xferOffer(c, fr);
+        else if(fr->type == FRAME_FILE_CHUNK && fr->nfields == 3) xferUpload(c, fr);
+        else if(fr->type == FRAME_FILE_RECEIVED && fr->nfields == 2) xferReceived(c, fr);
+        else queueReply(c, FRAME_NOTICE, "[SERVER] Error: unexpected frame");
+        return;
+    }
+    if(fr->type != FRAME_SEND || (fr->nfields != 3 && !(fr->nfields == 4 && frameUrgent(fr, 3)))) {
+        evLog(EV_WARN, "[SERVER] Unexpected frame type %d from %s %s\n", fr->type, c->campus, c->dept);
+        queueReply(c, FRAME_NOTICE, "[SERVER] Error: unexpected frame");
+        return;
+    }
+    char tgtCampus[MAX_NAME], tgtDept[MAX_NAME];
+    frameFieldCopy(tgtCampus, sizeof(tgtCampus), fr->f[0]);
+    frameFieldCopy(tgtDept, sizeof(tgtDept), fr->f[1]);
+    evLog(EV_DEBUG, "[TCP][%s %s] >> %s,%s,%.*s\n", c->campus, c->dept, tgtCampus, tgtDept,
+                    (int)fr->f[2].len, fr->f[2].ptr);
+    routeMessage(c, tgtCampus, tgtDept, fr->f[2].ptr, fr->f[2].len, frameUrgent(fr, 3));
+}
 
-/* Helper authenticate */
-int authenticate(const char *campus, const char *pass) {
-    for(int i=0;i<numCreds;i++) {
-        if(strcmp(validCreds[i].campus, campus)==0 && strcmp(validCreds[i].password, pass)==0)
-            return 1;
+/* AUTH_OK for a session. A resumable session's carries its resume token,
+   "slot:gen:key", and the number of DELIVER frames the client has seen. */
+struct OutBuf *makeAuthOk(struct Session *s, uint64_t seq) {
+    if(!s->resumable) return makeReply(s->framed, FRAME_AUTH_OK, "AUTH_OK");
+    char token[64], key[2 * sizeof(s->resumeKey) + 1], seqStr[24];
+    hexEncode(key, s->resumeKey, sizeof(s->resumeKey));
+    snprintf(token, sizeof(token), "%d:%u:%s", (int)(s - sessions), s->gen, key);
+    snprintf(seqStr, sizeof(seqStr), "%llu", (unsigned long long)seq);
+    struct FrameField f[2] = { frameStr(token), frameStr(seqStr) };
+    size_t len = frameSize(f, 2);
+    struct OutBuf *b = outBufNew(len);
+    if(!b) return NULL;
+    frameEncode(b->data, len, FRAME_AUTH_OK, f, 2);
+    b->lane = LANE_URGENT;
+    return b;
+}
+
+void authRefuse(struct Conn *c, const char *campus, const char *dept) {
+    evLog(EV_WARN, "[SERVER] Authentication FAILED for %s %s\n", campus, dept);
+    metricAdd(M_AUTH_FAIL, 1);
+    sendReply(c->fd, c->framed, FRAME_AUTH_FAIL, "AUTH_FAILED");
+}
+
+/* Register the session of a connection whose password checked out.
+   Returns 0 if the socket must be closed. */
+int openSession(struct Conn *c, const char *campus, const char *dept) {
+    int clientSock = c->fd;
+    pthread_mutex_lock(&clientsLock);
+    int slot = addSession(c, clientSock, c->framed, campus, dept);
+    if(slot < 0) {
+        pthread_mutex_unlock(&clientsLock);
+        metricAdd(M_AUTH_FAIL, 1);
+        sendReply(clientSock, c->framed, FRAME_AUTH_FAIL, "SERVER_FULL");
+        return 0;
     }
-    return 0;
+    c->session = makeHandle(slot);
+    /* the first heartbeat is due one interval after login */
+    armHeartbeat(&sessions[slot]);
+    /* AUTH_OK goes first in the queue, before anything routed to the new session */
+    struct OutBuf *ok = makeAuthOk(&sessions[slot], 0);
+    if(ok) {
+        sessionEnqueue(&sessions[slot], ok, NULL);
+        outBufRelease(ok);
+    }
+    /* then anything that was stored while it was away */
+    if(logDir) logAttach(&sessions[slot]);
+    if(spoolDir) xferStream(&sessions[slot]);
+    pthread_mutex_unlock(&clientsLock);
+
+    strcpy(c->campus, campus);
+    strcpy(c->dept, dept);
+    handshakeUnlink(c);
+    c->state = CONN_ACTIVE;
+    metricAdd(M_AUTH_OK, 1);
+    histRecord(H_AUTH, nowNs() - c->acceptedNs);
+    evLog(EV_INFO, "[SERVER] %s %s authenticated and TCP session started.\n", campus, dept);
+    return 1;
 }
 
-/* Find client index by campus name, -1 if not found */
-int findClientByCampus(const char *campus) {
-    for(int i=0;i<clientCount;i++) if(strcmp(clientCampus[i], campus)==0) return i;
-    return -1;
+/* Check credentials and register the session. A password that is not the one
+   of the last good login goes to an auth worker, and the connection waits in
+   CONN_AUTH for authFinish(). Returns 0 if the socket must be closed. */
+int startSession(struct Conn *c, const char *campus, const char *dept, const char *pass) {
+    struct Cred *cred = credFind(campus);
+    uint8_t tag[32];
+    if(!cred) {
+        authRefuse(c, campus, dept);
+        return 0;
+    }
+    if(authFast(cred, pass, tag)) return openSession(c, campus, dept);
+    struct AuthJob *j = malloc(sizeof(*j));
+    if(!j) return 0;
+    j->c = c;
+    j->reactor = c->reactor;
+    j->cred = cred;
+    snprintf(j->campus, sizeof(j->campus), "%s", campus);
+    snprintf(j->dept, sizeof(j->dept), "%s", dept);
+    snprintf(j->pass, sizeof(j->pass), "%s", pass);
+    memcpy(j->tag, tag, 32);
+    if(authSubmit(j) < 0) {
+        free(j);
+        evLog(EV_WARN, "[SERVER] Too many logins waiting for a password check, refusing %s %s\n", campus, dept);
+        metricAdd(M_AUTH_FAIL, 1);
+        sendReply(c->fd, c->framed, FRAME_AUTH_FAIL, "SERVER_BUSY");
+        return 0;
+    }
+    c->state = CONN_AUTH;
+    return 1;
 }
 
-/* Find client by campus AND department */
-int findClientByCampusAndDept(const char *campus, const char *dept) {
-    for(int i=0;i<clientCount;i++) {
-        if(strcmp(clientCampus[i], campus)==0 && strcmp(clientDept[i], dept)==0)
-            return i;
+/* Password checks the workers finished: open the session and read what the
+   client sent meanwhile, or refuse it. Runs after the event batch, like
+   handshakeExpire(), because it closes connections. */
+void authFinish(struct Reactor *r) {
+    struct AuthJob *list = r->authDone;
+    r->authDone = NULL;
+    while(list) {
+        struct AuthJob *j = list;
+        list = j->next;
+        struct Conn *c = j->c;
+        if(c->fd < 0) {
+            /* closed while the worker had it */
+            poolFree(c);
+        } else {
+            c->state = CONN_HANDSHAKE;
+            if(!j->ok) authRefuse(c, j->campus, j->dept);
+            if(j->ok && openSession(c, j->campus, j->dept)) handleConnReadable(c);
+            else closeConn(c);
+        }
+        free(j);
     }
-    return -1;
 }
 
-/* Handle LIST_REQUEST from client */
-void handleListRequest(int sock, int clientIndex) {
+/* Reattach a parked session to a new connection from a RESUME frame: campus,
+   dept, token and the DELIVER frames the client has received. AUTH_OK tells
+   the client where its count resumes; then every retained DELIVER after that
+   is queued again, followed by anything routed while it was away.
+   Returns 0 if the socket must be closed. */
+int resumeSession(struct Conn *c, const struct Frame *fr) {
+    char campus[MAX_NAME], dept[MAX_NAME], token[64], seqStr[24], reply[MAX_MSG];
+    frameFieldCopy(campus, sizeof(campus), fr->f[0]);
+    frameFieldCopy(dept, sizeof(dept), fr->f[1]);
+    frameFieldCopy(token, sizeof(token), fr->f[2]);
+    frameFieldCopy(seqStr, sizeof(seqStr), fr->f[3]);
+    uint64_t have = strtoull(seqStr, NULL, 10);
+    int slot;
+    unsigned gen;
+    char keyHex[2 * sizeof(((struct Session*)0)->resumeKey) + 1];
+    uint8_t key[sizeof(((struct Session*)0)->resumeKey)];
+    int ok = sscanf(token, "%d:%u:%32s", &slot, &gen, keyHex) == 3 && slot >= 0 &&
+             hexDecode(key, sizeof(key), keyHex) == 0;
+
     pthread_mutex_lock(&clientsLock);
+    struct Session *s = ok ? sessionGet(((SessionHandle)gen << 32) | (uint32_t)slot) : NULL;
+    if(!s || !s->resumable || strcmp(s->campus, campus) != 0 || strcmp(s->dept, dept) != 0 ||
+       !equalConstTime(s->resumeKey, key, sizeof(key))) {
+        pthread_mutex_unlock(&clientsLock);
+        evLog(EV_WARN, "[SERVER] Resume FAILED for %s %s: no such session.\n", campus, dept);
+        metricAdd(M_AUTH_FAIL, 1);
+        sendReply(c->fd, 1, FRAME_AUTH_FAIL, "RESUME_FAILED");
+        return 0;
+    }
+    if(!s->parked) {
+        /* we have not seen the old connection drop yet; the client tries again */
+        pthread_mutex_unlock(&clientsLock);
+        sendReply(c->fd, 1, FRAME_AUTH_FAIL, "RESUME_BUSY");
+        return 0;
+    }
+
+    c->session = makeHandle(slot);
+    c->campusTat = names[s->campusId].rateTat;
+    pthread_mutex_lock(&s->outLock);
+    s->fd = c->fd;
+    s->conn = c;
+    s->owner = c->reactor;
+    s->flushPending = 0;
+    __atomic_store_n(&s->parked, 0, __ATOMIC_RELEASE);
+    if(have > s->deliverSeq) have = s->deliverSeq;
+    uint64_t oldest = !s->sent ? s->deliverSeq + 1 :
+                      s->deliverSeq >= (uint64_t)resumeWindow ? s->deliverSeq - resumeWindow + 1 : 1;
+    uint64_t from = have + 1 > oldest ? have + 1 : oldest;
+    struct OutBuf *b = makeAuthOk(s, from - 1);
+    if(b) {
+        queuePushLocked(s, b, LANE_URGENT, 0);
+        outBufRelease(b);
+    }
+    if(from > have + 1) {
+        snprintf(reply, sizeof(reply), "[SERVER] %llu message(s) sent while you were away could not be recovered.",
+                 (unsigned long long)(from - have - 1));
+        if((b = makeReply(1, FRAME_NOTICE, reply))) {
+            queuePushLocked(s, b, LANE_URGENT, 0);
+            outBufRelease(b);
+        }
+    }
+    /* the replay keeps its numbering: it goes out first and in order, ahead of anything new */
+    for(uint64_t seq = from; seq <= s->deliverSeq; seq++) queuePushLocked(s, s->sent[seq % resumeWindow], LANE_URGENT, 1);
+    uint64_t replayed = s->deliverSeq + 1 - from;
+    flushDeferLocked(s);
+    pthread_mutex_unlock(&s->outLock);
+
+    s->missed = 0;
+    armHeartbeat(s);
+    if(s->liveness != LIVE_ONLINE) {
+        s->liveness = LIVE_ONLINE;
+        publishPresence(s, LIVE_ONLINE);
+    }
+    if(__atomic_load_n(&s->logBacklog, __ATOMIC_ACQUIRE)) logStream(s);
+    if(spoolDir) xferStream(s);
+    pthread_mutex_unlock(&clientsLock);
+
+    strcpy(c->campus, campus);
+    strcpy(c->dept, dept);
+    handshakeUnlink(c);
+    c->state = CONN_ACTIVE;
+    metricAdd(M_RESUMED, 1);
+    metricAdd(M_RESUME_REPLAYED, replayed);
+    metricAdd(M_RESUME_LOST, from - have - 1);
+    histRecord(H_AUTH, nowNs() - c->acceptedNs);
+    evLog(EV_INFO, "[SERVER] %s %s resumed its session: %llu message(s) replayed, %llu lost.\n", campus, dept,
+                   (unsigned long long)replayed, (unsigned long long)(from - have - 1));
+    return 1;
+}
+
+/* Authenticate a legacy socket from its Campus:Dept:Password line. Returns 0 if the socket must be closed. */
+int handleLegacyHandshake(struct Conn *c, char *buf) {
+    int clientSock = c->fd;
+    /* Parse campus:dept:password format */
+    char campus[MAX_NAME], dept[MAX_NAME], pass[MAX_NAME];
     
-    /* Build list of connected campuses */
-    char listMsg[MAX_MSG * MAX_CLIENTS];
-    strcpy(listMsg, "[SERVER] Connected Campuses:\n");
+    /* Find first colon (campus:...) */
+    char *firstColon = strchr(buf, ':');
+    if(!firstColon) { 
+        sendHandshake(clientSock, "BAD_FORMAT: Use Campus:Dept:Password", 35); 
+        return 0; 
+    }
     
-    if(clientCount == 0) {
-        strcat(listMsg, "  No campuses connected.\n");
-    } else {
-        for(int i = 0; i < clientCount; i++) {
-            char entry[100];
-            char tsbuf[64] = "never";
-            
-            if(udpKnown[i]) {
-                struct tm *tm = localtime(&lastSeen[i]);
-                strftime(tsbuf, sizeof(tsbuf), "%H:%M:%S", tm);
-            }
-            
-            snprintf(entry, sizeof(entry), "  %d. %s - %s (Last seen: %s)\n", 
-                    i+1, clientCampus[i], clientDept[i], tsbuf);
-            strcat(listMsg, entry);
-        }
+    /* Find second colon (campus:dept:...) */
+    char *secondColon = strchr(firstColon + 1, ':');
+    if(!secondColon) { 
+        sendHandshake(clientSock, "BAD_FORMAT: Use Campus:Dept:Password", 35); 
+        return 0; 
     }
     
-    strcat(listMsg, "----------------------------\n");
+    /* Extract campus */
+    int pos1 = firstColon - buf;
+    if(pos1 >= MAX_NAME) pos1 = MAX_NAME-1;
+    strncpy(campus, buf, pos1); 
+    campus[pos1] = '\0';
     
-    /* Send the list to the requesting client */
-    send(sock, listMsg, strlen(listMsg), 0);
+    /* Extract department */
+    int pos2 = secondColon - (firstColon + 1);
+    if(pos2 >= MAX_NAME) pos2 = MAX_NAME-1;
+    strncpy(dept, firstColon + 1, pos2); 
+    dept[pos2] = '\0';
     
-    pthread_mutex_unlock(&clientsLock);
-    printf("[SERVER] Sent campus list to %s %s\n", clientCampus[clientIndex], clientDept[clientIndex]);
+    /* Extract password */
+    strncpy(pass, secondColon + 1, MAX_NAME-1); 
+    pass[MAX_NAME-1] = '\0';
+    pass[strcspn(pass, "\n")] = 0;
+
+    return startSession(c, campus, dept, pass);
 }
 
-/* handle TCP client messages */
-void *clientHandler(void *arg) {
-    int index = *((int*)arg);
-    int sock = tcpSockets[index];
-    char buf[MAX_MSG];
-    while(1) {
-        ssize_t n = read(sock, buf, sizeof(buf)-1);
+/* Authenticate a framed socket from its AUTH frame. Returns 0 if the socket must be closed. */
+int handleFrameHandshake(struct Conn *c, const struct Frame *fr) {
+    if(fr->type == FRAME_PEER_HELLO) return peerHello(c, fr);
+    if(fr->type == FRAME_PEER_PROOF) return peerCheckProof(c, fr);
+    if(c->dial >= 0) {
+        /* the node we dialled turned us down */
+        evLog(EV_WARN, "[FEDERATION] Peer %s refused the link: %.*s\n", dials[c->dial].addr,
+                       fr->nfields ? (int)fr->f[0].len : 0, fr->nfields ? fr->f[0].ptr : "");
+        return 0;
+    }
+    if(fr->type == FRAME_RESUME && fr->nfields == 4) return resumeSession(c, fr);
+    if(fr->type != FRAME_AUTH || fr->nfields != 3) {
+        sendReply(c->fd, 1, FRAME_AUTH_FAIL, "BAD_FORMAT: expected AUTH frame");
+        return 0;
+    }
+    char campus[MAX_NAME], dept[MAX_NAME], pass[MAX_NAME];
+    frameFieldCopy(campus, sizeof(campus), fr->f[0]);
+    frameFieldCopy(dept, sizeof(dept), fr->f[1]);
+    frameFieldCopy(pass, sizeof(pass), fr->f[2]);
+    return startSession(c, campus, dept, pass);
+}
+
+/* Where a connection reads into: its own buffer while it carries a partial
+   frame, otherwise the reactor thread's scratch buffer, so an idle
+   connection holds no receive buffer at all */
+__thread char *readScratch = NULL;
+
+char *connReadBuf(struct Conn *c) {
+    if(c->inBuf) return c->inBuf;
+    if(!readScratch) readScratch = malloc(connBufSize);
+    return readScratch;
+}
+
+/* Extract and handle every complete frame in buf, which holds c->inLen bytes
+   (see connReadBuf). Returns 0 if the connection must be closed. */
+int processFrames(struct Conn *c, char *buf) {
+    size_t off = 0;
+    while(off < c->inLen) {
+        struct Frame fr;
+        int used = frameParse(buf + off, c->inLen - off, &fr);
+        if(used < 0) {
+            evLog(EV_WARN, "[SERVER] Malformed frame from %s %s, closing.\n", c->campus, c->dept);
+            return 0;
+        }
+        if(used == 0) break;
+        /* over its rate: this frame and the rest wait in the buffer */
+        if(c->state == CONN_ACTIVE && fr.type == FRAME_SEND && !rateAdmit(c)) break;
+        off += used;
+        if(c->state == CONN_HANDSHAKE) {
+            if(!handleFrameHandshake(c, &fr)) return 0;
+            /* its password is being checked: the rest waits for the answer */
+            if(c->state == CONN_AUTH) break;
+        } else if(c->state == CONN_PEER) {
+            handlePeerFrame(c, &fr);
+            if(__atomic_load_n(&c->paused, __ATOMIC_ACQUIRE)) break;
+        } else if(fr.type == FRAME_BYE) {
+            c->bye = 1;
+            return 0;
+        } else {
+            handleFrame(c, &fr);
+            /* a receiver pushed back: leave the rest buffered until it drains */
+            if(__atomic_load_n(&c->paused, __ATOMIC_ACQUIRE)) break;
+        }
+    }
+    /* keep the partial tail for the next read, in a buffer of the connection's own */
+    size_t left = c->inLen - off;
+    if(left == 0 && c->inBuf) {
+        poolFree(c->inBuf);
+        c->inBuf = NULL;
+        __atomic_sub_fetch(&inBufsHeld, 1, __ATOMIC_RELAXED);
+    } else if(left > 0 && buf != c->inBuf) {
+        if(!(c->inBuf = poolAlloc(connBufSize))) return 0;
+        __atomic_add_fetch(&inBufsHeld, 1, __ATOMIC_RELAXED);
+        memcpy(c->inBuf, buf + off, left);
+    } else if(off > 0) {
+        memmove(c->inBuf, c->inBuf + off, left);
+    }
+    c->inLen = left;
+    return 1;
+}
+
+/* Drain a readable client socket (edge-triggered: read until EAGAIN) */
+void handleConnReadable(struct Conn *c) {
+    /* a rate limited connection is read again when its wait is over, one
+       waiting for its password check when the answer comes */
+    if(c->throttled || c->state == CONN_AUTH) return;
+    /* frames left over from before a POLICY_BLOCK pause or a rate limit come first */
+    if(c->framed == 1 && c->inLen > 0 && !processFrames(c, c->inBuf)) {
+        closeConn(c);
+        return;
+    }
+    size_t budget = READ_BUDGET;
+    while(!__atomic_load_n(&c->paused, __ATOMIC_ACQUIRE) && !c->throttled && c->state != CONN_AUTH) {
+        /* a sender streaming an attachment refills its socket as fast as it is
+           read; let the rest of the batch go first and pick it up after */
+        if(c->framed == 1 && budget == 0) {
+            throttleLink(c, nowNs());
+            return;
+        }
+        char *buf = connReadBuf(c);
+        if(!buf) {
+            closeConn(c);
+            return;
+        }
+        /* legacy clients send one text message per write and leave room for the terminator */
+        size_t room = connBufSize - c->inLen - 1;
+        if(c->framed == 0 && room > MAX_MSG - 1) room = MAX_MSG - 1;
+        if(room == 0) {
+            evLog(EV_WARN, "[SERVER] Frame from %s %s exceeds %zu bytes, closing.\n", c->campus, c->dept, connBufSize);
+            closeConn(c);
+            return;
+        }
+        ssize_t n = read(c->fd, buf + c->inLen, room);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
         if(n <= 0) {
-            printf("[SERVER] %s %s disconnected or socket closed.\n", clientCampus[index], clientDept[index]);
-            close(sock);
+            closeConn(c);
+            return;
+        }
+        if(c->traceId && traceRecord(TRACE_DATA, c->traceId, buf + c->inLen, n) < 0) c->traceId = 0;   /* cut */
+        if(c->framed < 0) {
+            /* a frame length header always starts with a zero byte, legacy text never does */
+            c->framed = (buf[0] == 0);
+            if(!c->framed && !legacyCompat) {
+                evLog(EV_WARN, "[SERVER] Rejecting legacy text client (strict framing).\n");
+                closeConn(c);
+                return;
+            }
+        }
+        if(c->framed) {
+            c->inLen += n;
+            budget = (size_t)n < budget ? budget - n : 0;
+            if(!processFrames(c, buf)) {
+                closeConn(c);
+                return;
+            }
+        } else {
+            buf[n] = '\0';
+            if(c->state == CONN_HANDSHAKE) {
+                if(!handleLegacyHandshake(c, buf)) {
+                    closeConn(c);
+                    return;
+                }
+            } else {
+                handleLegacyMessage(c, buf);
+            }
+        }
+    }
+}
 
-            pthread_mutex_lock(&clientsLock);
-            /* remove client by shifting arrays left */
-            for(int j=index;j<clientCount-1;j++) {
-                tcpSockets[j] = tcpSockets[j+1];
-                strcpy(clientCampus[j], clientCampus[j+1]);
-                strcpy(clientDept[j], clientDept[j+1]);  /* Copy department */
-                udpAddr[j] = udpAddr[j+1];
-                lastSeen[j] = lastSeen[j+1];
-                udpKnown[j] = udpKnown[j+1];
-            }
-            clientCount--;
-            pthread_mutex_unlock(&clientsLock);
-            pthread_exit(NULL);
+/* Accept every pending connection and hand it to a reactor round-robin */
+void handleAccept(struct Reactor *self) {
+    while(1) {
+        int clientSock = accept(self->listenFd, NULL, NULL);
+        if(clientSock < 0) {
+            if(errno == EINTR) continue;
+            return; /* EAGAIN: backlog drained */
         }
-        buf[n] = '\0';
-        printf("[TCP][%s %s] >> %s\n", clientCampus[index], clientDept[index], buf);
+        setNonBlocking(clientSock);
+        /* replies are small and latency bound, do not let Nagle hold them for the peer's delayed ACK */
+        int one = 1;
+        setsockopt(clientSock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct Conn *c = poolCalloc(sizeof(*c));
+        if(!c) { close(clientSock); continue; }
+        c->fd = clientSock;
+        c->acceptedNs = nowNs();
+        metricAdd(M_ACCEPTS, 1);
+        c->state = CONN_HANDSHAKE;
+        c->framed = -1;
+        c->dial = -1;
+        c->peer = -1;
+        if(traceFd >= 0) c->traceId = traceConnOpen();
+        evLog(EV_DEBUG, "[SERVER] New TCP client connected, awaiting credentials...\n");
 
-        /* Check if this is a LIST_REQUEST */
-        if(strcmp(buf, "LIST_REQUEST") == 0) {
-            handleListRequest(sock, index);
-            continue;
+        /* a shard keeps what it accepts; a lone acceptor deals connections round-robin */
+        struct Reactor *r = self;
+        if(!sharded) {
+            r = &reactors[nextReactor];
+            nextReactor = (nextReactor + 1) % numReactors;
+        }
+        c->epfd = r->epfd;
+        c->reactor = r - reactors;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, clientSock, &ev) < 0) {
+            perror("epoll_ctl");
+            close(clientSock);
+            poolFree(c);
+        }
+    }
+}
+
+/* Send prepared datagrams, UDP_BATCH per sendmmsg */
+void udpSendBatch(struct mmsghdr *msgs, int count) {
+    int sent = 0;
+    while(sent < count) {
+        int n = count - sent < UDP_BATCH ? count - sent : UDP_BATCH;
+        int r = sendmmsg(bcastSock, msgs + sent, n, 0);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            /* skip the datagram that failed and carry on with the rest */
+            r = 1;
         }
+        __atomic_add_fetch(&udpSendCalls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&udpDatagramsOut, r, __ATOMIC_RELAXED);
+        sent += r;
+    }
+}
 
-        char tgtCampus[MAX_NAME], tgtDept[MAX_NAME], message[MAX_MSG];
-        
-        char *firstPipe = strchr(buf, ',');
-        if(firstPipe == NULL) {
-            printf("[SERVER] Invalid message format from %s. Use TargetCampus,Dept,Message\n", clientCampus[index]);
-            char reply[MAX_MSG] = "[SERVER] Error: Use format TargetCampus,Dept,Message";
-            send(sock, reply, strlen(reply), 0);
-            continue;
+/* Resend the announcements a client reports missing ("epoch|a-b,c,..."),
+   at most ANN_REPAIR_MAX of them, and tell it which ones are gone for good */
+void annRepair(const struct sockaddr_in *to, const char *req) {
+    static char bufs[ANN_REPAIR_MAX][ANN_MAX];   /* reactor 0 only */
+    struct mmsghdr msgs[ANN_REPAIR_MAX + 1];
+    struct iovec iovs[ANN_REPAIR_MAX + 1];
+    char gone[HEARTBEAT_MAX];
+    unsigned epoch;
+    int off = 0, n = 0;
+    if(sscanf(req, "%u|%n", &epoch, &off) != 1 || off == 0) return;
+    int goneLen = snprintf(gone, sizeof(gone), "ANNGONE|%u|", epoch), goneStart = goneLen;
+    const char *p = req + off;
+    pthread_mutex_lock(&annLock);
+    annNacks++;
+    while(*p && n < ANN_REPAIR_MAX) {
+        char *end;
+        unsigned long from = strtoul(p, &end, 10), to = from;
+        if(end == p) break;
+        if(*end == '-') to = strtoul(end + 1, &end, 10);
+        p = *end == ',' ? end + 1 : end;
+        if(to < from || to - from > ANN_WINDOW) to = from;
+        for(unsigned long seq = from; seq <= to && n < ANN_REPAIR_MAX; seq++) {
+            struct Announcement *a = &annWindow[seq % ANN_WINDOW];
+            if(epoch == annEpoch && a->seq == seq) {
+                memcpy(bufs[n], a->data, a->len);
+                iovs[n].iov_base = bufs[n];
+                iovs[n].iov_len = a->len;
+                n++;
+                continue;
+            }
+            /* another run's epoch, or overwritten: the client stops asking */
+            if(goneLen < (int)sizeof(gone) - 24)
+                goneLen += snprintf(gone + goneLen, sizeof(gone) - goneLen, "%s%lu", goneLen > goneStart ? "," : "", seq);
+            annGone++;
         }
-        int pos1 = firstPipe - buf;
-        if(pos1 >= MAX_NAME) pos1 = MAX_NAME-1;
-        strncpy(tgtCampus, buf, pos1); 
-        tgtCampus[pos1] = '\0';
-        
-        char *secondPipe = strchr(firstPipe + 1, ',');
-        if(secondPipe == NULL) {
-            printf("[SERVER] Invalid message format from %s. Use TargetCampus,Dept,Message\n", clientCampus[index]);
-            char reply[MAX_MSG] = "[SERVER] Error: Use format TargetCampus,Dept,Message";
-            send(sock, reply, strlen(reply), 0);
-            continue;
+    }
+    annRepairs += n;
+    pthread_mutex_unlock(&annLock);
+    if(goneLen > goneStart) {
+        iovs[n].iov_base = gone;
+        iovs[n].iov_len = goneLen;
+        n++;
+    }
+    for(int i=0;i<n;i++) {
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = (void*)to;
+        msgs[i].msg_hdr.msg_namelen = sizeof(*to);
+    }
+    udpSendBatch(msgs, n);
+}
+
+/* One parsed heartbeat datagram */
+struct Heartbeat {
+    char campus[MAX_NAME];
+    char dept[MAX_NAME];
+    struct sockaddr_in from;
+    int result;        /* 2 = exact session, 1 = campus fallback, 0 = no session */
+    const char *nack;  /* "epoch|ranges" of a NACK datagram, NULL for a heartbeat */
+};
+
+/* Parse campus|dept from heartbeat, or NACK|campus|dept|epoch|ranges */
+void parseHeartbeat(char *buf, struct Heartbeat *hb) {
+    hb->nack = NULL;
+    if(strncmp(buf, "NACK|", 5) == 0) {
+        char *campus = buf + 5, *dept = strchr(campus, '|');
+        char *rest = dept ? strchr(dept + 1, '|') : NULL;
+        if(!rest) {
+            hb->campus[0] = hb->dept[0] = 0;
+            return;
+        }
+        *dept++ = 0;
+        *rest++ = 0;
+        snprintf(hb->campus, MAX_NAME, "%s", campus);
+        snprintf(hb->dept, MAX_NAME, "%s", dept);
+        hb->nack = rest;
+        return;
+    }
+    char *pipe = strchr(buf, '|');
+    if(pipe == NULL) {
+
+        strncpy(hb->campus, buf, MAX_NAME-1); 
+        hb->campus[MAX_NAME-1]=0;
+        strcpy(hb->dept, "Unknown");
+    } else {
+        /* New format: campus|dept */
+        int pos = pipe - buf;
+        if(pos >= MAX_NAME) pos = MAX_NAME-1;
+        strncpy(hb->campus, buf, pos); 
+        hb->campus[pos] = '\0';
+        strncpy(hb->dept, pipe + 1, MAX_NAME-1); 
+        hb->dept[MAX_NAME-1] = '\0';
+    }
+}
+
+/* UDP heartbeats (port 6000): drain the socket a batch at a time with recvmmsg,
+   parse the batch outside the lock, then apply all of it under one clientsLock */
+void handleUdpReadable(void) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    char bufs[UDP_BATCH][HEARTBEAT_MAX];
+    struct Heartbeat hbs[UDP_BATCH];
+    while(1) {
+        for(int i=0;i<UDP_BATCH;i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = HEARTBEAT_MAX - 1;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &hbs[i].from;
+            msgs[i].msg_hdr.msg_namelen = sizeof(hbs[i].from);
+        }
+        int n = recvmmsg(udpSock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return; /* EAGAIN: no more datagrams */
+        udpRecvCalls++;
+        udpDatagramsIn += n;
+        if(traceFd >= 0) {
+            pthread_mutex_lock(&traceLock);
+            for(int i=0;i<n;i++) traceAppendLocked(TRACE_UDP, 0, bufs[i], msgs[i].msg_len);
+            pthread_mutex_unlock(&traceLock);
+        }
+
+        for(int i=0;i<n;i++) {
+            bufs[i][msgs[i].msg_len] = '\0';
+            parseHeartbeat(bufs[i], &hbs[i]);
         }
-        int pos2 = secondPipe - (firstPipe + 1);
-        if(pos2 >= MAX_NAME) pos2 = MAX_NAME-1;
-        strncpy(tgtDept, firstPipe + 1, pos2);
-        tgtDept[pos2] = '\0';
-        
-        /* Get Message */
-        strcpy(message, secondPipe + 1);
 
         pthread_mutex_lock(&clientsLock);
-        int destIdx = findClientByCampusAndDept(tgtCampus, tgtDept);
-        if(destIdx == -1) {
-            /* Try to find any client from that campus if department not found */
-            int campusIdx = findClientByCampus(tgtCampus);
-            if(campusIdx == -1) {
-                char reply[MAX_MSG];
-                snprintf(reply, sizeof(reply), "[SERVER] Target campus %s not connected.", tgtCampus);
-                send(sock, reply, strlen(reply), 0);
-                printf("[SERVER] Could not route message from %s %s to %s %s (not connected).\n", 
-                       clientCampus[index], clientDept[index], tgtCampus, tgtDept);
-            } else {
-                /* Forward to any department in that campus */
-                char forward[MAX_MSG];
-                snprintf(forward, sizeof(forward), "[%s %s -> %s %s] %s", 
-                        clientCampus[index], clientDept[index], tgtCampus, tgtDept, message);
-                send(tcpSockets[campusIdx], forward, strlen(forward), 0);
-                printf("[SERVER] Routed message from %s %s to %s (department %s not found, sent to campus).\n", 
-                       clientCampus[index], clientDept[index], tgtCampus, tgtDept);
+        for(int i=0;i<n;i++) {
+            struct Heartbeat *hb = &hbs[i];
+            if(msgs[i].msg_len == 0) { hb->result = -1; continue; }
+            /* Try to find by campus AND department first */
+            int idx = findClientByCampusAndDept(hb->campus, hb->dept);
+            if(hb->nack) {
+                /* repairs only go back to the address that session heartbeats from */
+                struct Session *s = idx >= 0 ? &sessions[idx] : NULL;
+                hb->result = s && s->udpKnown && s->udpAddr.sin_addr.s_addr == hb->from.sin_addr.s_addr &&
+                             s->udpAddr.sin_port == hb->from.sin_port ? 3 : -1;
+                continue;
             }
-        } else {
-            /* Exact match found - send to specific department */
-            char forward[MAX_MSG];
-            snprintf(forward, sizeof(forward), "[%s %s -> %s %s] %s", 
-                    clientCampus[index], clientDept[index], tgtCampus, tgtDept, message);
-            send(tcpSockets[destIdx], forward, strlen(forward), 0);
-            printf("[SERVER] Routed message from %s %s to %s %s.\n", 
-                   clientCampus[index], clientDept[index], tgtCampus, tgtDept);
+            hb->result = 2;
+            if(idx < 0) {
+                /* Fallback: find by campus only */
+                idx = findClientByCampus(hb->campus);
+                hb->result = idx >= 0 ? 1 : 0;
+            }
+            if(idx >= 0) recordHeartbeat(&sessions[idx], &hb->from);
+            metricAdd(idx >= 0 ? M_HEARTBEATS : M_HEARTBEAT_UNKNOWN, 1);
+        }
+        pthread_mutex_unlock(&clientsLock);
+
+        for(int i=0;i<n;i++) {
+            struct Heartbeat *hb = &hbs[i];
+            if(hb->result == 2)
+                evLog(EV_DEBUG, "[UDP][HEARTBEAT] %s %s (stored UDP addr). LastSeen updated.\n", hb->campus, hb->dept);
+            else if(hb->result == 1)
+                evLog(EV_DEBUG, "[UDP][HEARTBEAT] %s (department %s, stored UDP addr). LastSeen updated.\n", hb->campus, hb->dept);
+            else if(hb->result == 0)
+                evLog(EV_DEBUG, "[UDP][HEARTBEAT] Received from %s %s but no TCP session found.\n", hb->campus, hb->dept);
+            else if(hb->result == 3)
+                annRepair(&hb->from, hb->nack);
         }
+        if(n < UDP_BATCH) return; /* short batch: socket drained */
+    }
+}
+
+/* Send one datagram to every session with a known UDP address. Addresses are
+   copied out under the lock; the sends happen after, UDP_BATCH per sendmmsg.
+   Returns the number of recipients. */
+int udpSendAll(const char *msg, size_t len) {
+    pthread_mutex_lock(&clientsLock);
+    int count = 0;
+    struct sockaddr_in *addrs = poolAlloc((clientCount + 1) * sizeof(*addrs));
+    if(!addrs) {
         pthread_mutex_unlock(&clientsLock);
+        return 0;
     }
-    return NULL;
+    for(int i = allHead; i >= 0; i = sessions[i].allNext) {
+        if(sessions[i].udpKnown) addrs[count++] = sessions[i].udpAddr;
+    }
+    pthread_mutex_unlock(&clientsLock);
+
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov = { (void*)msg, len };
+    for(int sent = 0; sent < count; sent += UDP_BATCH) {
+        int n = count - sent < UDP_BATCH ? count - sent : UDP_BATCH;
+        for(int i=0;i<n;i++) {
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iov;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[sent + i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[sent + i]);
+        }
+        udpSendBatch(msgs, n);
+    }
+    poolFree(addrs);
+    return count;
 }
 
-/*UDP listener for heartbeats (port 6000) */
-void *udpListener(void *arg) {
-    int udpSock = socket(AF_INET, SOCK_DGRAM, 0);
-    struct sockaddr_in servAddr, cliAddr;
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_port = htons(UDP_PORT);
-    servAddr.sin_addr.s_addr = INADDR_ANY;
-    bind(udpSock, (struct sockaddr*)&servAddr, sizeof(servAddr));
-    char buf[256];
-    socklen_t addrLen = sizeof(cliAddr);
+/* Number an admin announcement, keep it for repairs and send it to everyone */
+int broadcastAnnouncement(const char *msg, size_t len) {
+    char buf[ANN_MAX];
+    pthread_mutex_lock(&annLock);
+    uint32_t seq = ++annSeq;
+    struct Announcement *a = &annWindow[seq % ANN_WINDOW];
+    int n = snprintf(a->data, sizeof(a->data), "ANN|%u|%u|%.*s", annEpoch, seq, (int)len, msg);
+    a->len = n < (int)sizeof(a->data) ? n : (int)sizeof(a->data) - 1;
+    a->seq = seq;
+    memcpy(buf, a->data, a->len);
+    size_t bufLen = a->len;
+    annSpmDue = nowNs() + ANN_SPM_FIRST;
+    annSpmLeft = 2;
+    pthread_mutex_unlock(&annLock);
+    return udpSendAll(buf, bufLen);
+}
+
+/* Announce the latest sequence number after a broadcast, so a client that
+   lost the last announcements sees the gap. Runs on reactor 0's tick. */
+void annSpmTick(void) {
+    pthread_mutex_lock(&annLock);
+    uint64_t now = nowNs();
+    int due = annSpmLeft > 0 && now >= annSpmDue;
+    if(due) {
+        annSpmLeft--;
+        annSpmDue = now + ANN_SPM_LATER;
+    }
+    uint32_t seq = annSeq;
+    pthread_mutex_unlock(&annLock);
+    if(!due) return;
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "ANNSEQ|%u|%u", annEpoch, seq);
+    udpSendAll(buf, len);
+}
+
+/* Close every connection whose handshake deadline has passed */
+void handshakeExpire(struct Reactor *r) {
+    uint64_t now = nowNs();
+    while(r->hsHead && r->hsHead->hsDeadline <= now) {
+        struct Conn *c = r->hsHead;
+        evLog(EV_WARN, "[SERVER] No credentials within %d s, closing connection.\n", authTimeoutSecs);
+        metricAdd(M_AUTH_TIMEOUT, 1);
+        if(c->framed >= 0) sendReply(c->fd, c->framed, FRAME_AUTH_FAIL, "AUTH_TIMEOUT");
+        closeConn(c);
+    }
+}
+
+/* epoll_wait with a timeout in nanoseconds (-1 = none). epoll_pwait2 keeps
+   sub-millisecond -W windows exact; kernels without it get whole milliseconds. */
+int noPwait2 = 0;
+int reactorWait(struct Reactor *r, struct epoll_event *events, int64_t timeoutNs) {
+    if(timeoutNs >= 0 && !noPwait2) {
+        struct timespec ts = { timeoutNs / 1000000000, timeoutNs % 1000000000 };
+        int n = epoll_pwait2(r->epfd, events, MAX_EVENTS, &ts, NULL);
+        if(n >= 0 || errno != ENOSYS) return n;
+        noPwait2 = 1;
+    }
+    return epoll_wait(r->epfd, events, MAX_EVENTS, timeoutNs < 0 ? -1 : (int)((timeoutNs + 999999) / 1000000));
+}
+
+/* Event loop for one reactor thread */
+void *reactorLoop(void *arg) {
+    struct Reactor *r = arg;
+    struct epoll_event events[MAX_EVENTS];
+    threadSlot = r - reactors;
+    currentReactor = r - reactors;
     while(1) {
-        ssize_t n = recvfrom(udpSock, buf, sizeof(buf)-1, 0, (struct sockaddr*)&cliAddr, &addrLen);
-        if(n > 0) {
-            buf[n] = '\0';
-            /* Parse campus|dept from heartbeat */
-            char campusName[MAX_NAME], deptName[MAX_NAME];
-            char *pipe = strchr(buf, '|');
-            if(pipe == NULL) {
-
-                strncpy(campusName, buf, MAX_NAME-1); 
-                campusName[MAX_NAME-1]=0;
-                strcpy(deptName, "Unknown");
-            } else {
-                /* New format: campus|dept */
-                int pos = pipe - buf;
-                if(pos >= MAX_NAME) pos = MAX_NAME-1;
-                strncpy(campusName, buf, pos); 
-                campusName[pos] = '\0';
-                strncpy(deptName, pipe + 1, MAX_NAME-1); 
-                deptName[MAX_NAME-1] = '\0';
-            }
-            
-            pthread_mutex_lock(&clientsLock);
-            /* Try to find by campus AND department first */
-            int idx = findClientByCampusAndDept(campusName, deptName);
-            if(idx >= 0) {
-                udpAddr[idx] = cliAddr;
-                lastSeen[idx] = time(NULL);
-                udpKnown[idx] = 1;
-                printf("[UDP][HEARTBEAT] %s %s (stored UDP addr). LastSeen updated.\n", campusName, deptName);
-            } else {
-                /* Fallback: find by campus only */
-                idx = findClientByCampus(campusName);
-                if(idx >= 0) {
-                    udpAddr[idx] = cliAddr;
-                    lastSeen[idx] = time(NULL);
-                    udpKnown[idx] = 1;
-                    printf("[UDP][HEARTBEAT] %s (department %s, stored UDP addr). LastSeen updated.\n", campusName, deptName);
-                } else {
-                    printf("[UDP][HEARTBEAT] Received from %s %s but no TCP session found.\n", campusName, deptName);
+        /* sleep no longer than the oldest handshake deadline, coalescing window or rate limit wait */
+        int64_t timeout = -1;
+        if(r->hsHead || r->deferCount || r->thrHead) {
+            uint64_t now = nowNs(), due = UINT64_MAX;
+            if(r->hsHead) due = r->hsHead->hsDeadline;
+            if(r->thrHead && r->thrHead->thrUntil < due) due = r->thrHead->thrUntil;
+            if(r->deferCount && sessions[(uint32_t)r->deferred[0]].flushDue < due)
+                due = sessions[(uint32_t)r->deferred[0]].flushDue;
+            timeout = due <= now ? 0 : (int64_t)(due - now);
+        }
+        int n = reactorWait(r, events, timeout);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for(int i=0;i<n;i++) {
+            void *tag = events[i].data.ptr;
+            if(tag == TAG_LISTEN) handleAccept(r);
+            else if(tag == TAG_INBOX) handleInbox(r);
+            else if(tag == TAG_UDP) handleUdpReadable();
+            else if(tag == TAG_TIMER) handleTimer();
+            else {
+                struct Conn *c = tag;
+                if(c->state == CONN_DIAL) {
+                    peerConnected(c);
+                    continue;
                 }
+                /* registration reports EPOLLOUT at once, so the owner sees every new connection here */
+                if(c->state == CONN_HANDSHAKE && !c->hsLinked) handshakeLink(r, c);
+                /* EPOLLOUT: the socket has room again, write what is queued */
+                if((events[i].events & EPOLLOUT) && (c->state == CONN_ACTIVE || c->state == CONN_PEER))
+                    flushSession(connSession(c));
+                handleConnReadable(c);
             }
-            pthread_mutex_unlock(&clientsLock);
         }
+        /* write what the batch queued, one writev per session */
+        if(r->deferCount) flushDeferred(r);
+        /* after the batch, so no event left in it can name a connection closed here */
+        if(r->authDone) authFinish(r);
+        if(r->hsHead) handshakeExpire(r);
+        if(r->thrHead) throttleExpire(r);
     }
     return NULL;
 }
 
+/* Sum every thread's metrics into one */
+void metricsCollect(struct Metrics *sum) {
+    memset(sum, 0, sizeof(*sum));
+    for(int t=0;t<MAX_THREAD_SLOTS;t++) {
+        for(int m=0;m<M_COUNTERS;m++)
+            sum->counters[m] += __atomic_load_n(&metrics[t].counters[m], __ATOMIC_RELAXED);
+        for(int h=0;h<H_HISTS;h++)
+            for(int i=0;i<HIST_BUCKETS;i++)
+                sum->hist[h][i] += __atomic_load_n(&metrics[t].hist[h][i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Value at quantile q (0..1) of a histogram, in ns; 0 if it is empty */
+uint64_t histQuantile(const unsigned long *hist, unsigned long total, double q) {
+    if(total == 0) return 0;
+    unsigned long rank = (unsigned long)(q * (total - 1)) + 1, seen = 0;
+    for(int i=0;i<HIST_BUCKETS;i++) {
+        seen += hist[i];
+        if(seen >= rank) return histValue(i);
+    }
+    return histValue(HIST_BUCKETS - 1);
+}
+
+/* Admin 'stats' (human readable) and 'stats json' (one line for scripts) */
+void printStats(int json) {
+    static struct Metrics sum;          /* only the admin thread prints */
+    static unsigned long lastHeartbeats = 0;
+    static uint64_t lastNs = 0;
+    metricsCollect(&sum);
+    uint64_t now = nowNs();
+    if(!lastNs) lastNs = startNs;
+    double hbRate = (sum.counters[M_HEARTBEATS] - lastHeartbeats) / ((now - lastNs + 1) / 1e9);
+    lastHeartbeats = sum.counters[M_HEARTBEATS];
+    lastNs = now;
+
+    if(json) printf("{\"counters\":{");
+    else printf("---- Server stats ----\n");
+    for(int m=0;m<M_COUNTERS;m++) {
+        if(json) printf("%s\"%s\":%lu", m ? "," : "", counterNames[m], sum.counters[m]);
+        else printf("%-20s %lu\n", counterNames[m], sum.counters[m]);
+    }
+    if(json) printf("},\"heartbeats_per_s\":%.1f,\"latency_us\":{", hbRate);
+    else printf("%-20s %.1f/s since the last 'stats' (or startup)\n", "heartbeat rate", hbRate);
+    static const double qs[] = { 0.5, 0.99, 0.999, 1.0 };
+    static const char *qNames[] = { "p50", "p99", "p999", "max" };
+    for(int h=0;h<H_HISTS;h++) {
+        unsigned long total = 0;
+        for(int i=0;i<HIST_BUCKETS;i++) total += sum.hist[h][i];
+        if(json) printf("%s\"%s\":{\"count\":%lu", h ? "," : "", histNames[h], total);
+        else printf("%-20s count=%lu", histNames[h], total);
+        for(int k=0;k<4;k++) {
+            double us = histQuantile(sum.hist[h], total, qs[k]) / 1000.0;
+            if(json) printf(",\"%s\":%.1f", qNames[k], us);
+            else printf(" %s=%.1fus", qNames[k], us);
+        }
+        printf(json ? "}" : "\n");
+    }
+    size_t slabBytes = __atomic_load_n(&poolSlabBytes, __ATOMIC_RELAXED), depotBytes = poolDepotBytes();
+    if(json) printf("},\"pool\":{\"slab_bytes\":%zu,\"depot_free_bytes\":%zu", slabBytes, depotBytes);
+    else printf("%-20s %zu KB in slabs, %zu KB free in the shared depot\n", "buffer pool", slabBytes / 1024, depotBytes / 1024);
+    if(json) printf("},\"campuses\":{");
+    else printf("Per campus (messages/bytes routed out, in):\n");
+    /* copy under the lock, print after */
+    pthread_mutex_lock(&clientsLock);
+    int count = 0;
+    struct Name *copy = malloc((nameCount ? nameCount : 1) * sizeof(*copy));
+    for(int i=0;copy && i<nameCount;i++)
+        if(names[i].msgsOut || names[i].msgsIn) copy[count++] = names[i];
+    pthread_mutex_unlock(&clientsLock);
+    for(int i=0;i<count;i++) {
+        struct Name *n = &copy[i];
+        if(json) printf("%s\"%s\":{\"msgs_out\":%lu,\"bytes_out\":%lu,\"msgs_in\":%lu,\"bytes_in\":%lu}",
+                        i ? "," : "", n->str, n->msgsOut, n->bytesOut, n->msgsIn, n->bytesIn);
+        else printf("  %-12s out %lu/%lu  in %lu/%lu\n", n->str, n->msgsOut, n->bytesOut, n->msgsIn, n->bytesIn);
+    }
+    free(copy);
+    printf(json ? "}}\n" : "----------------------\n");
+    fflush(stdout);
+}
+
+/* Admin 'mem': what sessions cost. Slots are set up on first use and an
+   idle connection holds no receive buffer, so an idle session is its slot,
+   its connection, its (small) queue arrays and its kernel socket. */
+void printMemory(void) {
+    pthread_mutex_lock(&clientsLock);
+    int count = clientCount, committed = slotsCommitted;
+    pthread_mutex_unlock(&clientsLock);
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%*d %ld", &pages) != 1) pages = 0;
+        fclose(f);
+    }
+    size_t rss = (size_t)pages * sysconf(_SC_PAGESIZE);
+    size_t queues = poolBlockSize(OUTQ_INITIAL * sizeof(struct OutEntry));
+    printf("---- Session memory ----\n");
+    printf("sessions             %d connected, %d of %d slots committed\n", count, committed, maxSessions);
+    printf("slot                 %zu bytes\n", sizeof(struct Session));
+    printf("connection           %zu bytes (pool block)\n", poolBlockSize(sizeof(struct Conn)));
+    printf("queue arrays         %zu bytes per lane from its first message, doubling as a lane grows\n", queues);
+    printf("input buffer         %zu bytes while a partial frame is held (%d held now)\n",
+           poolBlockSize(connBufSize), __atomic_load_n(&inBufsHeld, __ATOMIC_RELAXED));
+    printf("resume window        %zu bytes from the first delivery, with -R\n", poolBlockSize(resumeWindow * sizeof(struct OutBuf *)));
+    printf("process RSS          %zu KB", rss / 1024);
+    if(count) printf(", %zu bytes per connected session", rss / count);
+    printf("\n------------------------\n");
+    fflush(stdout);
+}
+
 void *adminConsole(void *arg) {
+    (void)arg;
+    threadSlot = MAX_REACTORS;
     char line[1024];
     while(1) {
-        if(!fgets(line, sizeof(line), stdin)) continue;
+        if(!fgets(line, sizeof(line), stdin)) {
+            /* no console attached (headless or benchmark run): stop polling stdin */
+            if(feof(stdin)) break;
+            continue;
+        }
         line[strcspn(line, "\n")] = 0;
         if(strncmp(line, "list", 4)==0) {
-            pthread_mutex_lock(&clientsLock);
-            printf("---- Connected campuses (%d) ----\n", clientCount);
-            for(int i=0;i<clientCount;i++) {
+            struct PresenceSnap *p = presenceAcquire();
+            int count = p ? p->count : 0;
+            printf("---- Connected campuses (%d) ----\n", count);
+            for(int n=0;n<count;n++) {
+                struct PresenceEntry *e = &p->entries[n];
                 char tsbuf[64] = "never";
-                if(udpKnown[i]) {
-                    struct tm *tm = localtime(&lastSeen[i]);
-                    strftime(tsbuf, sizeof(tsbuf), "%Y-%m-%d %H:%M:%S", tm);
+                if(e->udpKnown) {
+                    struct tm tm;
+                    localtime_r(&e->lastSeen, &tm);
+                    strftime(tsbuf, sizeof(tsbuf), "%Y-%m-%d %H:%M:%S", &tm);
                 }
-                printf("%d) %s | Dept: %s | TCPFD=%d | UDP known=%d | lastSeen=%s\n", 
-                       i+1, clientCampus[i], clientDept[i], tcpSockets[i], udpKnown[i], tsbuf);
+                /* queue depth is read live; slots never move, so this is safe even if the session left */
+                struct Session *s = &sessions[(uint32_t)e->handle];
+                pthread_mutex_lock(&s->outLock);
+                int qLen = queueCountLocked(s);
+                size_t qBytes = s->outBytes;
+                unsigned long dropped = s->outDropped;
+                pthread_mutex_unlock(&s->outLock);
+                printf("%d) %s | Dept: %s | TCPFD=%d | UDP known=%d | lastSeen=%s | %s | outQ=%d msgs/%zu bytes | dropped=%lu\n", 
+                       n + 1, e->campus, e->dept, e->fd, e->udpKnown, tsbuf, liveNames[e->liveness], qLen, qBytes, dropped);
             }
+            presenceRelease();
+            printf("Backpressure: policy=%s high=%zu low=%zu bytes\n",
+                   policyNames[backpressurePolicy], highWatermark, lowWatermark);
+            printf("Heartbeats: every %d s, suspect after %d missed, evict after %d missed\n",
+                   heartbeatSecs, suspectAfter, offlineAfter);
+            printf("Resume: dropped sessions held %d s, last %d deliveries kept\n", resumeGraceSecs, resumeWindow);
+            char sr[48], cr[48];
+            printf("Rate limits: per session %s, per campus %s\n",
+                   rateDescribe(&sessionRate, sr, sizeof(sr)), rateDescribe(&campusRate, cr, sizeof(cr)));
             printf("------------------------------\n");
-            pthread_mutex_unlock(&clientsLock);
         } else if(strncmp(line, "broadcast ", 10)==0) {
             char *msg = line + 10;
+            int sent = broadcastAnnouncement(msg, strlen(msg));
+            printf("[ADMIN] Broadcast sent to %d clients: %s\n", sent, msg);
+        } else if(strncmp(line, "udpstats", 8)==0) {
+            unsigned long in = udpDatagramsIn, calls = udpRecvCalls;
+            unsigned long out = __atomic_load_n(&udpDatagramsOut, __ATOMIC_RELAXED);
+            unsigned long sends = __atomic_load_n(&udpSendCalls, __ATOMIC_RELAXED);
+            printf("[ADMIN] UDP in: %lu datagrams in %lu recvmmsg calls (%.1f per call)\n",
+                   in, calls, calls ? (double)in / calls : 0.0);
+            printf("[ADMIN] UDP out: %lu datagrams in %lu sendmmsg calls (%.1f per call)\n",
+                   out, sends, sends ? (double)out / sends : 0.0);
+            pthread_mutex_lock(&annLock);
+            printf("[ADMIN] Announcements: epoch %u, last seq %u; %lu NACKs, %lu resent, %lu past the %d-announcement window\n",
+                   annEpoch, annSeq, annNacks, annRepairs, annGone, ANN_WINDOW);
+            pthread_mutex_unlock(&annLock);
+        } else if(strncmp(line, "group ", 6)==0) {
+            /* group add|del <name> <Campus> <Dept> */
+            char op[8], name[MAX_NAME], campus[MAX_NAME], dept[MAX_NAME];
+            if(sscanf(line + 6, "%7s %39s %39s %39s", op, name, campus, dept) != 4 ||
+               (strcmp(op, "add") != 0 && strcmp(op, "del") != 0)) {
+                printf("[ADMIN] Usage: group add|del <name> <Campus> <Dept>\n");
+                continue;
+            }
             pthread_mutex_lock(&clientsLock);
-            int udpSock = socket(AF_INET, SOCK_DGRAM, 0);
-            for(int i=0;i<clientCount;i++) {
-                if(udpKnown[i]) {
-                    sendto(udpSock, msg, strlen(msg), 0, (struct sockaddr*)&udpAddr[i], sizeof(udpAddr[i]));
-                }
+            int rc = op[0] == 'a' ? groupAdd(name, campus, dept) : groupRemove(name, campus, dept);
+            pthread_mutex_unlock(&clientsLock);
+            if(rc < 0) printf("[ADMIN] %s %s is %s group %s\n", campus, dept, op[0] == 'a' ? "already in" : "not in", name);
+            else printf("[ADMIN] Group %s: %s %s %s\n", name, op[0] == 'a' ? "added" : "removed", campus, dept);
+        } else if(strncmp(line, "groups", 6)==0) {
+            pthread_mutex_lock(&clientsLock);
+            printf("---- Groups (%d) ----\n", groupCount);
+            for(int g=0;g<groupCount;g++) {
+                printf("@%s:", groups[g].name);
+                for(int k=0;k<groups[g].count;k++)
+                    printf(" %s/%s", names[groups[g].members[k].campusId].str, names[groups[g].members[k].deptId].str);
+                printf("\n");
+            }
+            pthread_mutex_unlock(&clientsLock);
+        } else if(strncmp(line, "peers", 5)==0) {
+            pthread_mutex_lock(&clientsLock);
+            printf("---- Federation: node %s, %d peer(s) ----\n", nodeName, peerCount);
+            for(int p=0;p<peerCount;p++)
+                printf("%s | %s | remote sessions=%d | forwarded out=%lu in=%lu\n", peers[p].name,
+                       peers[p].conn ? (peers[p].dialledByUs ? "up (dialled)" : "up (accepted)") : "down",
+                       peers[p].remoteCount, peers[p].fwdOut, peers[p].fwdIn);
+            for(int d=0;d<dialCount;d++)
+                printf("dial %s -> %s%s\n", dials[d].addr, dials[d].name[0] ? dials[d].name : "(not reached yet)",
+                       dials[d].dialing ? ", connecting" : "");
+            pthread_mutex_unlock(&clientsLock);
+        } else if(strncmp(line, "stats", 5)==0) {
+            printStats(strcmp(line + 5, " json") == 0);
+        } else if(strncmp(line, "shards", 6)==0) {
+            printf("[ADMIN] %d %s\n", numReactors, sharded ? "shards with their own listening sockets" : "reactors, one acceptor");
+            for(int i=0;i<numReactors;i++) {
+                unsigned long in = reactors[i].handoffsIn, wakes = reactors[i].wakeups;
+                printf("[ADMIN] reactor %d: %lu messages handed in over %lu wakeups (%.1f per wakeup)\n",
+                       i, in, wakes, wakes ? (double)in / wakes : 0.0);
             }
-            close(udpSock);
-            printf("[ADMIN] Broadcast sent to %d clients: %s\n", clientCount, msg);
+        } else if(strncmp(line, "loglevel", 8)==0) {
+            int lv = line[8] == ' ' ? evLevelParse(line + 9) : -2;
+            if(lv == -1) printf("[ADMIN] Log levels: debug, info, warn, error\n");
+            else if(lv >= 0) __atomic_store_n(&evLevel, lv, __ATOMIC_RELAXED);
+            if(lv != -1) printf("[ADMIN] Log level is %s\n", evLevelNames[__atomic_load_n(&evLevel, __ATOMIC_RELAXED)]);
+        } else if(strcmp(line, "mem")==0) {
+            printMemory();
+        } else if(strncmp(line, "logstats", 8)==0) {
+            if(!logDir) {
+                printf("[ADMIN] Message log is off (start the server with -L dir)\n");
+                continue;
+            }
+            pthread_mutex_lock(&logLock);
+            int pending = 0, boxes = 0;
+            for(int i=0;i<mailboxCount;i++) {
+                pending += mailboxes[i].count;
+                if(mailboxes[i].count) boxes++;
+            }
+            printf("[ADMIN] Log %s: %d segment(s), %d message(s) waiting for %d department(s)\n",
+                   logDir, logSegCount, pending, boxes);
+            printf("[ADMIN] Stored %lu, delivered %lu, %lu records flushed in %lu syncs (%.1f per sync), %lu failed syncs\n",
+                   logStored, logDelivered, logSyncedRecords, logSyncs,
+                   logSyncs ? (double)logSyncedRecords / logSyncs : 0.0, logSyncErrors);
+            pthread_mutex_unlock(&logLock);
+        } else if(strncmp(line, "files", 5)==0) {
+            if(!spoolDir) {
+                printf("[ADMIN] Attachments are off (start the server with -T dir)\n");
+                continue;
+            }
+            pthread_mutex_lock(&clientsLock);
+            pthread_mutex_lock(&xferLock);
+            int count = 0;
+            for(struct Xfer *x = xfers; x; x = x->next) count++;
+            printf("---- Attachments (%d in progress, %lu delivered, %lu expired; relay by %s) ----\n",
+                   count, xferDone, xferExpired, xferCopy ? "copy" : "sendfile");
+            for(struct Xfer *x = xfers; x; x = x->next)
+                printf("%016llx %s | %s %s -> %s %s | %llu bytes, %llu spooled, %llu delivered%s\n",
+                       (unsigned long long)x->id, x->name, x->fromCampus, x->fromDept, names[x->toCampus].str,
+                       names[x->toDept].str, (unsigned long long)x->size, (unsigned long long)x->spooled,
+                       (unsigned long long)x->acked, x->to != NO_SESSION ? ", relaying" : "");
+            pthread_mutex_unlock(&xferLock);
             pthread_mutex_unlock(&clientsLock);
         } else {
-            printf("Admin commands: 'list' or 'broadcast <message>'\n");
+            printf("Admin commands: 'list', 'broadcast <message>', 'group add|del <name> <Campus> <Dept>', 'groups',\n"
+                   "                'stats [json]', 'mem', 'loglevel [level]', 'udpstats', 'logstats', 'files', 'shards' or 'peers'\n");
         }
     }
     return NULL;
 }
 
-int main() {
-    pthread_t up;
-    pthread_create(&up, NULL, udpListener, NULL);
-    pthread_t adm;
-    pthread_create(&adm, NULL, adminConsole, NULL);
+/* Register a shared socket with reactor 0 */
+int addToReactor(struct Reactor *r, int fd, void *tag) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = tag;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-    int serverSock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in servAddr;
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_port = htons(TCP_PORT);
-    servAddr.sin_addr.s_addr = INADDR_ANY;
-    bind(serverSock, (struct sockaddr*)&servAddr, sizeof(servAddr));
-    listen(serverSock, 5);
-    printf("[SERVER] TCP listening on port %d\n", TCP_PORT);
-    printf("[SERVER] UDP listening on port %d\n", UDP_PORT);
-    printf("[SERVER] Admin console ready. Type 'list' or 'broadcast <message>'\n");
+/* -q / -Q rate[:burst]: messages a second, bucket size (default one
+   second's worth); rate 0 turns the limit off */
+int parseRate(const char *arg, struct RateLimit *rl) {
+    double rate = 0;
+    int burst = 0;
+    if(sscanf(arg, "%lf:%d", &rate, &burst) < 1 || rate < 0 || rate > 1e9 || burst < 0) return -1;
+    if(rate == 0) {
+        rl->interval = rl->burst = 0;
+        return 0;
+    }
+    if(burst == 0) burst = rate < 1 ? 1 : (int)rate;
+    rl->interval = (uint64_t)(1e9 / rate);
+    rl->burst = rl->interval * burst;
+    return 0;
+}
 
-    while(1) {
-        int clientSock = accept(serverSock, NULL, NULL);
-        printf("[SERVER] New TCP client connected, awaiting credentials...\n");
-        char buf[256];
-        ssize_t n = read(clientSock, buf, sizeof(buf)-1);
-        if(n <= 0) { close(clientSock); continue; }
-        buf[n] = '\0';
-        
-        /* Parse campus:dept:password format */
-        char campus[MAX_NAME], dept[MAX_NAME], pass[MAX_NAME];
-        
-        /* Find first colon (campus:...) */
-        char *firstColon = strchr(buf, ':');
-        if(!firstColon) { 
-            send(clientSock, "BAD_FORMAT: Use Campus:Dept:Password", 35, 0); 
-            close(clientSock); 
-            continue; 
-        }
-        
-        /* Find second colon (campus:dept:...) */
-        char *secondColon = strchr(firstColon + 1, ':');
-        if(!secondColon) { 
-            send(clientSock, "BAD_FORMAT: Use Campus:Dept:Password", 35, 0); 
-            close(clientSock); 
-            continue; 
-        }
-        
-        /* Extract campus */
-        int pos1 = firstColon - buf;
-        if(pos1 >= MAX_NAME) pos1 = MAX_NAME-1;
-        strncpy(campus, buf, pos1); 
-        campus[pos1] = '\0';
-        
-        /* Extract department */
-        int pos2 = secondColon - (firstColon + 1);
-        if(pos2 >= MAX_NAME) pos2 = MAX_NAME-1;
-        strncpy(dept, firstColon + 1, pos2); 
-        dept[pos2] = '\0';
-        
-        /* Extract password */
-        strncpy(pass, secondColon + 1, MAX_NAME-1); 
-        pass[MAX_NAME-1] = '\0';
-        pass[strcspn(pass, "\n")] = 0;
-
-        if(!authenticate(campus, pass)) {
-            printf("[SERVER] Authentication FAILED for %s %s\n", campus, dept);
-            send(clientSock, "AUTH_FAILED", 11, 0);
-            close(clientSock);
-            continue;
+/* Apply one setting from the command line or a -c file. Returns -1, after
+   saying why, if the value is bad. */
+int setOption(int opt, char *arg) {
+    switch(opt) {
+        case 'r':
+            numReactors = atoi(arg);
+            if(numReactors < 1) numReactors = 1;
+            if(numReactors > MAX_REACTORS) numReactors = MAX_REACTORS;
+            break;
+        case 's':
+            /* -s N: N reactors, each with its own listening socket */
+            numReactors = atoi(arg);
+            if(numReactors < 1) numReactors = 1;
+            if(numReactors > MAX_REACTORS) numReactors = MAX_REACTORS;
+            sharded = 1;
+            break;
+        case 'S':
+            /* from a file, "strict_framing no" turns it back off */
+            legacyCompat = arg && (strcmp(arg, "0") == 0 || strcmp(arg, "no") == 0);
+            break;
+        case 'n':
+            maxSessions = atoi(arg);
+            if(maxSessions < 1 || maxSessions > MAX_SESSIONS_LIMIT) {
+                fprintf(stderr, "Bad session limit: %s (1..%d)\n", arg, MAX_SESSIONS_LIMIT);
+                return -1;
+            }
+            break;
+        case 'w': {
+            /* -w high[:low] in bytes */
+            char *colon = strchr(arg, ':');
+            highWatermark = strtoul(arg, NULL, 10);
+            lowWatermark = colon ? strtoul(colon + 1, NULL, 10) : highWatermark / 4;
+            if(highWatermark == 0 || lowWatermark > highWatermark) {
+                fprintf(stderr, "Bad watermarks: %s\n", arg);
+                return -1;
+            }
+            break;
         }
-        pthread_mutex_lock(&clientsLock);
-        if(clientCount >= MAX_CLIENTS) {
-            pthread_mutex_unlock(&clientsLock);
-            send(clientSock, "SERVER_FULL", 11, 0);
-            close(clientSock);
-            continue;
+        case 'W':
+            /* -W usec: coalescing window */
+            coalesceNs = strtoull(arg, NULL, 10) * 1000;
+            break;
+        case 'p':
+            if(strcmp(arg, "drop") == 0) backpressurePolicy = POLICY_DROP;
+            else if(strcmp(arg, "block") == 0) backpressurePolicy = POLICY_BLOCK;
+            else if(strcmp(arg, "disconnect") == 0) backpressurePolicy = POLICY_DISCONNECT;
+            else { fprintf(stderr, "Unknown policy: %s\n", arg); return -1; }
+            break;
+        case 'H':
+            /* -H interval[:suspect[:offline]] */
+            if(sscanf(arg, "%d:%d:%d", &heartbeatSecs, &suspectAfter, &offlineAfter) < 1 ||
+               heartbeatSecs < 1 || suspectAfter < 1 || offlineAfter < 0) {
+                fprintf(stderr, "Bad heartbeat settings: %s\n", arg);
+                return -1;
+            }
+            break;
+        case 'R':
+            /* -R grace[:window] */
+            if(sscanf(arg, "%d:%d", &resumeGraceSecs, &resumeWindow) < 1 ||
+               resumeGraceSecs < 0 || resumeWindow < 1) {
+                fprintf(stderr, "Bad resume settings: %s\n", arg);
+                return -1;
+            }
+            break;
+        case 'L':
+            logDir = arg;
+            break;
+        case 'T':
+            spoolDir = arg;
+            break;
+        case 'D':
+            traceFile = arg;
+            break;
+        case 'Z':
+            /* -Z sendfile|copy: how attachment chunks are relayed */
+            if(strcmp(arg, "sendfile") == 0) xferCopy = 0;
+            else if(strcmp(arg, "copy") == 0) xferCopy = 1;
+            else { fprintf(stderr, "Unknown relay mode: %s (sendfile or copy)\n", arg); return -1; }
+            break;
+        case 'C':
+            credFile = arg;
+            break;
+        case 'A':
+            authTimeoutSecs = atoi(arg);
+            if(authTimeoutSecs < 1) authTimeoutSecs = 1;
+            break;
+        case 't':
+            tcpPort = atoi(arg);
+            break;
+        case 'u':
+            udpPort = atoi(arg);
+            break;
+        case 'b':
+            listenBacklog = atoi(arg);
+            if(listenBacklog < 1) listenBacklog = SOMAXCONN;
+            break;
+        case 'i': {
+            /* -i bytes: receive buffer per connection while it holds a partial frame */
+            long v = atol(arg);
+            if(v < 2 * MAX_MSG || v > FRAME_MAX + 3) {
+                fprintf(stderr, "Bad input buffer size: %s (%d..%d)\n", arg, 2 * MAX_MSG, FRAME_MAX + 3);
+                return -1;
+            }
+            connBufSize = v;
+            break;
         }
-        tcpSockets[clientCount] = clientSock;
-        strncpy(clientCampus[clientCount], campus, MAX_NAME-1);
-        clientCampus[clientCount][MAX_NAME-1] = 0;
-        strncpy(clientDept[clientCount], dept, MAX_NAME-1);  /* Store department */
-        clientDept[clientCount][MAX_NAME-1] = 0;
-        udpKnown[clientCount] = 0;
-        lastSeen[clientCount] = 0;
-        clientCount++;
-        int indexForThread = clientCount - 1;
-        pthread_t th;
-        pthread_create(&th, NULL, clientHandler, &indexForThread);
-        pthread_detach(th);
-        pthread_mutex_unlock(&clientsLock);
+        case 'l':
+            if((evLevel = evLevelParse(arg)) < 0) {
+                fprintf(stderr, "Unknown log level: %s (debug, info, warn or error)\n", arg);
+                return -1;
+            }
+            break;
+        case 'q':
+        case 'Q':
+            if(parseRate(arg, opt == 'q' ? &sessionRate : &campusRate) < 0) {
+                fprintf(stderr, "Bad rate limit: %s (rate[:burst])\n", arg);
+                return -1;
+            }
+            break;
+        case 'N':
+            snprintf(nodeName, sizeof(nodeName), "%s", arg);
+            break;
+        case 'K':
+            federationSecret = arg;
+            break;
+        case 'F':
+            /* -F host:port[,host:port...]: peers to dial */
+            for(char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+                char *colon = strrchr(tok, ':');
+                struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+                if(!colon || dialCount == MAX_PEERS) {
+                    fprintf(stderr, "Bad peer address: %s\n", tok);
+                    return -1;
+                }
+                struct PeerDial *pd = &dials[dialCount];
+                snprintf(pd->addr, sizeof(pd->addr), "%s", tok);
+                *colon = 0;
+                if(getaddrinfo(tok, colon + 1, &hints, &res) != 0) {
+                    fprintf(stderr, "Cannot resolve peer %s\n", pd->addr);
+                    return -1;
+                }
+                memcpy(&pd->sa, res->ai_addr, sizeof(pd->sa));
+                freeaddrinfo(res);
+                pd->backoff = 1;
+                dialCount++;
+            }
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/* Config file (-c): one "key value" per line, '#' starts a comment. Each key
+   stands for the option next to it, and settings apply in command line
+   order, so options after -c override the file. */
+struct ConfigKey {
+    const char *key;
+    int opt;
+} configKeys[] = {
+    { "reactors", 'r' }, { "shards", 's' }, { "strict_framing", 'S' }, { "max_sessions", 'n' },
+    { "watermarks", 'w' }, { "coalesce_usec", 'W' }, { "policy", 'p' }, { "heartbeat", 'H' },
+    { "resume", 'R' }, { "log_dir", 'L' }, { "credentials", 'C' }, { "auth_timeout", 'A' },
+    { "tcp_port", 't' }, { "udp_port", 'u' }, { "backlog", 'b' }, { "input_buffer", 'i' },
+    { "node_name", 'N' }, { "federation_secret", 'K' }, { "peers", 'F' }, { "log_level", 'l' },
+    { "session_rate", 'q' }, { "campus_rate", 'Q' }, { "spool_dir", 'T' }, { "file_relay", 'Z' },
+    { "trace_file", 'D' },
+};
+
+int loadConfig(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        perror(path);
+        return -1;
+    }
+    char line[1024];
+    int lineNo = 0, rc = 0;
+    while(rc == 0 && fgets(line, sizeof(line), f)) {
+        lineNo++;
+        line[strcspn(line, "#\r\n")] = 0;
+        char *key = strtok(line, " \t="), *val = key ? strtok(NULL, " \t=") : NULL;
+        if(!key) continue;
+        size_t k = 0;
+        while(k < sizeof(configKeys) / sizeof(configKeys[0]) && strcmp(configKeys[k].key, key) != 0) k++;
+        if(k == sizeof(configKeys) / sizeof(configKeys[0]) || (!val && configKeys[k].opt != 'S')) {
+            fprintf(stderr, "%s:%d: %s %s\n", path, lineNo, val ? "unknown setting" : "no value for", key);
+            rc = -1;
+        } else if(setOption(configKeys[k].opt, val ? strdup(val) : NULL) < 0) {
+            fprintf(stderr, "%s:%d: bad value for %s\n", path, lineNo, key);
+            rc = -1;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c configFile] [-r reactorThreads | -s shards] [-S] [-n maxSessions] "
+            "[-w high[:low]] [-W coalesceUsec] [-p drop|block|disconnect] "
+            "[-H interval[:suspect[:offline]]] [-R grace[:window]] [-q rate[:burst]] [-Q rate[:burst]]\n"
+            "       [-L logDir] [-T spoolDir] [-Z sendfile|copy] [-D traceFile] [-C credFile] [-A authTimeoutSecs]"
+            " [-t tcpPort] [-u udpPort] [-b listenBacklog] [-i inputBufferBytes] [-l debug|info|warn|error] "
+            "[-N nodeName] [-K federationSecret] [-F host:port,...]\n"
+            "       %s -P Campus:Password   (print a credential file line)\n", prog, prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    poolInit();
+    while((opt = getopt(argc, argv, "c:r:s:Sn:w:W:p:H:R:q:Q:L:T:Z:D:C:A:P:t:u:b:i:l:N:F:K:")) != -1) {
+        if(opt == 'c') {
+            if(loadConfig(optarg) < 0) return 1;
+        } else if(opt == 'P') {
+            /* -P Campus:Password prints a credential file line and exits */
+            char *colon = strchr(optarg, ':'), line[256];
+            if(!colon) {
+                fprintf(stderr, "Use -P Campus:Password\n");
+                return 1;
+            }
+            *colon = 0;
+            if(credFormat(line, sizeof(line), optarg, colon + 1) < 0) {
+                perror("getrandom");
+                return 1;
+            }
+            printf("%s\n", line);
+            return 0;
+        } else if(opt == '?') {
+            usage(argv[0]);
+            return 1;
+        } else if(setOption(opt, optarg) < 0) {
+            return 1;
+        }
+    }
 
-        printf("[SERVER] %s %s authenticated and TCP session started.\n", campus, dept);
-        send(clientSock, "AUTH_OK", 7, 0);
+    if(dialCount && !federationSecret) {
+        fprintf(stderr, "-F needs the federation secret (-K)\n");
+        return 1;
     }
+    if(!nodeName[0]) snprintf(nodeName, sizeof(nodeName), "node-%d", tcpPort);
+
+    startNs = nowNs();
+    /* writev() and sendfile() take no MSG_NOSIGNAL: a receiver that hangs up mid-write is an EPIPE, not a crash */
+    signal(SIGPIPE, SIG_IGN);
+    pthread_t logger;
+    evWakeFd = eventfd(0, EFD_NONBLOCK);
+    pthread_create(&logger, NULL, evLogger, NULL);
+    annEpoch = (uint32_t)time(NULL);
+    if(credLoad() < 0) { perror(credFile ? credFile : "credentials"); return 1; }
+    /* every session is a socket: allow as many as the hard limit does */
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)maxSessions + 64)
+        evLog(EV_WARN, "[SERVER] Note: the open file limit (%llu) is below -n %d; raise it to hold that many sessions.\n",
+                       (unsigned long long)rl.rlim_cur, maxSessions);
+    if(initSessions(maxSessions) < 0) { perror("initSessions"); return 1; }
+    if(logDir && logOpen() < 0) { perror(logDir); return 1; }
+    if(spoolDir && xferOpen() < 0) { perror(spoolDir); return 1; }
+    if(traceFile && traceOpen() < 0) { perror(traceFile); return 1; }
+    presenceMaybePublish();
+
+    for(int i=0;i<numReactors;i++) {
+        reactors[i].epfd = epoll_create1(0);
+        if(reactors[i].epfd < 0) { perror("epoll_create1"); return 1; }
+        reactors[i].inboxFd = eventfd(0, EFD_NONBLOCK);
+        if(reactors[i].inboxFd < 0) { perror("eventfd"); return 1; }
+        addToReactor(&reactors[i], reactors[i].inboxFd, TAG_INBOX);
+        reactors[i].listenFd = -1;
+    }
+
+    /* sharded: every reactor binds its own socket and the kernel spreads connections over them */
+    for(int i=0;i<(sharded ? numReactors : 1);i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(sharded) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        struct sockaddr_in servAddr;
+        servAddr.sin_family = AF_INET;
+        servAddr.sin_port = htons(tcpPort);
+        servAddr.sin_addr.s_addr = INADDR_ANY;
+        if(bind(fd, (struct sockaddr*)&servAddr, sizeof(servAddr)) < 0) { perror("bind tcp"); return 1; }
+        listen(fd, listenBacklog);
+        setNonBlocking(fd);
+        reactors[i].listenFd = fd;
+        addToReactor(&reactors[i], fd, TAG_LISTEN);
+    }
+
+    udpSock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in udpServAddr;
+    udpServAddr.sin_family = AF_INET;
+    udpServAddr.sin_port = htons(udpPort);
+    udpServAddr.sin_addr.s_addr = INADDR_ANY;
+    if(bind(udpSock, (struct sockaddr*)&udpServAddr, sizeof(udpServAddr)) < 0) { perror("bind udp"); return 1; }
+    setNonBlocking(udpSock);
+
+    addToReactor(&reactors[0], udpSock, TAG_UDP);
+    bcastSock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    /* heartbeat deadlines tick on reactor 0 */
+    wheelInit();
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct itimerspec its = { { 0, TICK_MS * 1000000L }, { 0, TICK_MS * 1000000L } };
+    timerfd_settime(timerFd, 0, &its, NULL);
+    addToReactor(&reactors[0], timerFd, TAG_TIMER);
+
+    pthread_t adm;
+    pthread_create(&adm, NULL, adminConsole, NULL);
+    if(logDir) {
+        pthread_t flusher;
+        pthread_create(&flusher, NULL, logFlusher, NULL);
+    }
+    for(int i=0;i<AUTH_WORKERS;i++) {
+        pthread_t worker;
+        pthread_create(&worker, NULL, authWorker, (void*)(intptr_t)(MAX_REACTORS + 2 + i));
+    }
+
+    evLog(EV_INFO, "[SERVER] TCP listening on port %d\n", tcpPort);
+    evLog(EV_INFO, "[SERVER] UDP listening on port %d\n", udpPort);
+    if(federationSecret)
+        evLog(EV_INFO, "[FEDERATION] Node %s, dialling %d peer(s)\n", nodeName, dialCount);
+    if(traceFile)
+        evLog(EV_INFO, "[TRACE] Recording everything received to %s\n", traceFile);
+    evLog(EV_INFO, "[SERVER] %d %s running\n", numReactors, sharded ? "shard(s)" : "reactor thread(s)");
+    evLog(EV_INFO, "[SERVER] Admin console ready. Type 'list' or 'broadcast <message>'\n");
+
+    /* reactor 0 runs on the main thread */
+    for(int i=1;i<numReactors;i++)
+        pthread_create(&reactors[i].thread, NULL, reactorLoop, &reactors[i]);
+    reactorLoop(&reactors[0]);
 
     return 0;
 }